@@ -0,0 +1,103 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+inline double nanoseconds(Clock::duration duration)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+/*
+    Records a number for --json and --baseline (see main.cpp) next to the line the
+    benchmark prints. Case names the measurement within the benchmark, e.g.
+    "dispatch depth=16 mean". Unit "M/s" is better when higher, any other when lower.
+*/
+void result(const char* benchmark, const char* Case, double value, const char* unit);
+
+//dispatch.cpp
+void benchmarkDispatchUnwind();
+
+//stack_walk.cpp
+void benchmarkStackWalk();
+
+//safeseh.cpp
+void benchmarkSafeSEH();
+
+//verdict_cache.cpp
+void benchmarkVerdictCache();
+
+//pipeline.cpp
+void benchmarkPipeline();
+
+//code_filter.cpp
+void benchmarkCodeFilter();
+
+//statistics.cpp
+void benchmarkStatistics();
+
+//handler_profile.cpp
+void benchmarkHandlerProfile();
+
+//trace.cpp
+void benchmarkTrace();
+
+//unwind_patch.cpp
+void benchmarkUnwindPatch();
+
+//thread_scope.cpp
+void benchmarkThreadScope();
+
+//bound_index.cpp
+void benchmarkBoundIndex();
+
+//epoch.cpp
+void benchmarkEpoch();
+
+//throw_sites.cpp
+void benchmarkThrowSites();
+
+//cxx_eh.cpp
+void benchmarkCxxEH();
+
+//scope_table.cpp
+void benchmarkScopeTable();
+
+//handler_manifest.cpp
+void benchmarkHandlerManifest();
+
+//chain_check.cpp
+void benchmarkChainCheck();
+
+//posix_signals.cpp
+void benchmarkPosixSignals();
+
+//dispatch_suite.cpp
+void benchmarkDispatchSuite();
+
+//resolution_memo.cpp
+void benchmarkResolutionMemo();
+
+//crash_snapshot.cpp
+void benchmarkCrashSnapshot();
+
+//telemetry.cpp
+void benchmarkTelemetry();
\ No newline at end of file
@@ -0,0 +1,217 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "bound_index.h"
+
+using namespace SEH;
+
+/*
+    Lookups in the BOUND_CHECK module index (src/bound_index.h) with 1 to 64 modules,
+    against a linear scan of the same ranges, then lookups racing a thread that keeps
+    adding and removing a module.
+*/
+
+struct Range
+{
+    uint32_t Base;
+    uint32_t Size;
+};
+
+//Modules on the 64KB allocation granularity with gaps between them, like a real process
+static std::vector<Range> makeModules(size_t count, std::mt19937& random)
+{
+    std::vector<Range> modules;
+    uint32_t Base = 0x00400000;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t Size = (uint32_t)(1 + random() % 64) * 0x10000 - (uint32_t)(random() % 0x1000);
+
+        modules.push_back({ Base, Size });
+        Base += ((Size + 0xFFFF) & ~0xFFFFu) + (uint32_t)(random() % 16) * 0x10000;
+    }
+
+    return modules;
+}
+
+static bool linearContains(const std::vector<Range>& modules, uint32_t address)
+{
+    for (const Range& module : modules)
+    {
+        if (address >= module.Base && address - module.Base < module.Size)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void benchmarkLookups(size_t count)
+{
+    std::mt19937 random(1234);
+    std::vector<Range> modules = makeModules(count, random);
+    Bound_Index::Ranges<> index;
+
+    //Added out of order, the index keeps them sorted
+    for (size_t i = 0; i < modules.size(); ++i)
+    {
+        index.add(modules[(i * 7) % modules.size()].Base, modules[(i * 7) % modules.size()].Size);
+    }
+
+    uint32_t highest = modules.back().Base + modules.back().Size;
+    std::vector<uint32_t> addresses(1 << 16);
+
+    for (uint32_t& address : addresses)
+    {
+        address = 0x003F0000 + (uint32_t)(random() % (highest - 0x003F0000 + 0x10000));
+    }
+
+    //Every range edge too
+    for (size_t i = 0; i < modules.size(); ++i)
+    {
+        addresses[4 * i] = modules[i].Base - 1;
+        addresses[4 * i + 1] = modules[i].Base;
+        addresses[4 * i + 2] = modules[i].Base + modules[i].Size - 1;
+        addresses[4 * i + 3] = modules[i].Base + modules[i].Size;
+    }
+
+    bool agrees = (index.size() == count);
+
+    for (uint32_t address : addresses)
+    {
+        agrees &= (index.contains(address) == linearContains(modules, address));
+    }
+
+    const size_t rounds = 64;
+    size_t hits = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (uint32_t address : addresses)
+        {
+            hits += index.contains(address);
+        }
+    }
+
+    double indexed = nanoseconds(Clock::now() - start) / (rounds * addresses.size());
+
+    start = Clock::now();
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (uint32_t address : addresses)
+        {
+            hits += linearContains(modules, address);
+        }
+    }
+
+    double linear = nanoseconds(Clock::now() - start) / (rounds * addresses.size());
+
+    printf("bound_index modules=%-3zu index %6.1f ns  linear %6.1f ns  (%s, %zu hits)\n",
+        count, indexed, linear, agrees ? "agrees with a linear scan" : "DISAGREES WITH A LINEAR SCAN", hits);
+}
+
+/*
+    Readers only look up addresses of the modules that never change, and of a gap that is
+    never added. Whatever the writer is doing, the answers must never flip.
+*/
+static void benchmarkChurn()
+{
+    std::mt19937 random(99);
+    std::vector<Range> modules = makeModules(32, random);
+    Bound_Index::Ranges<> index;
+
+    //Every other module stays, the rest are churned by the writer
+    for (size_t i = 0; i < modules.size(); i += 2)
+    {
+        index.add(modules[i].Base, modules[i].Size);
+    }
+
+    const uint32_t never = modules.back().Base + modules.back().Size + 0x100000;
+    const unsigned int readers = 3;
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> wrong(0);
+    std::atomic<size_t> lookups(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned int r = 0; r < readers; ++r)
+    {
+        threads.emplace_back([&, r]()
+        {
+            size_t count = 0;
+            size_t misses = 0;
+
+            for (size_t i = r; !stop.load(std::memory_order_relaxed); i += 2, ++count)
+            {
+                const Range& module = modules[i % modules.size() & ~(size_t)1];
+                uint32_t offset = (uint32_t)(i * 2654435761u) % module.Size;
+
+                misses += !index.contains(module.Base + offset);
+                misses += index.contains(never + offset % 0x10000);
+            }
+
+            wrong.fetch_add(misses);
+            lookups.fetch_add(count * 2);
+        });
+    }
+
+    size_t changes = 0;
+    Clock::time_point start = Clock::now();
+
+    while (Clock::now() - start < std::chrono::milliseconds(300))
+    {
+        const Range& module = modules[1 + 2 * (changes % (modules.size() / 2))];
+
+        index.add(module.Base, module.Size);
+        index.remove(module.Base);
+        changes += 2;
+    }
+
+    stop.store(true);
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    printf("bound_index churn readers=%u lookups %zu  changes %zu  (%s)\n",
+        readers, lookups.load(), changes, (wrong.load() == 0) ? "no wrong answers" : "WRONG ANSWERS");
+}
+
+void benchmarkBoundIndex()
+{
+    const size_t counts[] = { 1, 4, 16, 64 };
+
+    for (size_t count : counts)
+    {
+        benchmarkLookups(count);
+    }
+
+    benchmarkChurn();
+}
\ No newline at end of file
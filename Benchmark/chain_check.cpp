@@ -0,0 +1,328 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Chains that loop or were overwritten have to end the exception instead of hanging
+    the thread, and checking for them must not slow down the chains that are fine.
+*/
+
+//No order check or depth limit, what DispatchException and Unwind did before
+struct UncheckedPlatform : Simulated::Platform
+{
+    static const bool checkChainOrder = false;
+    static const unsigned int maxChainDepth = 0;
+};
+
+//The order check and a limit of 8 frames
+struct LimitedPlatform : Simulated::Platform
+{
+    static const unsigned int maxChainDepth = 8;
+};
+
+//The order check and a limit no sane chain reaches
+struct BudgetPlatform : Simulated::Platform
+{
+    static const unsigned int maxChainDepth = 4096;
+};
+
+static size_t handlerCalls = 0;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding) ? Core::ContinueSearch : Core::ContinueExecution;
+}
+
+//Links frames[order[0]] -> frames[order[1]] -> ... -> frames[order[last]] -> last, the head is frames[order[0]]
+static void link(std::vector<Simulated::Registration>& frames, std::initializer_list<size_t> order, Simulated::Registration* last)
+{
+    const size_t* index = order.begin();
+
+    for (; index + 1 != order.end(); ++index)
+    {
+        frames[*index] = { &frames[index[1]], &SearchHandler };
+    }
+
+    frames[*index] = { last, &ExecuteHandler };
+    Simulated::currentTeb().ExceptionList = &frames[*order.begin()];
+}
+
+static void linkChain(std::vector<Simulated::Registration>& frames, size_t depth)
+{
+    for (size_t i = 0; i < depth; ++i)
+    {
+        frames[i] = { (i + 1 < depth) ? &frames[i + 1] : Core::chainEnd<Simulated::Registration>(), (i + 1 < depth) ? &SearchHandler : &ExecuteHandler };
+    }
+
+    Simulated::currentTeb().ExceptionList = &frames[0];
+}
+
+/*
+    Dispatches (or unwinds the whole chain), returns the code of the exception that
+    ended it as unhandled or 0 if it was handled. handlers is how many handlers ran.
+*/
+template <class Platform>
+static uint32_t run(bool unwind, size_t& handlers)
+{
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+    uint32_t Code = 0;
+
+    Exception.ExceptionCode = 0xC0000005;
+    handlerCalls = 0;
+
+    try
+    {
+        if (unwind)
+            Core::Unwind<Platform>(Core::chainEnd<Simulated::Registration>(), &Exception, &Context);
+        else
+            Core::DispatchException<Platform>(&Exception, &Context);
+    }
+    catch (const Simulated::RaisedException& raised)
+    {
+        //Straight to second chance with the original exception attached
+        Code = (!raised.firstChance && raised.Exception.ExceptionRecord == &Exception) ? raised.Exception.ExceptionCode : 1;
+    }
+
+    handlers = handlerCalls;
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return Code;
+}
+
+/*
+    A handler that returns ContinueSearch but overwrites a Next the dispatch already
+    walked, then a catch further down unwinds through it. The overwritten Next points
+    up the chain, so only the frame checks can stop the unwind from calling whatever
+    is there.
+*/
+static Simulated::Registration* rewritten = NULL;
+static Simulated::Registration* rewriteTo = NULL;
+
+static Core::Disposition RewriteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (!(ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding))
+    {
+        rewritten->Next = rewriteTo;
+    }
+
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition CatchHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    Core::Unwind<Simulated::Platform>(EstablisherFrame, ExceptionRecord, ContextRecord);
+    return Core::ContinueExecution;
+}
+
+//Returns the code raised by the unwind or 0
+static uint32_t unwindThroughRewrite()
+{
+    //On the real stack, older than the nested registrations of executeHandler
+    Simulated::Registration frames[4];
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+    uint32_t Code = 0;
+
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+    Simulated::pushRegistration(frames[3], &CatchHandler);
+    Simulated::pushRegistration(frames[1], &SearchHandler);
+    Simulated::pushRegistration(frames[0], &SearchHandler);
+
+    //The second frame rewrites the first, unaligned and between the walked frames and the catch
+    frames[1].Handler = &RewriteHandler;
+    rewritten = &frames[0];
+    rewriteTo = (Simulated::Registration*)((uintptr_t)&frames[2] + 1);
+
+    Exception.ExceptionCode = 0xE06D7363;
+
+    try
+    {
+        Core::DispatchException<Simulated::Platform>(&Exception, &Context);
+    }
+    catch (const Simulated::RaisedException& raised)
+    {
+        Code = raised.Exception.ExceptionCode;
+    }
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return Code;
+}
+
+//Returns what's wrong or NULL
+static const char* verify()
+{
+    std::vector<Simulated::Registration> frames(16);
+    Simulated::Registration* end = Core::chainEnd<Simulated::Registration>();
+    size_t handlers;
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    //A frame pointing at itself: its handler runs once, then the walk stops
+    link(frames, { 3 }, &frames[3]);
+    frames[3].Handler = &SearchHandler;
+
+    if (run<Simulated::Platform>(false, handlers) != Core::Status::ChainCorrupt || handlers != 1)
+    {
+        return "a frame pointing at itself wasn't caught";
+    }
+
+    link(frames, { 2, 5 }, &frames[2]);
+    frames[5].Handler = &SearchHandler;
+
+    if (run<Simulated::Platform>(false, handlers) != Core::Status::ChainCorrupt || handlers != 2)
+    {
+        return "a loop of two frames wasn't caught";
+    }
+
+    //Not a loop, but Next was overwritten with a newer frame
+    link(frames, { 1, 6, 4 }, end);
+
+    if (run<Simulated::Platform>(false, handlers) != Core::Status::ChainCorrupt || handlers != 2)
+    {
+        return "a frame leading to a newer one wasn't caught";
+    }
+
+    linkChain(frames, 8);
+
+    if (run<LimitedPlatform>(false, handlers) != 0 || handlers != 8)
+    {
+        return "a chain at the depth limit wasn't dispatched";
+    }
+
+    linkChain(frames, 9);
+
+    if (run<LimitedPlatform>(false, handlers) != Core::Status::ChainTooDeep || handlers != 8)
+    {
+        return "a chain past the depth limit wasn't stopped";
+    }
+
+    //Unwinding pops the frames of a loop and comes back to one it already popped
+    link(frames, { 2, 5 }, &frames[2]);
+    frames[5].Handler = &SearchHandler;
+
+    if (run<Simulated::Platform>(true, handlers) != Core::Status::ChainCorrupt || handlers != 2)
+    {
+        return "an unwind through a loop wasn't stopped";
+    }
+
+    linkChain(frames, 9);
+
+    if (run<LimitedPlatform>(true, handlers) != Core::Status::ChainTooDeep || handlers != 8)
+    {
+        return "an unwind past the depth limit wasn't stopped";
+    }
+
+    linkChain(frames, 16);
+
+    if (run<Simulated::Platform>(true, handlers) != 0 || handlers != 16)
+    {
+        return "a sane chain wasn't unwound";
+    }
+
+    if (unwindThroughRewrite() != Core::Status::BadStack)
+    {
+        return "an unwind from a handler trusted a frame changed after the dispatch walked it";
+    }
+
+    return NULL;
+}
+
+template <class Platform>
+static double dispatch(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+    linkChain(frames, depth);
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        Core::DispatchException<Platform>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return elapsed;
+}
+
+void benchmarkChainCheck()
+{
+    const char* error = verify();
+    printf("chain_check %s%s\n", (error != NULL) ? "FAILED: " : "loops, overwritten frames and deep chains stopped", (error != NULL) ? error : "");
+
+    for (size_t depth : { 1, 4, 16, 64, 256 })
+    {
+        size_t iterations = 4000000 / depth + 100000;
+
+        //Interleaved so that frequency changes hit all three alike
+        double unchecked = 0, ordered = 0, budget = 0;
+
+        for (int round = 0; round < 4; ++round)
+        {
+            unchecked += dispatch<UncheckedPlatform>(depth, iterations / 4);
+            ordered += dispatch<Simulated::Platform>(depth, iterations / 4);
+            budget += dispatch<BudgetPlatform>(depth, iterations / 4);
+        }
+
+        printf("chain_check depth=%-4zu unchecked %8.1f ns  ordered %8.1f ns  ordered+limit %8.1f ns\n", depth, unchecked / 4, ordered / 4, budget / 4);
+    }
+
+    //A frame pointing at itself used to hang the thread, now it's one handler call
+    std::vector<Simulated::Registration> frames(1);
+    const size_t iterations = 200000;
+    size_t handlers;
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + 1));
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        link(frames, { 0 }, &frames[0]);
+        run<Simulated::Platform>(false, handlers);
+    }
+
+    printf("chain_check self loop stopped in %8.1f ns (including the simulated raise)\n", nanoseconds(Clock::now() - start) / iterations);
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "code_filter.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Dispatching OutputDebugString's exception through chains of growing depth with
+    and without the exception code filter in front. Without it every one of them
+    walks the whole chain to reach OutputDebugString's own handler at the end.
+*/
+
+static const uint32_t DebugPrint = 0x40010006; //DBG_PRINTEXCEPTION_C
+
+//The library defines this in code_filter.cpp
+Code_Filter::Codes& Code_Filter::codes()
+{
+    static Codes table;
+    return table;
+}
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+//Stands in for OutputDebugString's own __except, the oldest frame
+static Core::Disposition ExecuteHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueExecution;
+}
+
+template <class Checks>
+static double dispatch(size_t depth, size_t iterations, uint32_t Code)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    for (size_t i = frames.size(); i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], (i == frames.size() - 1) ? &ExecuteHandler : &SearchHandler);
+    }
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = Code;
+
+        Core::DispatchException<Simulated::Platform, Checks>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    return elapsed;
+}
+
+void benchmarkCodeFilter()
+{
+    typedef Pipeline::List<> Unfiltered;
+    typedef Pipeline::Stages<Code_Filter::Check> Filtered;
+
+    const size_t depths[] = { 1, 4, 16, 64, 256 };
+
+    Code_Filter::codes().set(DebugPrint, Code_Filter::Skip);
+
+    for (size_t depth : depths)
+    {
+        size_t iterations = 4000000 / depth + 100000;
+        Code_Filter::Stats before = Code_Filter::codes().stats(DebugPrint);
+
+        double unfiltered = dispatch<Unfiltered>(depth, iterations, DebugPrint);
+        double skipped = dispatch<Filtered>(depth, iterations, DebugPrint);
+        double unlisted = dispatch<Filtered>(depth, iterations, 0xC0000094); //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        Code_Filter::Stats after = Code_Filter::codes().stats(DebugPrint);
+
+        printf("code_filter depth=%-4zu walk %8.1f ns  skipped %6.1f ns  unlisted %8.1f ns  (%s)\n",
+            depth, unfiltered, skipped, unlisted, (after.skipped - before.skipped == iterations) ? "skips counted" : "SKIPS MISCOUNTED");
+    }
+}
\ No newline at end of file
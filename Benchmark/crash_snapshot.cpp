@@ -0,0 +1,251 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "crash_snapshot.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    What a crash snapshot captures for the ways a dispatch ends unhandled, and how long
+    capturing takes, since it runs while the process is dying.
+*/
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+//A handler the platform refuses to call, like one a handler manifest doesn't list
+static Core::Disposition DeniedHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static uint8_t snapshotBuffer[Crash_Snapshot::bufferSize];
+static size_t snapshotSize = 0;
+
+//Every handler lives in a 64KB "module" at its address rounded down
+struct ModuleLookup
+{
+    bool operator()(uint64_t Address, uint64_t& Base) const
+    {
+        Base = Address & ~(uint64_t)0xFFFF;
+        return true;
+    }
+};
+
+struct SnapshotPlatform : Simulated::Platform
+{
+    static bool isHandlerAllowed(const Simulated::Registration* Frame)
+    {
+        return Frame->Handler != &DeniedHandler;
+    }
+
+    //What the Windows platform does right before NtRaiseException
+    static void raiseUnhandled(Simulated::Record* Exception, Simulated::Context* Context)
+    {
+        ModuleLookup module;
+        snapshotSize = Crash_Snapshot::capture<SnapshotPlatform>(snapshotBuffer, Exception, Context, Crash_Snapshot::Simulated, 1, 2, module);
+
+        Simulated::Platform::raiseUnhandled(Exception, Context);
+    }
+};
+
+static void linkChain(std::vector<Simulated::Registration>& frames, size_t depth)
+{
+    for (size_t i = 0; i < depth; ++i)
+    {
+        frames[i] = { (i + 1 < depth) ? &frames[i + 1] : Core::chainEnd<Simulated::Registration>(), &SearchHandler };
+    }
+
+    Simulated::currentTeb().ExceptionList = &frames[0];
+}
+
+//Dispatches an access violation nobody handles, the snapshot is in snapshotBuffer
+static void crash()
+{
+    Simulated::Record Inner = {};
+    Inner.ExceptionCode = 0xE06D7363;
+
+    Simulated::Record Exception = {};
+    Simulated::Context Context = { 0x401234, 0x12FF00, 0x12FF40, 7 };
+
+    Exception.ExceptionCode = 0xC0000005;
+    Exception.ExceptionAddress = (void*)0x401234;
+    Exception.ExceptionRecord = &Inner;
+    Exception.NumberParameters = 2;
+    Exception.ExceptionInformation[0] = 1;
+    Exception.ExceptionInformation[1] = 0xDEAD;
+
+    snapshotSize = 0;
+
+    try
+    {
+        Core::DispatchException<SnapshotPlatform>(&Exception, &Context);
+    }
+    catch (const Simulated::RaisedException&)
+    {
+    }
+}
+
+static const Crash_Snapshot::FileHeader& header()
+{
+    return *reinterpret_cast<const Crash_Snapshot::FileHeader*>(snapshotBuffer);
+}
+
+static const Crash_Snapshot::Frame& frame(uint32_t index)
+{
+    const Crash_Snapshot::Record* records = reinterpret_cast<const Crash_Snapshot::Record*>(snapshotBuffer + sizeof(Crash_Snapshot::FileHeader));
+    return reinterpret_cast<const Crash_Snapshot::Frame*>(records + header().recordCount)[index];
+}
+
+//The last frame captured, where the walk stopped
+static const Crash_Snapshot::Frame& lastFrame()
+{
+    return frame(header().frameCount - 1);
+}
+
+//Returns what's wrong or NULL
+static const char* verify()
+{
+    using namespace Crash_Snapshot;
+
+    std::vector<Simulated::Registration> frames(maxFrames + 8);
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    linkChain(frames, 4);
+    crash();
+
+    const Record* records = reinterpret_cast<const Record*>(snapshotBuffer + sizeof(FileHeader));
+
+    if (snapshotSize == 0 || memcmp(header().magic, "SEHCRASH", 8) != 0 || header().size != snapshotSize || snapshotSize % 8 != 0)
+    {
+        return "an unhandled exception wasn't captured";
+    }
+
+    if (header().reason != NoHandler || header().recordCount != 2 || records[0].code != 0xC0000005 || records[0].numberParameters != 2 || records[0].information[1] != 0xDEAD || records[1].code != 0xE06D7363)
+    {
+        return "the exception records weren't captured";
+    }
+
+    uint64_t handler = (uint64_t)(uintptr_t)&SearchHandler;
+
+    if (header().frameCount != 4 || lastFrame().status != Valid || frame(0).frame != (uint64_t)(uintptr_t)&frames[0] || frame(3).handler != handler || frame(3).handlerRva != (handler & 0xFFFF))
+    {
+        return "the frames weren't captured";
+    }
+
+    const uint8_t* context = reinterpret_cast<const uint8_t*>(&frame(header().frameCount));
+    Simulated::Context Context;
+    memcpy(&Context, context, sizeof(Context));
+
+    if (header().contextSize != sizeof(Simulated::Context) || Context.Eip != 0x401234 || Context.Eax != 7)
+    {
+        return "the context wasn't captured";
+    }
+
+    //Frame 2 leads outside the stack
+    linkChain(frames, 4);
+    frames[2].Next = (Simulated::Registration*)((uintptr_t)frames.data() - 64);
+    crash();
+
+    if (header().reason != StackInvalid || header().frameCount != 4 || lastFrame().status != OutsideStack || lastFrame().handler != 0)
+    {
+        return "a frame outside the stack wasn't captured as the reason";
+    }
+
+    linkChain(frames, 4);
+    frames[1].Next = (Simulated::Registration*)((uintptr_t)&frames[3] + 1);
+    crash();
+
+    if (header().reason != StackInvalid || header().frameCount != 3 || lastFrame().status != Unaligned)
+    {
+        return "an unaligned frame wasn't captured as the reason";
+    }
+
+    linkChain(frames, 4);
+    frames[2].Handler = &DeniedHandler;
+    crash();
+
+    if (header().reason != StackInvalid || header().frameCount != 3 || lastFrame().status != HandlerNotAllowed)
+    {
+        return "a handler that wasn't allowed wasn't captured as the reason";
+    }
+
+    linkChain(frames, 4);
+    frames[3].Next = &frames[1];
+    crash();
+
+    if (header().reason != ChainCorrupt || header().frameCount != 5 || lastFrame().status != OutOfOrder || records[1].code != 0xC0000005)
+    {
+        return "a loop wasn't captured as the reason";
+    }
+
+    //Longer than a snapshot holds
+    linkChain(frames, maxFrames + 8);
+    crash();
+
+    if (header().frameCount != maxFrames || !header().chainTruncated || snapshotSize > bufferSize)
+    {
+        return "a long chain wasn't cut at maxFrames";
+    }
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return NULL;
+}
+
+void benchmarkCrashSnapshot()
+{
+    const char* error = verify();
+    printf("crash_snapshot %s%s\n", (error != NULL) ? "FAILED: " : "records, frames, context and reasons captured", (error != NULL) ? error : "");
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        std::vector<Simulated::Registration> frames(depth);
+        Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+        linkChain(frames, depth);
+
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000005;
+
+        ModuleLookup module;
+        const size_t iterations = 200000;
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            snapshotSize = Crash_Snapshot::capture<SnapshotPlatform>(snapshotBuffer, &Exception, &Context, Crash_Snapshot::Simulated, 1, 2, module);
+        }
+
+        double elapsed = nanoseconds(Clock::now() - start) / iterations;
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+        printf("crash_snapshot depth=%-3zu capture %8.1f ns  %5zu bytes\n", depth, elapsed, snapshotSize);
+
+        char Case[64];
+        snprintf(Case, sizeof(Case), "capture depth=%zu", depth);
+        result("crash_snapshot", Case, elapsed, "ns");
+    }
+}
\ No newline at end of file
@@ -0,0 +1,371 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.h"
+#include "cxx_eh.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Decodes MSVC's C++ EH tables (src/cxx_eh.h) out of a fixture laid out like a /MD
+    module: frame handler thunks that check the stack cookie and jmp to an import thunk
+    for __CxxFrameHandler3, FuncInfos with and without try blocks, and a std::runtime_error
+    ThrowInfo. Then dispatches a throw through chains of such frames on the simulated
+    platform, with every frame handler called and with the frames skipped that the
+    tables say won't catch. The stand-in frame handler does the same table walk as
+    the fast path, a real __CxxFrameHandler3 does more, so the gap is a lower bound.
+*/
+
+static const uint32_t Base = 0x20000000;
+
+enum : uint32_t
+{
+    FrameHandler = Base + 0x000,       //__CxxFrameHandler3 in vcruntime
+    FrameHandlerThunk = Base + 0x010,  //jmp [FrameHandlerSlot]
+    OtherHandler = Base + 0x020,       //_except_handler4, not a C++ frame handler
+
+    CleanupThunk = Base + 0x100,       //Only destructors: A a; B b; may_throw();
+    CatchOtherThunk = Base + 0x140,    //try { ... } catch (const Other&)
+    CatchExceptionThunk = Base + 0x180,//try { ... } catch (const std::exception&)
+    CatchAllThunk = Base + 0x1C0,      //try { ... } catch (...)
+    NoexceptThunk = Base + 0x200,      //void f() noexcept
+    ForeignThunk = Base + 0x240,       //mov eax, FuncInfo; jmp _except_handler4
+
+    CleanupInfo = Base + 0x400,
+    CleanupUnwindMap = Base + 0x430,
+    CatchOtherInfo = Base + 0x480,
+    CatchExceptionInfo = Base + 0x500,
+    CatchAllInfo = Base + 0x580,
+    NoexceptInfo = Base + 0x600,
+    TryBlocks = Base + 0x640,          //One for each catching function, 20 bytes each
+    Handlers = Base + 0x6C0,           //16 bytes each
+
+    RuntimeErrorType = Base + 0x800,
+    ExceptionType = Base + 0x840,
+    OtherType = Base + 0x880,
+    ForeignExceptionType = Base + 0x8C0,//std::exception's descriptor of another module
+
+    ThrowInfo = Base + 0x900,
+    ConstThrowInfo = Base + 0x910,
+    CatchableTypes = Base + 0x920,
+    RuntimeErrorCatchable = Base + 0x930,
+    ExceptionCatchable = Base + 0x950,
+
+    FrameHandlerSlot = Base + 0xF00,
+    FixtureSize = 0x1000
+};
+
+struct Blob
+{
+    std::vector<uint8_t>& image;
+    uint32_t VA;
+
+    Blob& bytes(std::initializer_list<uint8_t> values)
+    {
+        for (uint8_t value : values)
+        {
+            image[VA++ - Base] = value;
+        }
+
+        return *this;
+    }
+
+    Blob& dword(uint32_t value)
+    {
+        memcpy(&image[VA - Base], &value, sizeof(value));
+        VA += 4;
+        return *this;
+    }
+
+    Blob& string(const char* text)
+    {
+        memcpy(&image[VA - Base], text, strlen(text) + 1);
+        VA += (uint32_t)strlen(text) + 1;
+        return *this;
+    }
+
+    //mov edx, [esp+8]; lea eax, [edx+0Ch]; mov ecx, [edx-20h]; xor ecx, eax; call __security_check_cookie; mov eax, FuncInfo; jmp Handler
+    Blob& handlerThunk(uint32_t FuncInfo, uint32_t Handler)
+    {
+        bytes({ 0x8B, 0x54, 0x24, 0x08, 0x8D, 0x42, 0x0C, 0x8B, 0x4A, 0xE0, 0x33, 0xC8 });
+        bytes({ 0xE8 }).dword(OtherHandler - (VA + 4));
+        bytes({ 0xB8 }).dword(FuncInfo);
+        bytes({ 0xE9 });
+        return dword(Handler - (VA + 4));
+    }
+
+    //magic, maxState, pUnwindMap, nTryBlocks, pTryBlockMap, nIPMapEntries, pIPtoStateMap, pESTypeList, EHFlags
+    Blob& funcInfo(int32_t maxState, uint32_t UnwindMap, uint32_t tryBlocks, uint32_t TryBlockMap, uint32_t EHFlags = 0)
+    {
+        return dword(Cxx_EH::Magic3).dword(maxState).dword(UnwindMap).dword(tryBlocks).dword(TryBlockMap).dword(0).dword(0).dword(0).dword(EHFlags);
+    }
+
+    //tryLow, tryHigh, catchHigh, nCatches, pHandlerArray
+    Blob& tryBlock(uint32_t Handler)
+    {
+        return dword(0).dword(0).dword(1).dword(1).dword(Handler);
+    }
+
+    //adjectives, pType, dispCatchObj, addressOfHandler
+    Blob& handlerType(uint32_t adjectives, uint32_t Type)
+    {
+        return dword(adjectives).dword(Type).dword(0xFFFFFFE4).dword(Base + 0x300);
+    }
+
+    //properties, pType, PMD (3 dwords), sizeOrOffset, copyFunction
+    Blob& catchableType(uint32_t properties, uint32_t Type)
+    {
+        return dword(properties).dword(Type).dword(0).dword(0xFFFFFFFF).dword(0).dword(12).dword(0);
+    }
+
+    //pVFTable, spare, name
+    Blob& typeDescriptor(const char* name)
+    {
+        return dword(Base + 0xE00).dword(0).string(name);
+    }
+};
+
+static std::vector<uint8_t> buildFixture()
+{
+    std::vector<uint8_t> image(FixtureSize, 0xCC);
+
+    Blob{ image, FrameHandlerSlot }.dword(FrameHandler);
+    Blob{ image, FrameHandler }.bytes({ 0x55, 0x8B, 0xEC });
+    Blob{ image, FrameHandlerThunk }.bytes({ 0xFF, 0x25 }).dword(FrameHandlerSlot);
+    Blob{ image, OtherHandler }.bytes({ 0xC3 });
+
+    Blob{ image, CleanupThunk }.handlerThunk(CleanupInfo, FrameHandlerThunk);
+    Blob{ image, CatchOtherThunk }.handlerThunk(CatchOtherInfo, FrameHandlerThunk);
+    Blob{ image, CatchExceptionThunk }.handlerThunk(CatchExceptionInfo, FrameHandlerThunk);
+    Blob{ image, CatchAllThunk }.handlerThunk(CatchAllInfo, FrameHandlerThunk);
+    Blob{ image, NoexceptThunk }.handlerThunk(NoexceptInfo, FrameHandlerThunk);
+    Blob{ image, ForeignThunk }.handlerThunk(CleanupInfo, OtherHandler);
+
+    //State 0 constructed A, state 1 constructed B
+    Blob{ image, CleanupInfo }.funcInfo(2, CleanupUnwindMap, 0, 0);
+    Blob{ image, CleanupUnwindMap }.dword(0xFFFFFFFF).dword(Base + 0x310).dword(0).dword(Base + 0x320);
+
+    Blob{ image, CatchOtherInfo }.funcInfo(2, CleanupUnwindMap, 1, TryBlocks);
+    Blob{ image, CatchExceptionInfo }.funcInfo(2, CleanupUnwindMap, 1, TryBlocks + 20);
+    Blob{ image, CatchAllInfo }.funcInfo(2, CleanupUnwindMap, 1, TryBlocks + 40);
+    Blob{ image, NoexceptInfo }.funcInfo(2, CleanupUnwindMap, 0, 0, Cxx_EH::FunctionNoexcept);
+
+    Blob{ image, TryBlocks }.tryBlock(Handlers).tryBlock(Handlers + 16).tryBlock(Handlers + 32);
+    Blob{ image, Handlers }
+        .handlerType(Cxx_EH::HandlerConst | Cxx_EH::HandlerReference, OtherType)
+        .handlerType(Cxx_EH::HandlerConst | Cxx_EH::HandlerReference, ForeignExceptionType)
+        .handlerType(0, 0);
+
+    Blob{ image, RuntimeErrorType }.typeDescriptor(".?AVruntime_error@std@@");
+    Blob{ image, ExceptionType }.typeDescriptor(".?AVexception@std@@");
+    Blob{ image, OtherType }.typeDescriptor(".?AVOther@@");
+    Blob{ image, ForeignExceptionType }.typeDescriptor(".?AVexception@std@@");
+
+    //attributes, pmfnUnwind, pForwardCompat, pCatchableTypeArray
+    Blob{ image, ThrowInfo }.dword(0).dword(Base + 0x330).dword(0).dword(CatchableTypes);
+    Blob{ image, ConstThrowInfo }.dword(Cxx_EH::ThrowConst).dword(Base + 0x330).dword(0).dword(CatchableTypes);
+    Blob{ image, CatchableTypes }.dword(2).dword(RuntimeErrorCatchable).dword(ExceptionCatchable);
+    Blob{ image, RuntimeErrorCatchable }.catchableType(0, RuntimeErrorType);
+    Blob{ image, ExceptionCatchable }.catchableType(0, ExceptionType);
+
+    return image;
+}
+
+static Cxx_EH::Verdict verdictOf(const Throw_Sites::BufferMemory& memory, uint32_t Thunk, int32_t state, uint32_t Throw)
+{
+    Cxx_EH::FuncInfo info;
+    Cxx_EH::ThrowTypes throwTypes;
+    uint32_t VA = Cxx_EH::funcInfoOf(memory, Thunk, FrameHandler);
+
+    if (VA == 0 || !Cxx_EH::readFuncInfo(memory, VA, info) || !Cxx_EH::readThrowInfo(memory, Throw, throwTypes))
+    {
+        return Cxx_EH::Unknown;
+    }
+
+    return Cxx_EH::findCatch(memory, info, state, throwTypes);
+}
+
+static bool decodesFixture(std::vector<uint8_t>& image)
+{
+    Throw_Sites::BufferMemory memory = { image.data(), image.size(), Base };
+    bool correct = true;
+
+    correct &= Cxx_EH::funcInfoOf(memory, CleanupThunk, FrameHandler) == CleanupInfo;
+    correct &= Cxx_EH::funcInfoOf(memory, ForeignThunk, FrameHandler) == 0;
+
+    correct &= verdictOf(memory, CleanupThunk, 1, ThrowInfo) == Cxx_EH::Passes;
+    correct &= verdictOf(memory, CatchOtherThunk, 0, ThrowInfo) == Cxx_EH::Passes;
+    correct &= verdictOf(memory, CatchExceptionThunk, 0, ThrowInfo) == Cxx_EH::Catches; //Same name, other module's descriptor
+    correct &= verdictOf(memory, CatchExceptionThunk, 0, ConstThrowInfo) == Cxx_EH::Catches;
+    correct &= verdictOf(memory, CatchExceptionThunk, -1, ThrowInfo) == Cxx_EH::Passes; //Outside of the try
+    correct &= verdictOf(memory, CatchExceptionThunk, 5, ThrowInfo) == Cxx_EH::Unknown; //Past maxState
+    correct &= verdictOf(memory, CatchAllThunk, 0, ThrowInfo) == Cxx_EH::Catches;
+    correct &= verdictOf(memory, NoexceptThunk, 1, ThrowInfo) == Cxx_EH::Terminates;
+
+    //Thrown const, caught as a non-const reference
+    Blob{ image, Handlers + 16 }.dword(Cxx_EH::HandlerReference);
+    correct &= verdictOf(memory, CatchExceptionThunk, 0, ConstThrowInfo) == Cxx_EH::Passes;
+    correct &= verdictOf(memory, CatchExceptionThunk, 0, ThrowInfo) == Cxx_EH::Catches;
+
+    //Only catchable by reference, caught by value
+    Blob{ image, Handlers + 16 }.dword(0);
+    Blob{ image, ExceptionCatchable }.dword(Cxx_EH::CatchByReferenceOnly);
+    correct &= verdictOf(memory, CatchExceptionThunk, 0, ThrowInfo) == Cxx_EH::Passes;
+
+    Blob{ image, Handlers + 16 }.dword(Cxx_EH::HandlerConst | Cxx_EH::HandlerReference);
+    Blob{ image, ExceptionCatchable }.dword(0);
+
+    //Unwinding the cleanup function from state 1 destroys B then A
+    std::vector<uint32_t> actions;
+    Cxx_EH::FuncInfo info;
+    Cxx_EH::readFuncInfo(memory, CleanupInfo, info);
+
+    correct &= Cxx_EH::forEachUnwindAction(memory, info, 1, -1, [&](int32_t, uint32_t action) { actions.push_back(action); });
+    correct &= actions == std::vector<uint32_t>{ Base + 0x320, Base + 0x310 };
+
+    return correct;
+}
+
+//Simulated dispatch through C++ frames
+
+static std::vector<uint8_t> fixture;
+static size_t handlersCalled = 0;
+
+//EHRegistrationNode, with the VA of the frame handler thunk since Handler is a host pointer here
+struct CxxFrame
+{
+    Simulated::Registration Node;
+    int32_t state;
+    uint32_t Thunk;
+};
+
+//Stand-in for __CxxFrameHandler3's search: find the catch, take it if there is one
+static Core::Disposition CxxFrameHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context*, void*)
+{
+    Throw_Sites::BufferMemory memory = { fixture.data(), fixture.size(), Base };
+    const CxxFrame* Frame = reinterpret_cast<const CxxFrame*>(EstablisherFrame);
+
+    ++handlersCalled;
+
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    Cxx_EH::FuncInfo info;
+    Cxx_EH::ThrowTypes throwTypes;
+    uint32_t VA = Cxx_EH::funcInfoOf(memory, Frame->Thunk, FrameHandler);
+
+    if (VA != 0 && Cxx_EH::readFuncInfo(memory, VA, info) && Cxx_EH::readThrowInfo(memory, Cxx_EH::throwInfoOf(ExceptionRecord), throwTypes)
+        && Cxx_EH::findCatch(memory, info, Frame->state, throwTypes) == Cxx_EH::Catches)
+    {
+        return Core::ContinueExecution;
+    }
+
+    return Core::ContinueSearch;
+}
+
+//What platform_win32.h does with CXX_FAST_PATH
+struct FastPathPlatform : Simulated::Platform
+{
+    static bool skipHandler(const Record* Exception, const Registration* Frame)
+    {
+        static thread_local Cxx_EH::ThrowCache cache = {};
+        Throw_Sites::BufferMemory memory = { fixture.data(), fixture.size(), Base };
+        const CxxFrame* Node = reinterpret_cast<const CxxFrame*>(Frame);
+
+        return Cxx_EH::canSkip(memory, cache, Exception, Node->Thunk, Node->state, FrameHandler);
+    }
+};
+
+static Simulated::Record cxxThrow()
+{
+    Simulated::Record Exception = {};
+    Exception.ExceptionCode = Cxx_EH::ExceptionCode; //Not NonContinuable so the catching frame can return ContinueExecution
+    Exception.NumberParameters = 3;
+    Exception.ExceptionInformation[0] = Cxx_EH::Magic1;
+    Exception.ExceptionInformation[1] = Base + 0xD00; //The thrown object
+    Exception.ExceptionInformation[2] = ThrowInfo;
+
+    return Exception;
+}
+
+//depth frames that only clean up, then one that catches std::exception, newest at the lowest address
+static void pushFrames(std::vector<CxxFrame>& frames)
+{
+    for (size_t i = frames.size(); i-- > 0;)
+    {
+        frames[i].state = (i == frames.size() - 1) ? 0 : 1;
+        frames[i].Thunk = (i == frames.size() - 1) ? CatchExceptionThunk : (i % 2 ? CleanupThunk : CatchOtherThunk);
+        Simulated::pushRegistration(frames[i].Node, &CxxFrameHandler);
+    }
+}
+
+template <class Platform>
+static double timeDispatch(size_t depth, size_t iterations, bool& correct)
+{
+    std::vector<CxxFrame> frames(depth + 1);
+    pushFrames(frames);
+
+    handlersCalled = 0;
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = cxxThrow();
+        Simulated::Context Context = {};
+
+        //The catching frame would unwind and never return, ContinueExecution is what reaches here instead
+        correct &= Core::DispatchException<Platform>(&Exception, &Context) == Core::ContinueExecutionFilter;
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return elapsed;
+}
+
+void benchmarkCxxEH()
+{
+    fixture = buildFixture();
+
+    bool correct = decodesFixture(fixture);
+    printf("cxx_eh decode %s\n", correct ? "matches the CRT's rules" : "WRONG VERDICTS");
+
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        const size_t iterations = 400000 / depth;
+        bool dispatched = true;
+
+        double walk = timeDispatch<Simulated::Platform>(depth, iterations, dispatched);
+        bool walkCalls = handlersCalled == iterations * (depth + 1);
+
+        double skipped = timeDispatch<FastPathPlatform>(depth, iterations, dispatched);
+        bool skippedCalls = handlersCalled == iterations; //Only the catching frame
+
+        printf("cxx_eh depth=%-4zu walk %8.1f ns  skipped %8.1f ns  (%s)\n", depth, walk, skipped,
+            (dispatched && walkCalls && skippedCalls) ? "caught by the same frame" : "WRONG DISPATCH");
+    }
+}
\ No newline at end of file
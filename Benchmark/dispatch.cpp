@@ -0,0 +1,236 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    NOTE: Everything here runs on the simulated platform (platform_simulated.h). The
+    numbers are the cost of the dispatch/unwind state machine itself, not of the
+    kernel delivering an exception to VEH.
+*/
+
+//Handlers
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    return Core::ContinueExecution;
+}
+
+static bool caughtAtTarget = true;
+
+//Unwinds to its own frame like a C++ catch or __except would, then resumes
+static Core::Disposition CatchHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    Simulated::Unwind(EstablisherFrame, ExceptionRecord);
+
+    //Everything above this frame is gone and the dispatch's snapshot with it
+    caughtAtTarget &= Simulated::currentTeb().ExceptionList == EstablisherFrame && Core::chainSnapshot<Simulated::Platform>().Head == NULL;
+    return Core::ContinueExecution;
+}
+
+//Chain helpers
+
+/*
+    Frames are registered from the highest address down so that older frames
+    are higher on the simulated stack, just like the real thing.
+*/
+static void pushChain(Simulated::Registration* frames, size_t depth, Simulated::Routine Oldest = &ExecuteHandler)
+{
+    for (size_t i = depth; i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], (i == depth - 1) ? Oldest : &SearchHandler);
+    }
+}
+
+static void limitStack(std::vector<Simulated::Registration>& frames)
+{
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+}
+
+//Benchmarks
+
+static void benchmarkDispatch(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+    std::vector<double> samples;
+    samples.reserve(iterations / 16 + 1);
+
+    limitStack(frames);
+    pushChain(frames.data(), depth);
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        if ((i & 0xF) == 0)
+        {
+            //Sample latency of every 16th dispatch
+            Clock::time_point sampleStart = Clock::now();
+            Simulated::DispatchException(&Exception, &Context);
+            samples.push_back(nanoseconds(Clock::now() - sampleStart));
+        }
+        else
+            Simulated::DispatchException(&Exception, &Context);
+    }
+
+    double total = nanoseconds(Clock::now() - start);
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    std::sort(samples.begin(), samples.end());
+
+    printf("dispatch depth=%-4zu %10.2f M/s  mean %8.1f ns  p50 %8.1f ns  p99 %8.1f ns\n",
+        depth, iterations / total * 1e3, total / iterations,
+        samples[samples.size() / 2], samples[samples.size() * 99 / 100]);
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "dispatch depth=%zu mean", depth);
+    result("dispatch", Case, total / iterations, "ns");
+    snprintf(Case, sizeof(Case), "dispatch depth=%zu p99", depth);
+    result("dispatch", Case, samples[samples.size() * 99 / 100], "ns");
+}
+
+static void benchmarkUnwind(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    limitStack(frames);
+
+    Clock::duration total = Clock::duration::zero();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        pushChain(frames.data(), depth);
+
+        Clock::time_point start = Clock::now();
+        Simulated::Unwind(Core::chainEnd<Simulated::Registration>(), NULL);
+        total += Clock::now() - start;
+    }
+
+    double elapsed = nanoseconds(total);
+
+    printf("unwind   depth=%-4zu %10.2f M/s  mean %8.1f ns  %6.2f ns/frame\n",
+        depth, iterations / elapsed * 1e3, elapsed / iterations, elapsed / iterations / depth);
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "unwind depth=%zu per frame", depth);
+    result("dispatch", Case, elapsed / iterations / depth, "ns/frame");
+}
+
+/*
+    A throw: the oldest frame's handler unwinds the rest of the chain from inside the
+    dispatch, so the unwind reuses the stack limits of the dispatch's chain snapshot.
+    "separate" is the same work done as a dispatch followed by an unwind from outside
+    of it, which has to read the stack limits again.
+*/
+static void benchmarkThrow(size_t depth, size_t iterations)
+{
+    /*
+        On the real stack, older than the nested registrations the handlers get from
+        executeHandler, otherwise Unwind would see them as frames past its target.
+    */
+    Simulated::Registration frames[256];
+    Simulated::Registration* Target = &frames[depth - 1];
+
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+
+    Clock::duration inside = Clock::duration::zero();
+    Clock::duration separate = Clock::duration::zero();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xE06D7363; //C++ exception
+
+        pushChain(frames, depth, &CatchHandler);
+
+        Clock::time_point start = Clock::now();
+        Simulated::DispatchException(&Exception, &Context);
+        inside += Clock::now() - start;
+
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+        Exception = {};
+        Exception.ExceptionCode = 0xE06D7363;
+
+        pushChain(frames, depth);
+
+        start = Clock::now();
+        Simulated::DispatchException(&Exception, &Context);
+        Simulated::Unwind(Target, &Exception);
+        separate += Clock::now() - start;
+
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    }
+
+    printf("throw    depth=%-4zu inside %8.1f ns  separate %8.1f ns  (%s)\n",
+        depth, nanoseconds(inside) / iterations, nanoseconds(separate) / iterations, caughtAtTarget ? "caught at the target" : "NOT CAUGHT AT THE TARGET");
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "throw depth=%zu inside", depth);
+    result("dispatch", Case, nanoseconds(inside) / iterations, "ns");
+    snprintf(Case, sizeof(Case), "throw depth=%zu separate", depth);
+    result("dispatch", Case, nanoseconds(separate) / iterations, "ns");
+}
+
+void benchmarkDispatchUnwind()
+{
+    const size_t depths[] = { 1, 4, 16, 64, 256 };
+
+    for (size_t depth : depths)
+    {
+        benchmarkDispatch(depth, 4000000 / depth + 100000);
+    }
+
+    for (size_t depth : depths)
+    {
+        benchmarkUnwind(depth, 4000000 / depth + 100000);
+    }
+
+    for (size_t depth : depths)
+    {
+        benchmarkThrow(depth, 2000000 / depth + 50000);
+    }
+}
\ No newline at end of file
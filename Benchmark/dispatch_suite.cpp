@@ -0,0 +1,535 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "bound_index.h"
+#include "platform_simulated.h"
+#include "stack_walk.h"
+#include "verdict_cache.h"
+
+using namespace SEH;
+
+/*
+    The dispatch numbers worth tracking from one build to the next, all recorded with
+    result() for --json and --baseline: where in the chain the exception is caught,
+    nested and collided exceptions, what each EXCEPTION_CHECKING mode adds in front of
+    the walk and how dispatch throughput scales with throwing threads.
+
+    Frames are on the real stack and the stack limits are the whole address space,
+    so the nested registrations executeHandler makes are accepted like in dispatch.cpp.
+*/
+
+static const size_t maxDepth = 256;
+
+static Simulated::Registration* catcher = NULL;
+static size_t unwindCalls = 0;
+static size_t nestedCalls = 0;
+
+//Handlers
+
+//Only the frame in catcher takes the exception
+static Core::Disposition MixHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        ++unwindCalls;
+        return Core::ContinueSearch;
+    }
+
+    return (EstablisherFrame == catcher) ? Core::ContinueExecution : Core::ContinueSearch;
+}
+
+//For the threads, which can't share catcher
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding) ? Core::ContinueSearch : Core::ContinueExecution;
+}
+
+//Raises an exception from inside the handler, which the same frame is asked about again
+static Core::Disposition RaisingHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::NestedCall)
+    {
+        ++nestedCalls;
+        return Core::ContinueSearch;
+    }
+
+    if (!(ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding))
+    {
+        Simulated::Record Nested = {};
+        Nested.ExceptionCode = 0xC0000005;
+
+        Core::DispatchException<Simulated::Platform>(&Nested, ContextRecord);
+    }
+
+    return Core::ContinueSearch;
+}
+
+//While being unwound, raises an exception whose handler unwinds again and collides with this unwind
+static Core::Disposition CollidingHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        ++unwindCalls;
+
+        Simulated::Record Raised = {};
+        Raised.ExceptionCode = 0xE06D7363;
+
+        Core::DispatchException<Simulated::Platform>(&Raised, ContextRecord);
+    }
+
+    return Core::ContinueSearch;
+}
+
+//Takes the exception raised by CollidingHandler by unwinding to its own frame
+static Core::Disposition CatchingHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        ++unwindCalls;
+        return Core::ContinueSearch;
+    }
+
+    Core::Unwind<Simulated::Platform>(EstablisherFrame, ExceptionRecord, ContextRecord);
+    return Core::ContinueExecution;
+}
+
+//Chain helpers
+
+//Older frames higher on the stack, the oldest one catches unless told otherwise
+static void pushChain(Simulated::Registration* frames, size_t depth, Simulated::Routine Handler = &MixHandler)
+{
+    for (size_t i = depth; i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], Handler);
+    }
+
+    catcher = &frames[depth - 1];
+}
+
+static void clearChain()
+{
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+}
+
+static long dispatchOne(uint32_t Code = 0xC0000094)
+{
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+    Exception.ExceptionCode = Code;
+
+    return Core::DispatchException<Simulated::Platform>(&Exception, &Context);
+}
+
+static void record(const char* Case, double value, const char* unit)
+{
+    result("dispatch_suite", Case, value, unit);
+}
+
+//Where the exception is caught
+
+static uint32_t nextRandom(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void benchmarkMix(size_t depth)
+{
+    Simulated::Registration frames[maxDepth];
+    const size_t iterations = 4000000 / depth + 100000;
+
+    //The catching frame for the random mix, drawn up front so the draw isn't timed
+    std::vector<Simulated::Registration*> catchers(1024);
+    uint32_t state = 0x9E3779B9;
+
+    for (Simulated::Registration*& frame : catchers)
+    {
+        frame = &frames[nextRandom(state) % depth];
+    }
+
+    struct Mix
+    {
+        const char* name;
+        Simulated::Registration* catcher;
+    };
+
+    const Mix mixes[] = { { "newest", &frames[0] }, { "middle", &frames[depth / 2] }, { "oldest", &frames[depth - 1] }, { "random", NULL } };
+
+    pushChain(frames, depth);
+    printf("dispatch_suite mix    depth=%-4zu", depth);
+
+    for (const Mix& mix : mixes)
+    {
+        catcher = mix.catcher;
+        bool caught = true;
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            if (mix.catcher == NULL)
+            {
+                catcher = catchers[i & 1023];
+            }
+
+            caught &= dispatchOne() == Core::ContinueExecutionFilter;
+        }
+
+        double elapsed = nanoseconds(Clock::now() - start) / iterations;
+        printf("  %s %7.1f ns%s", mix.name, elapsed, caught ? "" : " (NOT CAUGHT)");
+
+        char Case[64];
+        snprintf(Case, sizeof(Case), "mix=%s depth=%zu", mix.name, depth);
+        record(Case, elapsed, "ns");
+    }
+
+    printf("\n");
+    clearChain();
+}
+
+//Nested and collided
+
+static void benchmarkNested(size_t depth)
+{
+    Simulated::Registration frames[maxDepth];
+    const size_t iterations = 2000000 / depth + 50000;
+
+    pushChain(frames, depth);
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        dispatchOne();
+    }
+
+    double plain = nanoseconds(Clock::now() - start) / iterations;
+
+    //The newest frame raises, the nested dispatch walks through it again and is caught by the oldest frame
+    frames[0].Handler = &RaisingHandler;
+    nestedCalls = 0;
+    start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        dispatchOne();
+    }
+
+    double nested = nanoseconds(Clock::now() - start) / iterations;
+    clearChain();
+
+    printf("dispatch_suite nested depth=%-4zu  plain %8.1f ns  nested %8.1f ns  (%s)\n", depth, plain, nested,
+        (nestedCalls == iterations) ? "raising frame asked once more with EXCEPTION_NESTED_CALL" : "WRONG NESTED CALLS");
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "nested depth=%zu", depth);
+    record(Case, nested, "ns");
+}
+
+static void benchmarkCollided(size_t depth)
+{
+    Simulated::Registration frames[maxDepth];
+    const size_t iterations = 2000000 / depth + 50000;
+
+    Clock::duration plain = Clock::duration::zero();
+    Clock::duration collided = Clock::duration::zero();
+    bool unwoundOnce = true;
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        pushChain(frames, depth);
+
+        Clock::time_point start = Clock::now();
+        Simulated::Unwind(Core::chainEnd<Simulated::Registration>(), NULL);
+        plain += Clock::now() - start;
+
+        /*
+            The second frame raises while being unwound and the third one catches that by
+            unwinding to itself. That unwind collides with the first one at the second
+            frame's nested registration and must not unwind the second frame again.
+        */
+        pushChain(frames, depth);
+        frames[1].Handler = &CollidingHandler;
+        frames[2].Handler = &CatchingHandler;
+        unwindCalls = 0;
+
+        start = Clock::now();
+        Simulated::Unwind(Core::chainEnd<Simulated::Registration>(), NULL);
+        collided += Clock::now() - start;
+
+        unwoundOnce &= unwindCalls == depth && Simulated::currentTeb().ExceptionList == Core::chainEnd<Simulated::Registration>();
+    }
+
+    printf("dispatch_suite collided depth=%-4zu plain unwind %8.1f ns  collided %8.1f ns  (%s)\n", depth,
+        nanoseconds(plain) / iterations, nanoseconds(collided) / iterations, unwoundOnce ? "every frame unwound once" : "FRAMES UNWOUND TWICE OR LEFT");
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "collided depth=%zu", depth);
+    record(Case, nanoseconds(collided) / iterations, "ns");
+}
+
+/*
+    EXCEPTION_CHECKING modes, built from the same pieces as the library's stages
+    (bound_check.cpp and handler.cpp) with the Windows calls replaced: BOUND_CHECK
+    walks a synthetic x86 stack image of a C++ throw and looks the thrower up in the
+    module index, VALID_TOP_HANDLER_CHECK finds the top handler's verdict in the
+    verdict cache like it does once warmed up. Every exception passes both.
+*/
+
+namespace Modes
+{
+    typedef uint32_t Address;
+
+    const Address stackLow = 0x00200000;
+    const Address raiseSite = 0x76501234;  //In kernelbase
+    const Address throwSite = 0x10002345;  //In the CRT
+    const Address thrower = 0x00401234;    //In the module with the library
+
+    std::vector<uint8_t> stackImage;
+    Bound_Index::Ranges<> modules;
+    Verdict_Cache::Cache<4096> verdicts;
+
+    //RaiseException's frame, _CxxThrowException's and the thrower's, each saving EBP and a return address
+    void build()
+    {
+        const Address frames[] = { throwSite, thrower, 0x00405678 };
+        stackImage.assign(sizeof(frames) * 0x20, 0);
+
+        for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); ++i)
+        {
+            Address SavedEbp = stackLow + (Address)((i + 1) * 0x20);
+            memcpy(&stackImage[i * 0x20], &SavedEbp, sizeof(SavedEbp));
+            memcpy(&stackImage[i * 0x20 + sizeof(Address)], &frames[i], sizeof(Address));
+        }
+
+        //The main module and a few registered with AddBoundModule
+        for (Address Base = 0x00400000; Base < 0x00C00000; Base += 0x00100000)
+        {
+            modules.add(Base, 0x00080000);
+        }
+    }
+
+    struct BoundCheck
+    {
+        static const bool enabled = true;
+        static const unsigned int cost = 3;
+
+        template <class Platform>
+        static Pipeline::Verdict filter(typename Platform::Record*, typename Platform::Context* Context)
+        {
+            Stack_Walk::ImageMemory<Address> memory = { stackImage.data(), stackImage.size(), stackLow };
+            Address stackTrace[Stack_Walk::maxFrames];
+
+            unsigned int frameCount = Stack_Walk::walk(memory, (Address)Context->Eip, (Address)Context->Ebp, stackLow, (Address)(stackLow + stackImage.size()), stackTrace, Stack_Walk::maxFrames);
+            unsigned int i = 0;
+
+            if (i < frameCount && stackTrace[i] == raiseSite) { ++i; }
+            if (i < frameCount && stackTrace[i] == throwSite) { ++i; }
+
+            return (i < frameCount && modules.contains(stackTrace[i])) ? Pipeline::Next : Pipeline::Skip;
+        }
+    };
+
+    struct TopHandlerCheck
+    {
+        static const bool enabled = true;
+        static const unsigned int cost = 2;
+
+        template <class Platform>
+        static Pipeline::Verdict filter(typename Platform::Record*, typename Platform::Context*)
+        {
+            uint32_t Handler = (uint32_t)(uintptr_t)Platform::getRegistrationHead()->Handler;
+            bool valid;
+
+            if (!verdicts.lookup(Handler, valid))
+            {
+                //Not in a SafeSEH table, the reason the library dispatches it
+                uint32_t generation = verdicts.generation();
+                valid = false;
+                verdicts.insert(Handler, valid, generation);
+            }
+
+            return valid ? Pipeline::Skip : Pipeline::Next;
+        }
+    };
+
+    template <class Checks>
+    double dispatch(size_t depth, size_t iterations, bool& dispatched)
+    {
+        Simulated::Registration frames[maxDepth];
+        pushChain(frames, depth);
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            Simulated::Record Exception = {};
+            Simulated::Context Context = {};
+            Exception.ExceptionCode = 0xE06D7363;
+            Context.Eip = raiseSite;
+            Context.Ebp = stackLow;
+
+            dispatched &= Core::DispatchException<Simulated::Platform, Checks>(&Exception, &Context) == Core::ContinueExecutionFilter;
+        }
+
+        double elapsed = nanoseconds(Clock::now() - start) / iterations;
+        clearChain();
+        return elapsed;
+    }
+}
+
+static void benchmarkModes(size_t depth)
+{
+    const size_t iterations = 4000000 / depth + 100000;
+    bool dispatched = true;
+
+    double none = Modes::dispatch<Pipeline::Stages<>>(depth, iterations, dispatched);
+    double bound = Modes::dispatch<Pipeline::Stages<Modes::BoundCheck>>(depth, iterations, dispatched);
+    double top = Modes::dispatch<Pipeline::Stages<Modes::TopHandlerCheck>>(depth, iterations, dispatched);
+    double both = Modes::dispatch<Pipeline::Stages<Modes::BoundCheck, Modes::TopHandlerCheck>>(depth, iterations, dispatched);
+
+    printf("dispatch_suite checking depth=%-4zu NO_CHECK %7.1f ns  BOUND_CHECK %7.1f ns  VALID_TOP_HANDLER_CHECK %7.1f ns  both %7.1f ns%s\n",
+        depth, none, bound, top, both, dispatched ? "" : "  (NOT DISPATCHED)");
+
+    const struct { const char* mode; double value; } modes[] = { { "NO_CHECK", none }, { "BOUND_CHECK", bound }, { "VALID_TOP_HANDLER_CHECK", top }, { "both", both } };
+
+    for (const auto& mode : modes)
+    {
+        char Case[64];
+        snprintf(Case, sizeof(Case), "checking=%s depth=%zu", mode.mode, depth);
+        record(Case, mode.value, "ns");
+    }
+}
+
+//Throwing threads, each with its own chain
+
+static void benchmarkThreads(unsigned int threadCount, size_t depth)
+{
+    std::atomic<bool> go(false), stop(false);
+    std::atomic<uint64_t> total(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, depth]
+        {
+            Simulated::Registration frames[maxDepth];
+            Simulated::setStackLimits(0, UINTPTR_MAX);
+
+            for (size_t i = depth; i-- > 0;)
+            {
+                Simulated::pushRegistration(frames[i], (i == depth - 1) ? &ExecuteHandler : &SearchHandler);
+            }
+
+            uint64_t count = 0;
+
+            while (!go.load(std::memory_order_acquire)) {}
+
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int i = 0; i < 64; ++i)
+                {
+                    Simulated::Record Exception = {};
+                    Simulated::Context Context = {};
+                    Exception.ExceptionCode = 0xC0000094;
+
+                    Core::DispatchException<Simulated::Platform>(&Exception, &Context);
+                }
+
+                count += 64;
+            }
+
+            total += count;
+            clearChain();
+        });
+    }
+
+    Clock::time_point start = Clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    stop.store(true);
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double perSecond = total / (nanoseconds(Clock::now() - start) / 1e9) / 1e6;
+
+    printf("dispatch_suite threads=%-3u depth=%-4zu %8.2f M/s  %8.2f M/s per thread\n", threadCount, depth, perSecond, perSecond / threadCount);
+
+    char Case[64];
+    snprintf(Case, sizeof(Case), "threads=%u depth=%zu", threadCount, depth);
+    record(Case, perSecond, "M/s");
+}
+
+void benchmarkDispatchSuite()
+{
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        benchmarkMix(depth);
+    }
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        benchmarkNested(depth);
+    }
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        benchmarkCollided(depth);
+    }
+
+    Modes::build();
+
+    for (size_t depth : { 1, 16 })
+    {
+        benchmarkModes(depth);
+    }
+
+    //1, 2, 4, ... up to every core, and every core once more if that's not a power of two
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int threads = 1; threads <= cores; threads *= 2)
+    {
+        benchmarkThreads(threads, 16);
+
+        if (threads < cores && threads * 2 > cores)
+        {
+            benchmarkThreads(cores, 16);
+        }
+    }
+}
\ No newline at end of file
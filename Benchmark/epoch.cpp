@@ -0,0 +1,442 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "epoch.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    The quiescence behind DisableSEH (src/epoch.h). First that dispatches left without
+    leave end where they should, then what entering and leaving costs a dispatch, then
+    a stress test: threads keep throwing while others keep enabling and disabling, and
+    a handler must never see the state a disable tears down.
+*/
+
+typedef Epoch::Domain<Epoch::SymmetricBarrier> Dispatches;
+
+//What Win32::Barrier costs the dispatch side; the heavy side needs FlushProcessWriteBuffers, so this one is only timed
+struct CompilerBarrier
+{
+    static void light() { std::atomic_signal_fence(std::memory_order_seq_cst); }
+    static void heavy() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+};
+
+//Like NtContinue, continuing a context doesn't return to the dispatches the handler was called from
+struct Resumed {};
+
+//Unwinding ends the dispatch the way Win32::Platform::continueContext does
+struct Platform : Simulated::Platform
+{
+    static void continueContext(Simulated::Context*, Simulated::Registration* TargetFrame)
+    {
+        Dispatches::abandon((uintptr_t)TargetFrame);
+        throw Resumed();
+    }
+};
+
+//Stands in for what DisableSEH tears down, alive between enable and disable
+static std::atomic<bool> alive(false);
+static std::atomic<size_t> violations(0);
+
+//The same state and steps as SEH.cpp
+static std::mutex lifetime;
+static bool enabled = true;
+static uint64_t enables = 0;
+static std::atomic<size_t> gaveUp(0);
+static std::atomic<size_t> enabledByHandlers(0);
+
+//Called with lifetime locked
+static void enable()
+{
+    ++enables;
+    alive.store(true, std::memory_order_relaxed);
+
+    if (!enabled)
+    {
+        Dispatches::open();
+        enabled = true;
+    }
+}
+
+static void disable()
+{
+    uint64_t Enables;
+
+    {
+        std::lock_guard<std::mutex> lock(lifetime);
+
+        if (!enabled)
+        {
+            return;
+        }
+
+        enabled = false;
+        Dispatches::close();
+        Enables = enables;
+    }
+
+    bool Drained = Dispatches::drain(std::chrono::milliseconds(200));
+
+    std::lock_guard<std::mutex> lock(lifetime);
+
+    if (!Drained || enabled || enables != Enables)
+    {
+        gaveUp.fetch_add(!Drained && !enabled && enables == Enables, std::memory_order_relaxed);
+        return;
+    }
+
+    alive.store(false, std::memory_order_relaxed);
+}
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    violations.fetch_add(!alive.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return Core::ContinueSearch;
+}
+
+//Either resumes like EXCEPTION_CONTINUE_EXECUTION or unwinds to itself like a catch
+static Core::Disposition CatchHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    violations.fetch_add(!alive.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    //Like EnableSEH from a handler, which hangs if a disable waits with the lock held
+    if ((ExceptionRecord->ExceptionInformation[0] & 0x3F) == 0)
+    {
+        std::lock_guard<std::mutex> lock(lifetime);
+        enable();
+        enabledByHandlers.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (ExceptionRecord->ExceptionCode == 0xE06D7363) //C++ exception
+    {
+        //SEH::Unwind captures the context of its caller, the handler, deep under the dispatch
+        ContextRecord->Esp = (uintptr_t)&ContextRecord;
+        Core::Unwind<Platform>(EstablisherFrame, ExceptionRecord, ContextRecord); //Resumes in the thrower, never returns
+    }
+
+    return Core::ContinueExecution;
+}
+
+//Stand-in for the library's VEH, see dispatch_exception.cpp. Called by the OS, so never inlined into the thrower
+__attribute__((noinline)) static long dispatch(Simulated::Record* Exception, Simulated::Context* Context)
+{
+    uintptr_t Position = (uintptr_t)&Exception;
+
+    if (!Dispatches::enter(Position))
+    {
+        return Core::ContinueSearchFilter;
+    }
+
+    long Result = Core::DispatchException<Platform>(Exception, Context);
+
+    Dispatches::leave(Position);
+    return Result;
+}
+
+//Returns what's wrong or NULL, positions stand in for stack addresses
+static const char* verify()
+{
+    Dispatches::open();
+
+    //A handler of the outer dispatch raised, and the nested one is unwound into the handler's catch
+    if (!Dispatches::enter(0x9000) || !Dispatches::enter(0x8000) || Dispatches::depth() != 2)
+    {
+        return "nested dispatches weren't counted";
+    }
+
+    Dispatches::abandon(0x8800);
+
+    if (Dispatches::depth() != 1)
+    {
+        return "an unwind into a handler didn't leave the outer dispatch going";
+    }
+
+    Dispatches::leave(0x9000);
+
+    if (Dispatches::depth() != 0)
+    {
+        return "leaving the outer dispatch didn't end it";
+    }
+
+    //Left without leave or abandon, like a real RtlUnwind or a longjmp out of a handler
+    Dispatches::enter(0x8000);
+    Dispatches::enter(0x7000);
+    Dispatches::enter(0x9000);
+
+    if (Dispatches::depth() != 1)
+    {
+        return "a dispatch further up the stack didn't end the ones left under it";
+    }
+
+    Dispatches::leave(0x9000);
+
+    //Merged past 16 nested dispatches, an unwind under all of them still keeps them going
+    for (uintptr_t i = 0; i < 20; ++i)
+    {
+        Dispatches::enter(0x9000 - i * 0x100);
+    }
+
+    Dispatches::abandon(0x7000);
+    bool merged = Dispatches::depth() == 20;
+    Dispatches::abandon(0x8FF0);
+
+    if (!merged || Dispatches::depth() != 1)
+    {
+        return "dispatches nested past the positions kept weren't ended right";
+    }
+
+    Dispatches::leave(0x9000);
+
+    //Another thread left a dispatch behind and never dispatches again
+    std::atomic<int> step(0);
+    std::thread stuck([&]()
+    {
+        Dispatches::enter(0x8000);
+        step.store(1);
+
+        while (step.load() != 2)
+        {
+            std::this_thread::yield();
+        }
+    });
+
+    while (step.load() != 1)
+    {
+        std::this_thread::yield();
+    }
+
+    Dispatches::close();
+
+    Clock::time_point start = Clock::now();
+    bool drained = Dispatches::drain(std::chrono::milliseconds(50));
+    double waited = nanoseconds(Clock::now() - start) / 1e6;
+
+    step.store(2);
+    stuck.join();
+    Dispatches::open();
+
+    if (drained || waited > 1000)
+    {
+        return "waiting for a dispatch that never ends wasn't cut short";
+    }
+
+    //Opening again ends the wait, a handler may have enabled
+    Dispatches::enter(0x8000);
+    Dispatches::close();
+    Dispatches::open();
+
+    if (Dispatches::drain(std::chrono::milliseconds(50)))
+    {
+        return "an open domain was drained";
+    }
+
+    Dispatches::leave(0x8000);
+
+    //A catch resumes in the thrower with the dispatch never returning, the thread is out of it all the same
+    uint32_t depthAfterCatch = 1;
+    step.store(0);
+
+    std::thread catcher([&]()
+    {
+        Simulated::Registration frame;
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xE06D7363;
+        Exception.ExceptionInformation[0] = 1; //No enable from the handler
+
+        Simulated::setStackLimits(0, UINTPTR_MAX);
+        Simulated::pushRegistration(frame, &CatchHandler);
+
+        try
+        {
+            dispatch(&Exception, &Context);
+        }
+        catch (const Resumed&)
+        {
+        }
+
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+        depthAfterCatch = Dispatches::depth();
+        step.store(1);
+
+        while (step.load() != 2)
+        {
+            std::this_thread::yield();
+        }
+    });
+
+    while (step.load() != 1)
+    {
+        std::this_thread::yield();
+    }
+
+    Dispatches::close();
+    drained = Dispatches::drain(std::chrono::milliseconds(50));
+
+    step.store(2);
+    catcher.join();
+    Dispatches::open();
+
+    if (depthAfterCatch != 0 || !drained)
+    {
+        return "a caught exception left its dispatch in flight";
+    }
+
+    return NULL;
+}
+
+template <class Barrier>
+static double enterLeave(size_t iterations)
+{
+    typedef Epoch::Domain<Barrier> Domain;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (Domain::enter((uintptr_t)&i))
+        {
+            Domain::leave((uintptr_t)&i);
+        }
+    }
+
+    return nanoseconds(Clock::now() - start) / iterations;
+}
+
+static void stress(unsigned int throwers, unsigned int togglers, std::chrono::milliseconds duration)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> dispatched(0);
+    std::atomic<size_t> turnedAway(0);
+    std::atomic<size_t> toggles(0);
+    std::atomic<size_t> leftInFlight(0);
+    std::vector<std::thread> threads;
+
+    alive.store(true);
+    violations.store(0);
+    gaveUp.store(0);
+    enabledByHandlers.store(0);
+    enabled = true;
+    Dispatches::open();
+
+    for (unsigned int t = 0; t < throwers; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            //On the stack, older than the nested registrations of executeHandler
+            Simulated::Registration frames[8];
+            size_t count = 0;
+            size_t away = 0;
+            size_t left = 0;
+
+            Simulated::setStackLimits(0, UINTPTR_MAX);
+
+            for (size_t i = t; !stop.load(std::memory_order_relaxed); ++i)
+            {
+                for (size_t f = 8; f-- > 0;)
+                {
+                    Simulated::pushRegistration(frames[f], (f == 7) ? &CatchHandler : &SearchHandler);
+                }
+
+                Simulated::Record Exception = {};
+                Simulated::Context Context = {};
+                Exception.ExceptionCode = (i & 1) ? 0xE06D7363 : 0xC0000094;
+                Exception.ExceptionInformation[0] = i;
+
+                try
+                {
+                    if (dispatch(&Exception, &Context) == Core::ContinueSearchFilter)
+                        ++away;
+                    else
+                        ++count;
+                }
+                catch (const Resumed&)
+                {
+                    ++count;
+                }
+
+                Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+                left += (Dispatches::depth() != 0);
+            }
+
+            dispatched.fetch_add(count);
+            turnedAway.fetch_add(away);
+            leftInFlight.fetch_add(left);
+        });
+    }
+
+    for (unsigned int t = 0; t < togglers; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            for (bool disabling = true; !stop.load(std::memory_order_relaxed); disabling = !disabling)
+            {
+                if (disabling)
+                    disable();
+                else
+                {
+                    std::lock_guard<std::mutex> lock(lifetime);
+                    enable();
+                }
+
+                toggles.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    Dispatches::open();
+
+    printf("epoch stress throwers=%u togglers=%u dispatched %zu  turned away %zu  toggles %zu  enabled by handlers %zu  gave up waiting %zu  (%s)\n",
+        throwers, togglers, dispatched.load(), turnedAway.load(), toggles.load(), enabledByHandlers.load(), gaveUp.load(),
+        (violations.load() != 0) ? "HANDLERS SAW TORN DOWN STATE" : (leftInFlight.load() != 0) ? "CAUGHT DISPATCHES LEFT IN FLIGHT" : "no handler saw torn down state");
+}
+
+void benchmarkEpoch()
+{
+    const char* error = verify();
+    printf("epoch %s%s\n", (error != NULL) ? "FAILED: " : "unwinds end the dispatches under them, a dispatch that never ends stops the wait", (error != NULL) ? error : "");
+
+    const size_t iterations = 20000000;
+
+    printf("epoch enter+leave  fence %6.2f ns  compiler barrier %6.2f ns\n",
+        enterLeave<Epoch::SymmetricBarrier>(iterations), enterLeave<CompilerBarrier>(iterations));
+
+    stress(4, 1, std::chrono::milliseconds(300));
+    stress(4, 4, std::chrono::milliseconds(300));
+}
\ No newline at end of file
@@ -0,0 +1,565 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdio>
+#include <initializer_list>
+#include <random>
+#include <vector>
+
+#include "benchmark.h"
+#include "handler_scan.h"
+#include "safeseh_index.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Builds a PE32 file with every kind of handler registration MSVC writes, lists its
+    handlers with src/handler_scan.h, embeds the manifest and looks the handlers up
+    from the mapped image the way HANDLER_MANIFEST does. Then times the scan of large
+    code sections and the manifest's lookup next to the SafeSEH index's.
+*/
+
+static const uint32_t imageBase = 0x00400000;
+static const uint32_t textRVA = 0x1000;
+static const uint32_t textOffset = 0x400;
+
+//Where things are in the code section of a fixture
+enum : uint32_t
+{
+    cxxThunk = 0x000,     //mov eax, offset FuncInfo / jmp __CxxFrameHandler3
+    cxxFunction = 0x040,  //push -1 / push offset cxxThunk / mov eax, fs:[0]
+    eh4Stub = 0x080,      //_except_handler4: push / push cookie / call _except_handler4_common
+    eh4Function = 0x0C0,  //push -2 / push offset scope4 / push offset eh4Stub / mov eax, fs:[0]
+    sehProlog4 = 0x100,   //push offset eh4Stub / push fs:[0]
+    sehCaller = 0x140,    //push 10h / push offset scope4Prolog / call sehProlog4
+    eh3Handler = 0x180,
+    eh3Function = 0x1C0,  //push -1 / push offset scope3 / push offset eh3Handler / mov eax, fs:[0]
+    ehProlog3 = 0x200,    //push eax / push fs:[0]
+    cxxThunk2 = 0x240,
+    cxxCaller = 0x280,    //push 20h / mov eax, offset cxxThunk2 / call ehProlog3
+    safeOnly = 0x2C0,     //Only in the SafeSEH table
+    unrelocated = 0x300,  //push offset lookAlike / mov eax, fs:[0] without a relocation, not code
+    lookAlike = 0x340,
+    dataPush = 0x380,     //push offset cookie / mov eax, fs:[0], the "handler" isn't code
+    filter = 0x3C0,
+    except = 0x3D0,
+    frameHandler3 = 0x700,
+    checkCookie = 0x740,
+    common = 0x780,
+    codeEnd = 0x800       //Random bytes from here on
+};
+
+//Where things are in .rdata and .data
+enum : uint32_t
+{
+    loadConfig = 0x000,
+    safeSEHTable = 0x100,
+    scope4 = 0x200,
+    scope4Prolog = 0x240,
+    scope3 = 0x280,
+    funcInfo = 0x300,
+    funcInfo2 = 0x340,
+    cookie = 0x000        //In .data
+};
+
+struct Fixture
+{
+    std::vector<uint8_t> file;
+    uint32_t rdataRVA;
+    uint32_t dataRVA;
+};
+
+static void write16(std::vector<uint8_t>& file, size_t offset, uint16_t value) { memcpy(&file[offset], &value, sizeof(value)); }
+static void write32(std::vector<uint8_t>& file, size_t offset, uint32_t value) { memcpy(&file[offset], &value, sizeof(value)); }
+
+static void section(std::vector<uint8_t>& file, size_t header, const char* name, uint32_t RVA, uint32_t size, uint32_t offset, uint32_t characteristics)
+{
+    memcpy(&file[header], name, strlen(name));
+    write32(file, header + 0x08, size);
+    write32(file, header + 0x0C, RVA);
+    write32(file, header + 0x10, size);
+    write32(file, header + 0x14, offset);
+    write32(file, header + 0x24, characteristics);
+}
+
+static Fixture buildFixture(uint32_t textSize)
+{
+    const uint32_t ntHeaders = 0x80;
+    const uint32_t rdataSize = 0x1000;
+    const uint32_t dataSize = 0x200;
+
+    Fixture fixture;
+    fixture.rdataRVA = textRVA + textSize;
+    fixture.dataRVA = fixture.rdataRVA + rdataSize;
+
+    uint32_t rdataOffset = textOffset + textSize;
+    uint32_t dataOffset = rdataOffset + rdataSize;
+    uint32_t relocRVA = fixture.dataRVA + 0x1000;
+    uint32_t relocOffset = dataOffset + dataSize;
+    uint32_t relocSize = 0x200;
+
+    std::vector<uint8_t>& file = fixture.file;
+    file.resize(relocOffset + relocSize);
+
+    //int3 padding between the functions, then random bytes (which have plenty of 64, 68 and E8 in them)
+    std::mt19937 random(textSize);
+    memset(&file[textOffset], 0xCC, codeEnd);
+
+    for (uint32_t i = codeEnd; i < textSize; ++i)
+    {
+        file[textOffset + i] = (uint8_t)random();
+    }
+
+    write16(file, 0, 0x5A4D); //MZ
+    write32(file, 0x3C, ntHeaders);
+    write32(file, ntHeaders, 0x00004550); //PE\0\0
+    write16(file, ntHeaders + 4, 0x14C); //i386
+    write16(file, ntHeaders + 6, 4); //NumberOfSections
+    write16(file, ntHeaders + 20, 0xE0); //SizeOfOptionalHeader
+    write16(file, ntHeaders + 0x18, 0x10B); //PE32
+    write32(file, ntHeaders + 0x18 + 0x1C, imageBase);
+    write32(file, ntHeaders + 0x18 + 0x20, 0x1000); //SectionAlignment
+    write32(file, ntHeaders + 0x18 + 0x24, 0x200); //FileAlignment
+    write32(file, ntHeaders + 0x18 + 0x38, relocRVA + 0x1000); //SizeOfImage
+    write32(file, ntHeaders + 0x18 + 0x3C, textOffset); //SizeOfHeaders
+    write32(file, ntHeaders + 0x18 + 0x40, 1); //CheckSum, anything but 0 means it's kept up to date
+    write32(file, ntHeaders + 0x18 + 0x5C, 16); //NumberOfRvaAndSizes
+
+    size_t sections = ntHeaders + 0x18 + 0xE0;
+    section(file, sections, ".text", textRVA, textSize, textOffset, 0x60000020);
+    section(file, sections + 0x28, ".rdata", fixture.rdataRVA, rdataSize, rdataOffset, 0x40000040);
+    section(file, sections + 0x50, ".data", fixture.dataRVA, dataSize, dataOffset, 0xC0000040);
+    section(file, sections + 0x78, ".reloc", relocRVA, relocSize, relocOffset, 0x42000040);
+
+    std::vector<uint32_t> relocated;
+    uint32_t at = 0;
+
+    //Emits code at a text offset, addresses are text offsets unless they're already RVAs
+    auto code = [&](uint32_t site) { at = site; };
+    auto bytes = [&](std::initializer_list<uint8_t> list) { for (uint8_t byte : list) file[textOffset + at++] = byte; };
+    auto addressRVA = [&](uint32_t RVA, bool relocate = true)
+    {
+        write32(file, textOffset + at, imageBase + RVA);
+
+        if (relocate)
+        {
+            relocated.push_back(textRVA + at);
+        }
+
+        at += 4;
+    };
+    auto address = [&](uint32_t site, bool relocate = true) { addressRVA(textRVA + site, relocate); };
+    auto rel32 = [&](uint32_t site) { write32(file, textOffset + at, site - (at + 4)); at += 4; };
+
+    code(cxxThunk);
+    bytes({ 0x8B, 0x54, 0x24, 0x08, 0xB8 }); addressRVA(fixture.rdataRVA + funcInfo); bytes({ 0xE9 }); rel32(frameHandler3);
+
+    code(cxxFunction);
+    bytes({ 0x55, 0x8B, 0xEC, 0x6A, 0xFF, 0x68 }); address(cxxThunk); bytes({ 0x64, 0xA1, 0, 0, 0, 0, 0x50 });
+
+    code(eh4Stub);
+    bytes({ 0x8B, 0xFF, 0x55, 0x8B, 0xEC, 0xFF, 0x75, 0x14, 0xFF, 0x75, 0x10, 0xFF, 0x75, 0x0C, 0xFF, 0x75, 0x08, 0x68 });
+    address(checkCookie); bytes({ 0x68 }); addressRVA(fixture.dataRVA + cookie); bytes({ 0xE8 }); rel32(common); bytes({ 0x83, 0xC4, 0x18, 0x5D, 0xC3 });
+
+    code(eh4Function);
+    bytes({ 0x55, 0x8B, 0xEC, 0x6A, 0xFE, 0x68 }); addressRVA(fixture.rdataRVA + scope4); bytes({ 0x68 }); address(eh4Stub); bytes({ 0x64, 0xA1, 0, 0, 0, 0, 0x50 });
+
+    code(sehProlog4);
+    bytes({ 0x68 }); address(eh4Stub); bytes({ 0x64, 0xFF, 0x35, 0, 0, 0, 0 });
+
+    code(sehCaller);
+    bytes({ 0x6A, 0x10, 0x68 }); addressRVA(fixture.rdataRVA + scope4Prolog); bytes({ 0xE8 }); rel32(sehProlog4);
+
+    code(eh3Function);
+    bytes({ 0x55, 0x8B, 0xEC, 0x6A, 0xFF, 0x68 }); addressRVA(fixture.rdataRVA + scope3); bytes({ 0x68 }); address(eh3Handler); bytes({ 0x64, 0xA1, 0, 0, 0, 0, 0x50 });
+
+    code(ehProlog3);
+    bytes({ 0x50, 0x64, 0xFF, 0x35, 0, 0, 0, 0 });
+
+    code(cxxThunk2);
+    bytes({ 0xB8 }); addressRVA(fixture.rdataRVA + funcInfo2); bytes({ 0xE9 }); rel32(frameHandler3);
+
+    code(cxxCaller);
+    bytes({ 0x6A, 0x20, 0xB8 }); address(cxxThunk2); bytes({ 0xE8 }); rel32(ehProlog3);
+
+    code(unrelocated);
+    bytes({ 0x68 }); address(lookAlike, false); bytes({ 0x64, 0xA1, 0, 0, 0, 0 });
+
+    code(dataPush);
+    bytes({ 0x68 }); addressRVA(fixture.dataRVA + cookie); bytes({ 0x64, 0xA1, 0, 0, 0, 0 });
+
+    for (uint32_t stub : { eh3Handler, safeOnly, lookAlike, filter, except, frameHandler3, checkCookie, common })
+    {
+        file[textOffset + stub] = 0xC3; //ret
+    }
+
+    //.rdata: the load config with the SafeSEH table, scope tables and FuncInfos
+    uint32_t rdata = rdataOffset;
+
+    write32(file, rdata + loadConfig, 0x48);
+    write32(file, rdata + loadConfig + 0x40, imageBase + fixture.rdataRVA + safeSEHTable);
+    write32(file, rdata + loadConfig + 0x44, 3);
+    write32(file, rdata + safeSEHTable, textRVA + cxxThunk);
+    write32(file, rdata + safeSEHTable + 4, textRVA + eh4Stub);
+    write32(file, rdata + safeSEHTable + 8, textRVA + safeOnly);
+
+    for (uint32_t table : { scope4, scope4Prolog })
+    {
+        write32(file, rdata + table, 0xFFFFFFFE); //GSCookieOffset, none
+        write32(file, rdata + table + 8, 0xFFFFFFCC); //EHCookieOffset
+        write32(file, rdata + table + 16, 0xFFFFFFFE); //Outside of every __try
+        write32(file, rdata + table + 20, imageBase + textRVA + filter);
+        write32(file, rdata + table + 24, imageBase + textRVA + except);
+    }
+
+    write32(file, rdata + scope3, 0xFFFFFFFF);
+    write32(file, rdata + scope3 + 4, imageBase + textRVA + filter);
+    write32(file, rdata + scope3 + 8, imageBase + textRVA + except);
+
+    write32(file, rdata + funcInfo, Cxx_EH::Magic3);
+    write32(file, rdata + funcInfo + 4, 1); //maxState
+    write32(file, rdata + funcInfo2, Cxx_EH::Magic1);
+
+    write32(file, ntHeaders + 0x18 + 0x60 + 10 * 8, fixture.rdataRVA + loadConfig); //IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG
+    write32(file, ntHeaders + 0x18 + 0x60 + 10 * 8 + 4, 0x48);
+
+    //One IMAGE_BASE_RELOCATION block per page
+    std::sort(relocated.begin(), relocated.end());
+    uint32_t block = relocOffset;
+
+    for (size_t i = 0; i < relocated.size(); )
+    {
+        uint32_t page = relocated[i] & ~0xFFFu;
+        uint32_t entries = 0;
+
+        for (; i < relocated.size() && (relocated[i] & ~0xFFFu) == page; ++i, ++entries)
+        {
+            write16(file, block + 8 + entries * 2, (uint16_t)(0x3000 | (relocated[i] & 0xFFF)));
+        }
+
+        entries += entries & 1;
+        write32(file, block, page);
+        write32(file, block + 4, 8 + entries * 2);
+        block += 8 + entries * 2;
+    }
+
+    write32(file, ntHeaders + 0x18 + 0x60 + 5 * 8, relocRVA); //IMAGE_DIRECTORY_ENTRY_BASERELOC
+    write32(file, ntHeaders + 0x18 + 0x60 + 5 * 8 + 4, block - relocOffset);
+
+    return fixture;
+}
+
+//What the manifest of a fixture has to hold, sorted by RVA
+static std::vector<Handler_Manifest::Entry> expectedEntries(const Fixture& fixture)
+{
+    using namespace Handler_Manifest;
+
+    return
+    {
+        { textRVA + cxxThunk, SafeSEH | Registered | CxxHandler, fixture.rdataRVA + funcInfo },
+        { textRVA + eh4Stub, SafeSEH | Registered | ExceptHandler4, fixture.dataRVA + cookie },
+        { textRVA + eh3Handler, Registered | ExceptHandler3, 0 },
+        { textRVA + cxxThunk2, Registered | CxxHandler, fixture.rdataRVA + funcInfo2 },
+        { textRVA + safeOnly, SafeSEH, 0 },
+        { fixture.rdataRVA + scope4, ScopeTable, textRVA + eh4Stub },
+        { fixture.rdataRVA + scope4Prolog, ScopeTable, textRVA + eh4Stub },
+        { fixture.rdataRVA + scope3, ScopeTable, textRVA + eh3Handler },
+        { fixture.rdataRVA + funcInfo, FuncInfo, textRVA + cxxThunk },
+        { fixture.rdataRVA + funcInfo2, FuncInfo, textRVA + cxxThunk2 }
+    };
+}
+
+static bool manifestOf(std::vector<uint8_t>& file, std::vector<uint8_t>& manifest)
+{
+    Unwind_Patch::Image image;
+    return image.parse(file.data(), file.size(), Unwind_Patch::FileLayout) && Handler_Manifest::build(Handler_Scan::scanImage(image), manifest);
+}
+
+//Lays a file out the way the loader maps it
+static std::vector<uint8_t> mapFile(std::vector<uint8_t> file)
+{
+    Unwind_Patch::Image image;
+    image.parse(file.data(), file.size(), Unwind_Patch::FileLayout);
+
+    std::vector<uint8_t> mapped(image.SizeOfImage);
+    memcpy(mapped.data(), file.data(), image.SizeOfHeaders);
+
+    for (const Unwind_Patch::Section& section : image.sections)
+    {
+        memcpy(&mapped[section.VirtualAddress], &file[section.PointerToRawData], std::min(section.SizeOfRawData, image.SizeOfImage - section.VirtualAddress));
+    }
+
+    return mapped;
+}
+
+//Scans, embeds and looks up a fixture's handlers, returns what's wrong or NULL
+static const char* verify()
+{
+    Fixture fixture = buildFixture(0x10000);
+    std::vector<uint8_t> manifest;
+    Handler_Manifest::View view;
+
+    if (!manifestOf(fixture.file, manifest) || !view.open(manifest.data(), manifest.size()))
+    {
+        return "no manifest built";
+    }
+
+    std::vector<Handler_Manifest::Entry> expected = expectedEntries(fixture);
+
+    if (view.size() != expected.size())
+    {
+        return "wrong number of entries";
+    }
+
+    for (uint32_t i = 0; i < view.size(); ++i)
+    {
+        Handler_Manifest::Entry entry, found;
+
+        entry = view.at(i);
+
+        if (entry.RVA != expected[i].RVA || entry.Kinds != expected[i].Kinds || entry.Data != expected[i].Data)
+        {
+            return "wrong entry";
+        }
+
+        if (!view.find(entry.RVA, found) || found.RVA != entry.RVA || view.find(entry.RVA + 1, found))
+        {
+            return "perfect hash lookup failed";
+        }
+    }
+
+    //Embedding twice replaces the first manifest instead of adding another section
+    const char* error = NULL;
+    std::vector<uint8_t> embedded = fixture.file;
+
+    if (!Handler_Scan::embed(embedded, manifest, error))
+    {
+        return error;
+    }
+
+    size_t once = embedded.size();
+    Unwind_Patch::Image image;
+
+    if (!Handler_Scan::embed(embedded, manifest, error) || embedded.size() != once)
+    {
+        return "embedding again didn't replace the manifest";
+    }
+
+    if (!image.parse(embedded.data(), embedded.size(), Unwind_Patch::FileLayout) || image.sections.size() != 5
+        || Unwind_Patch::checksum(embedded.data(), embedded.size(), image.CheckSumOffset) != Throw_Sites::load32(&embedded[image.CheckSumOffset]))
+    {
+        return "embedded file has wrong headers";
+    }
+
+    //The manifest section isn't code, so scanning the embedded file lists the same handlers
+    std::vector<uint8_t> rescanned;
+
+    if (!manifestOf(embedded, rescanned) || rescanned != manifest)
+    {
+        return "scan of the embedded file differs";
+    }
+
+    //What HANDLER_MANIFEST sees once the module is loaded
+    std::vector<uint8_t> mapped = mapFile(embedded);
+    Safe_SEH::ModuleIndex modules;
+
+    if (!modules.addImage({ mapped.data(), mapped.size() }, imageBase))
+    {
+        return "mapped image not indexed";
+    }
+
+    if (modules.lookup(imageBase + textRVA + cxxThunk) != Safe_SEH::Listed || modules.lookup(imageBase + textRVA + eh3Handler) != Safe_SEH::NotListed)
+    {
+        return "wrong SafeSEH verdict from the manifest";
+    }
+
+    if (!modules.manifestAllows(imageBase + textRVA + eh3Handler) || !modules.manifestAllows(imageBase + textRVA + cxxThunk2)
+        || modules.manifestAllows(imageBase + textRVA + lookAlike) || modules.manifestAllows(imageBase + textRVA + dataPush)
+        || !modules.manifestAllows(0x70000000))
+    {
+        return "wrong handler verdict from the manifest";
+    }
+
+    return NULL;
+}
+
+//A platform that refuses one frame's handler, like a handler missing from its module's manifest
+struct RefusingPlatform : Simulated::Platform
+{
+    static const Simulated::Registration* refused;
+
+    static bool isHandlerAllowed(const Simulated::Registration* Frame)
+    {
+        return Frame != refused;
+    }
+};
+
+const Simulated::Registration* RefusingPlatform::refused = NULL;
+
+static size_t handlerCalls = 0;
+
+static Core::Disposition CountingHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding) ? Core::ContinueSearch : Core::ContinueExecution;
+}
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return Core::ContinueSearch;
+}
+
+//The dispatch stops at the refused frame with EXCEPTION_STACK_INVALID, the frame that would catch is never asked
+static const char* verifyDispatch()
+{
+    Simulated::Registration frames[3];
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+
+    Simulated::setStackLimits((uintptr_t)frames, (uintptr_t)(frames + 3));
+    Simulated::pushRegistration(frames[2], &CountingHandler);
+    Simulated::pushRegistration(frames[1], &SearchHandler);
+    Simulated::pushRegistration(frames[0], &SearchHandler);
+
+    RefusingPlatform::refused = &frames[1];
+    Exception.ExceptionCode = 0xC0000005;
+
+    const char* error = "dispatch went past the refused frame";
+
+    try
+    {
+        Core::DispatchException<RefusingPlatform>(&Exception, &Context);
+    }
+    catch (const Simulated::RaisedException& raised)
+    {
+        if (!raised.firstChance && (raised.Exception.ExceptionFlags & Core::Flags::StackInvalid) && handlerCalls == 1)
+        {
+            error = NULL;
+        }
+    }
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return error;
+}
+
+static void timeScan(uint32_t textSize)
+{
+    Fixture fixture = buildFixture(textSize);
+    std::vector<uint8_t> manifest;
+
+    Clock::time_point start = Clock::now();
+    bool built = manifestOf(fixture.file, manifest);
+    double elapsed = nanoseconds(Clock::now() - start) / 1e6;
+
+    printf("handler_manifest scan %3u MB code  %8.1f ms  (%s)\n", textSize >> 20, elapsed,
+        (built && manifest.size() > Handler_Manifest::headerSize) ? "built" : "NOT BUILT");
+}
+
+/*
+    Lookups of handlers that are listed half the time, in a manifest and in the SafeSEH
+    index's Eytzinger table holding the same RVAs.
+*/
+static void timeLookups(uint32_t count)
+{
+    std::mt19937 random(count);
+    std::vector<Handler_Manifest::Entry> entries;
+    std::vector<uint32_t> keys;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        keys.push_back((random() & 0x00FFFFF0) | 0x1000);
+    }
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    for (uint32_t RVA : keys)
+    {
+        entries.push_back({ RVA, Handler_Manifest::Registered, 0 });
+    }
+
+    std::vector<uint8_t> manifest;
+    Handler_Manifest::View view;
+
+    Clock::time_point start = Clock::now();
+    Handler_Manifest::build(entries, manifest);
+    double buildTime = nanoseconds(Clock::now() - start) / 1e6;
+
+    view.open(manifest.data(), manifest.size());
+    Safe_SEH::EytzingerTable table(keys);
+
+    std::vector<uint32_t> queries(4096);
+
+    for (uint32_t& query : queries)
+    {
+        query = (random() & 1) ? keys[random() % keys.size()] : ((random() & 0x00FFFFF0) | 0x1008);
+    }
+
+    const size_t rounds = 400;
+    size_t manifestHits = 0, tableHits = 0;
+
+    start = Clock::now();
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (uint32_t query : queries)
+        {
+            manifestHits += view.contains(query, Handler_Manifest::Handler);
+        }
+    }
+
+    double manifestTime = nanoseconds(Clock::now() - start) / (rounds * queries.size());
+    start = Clock::now();
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (uint32_t query : queries)
+        {
+            tableHits += table.contains(query);
+        }
+    }
+
+    double tableTime = nanoseconds(Clock::now() - start) / (rounds * queries.size());
+
+    printf("handler_manifest handlers=%-6zu manifest %6.1f ns  eytzinger %6.1f ns  build %7.2f ms  %5.1f bytes/handler  (%s)\n",
+        keys.size(), manifestTime, tableTime, buildTime, (double)manifest.size() / keys.size(), (manifestHits == tableHits) ? "same verdicts" : "VERDICTS DIFFER");
+}
+
+void benchmarkHandlerManifest()
+{
+    const char* error = verify();
+
+    if (error == NULL)
+    {
+        error = verifyDispatch();
+    }
+
+    printf("handler_manifest fixture %s%s\n", (error != NULL) ? "FAILED: " : "every handler found, embedded and looked up", (error != NULL) ? error : "");
+
+    timeScan(1 << 20);
+    timeScan(50 << 20);
+
+    for (uint32_t count : { 16u, 256u, 4096u, 65536u })
+    {
+        timeLookups(count);
+    }
+}
\ No newline at end of file
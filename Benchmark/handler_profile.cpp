@@ -0,0 +1,137 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "handler_profile.h"
+
+using namespace SEH;
+
+/*
+    Threads recording calls of the same 64 handlers into one profile table, each
+    handler with a known cost. Reports the cost of one record and checks that the
+    call counts add up and that the top 8 come out in the right order.
+*/
+
+typedef Handler_Profile::Table<> Profiles;
+
+static const unsigned int handlerCount = 64;
+
+static uint64_t handlerAddress(unsigned int i)
+{
+    return 0x10001000 + i * 0x40;
+}
+
+//Handler i takes 100 + 10 * i cycles, except that every 1000th call of handler 3 takes a million
+static uint64_t handlerCost(unsigned int i, size_t call)
+{
+    return (i == 3 && call % 1000 == 0) ? 1000000 : 100 + 10 * i;
+}
+
+static void stress(unsigned int threadCount, size_t iterations)
+{
+    std::unique_ptr<Profiles> profiles(new Profiles());
+    std::atomic<unsigned int> ready(0);
+    std::vector<double> elapsed(threadCount);
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            ready.fetch_add(1);
+            while (ready.load() != threadCount) {}
+
+            Clock::time_point start = Clock::now();
+
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                unsigned int handler = (unsigned int)(i % handlerCount);
+                profiles->record(handlerAddress(handler), handlerCost(handler, i / handlerCount), (handler & 1) ? 1 : 0);
+            }
+
+            elapsed[t] = nanoseconds(Clock::now() - start);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double total = 0;
+
+    for (double time : elapsed)
+    {
+        total += time;
+    }
+
+    Handler_Profile::Profile top[8];
+    size_t found = profiles->top(top, 8, Handler_Profile::ByMean);
+    bool ordered = (found == 8) && top[0].handler == handlerAddress(3); //The occasional million dominates its mean
+
+    for (size_t i = 1; i < found; ++i)
+    {
+        ordered = ordered && top[i].handler == handlerAddress(handlerCount - i);
+    }
+
+    Handler_Profile::Profile all[handlerCount];
+    uint64_t calls = 0;
+
+    for (size_t i = 0, count = profiles->top(all, handlerCount, Handler_Profile::ByTotal); i < count; ++i)
+    {
+        calls += all[i].calls;
+    }
+
+    Handler_Profile::Profile slowest;
+    profiles->top(&slowest, 1, Handler_Profile::ByMax);
+
+    printf("handler_profile threads=%-3u %6.1f ns/record  calls %s  top 8 by mean %s  slowest call %llu cycles\n",
+        threadCount, total / threadCount / iterations, (calls == (uint64_t)threadCount * iterations && profiles->dropped() == 0) ? "exact" : "WRONG",
+        ordered ? "ordered" : "NOT ORDERED", (unsigned long long)slowest.max);
+}
+
+void benchmarkHandlerProfile()
+{
+    unsigned int maxThreads = std::thread::hardware_concurrency();
+
+    if (maxThreads == 0)
+    {
+        maxThreads = 1;
+    }
+
+    for (unsigned int threadCount = 1; ; threadCount *= 2)
+    {
+        if (threadCount > maxThreads)
+        {
+            threadCount = maxThreads;
+        }
+
+        stress(threadCount, 2000000);
+
+        if (threadCount == maxThreads)
+        {
+            break;
+        }
+    }
+}
\ No newline at end of file
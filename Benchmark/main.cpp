@@ -0,0 +1,238 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+
+struct Benchmark
+{
+    const char* name;
+    void (*run)();
+};
+
+static const Benchmark benchmarks[] =
+{
+    { "dispatch", &benchmarkDispatchUnwind },
+    { "stack_walk", &benchmarkStackWalk },
+    { "safeseh", &benchmarkSafeSEH },
+    { "verdict_cache", &benchmarkVerdictCache },
+    { "pipeline", &benchmarkPipeline },
+    { "code_filter", &benchmarkCodeFilter },
+    { "statistics", &benchmarkStatistics },
+    { "handler_profile", &benchmarkHandlerProfile },
+    { "trace", &benchmarkTrace },
+    { "unwind_patch", &benchmarkUnwindPatch },
+    { "thread_scope", &benchmarkThreadScope },
+    { "bound_index", &benchmarkBoundIndex },
+    { "epoch", &benchmarkEpoch },
+    { "throw_sites", &benchmarkThrowSites },
+    { "cxx_eh", &benchmarkCxxEH },
+    { "scope_table", &benchmarkScopeTable },
+    { "handler_manifest", &benchmarkHandlerManifest },
+    { "chain_check", &benchmarkChainCheck },
+    { "posix_signals", &benchmarkPosixSignals },
+    { "dispatch_suite", &benchmarkDispatchSuite },
+    { "resolution_memo", &benchmarkResolutionMemo },
+    { "crash_snapshot", &benchmarkCrashSnapshot },
+    { "telemetry", &benchmarkTelemetry },
+};
+
+struct Result
+{
+    std::string benchmark;
+    std::string Case;
+    double value;
+    std::string unit;
+};
+
+static std::vector<Result> results;
+
+void result(const char* benchmark, const char* Case, double value, const char* unit)
+{
+    results.push_back({ benchmark, Case, value, unit });
+}
+
+//One JSON object per line, the order they were recorded in
+static bool writeResults(const char* path)
+{
+    FILE* file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    for (const Result& entry : results)
+    {
+        fprintf(file, "{\"benchmark\":\"%s\",\"case\":\"%s\",\"value\":%.4f,\"unit\":\"%s\"}\n",
+            entry.benchmark.c_str(), entry.Case.c_str(), entry.value, entry.unit.c_str());
+    }
+
+    return fclose(file) == 0;
+}
+
+//The string value of "key" in a line written by writeResults
+static bool field(const std::string& line, const char* key, std::string& value)
+{
+    std::string prefix = std::string("\"") + key + "\":";
+    size_t start = line.find(prefix);
+
+    if (start == std::string::npos)
+    {
+        return false;
+    }
+
+    start += prefix.size();
+
+    if (line[start] == '"')
+    {
+        size_t end = line.find('"', start + 1);
+
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+
+        value = line.substr(start + 1, end - start - 1);
+    }
+    else
+        value = line.substr(start, line.find_first_of(",}", start) - start);
+
+    return true;
+}
+
+/*
+    Compares every result with the same benchmark and case in a file written by an
+    earlier --json run. Returns how many got worse by more than tolerance percent.
+*/
+static int compareResults(const char* path, double tolerance)
+{
+    FILE* file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        printf("baseline %s can't be read\n", path);
+        return 1;
+    }
+
+    int regressions = 0;
+    char buffer[512];
+
+    while (fgets(buffer, sizeof(buffer), file) != NULL)
+    {
+        std::string line = buffer, benchmark, Case, value, unit;
+
+        if (!field(line, "benchmark", benchmark) || !field(line, "case", Case) || !field(line, "value", value) || !field(line, "unit", unit))
+        {
+            continue;
+        }
+
+        for (const Result& entry : results)
+        {
+            if (entry.benchmark != benchmark || entry.Case != Case)
+            {
+                continue;
+            }
+
+            double before = atof(value.c_str());
+            double change = (before != 0) ? (entry.value - before) / before * 100.0 : 0;
+
+            //Throughput drops, everything else rises
+            bool worse = (unit == "M/s") ? (change < -tolerance) : (change > tolerance);
+
+            if (worse)
+            {
+                printf("regression %s: %s %.2f %s -> %.2f %s (%+.1f%%)\n", benchmark.c_str(), Case.c_str(), before, unit.c_str(), entry.value, unit.c_str(), change);
+                ++regressions;
+            }
+        }
+    }
+
+    fclose(file);
+    printf("baseline %s: %d regression%s beyond %.0f%%\n", path, regressions, (regressions == 1) ? "" : "s", tolerance);
+    return regressions;
+}
+
+/*
+    Runs every benchmark, or only the ones named on the command line.
+
+        --json <path>           writes the recorded results as JSON lines
+        --baseline <path>       compares them with an earlier --json file, exits with 1 on a regression
+        --tolerance <percent>   how much worse a result may get against the baseline, 10 by default
+*/
+int main(int argc, char** argv)
+{
+    const char* jsonPath = NULL;
+    const char* baselinePath = NULL;
+    double tolerance = 10.0;
+    std::vector<const char*> names;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            jsonPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baselinePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            tolerance = atof(argv[++i]);
+        }
+        else
+            names.push_back(argv[i]);
+    }
+
+    for (const Benchmark& benchmark : benchmarks)
+    {
+        bool selected = names.empty();
+
+        for (const char* name : names)
+        {
+            if (strcmp(name, benchmark.name) == 0)
+            {
+                selected = true;
+            }
+        }
+
+        if (selected)
+        {
+            benchmark.run();
+        }
+    }
+
+    if (jsonPath != NULL && !writeResults(jsonPath))
+    {
+        printf("results can't be written to %s\n", jsonPath);
+        return 1;
+    }
+
+    if (baselinePath != NULL && compareResults(baselinePath, tolerance) != 0)
+    {
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <type_traits>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    The pre-dispatch check pipeline on the simulated platform: no checks at all,
+    checks that are all disabled (what a build without EXCEPTION_CHECKING sees)
+    and two enabled checks that let every exception through.
+*/
+
+//Stages
+
+template <unsigned int stageCost, bool stageEnabled = true>
+struct PassCheck
+{
+    static const bool enabled = stageEnabled;
+    static const unsigned int cost = stageCost;
+
+    template <class Platform>
+    static Pipeline::Verdict filter(typename Platform::Record* Exception, typename Platform::Context*)
+    {
+        return (Exception->ExceptionCode != 0) ? Pipeline::Next : Pipeline::Skip;
+    }
+};
+
+typedef PassCheck<2, false> DisabledCheck;
+typedef PassCheck<3, false> OtherDisabledCheck;
+
+//Disabled stages leave nothing behind, so DispatchException gets the same code as with no checks
+static_assert(std::is_same<Pipeline::Stages<DisabledCheck, OtherDisabledCheck>, Pipeline::List<>>::value, "disabled stages must be dropped");
+static_assert(Pipeline::Stages<DisabledCheck>::empty, "a pipeline of disabled stages must be empty");
+
+//Cheapest first, equal costs keep their order
+static_assert(std::is_same<Pipeline::Stages<PassCheck<3>, DisabledCheck, PassCheck<1>, PassCheck<3, true>>,
+    Pipeline::List<PassCheck<1>, PassCheck<3>, PassCheck<3, true>>>::value, "stages must be sorted by cost");
+
+//Handlers
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    return Core::ContinueExecution;
+}
+
+//Benchmarks
+
+template <class Checks>
+static void benchmarkChecks(const char* name, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(1);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+    Simulated::pushRegistration(frames[0], &ExecuteHandler);
+
+    long handled = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        handled += (Core::DispatchException<Simulated::Platform, Checks>(&Exception, &Context) == Core::ContinueExecutionFilter);
+    }
+
+    double total = nanoseconds(Clock::now() - start);
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    printf("pipeline %-9s %8.2f ns/dispatch  (%s)\n", name, total / iterations, ((size_t)handled == iterations) ? "all handled" : "NOT ALL HANDLED");
+}
+
+void benchmarkPipeline()
+{
+    const size_t iterations = 10000000;
+
+    benchmarkChecks<Pipeline::List<>>("none", iterations);
+    benchmarkChecks<Pipeline::Stages<DisabledCheck, OtherDisabledCheck>>("disabled", iterations);
+    benchmarkChecks<Pipeline::Stages<PassCheck<3>, PassCheck<1>>>("enabled", iterations);
+}
\ No newline at end of file
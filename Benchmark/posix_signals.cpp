@@ -0,0 +1,494 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <atomic>
+#include <setjmp.h>
+#include <thread>
+#include <sys/wait.h>
+
+#include "platform_posix.h"
+
+using namespace SEH;
+
+/*
+    Real faults on Linux through platform_posix.h: what a fault costs from the faulting
+    instruction until the code after it (or the guard) runs again, next to the ways
+    Linux services recover from faults without it.
+*/
+
+#if defined(__x86_64__)
+static const int Ax = REG_RAX;
+#else
+static const int Ax = REG_EAX;
+#endif
+
+//Faults through inline assembly, a null dereference in C++ may be compiled into anything
+static void readFault(uintptr_t address)
+{
+    uintptr_t value;
+    asm volatile("mov (%1), %0" : "=r"(value) : "r"(address) : "memory");
+}
+
+static void writeFault(uintptr_t address)
+{
+    asm volatile("movl $1, (%0)" : : "r"(address) : "memory");
+}
+
+static void divideFault()
+{
+    static volatile unsigned int zero = 0;
+    unsigned int low = 1, high = 0;
+    asm volatile("divl %2" : "+a"(low), "+d"(high) : "r"(zero));
+}
+
+static void illegalFault()
+{
+    asm volatile("ud2");
+}
+
+//Loads through Ax, which is NULL until the handler points it somewhere
+static uintptr_t retriedLoad()
+{
+    uintptr_t pointer = 0;
+    asm volatile("mov (%0), %0" : "+a"(pointer) : : "memory");
+    return pointer;
+}
+
+static uintptr_t retriedValue = 0x5E4;
+
+static Core::Disposition RetryHandler(Posix::Record* ExceptionRecord, Posix::Registration*, Posix::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    ContextRecord->uc_mcontext.gregs[Ax] = (greg_t)&retriedValue;
+    return Core::ContinueExecution;
+}
+
+//What a frame saw, in the order it saw it
+struct Seen
+{
+    uint32_t Code;
+    uint32_t Flags;
+};
+
+static std::vector<Seen> seen;
+
+static Core::Disposition LoggingHandler(Posix::Record* ExceptionRecord, Posix::Registration*, Posix::Context*, void*)
+{
+    seen.push_back({ ExceptionRecord->ExceptionCode, ExceptionRecord->ExceptionFlags });
+    return Core::ContinueSearch;
+}
+
+//Faults itself the first time it's asked
+static Core::Disposition FaultingHandler(Posix::Record* ExceptionRecord, Posix::Registration* EstablisherFrame, Posix::Context* ContextRecord, void* DispatcherContext)
+{
+    bool first = seen.empty();
+    LoggingHandler(ExceptionRecord, EstablisherFrame, ContextRecord, DispatcherContext);
+
+    if (first)
+    {
+        readFault(8);
+    }
+
+    return Core::ContinueSearch;
+}
+
+static bool notDivide(const Posix::Record* Exception)
+{
+    return Exception->ExceptionCode != Posix::Status::IntegerDivideByZero;
+}
+
+//Its own function so the guard is newer on the stack than the caller's frames
+__attribute__((noinline)) static void declinedFault()
+{
+    Posix::Guard Declining = {};
+    Declining.Filter = &notDivide;
+
+    if (__builtin_setjmp(Declining.Resume) == 0)
+    {
+        Posix::pushGuard(Declining);
+        divideFault();
+    }
+
+    seen.push_back({ 0, 0 }); //Never reached
+}
+
+//Fault code caught by a guard around fault, 0 if nothing was
+static uint32_t guarded(void (*fault)(), Posix::Record* Caught = NULL)
+{
+    Posix::Guard Guard = {};
+
+    if (__builtin_setjmp(Guard.Resume) == 0)
+    {
+        Posix::pushGuard(Guard);
+        fault();
+        Posix::popGuard(Guard);
+        return 0;
+    }
+
+    if (Caught != NULL)
+    {
+        *Caught = Guard.Exception;
+    }
+
+    return Guard.Exception.ExceptionCode;
+}
+
+static bool chainEmpty()
+{
+    Posix::Teb& teb = Posix::currentTeb();
+    return teb.ExceptionList == Core::chainEnd<Posix::Registration>() && teb.Current == NULL;
+}
+
+/*
+    Runs fault in a child with the given frames and returns the signal it died of, 0
+    if it didn't. reached is set if any handler was called before that.
+*/
+static int unhandledInChild(Core::Disposition (*handler)(Posix::Record*, Posix::Registration*, Posix::Context*, void*), bool loop, bool& reached)
+{
+    static int pipeWrite = -1;
+    int pipes[2];
+
+    if (pipe(pipes) != 0)
+    {
+        return 0;
+    }
+
+    pid_t child = fork();
+
+    if (child == 0)
+    {
+        close(pipes[0]);
+        pipeWrite = pipes[1];
+
+        Posix::Registration Frame;
+        Posix::pushRegistration(Frame, handler);
+
+        if (loop)
+        {
+            Frame.Next = &Frame;
+        }
+
+        struct Reporter
+        {
+            static Core::Disposition handler(Posix::Record*, Posix::Registration*, Posix::Context*, void*)
+            {
+                char reached = 1;
+                (void)!write(pipeWrite, &reached, 1);
+                return Core::ContinueSearch;
+            }
+        };
+
+        Posix::Registration Reporting;
+        Posix::pushRegistration(Reporting, &Reporter::handler);
+
+        readFault(16);
+        _exit(0);
+    }
+
+    close(pipes[1]);
+
+    char byte = 0;
+    reached = read(pipes[0], &byte, 1) == 1;
+    close(pipes[0]);
+
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+//Returns what's wrong or NULL
+static const char* verify()
+{
+    Posix::Record Caught = {};
+
+    if (guarded([] { readFault(24); }, &Caught) != Posix::Status::AccessViolation || Caught.NumberParameters != 2 || Caught.ExceptionInformation[0] != 0 || Caught.ExceptionInformation[1] != 24)
+    {
+        return "a read of an unmapped address wasn't caught as a read access violation";
+    }
+
+    if (guarded([] { writeFault(32); }, &Caught) != Posix::Status::AccessViolation || Caught.ExceptionInformation[0] != 1 || Caught.ExceptionInformation[1] != 32)
+    {
+        return "a write to an unmapped address wasn't caught as a write access violation";
+    }
+
+    if (guarded(&divideFault) != Posix::Status::IntegerDivideByZero || guarded(&illegalFault) != Posix::Status::IllegalInstruction)
+    {
+        return "SIGFPE or SIGILL wasn't translated";
+    }
+
+    if (!chainEmpty())
+    {
+        return "a guard was left registered";
+    }
+
+    //A handler can fix the context and continue, every register comes back through rt_sigreturn
+    Posix::Registration Retry;
+    Posix::pushRegistration(Retry, &RetryHandler);
+    uintptr_t loaded = retriedLoad();
+    Posix::popRegistration(Retry);
+
+    if (loaded != retriedValue || !chainEmpty())
+    {
+        return "continuing a fixed context didn't retry the load";
+    }
+
+    //Newer frames are asked first and unwound before the guard resumes, a declining filter is passed over
+    seen.clear();
+
+    uint32_t code = guarded([]
+    {
+        Posix::Registration Inner;
+        Posix::pushRegistration(Inner, &LoggingHandler);
+        declinedFault();
+    });
+
+    if (code != Posix::Status::IntegerDivideByZero || seen.size() != 2 || seen[0].Flags != 0 || seen[1].Flags != Core::Flags::Unwinding || !chainEmpty())
+    {
+        return "frames under a guard weren't searched and unwound in order";
+    }
+
+    //A handler faulting: its frame is asked again with EXCEPTION_NESTED_CALL, then the guard catches the nested fault
+    seen.clear();
+
+    code = guarded([]
+    {
+        Posix::Registration Faulting;
+        Posix::pushRegistration(Faulting, &FaultingHandler);
+        illegalFault();
+    });
+
+    if (code != Posix::Status::AccessViolation || seen.size() != 3 || seen[0].Code != Posix::Status::IllegalInstruction ||
+        seen[1].Code != Posix::Status::AccessViolation || !(seen[1].Flags & Core::Flags::NestedCall) || !(seen[2].Flags & Core::Flags::Unwinding) || !chainEmpty())
+    {
+        return "a fault inside a handler wasn't dispatched as a nested exception";
+    }
+
+    //Nobody handles it or the chain is broken: the process dies of the signal like it would have without the library
+    bool reached;
+
+    if (unhandledInChild(&LoggingHandler, false, reached) != SIGSEGV || !reached)
+    {
+        return "an unhandled fault didn't end the process with SIGSEGV";
+    }
+
+    if (unhandledInChild(&LoggingHandler, true, reached) != SIGSEGV || !reached)
+    {
+        return "a chain looping back on itself didn't end the process with SIGSEGV";
+    }
+
+    //Every thread has its own chain and alternate stack
+    std::atomic<size_t> caught(0);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([&caught]
+        {
+            Posix::enterThread();
+
+            for (int j = 0; j < 1000; ++j)
+            {
+                caught += guarded([] { readFault(40); }) == Posix::Status::AccessViolation;
+            }
+
+            Posix::leaveThread();
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (caught != 4000)
+    {
+        return "faults on other threads weren't caught";
+    }
+
+    return NULL;
+}
+
+static void report(const char* name, std::vector<double>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0;
+
+    for (double sample : samples)
+    {
+        total += sample;
+    }
+
+    printf("posix_signals %-22s mean %9.1f ns  p50 %9.1f ns  p99 %9.1f ns\n", name, total / samples.size(), samples[samples.size() / 2], samples[samples.size() * 99 / 100]);
+}
+
+static sigjmp_buf classicResume;
+
+static void classicHandler(int, siginfo_t*, void*)
+{
+    siglongjmp(classicResume, 1);
+}
+
+//One pass through a guard that doesn't fault
+__attribute__((noinline)) static void enterGuard()
+{
+    Posix::Guard Guard;
+    Guard.Filter = NULL;
+
+    if (__builtin_setjmp(Guard.Resume) == 0)
+    {
+        Posix::pushGuard(Guard);
+        asm volatile("" : : : "memory");
+        Posix::popGuard(Guard);
+    }
+}
+
+__attribute__((noinline)) static void enterSigsetjmp(bool fault)
+{
+    if (sigsetjmp(classicResume, 1) == 0)
+    {
+        if (fault)
+        {
+            readFault(48);
+        }
+    }
+}
+
+void benchmarkPosixSignals()
+{
+    if (!Posix::enableSignals() || !Posix::enterThread())
+    {
+        printf("posix_signals FAILED: couldn't install the signal handlers\n");
+        return;
+    }
+
+    const char* error = verify();
+    printf("posix_signals %s%s\n", (error != NULL) ? "FAILED: " : "faults caught, continued, unwound and nested like SEH", (error != NULL) ? error : "");
+
+    const size_t entries = 10000000;
+    const size_t faults = 100000;
+    std::vector<double> samples;
+
+    //What entering and leaving a protected region costs when nothing faults
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < entries; ++i)
+    {
+        enterGuard();
+    }
+
+    double guardEntry = nanoseconds(Clock::now() - start) / entries;
+    start = Clock::now();
+
+    for (size_t i = 0; i < entries; ++i)
+    {
+        enterSigsetjmp(false);
+    }
+
+    double sigsetjmpEntry = nanoseconds(Clock::now() - start) / entries;
+    printf("posix_signals entry: guard %.1f ns  sigsetjmp %.1f ns\n", guardEntry, sigsetjmpEntry);
+
+    //Fault to the guard's else branch
+    for (size_t i = 0; i < faults; ++i)
+    {
+        Clock::time_point faultStart = Clock::now();
+        guarded([] { readFault(48); });
+        samples.push_back(nanoseconds(Clock::now() - faultStart));
+    }
+
+    report("guard", samples);
+    samples.clear();
+
+    //Fault, fix the register and retry the instruction
+    Posix::Registration Retry;
+    Posix::pushRegistration(Retry, &RetryHandler);
+
+    for (size_t i = 0; i < faults; ++i)
+    {
+        Clock::time_point faultStart = Clock::now();
+        retriedLoad();
+        samples.push_back(nanoseconds(Clock::now() - faultStart));
+    }
+
+    Posix::popRegistration(Retry);
+    report("continue", samples);
+    samples.clear();
+
+    //The usual way: a SIGSEGV handler jumping back to a sigsetjmp that saved the signal mask
+    Posix::disableSignals();
+
+    struct sigaction Classic = {}, Previous;
+    Classic.sa_sigaction = &classicHandler;
+    Classic.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &Classic, &Previous);
+
+    for (size_t i = 0; i < faults; ++i)
+    {
+        Clock::time_point faultStart = Clock::now();
+        enterSigsetjmp(true);
+        samples.push_back(nanoseconds(Clock::now() - faultStart));
+    }
+
+    sigaction(SIGSEGV, &Previous, NULL);
+    Posix::enableSignals();
+    report("sigsetjmp/siglongjmp", samples);
+    samples.clear();
+
+    //Isolating the parser in a child process instead
+    for (size_t i = 0; i < 200; ++i)
+    {
+        Clock::time_point faultStart = Clock::now();
+        pid_t child = fork();
+
+        if (child == 0)
+        {
+            Posix::disableSignals();
+            readFault(48);
+            _exit(0);
+        }
+
+        int status;
+        waitpid(child, &status, 0);
+        samples.push_back(nanoseconds(Clock::now() - faultStart));
+    }
+
+    report("fork", samples);
+}
+
+#else
+
+void benchmarkPosixSignals()
+{
+    printf("posix_signals skipped, platform_posix.h is for Linux on x86 and x86-64\n");
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,327 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    A thread raising the same exception from the same place again and again, below
+    handlers that always decline it. With the memo their calls should disappear from
+    the second exception on, and any change to the chain has to bring them back.
+*/
+
+static uint64_t memoGeneration = 1;
+static size_t handlerCalls = 0;
+static volatile uint32_t handlerWork;
+
+//Stands in for a frame handler that looks at its tables before declining
+static Core::Disposition SearchHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+
+    for (uint32_t i = 0; i < 16; ++i)
+    {
+        handlerWork = handlerWork + (ExceptionRecord->ExceptionCode ^ i);
+    }
+
+    return Core::ContinueSearch;
+}
+
+//Declines too, but never promised to
+static Core::Disposition UnsafeHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return Core::ContinueSearch;
+}
+
+//Memo-safe without always declining: what it returns only depends on the exception's address
+static Core::Disposition AddressHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return (ExceptionRecord->ExceptionAddress == (void*)0x405000) ? Core::ContinueExecution : Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    return (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding) ? Core::ContinueSearch : Core::ContinueExecution;
+}
+
+//Catches like a C++ catch block, its dispatch never returns
+struct Caught {};
+
+static Core::Disposition CatchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlerCalls;
+    throw Caught();
+}
+
+struct MemoPlatform : Simulated::Platform
+{
+    static const bool resolutionMemo = true;
+
+    static bool isMemoSafe(const Simulated::Registration* Frame)
+    {
+        return Frame->Handler == &SearchHandler || Frame->Handler == &AddressHandler;
+    }
+
+    static uint64_t memoGeneration()
+    {
+        return ::memoGeneration;
+    }
+};
+
+//Search handlers down to a frame with Last
+static void linkChain(std::vector<Simulated::Registration>& frames, size_t depth, Simulated::Routine Last = &ExecuteHandler)
+{
+    for (size_t i = 0; i < depth; ++i)
+    {
+        frames[i] = { (i + 1 < depth) ? &frames[i + 1] : Core::chainEnd<Simulated::Registration>(), (i + 1 < depth) ? &SearchHandler : Last };
+    }
+
+    Simulated::currentTeb().ExceptionList = &frames[0];
+}
+
+/*
+    Dispatches one exception, returns how many handlers ran. Result is what the dispatch
+    returned, the code of an exception raised instead or 1 if a handler caught it.
+*/
+template <class Platform>
+static size_t run(long& Result, void* Address = (void*)0x401000)
+{
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+
+    Simulated::Registration* Head = Simulated::currentTeb().ExceptionList;
+
+    Exception.ExceptionCode = 0xC0000005;
+    Exception.ExceptionAddress = Address;
+    handlerCalls = 0;
+
+    try
+    {
+        Result = Core::DispatchException<Platform>(&Exception, &Context);
+    }
+    catch (const Simulated::RaisedException& raised)
+    {
+        Result = (long)raised.Exception.ExceptionCode;
+    }
+    catch (const Caught&)
+    {
+        //What unwinding to the catching frame would have left, the throw skipped popping executeHandler's registration
+        Simulated::currentTeb().ExceptionList = Head;
+        Result = 1;
+    }
+
+    return handlerCalls;
+}
+
+//Returns what's wrong or NULL
+static const char* verify()
+{
+    std::vector<Simulated::Registration> frames(16);
+    long Result;
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    linkChain(frames, 8);
+
+    if (run<MemoPlatform>(Result) != 8 || Result != Core::ContinueExecutionFilter)
+    {
+        return "the first exception didn't call every handler";
+    }
+
+    if (run<MemoPlatform>(Result) != 1 || Result != Core::ContinueExecutionFilter)
+    {
+        return "a repeated exception still called memo-safe handlers";
+    }
+
+    if (run<Simulated::Platform>(Result) != 8 || Result != Core::ContinueExecutionFilter)
+    {
+        return "a platform without the memo skipped handlers";
+    }
+
+    if (run<MemoPlatform>(Result, (void*)0x402000) != 8 || run<MemoPlatform>(Result) != 1)
+    {
+        return "an exception from another address used the memo";
+    }
+
+    //A handler swapped in the same frame is called, the frames after it are recorded again
+    frames[3].Handler = &UnsafeHandler;
+
+    if (run<MemoPlatform>(Result) != 5 || run<MemoPlatform>(Result) != 2)
+    {
+        return "a handler swapped in a remembered frame wasn't noticed";
+    }
+
+    frames[3].Handler = &SearchHandler;
+    run<MemoPlatform>(Result);
+
+    //A frame taken out below the head
+    frames[2].Next = &frames[4];
+
+    if (run<MemoPlatform>(Result) != 4 || run<MemoPlatform>(Result) != 1)
+    {
+        return "a chain changed below its head wasn't noticed";
+    }
+
+    //A new head is a new path
+    linkChain(frames, 9);
+    Simulated::currentTeb().ExceptionList = &frames[1];
+    run<MemoPlatform>(Result, (void*)0x403000);
+    Simulated::currentTeb().ExceptionList = &frames[0];
+
+    if (run<MemoPlatform>(Result, (void*)0x403000) != 9 || run<MemoPlatform>(Result, (void*)0x403000) != 1)
+    {
+        return "a pushed frame wasn't noticed";
+    }
+
+    linkChain(frames, 8);
+
+    ++memoGeneration;
+
+    if (run<MemoPlatform>(Result) != 8 || run<MemoPlatform>(Result) != 1)
+    {
+        return "a new generation didn't drop the memo";
+    }
+
+    //Frames that were remembered still go through the chain checks
+    frames[5].Next = &frames[2];
+
+    if (run<MemoPlatform>(Result) != 0 || Result != (long)Core::Status::ChainCorrupt)
+    {
+        return "a loop behind remembered frames wasn't caught";
+    }
+
+    //Only a ContinueSearch that was seen is replayed, a memo-safe handler that takes the exception is called every time
+    linkChain(frames, 8);
+    frames[3].Handler = &AddressHandler;
+
+    if (run<MemoPlatform>(Result, (void*)0x406000) != 8 || run<MemoPlatform>(Result, (void*)0x406000) != 1)
+    {
+        return "a memo-safe handler that declined wasn't skipped";
+    }
+
+    if (run<MemoPlatform>(Result, (void*)0x405000) != 4 || Result != Core::ContinueExecutionFilter
+        || run<MemoPlatform>(Result, (void*)0x405000) != 1 || Result != Core::ContinueExecutionFilter)
+    {
+        return "a memo-safe handler that took the exception was skipped";
+    }
+
+    //Recorded up to a handler that never returns
+    linkChain(frames, 8, &CatchHandler);
+
+    if (run<MemoPlatform>(Result, (void*)0x404000) != 8 || Result != 1 || run<MemoPlatform>(Result, (void*)0x404000) != 1 || Result != 1)
+    {
+        return "a dispatch ending in a catch wasn't remembered";
+    }
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return NULL;
+}
+
+template <class Platform>
+static double dispatch(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+    linkChain(frames, depth);
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+        Exception.ExceptionAddress = (void*)0x401000;
+
+        Core::DispatchException<Platform>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return elapsed;
+}
+
+void benchmarkResolutionMemo()
+{
+    const char* error = verify();
+    printf("resolution_memo %s%s\n", (error != NULL) ? "FAILED: " : "memo-safe handlers skipped until the chain or generation changes", (error != NULL) ? error : "");
+
+    for (size_t depth : { 4, 16, 64 })
+    {
+        size_t iterations = 4000000 / depth + 100000;
+
+        //Interleaved so that frequency changes hit both alike
+        double plain = 0, memo = 0;
+
+        for (int round = 0; round < 4; ++round)
+        {
+            plain += dispatch<Simulated::Platform>(depth, iterations / 4);
+            memo += dispatch<MemoPlatform>(depth, iterations / 4);
+        }
+
+        printf("resolution_memo depth=%-3zu without %8.1f ns  with %8.1f ns  %5.2fx\n", depth, plain / 4, memo / 4, plain / memo);
+
+        char Case[64];
+        snprintf(Case, sizeof(Case), "depth=%zu without", depth);
+        result("resolution_memo", Case, plain / 4, "ns");
+        snprintf(Case, sizeof(Case), "depth=%zu with", depth);
+        result("resolution_memo", Case, memo / 4, "ns");
+    }
+
+    //Every exception from a new place, the memo only costs
+    std::vector<Simulated::Registration> frames(16);
+    const size_t iterations = 400000;
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    double plain = 0, memo = 0;
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        linkChain(frames, 16);
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            long Result;
+            handlerCalls = 0;
+
+            if (pass == 0)
+                run<Simulated::Platform>(Result, (void*)(0x401000 + i));
+            else
+                run<MemoPlatform>(Result, (void*)(0x401000 + i));
+        }
+
+        (pass == 0 ? plain : memo) = nanoseconds(Clock::now() - start) / iterations;
+    }
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    printf("resolution_memo depth=16  every address new: without %8.1f ns  with %8.1f ns\n", plain, memo);
+    result("resolution_memo", "depth=16 misses with", memo, "ns");
+}
\ No newline at end of file
@@ -0,0 +1,229 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "safeseh_index.h"
+
+using namespace SEH;
+
+/*
+    Compares the SafeSEH lookup of VALID_TOP_HANDLER_CHECK before and after the module
+    index, both run against the same mapped PE32 image fixture. Then looks up while
+    another thread keeps loading and unloading an image, the way the loader
+    notification changes the index under the VEH.
+*/
+
+static const uint32_t imageBase = 0x10000000;
+
+static void write16(std::vector<uint8_t>& image, size_t offset, uint16_t value) { memcpy(&image[offset], &value, sizeof(value)); }
+static void write32(std::vector<uint8_t>& image, size_t offset, uint32_t value) { memcpy(&image[offset], &value, sizeof(value)); }
+
+//A mapped PE32 image with a load config directory and handlerCount safe handlers
+static std::vector<uint8_t> buildImage(uint32_t handlerCount, std::vector<uint32_t>& handlers)
+{
+    const uint32_t ntHeaders = 0x80;
+    const uint32_t loadConfig = 0x1000;
+    const uint32_t table = 0x2000;
+    const uint32_t code = table + ((handlerCount * 4 + 0xFFF) & ~0xFFFu);
+    const uint32_t sizeOfImage = code + handlerCount * 0x20;
+
+    std::vector<uint8_t> image(sizeOfImage);
+
+    write16(image, 0, 0x5A4D); //MZ
+    write32(image, 0x3C, ntHeaders);
+    write32(image, ntHeaders, 0x00004550); //PE\0\0
+    write16(image, ntHeaders + 0x18, 0x10B); //PE32
+    write32(image, ntHeaders + 0x18 + 0x38, sizeOfImage);
+    write32(image, ntHeaders + 0x18 + 0x5C, 16); //NumberOfRvaAndSizes
+    write32(image, ntHeaders + 0x18 + 0x60 + 10 * 8, loadConfig);
+    write32(image, ntHeaders + 0x18 + 0x60 + 10 * 8 + 4, 0x48);
+
+    write32(image, loadConfig, 0x48); //Size
+    write32(image, loadConfig + 0x40, imageBase + table); //SEHandlerTable (VA)
+    write32(image, loadConfig + 0x44, handlerCount); //SEHandlerCount
+
+    handlers.clear();
+
+    for (uint32_t i = 0; i < handlerCount; ++i)
+    {
+        handlers.push_back(code + i * 0x20);
+        write32(image, table + i * 4, code + i * 0x20);
+    }
+
+    return image;
+}
+
+//What isTopHandlerValid did before: walk the headers and binary search the table every time
+static bool legacyLookup(const std::vector<uint8_t>& image, uint32_t Handler)
+{
+    uint32_t ntHeaders, loadConfig, tableVA, tableCount;
+
+    memcpy(&ntHeaders, &image[0x3C], 4);
+    memcpy(&loadConfig, &image[ntHeaders + 0x18 + 0x60 + 10 * 8], 4);
+    memcpy(&tableVA, &image[loadConfig + 0x40], 4);
+    memcpy(&tableCount, &image[loadConfig + 0x44], 4);
+
+    const uint32_t* SEHandlerTable = reinterpret_cast<const uint32_t*>(&image[tableVA - imageBase]);
+    uint32_t HandlerRVA = Handler - imageBase;
+    uint32_t lowerBound = 0;
+    uint32_t upperBound = tableCount - 1;
+
+    while (lowerBound <= upperBound && upperBound != (uint32_t)-1)
+    {
+        uint32_t middle = lowerBound + ((upperBound - lowerBound) / 2);
+
+        if (SEHandlerTable[middle] < HandlerRVA)
+            lowerBound = middle + 1;
+        else if (SEHandlerTable[middle] > HandlerRVA)
+            upperBound = middle - 1;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+//Readers must only ever see an image fully there or not at all, and nothing freed under them
+static void churn(unsigned int readers, std::chrono::milliseconds duration)
+{
+    std::vector<uint32_t> handlers;
+    std::vector<uint8_t> image = buildImage(16, handlers);
+    const uint32_t churned = imageBase + 0x01000000;
+
+    //The same image loaded elsewhere, SEHandlerTable is a VA
+    std::vector<uint8_t> moved = image;
+    write32(moved, 0x1000 + 0x40, churned + 0x2000);
+
+    Safe_SEH::ModuleIndex index;
+    index.addImage(Safe_SEH::ImageView{ image.data(), image.size() }, imageBase);
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> lookups(0), wrong(0), changes(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < readers; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            size_t count = 0, bad = 0;
+
+            for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i)
+            {
+                uint32_t handler = handlers[i % handlers.size()];
+                Safe_SEH::Verdict churnedVerdict = index.lookup(churned + handler);
+                uint32_t Base = 0, Size = 0;
+                bool found = index.image(churned + handler, Base, Size);
+
+                bad += index.lookup(imageBase + handler) != Safe_SEH::Listed;
+                bad += churnedVerdict != Safe_SEH::Listed && churnedVerdict != Safe_SEH::NotInImage;
+                bad += found && (Base != churned || Size != image.size());
+                count += 3;
+            }
+
+            lookups.fetch_add(count);
+            wrong.fetch_add(bad);
+        });
+    }
+
+    threads.emplace_back([&]()
+    {
+        for (bool loading = true; !stop.load(std::memory_order_relaxed); loading = !loading)
+        {
+            if (loading)
+                index.addImage(Safe_SEH::ImageView{ moved.data(), moved.size() }, churned);
+            else
+                index.removeImage(churned);
+
+            changes.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    //Nobody is looking up anymore, the next change frees whatever was left
+    index.removeImage(churned);
+
+    printf("safeseh churn readers=%u lookups %zu  changes %zu  (%s)\n", readers, lookups.load(), changes.load(),
+        (wrong.load() != 0) ? "WRONG ANSWERS" : (index.retiredCount() != 0) ? "REMOVED IMAGES NEVER FREED" : "no wrong answers");
+}
+
+void benchmarkSafeSEH()
+{
+    const uint32_t handlerCounts[] = { 16, 256, 4096, 65536 };
+    const size_t iterations = 2000000;
+
+    for (uint32_t handlerCount : handlerCounts)
+    {
+        std::vector<uint32_t> handlers;
+        std::vector<uint8_t> image = buildImage(handlerCount, handlers);
+
+        Safe_SEH::ModuleIndex index;
+        index.addImage(Safe_SEH::ImageView{ image.data(), image.size() }, imageBase);
+
+        //Half of the lookups are listed handlers, half land between them
+        std::mt19937 random(handlerCount);
+        std::vector<uint32_t> queries(4096);
+
+        for (uint32_t& query : queries)
+        {
+            query = imageBase + handlers[random() % handlers.size()] + ((random() & 1) ? 0 : 4);
+        }
+
+        size_t legacyHits = 0, indexHits = 0;
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            legacyHits += legacyLookup(image, queries[i & 4095]);
+        }
+
+        double legacy = nanoseconds(Clock::now() - start) / iterations;
+
+        start = Clock::now();
+
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            indexHits += (index.lookup(queries[i & 4095]) == Safe_SEH::Listed);
+        }
+
+        double indexed = nanoseconds(Clock::now() - start) / iterations;
+
+        //The image range the C++ fast path bounds its reads to
+        uint32_t Base = 0, Size = 0;
+        bool ranges = index.image(imageBase + (uint32_t)image.size() - 1, Base, Size) && Base == imageBase && Size == image.size()
+            && !index.image(imageBase + (uint32_t)image.size(), Base, Size) && !index.image(imageBase - 1, Base, Size);
+
+        printf("safeseh handlers=%-6u legacy %6.1f ns  index %6.1f ns  (%s)\n", handlerCount, legacy, indexed,
+            (legacyHits != indexHits) ? "VERDICTS DIFFER" : ranges ? "same verdicts" : "WRONG IMAGE RANGE");
+    }
+
+    churn(3, std::chrono::milliseconds(300));
+}
\ No newline at end of file
@@ -0,0 +1,403 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.h"
+#include "scope_table.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Decodes __try frames (src/scope_table.h) out of a fixture laid out like the real
+    thing: _except_handler4 stubs pushing their module's cookie before calling
+    _except_handler4_common directly or through the import table, an EH4 scope table
+    encoded with the cookie and an EH3 one, and frames with their EH cookie stored
+    next to the registration.
+
+    Then dispatches an exception through chains of such frames on the simulated
+    platform. "generic" calls every frame's handler, a stand-in for _except_handler4
+    doing the same scope table walk and unwinding through Unwind like a patched
+    RtlUnwind. "decoded" has the platform recognize the stubs and route the frames to
+    its own handler, as platform_win32.h does with SCOPE_TABLE_DISPATCH. The work per
+    frame is the same, the difference is what recognizing the stubs costs. The
+    round trip through a real RtlUnwind it removes can't be reproduced off Windows.
+*/
+
+static const uint32_t Base = 0x30000000;
+
+enum : uint32_t
+{
+    Common = Base + 0x000,        //_except_handler4_common
+    CommonThunk = Base + 0x010,   //jmp [CommonSlot]
+    CheckCookie = Base + 0x020,   //__security_check_cookie
+    Stub = Base + 0x040,          //_except_handler4 calling the import thunk
+    StubViaSlot = Base + 0x080,   //call [CommonSlot]
+    OtherStub = Base + 0x0C0,     //Same pushes, calls something else
+
+    ScopeTable = Base + 0x200,    //EH4, encoded in the frames
+    EH3Table = Base + 0x240,
+    LoopTable = Base + 0x280,     //A record enclosed by itself
+
+    Filter0 = Base + 0x300,       //Level 0: __try { ... } __except (Filter0) { Except0 }
+    Except0 = Base + 0x310,
+    Finally1 = Base + 0x320,      //Level 1: __try { ... } __finally { Finally1 }
+    Filter2 = Base + 0x330,       //Level 2: __try { ... } __except (Filter2) { Except2 }
+    Except2 = Base + 0x340,
+
+    CookieSlot = Base + 0x3F0,    //__security_cookie
+    CommonSlot = Base + 0x3F4,
+
+    Frames = Base + 0x400,        //0x40 per frame
+    FixtureSize = 0x2000
+};
+
+static const uint32_t Cookie = 0xBB40E64E;
+static const uint32_t Topmost = 0xFFFFFFFE;
+static const size_t maxFrames = 65;
+
+struct Blob
+{
+    std::vector<uint8_t>& image;
+    uint32_t VA;
+
+    Blob& bytes(std::initializer_list<uint8_t> values)
+    {
+        for (uint8_t value : values)
+        {
+            image[VA++ - Base] = value;
+        }
+
+        return *this;
+    }
+
+    Blob& dword(uint32_t value)
+    {
+        memcpy(&image[VA - Base], &value, sizeof(value));
+        VA += 4;
+        return *this;
+    }
+
+    //mov edi, edi; push ebp; mov ebp, esp; push [ebp+14h]; push [ebp+10h]; push [ebp+0Ch]; push [ebp+8]
+    Blob& stubPrologue()
+    {
+        bytes({ 0x8B, 0xFF, 0x55, 0x8B, 0xEC, 0xFF, 0x75, 0x14, 0xFF, 0x75, 0x10, 0xFF, 0x75, 0x0C, 0xFF, 0x75, 0x08 });
+        return bytes({ 0x68 }).dword(CheckCookie).bytes({ 0x68 }).dword(CookieSlot);
+    }
+
+    Blob& call(uint32_t destination) { bytes({ 0xE8 }); return dword(destination - (VA + 4)); }
+
+    //add esp, 18h; pop ebp; ret
+    Blob& stubEpilogue() { return bytes({ 0x83, 0xC4, 0x18, 0x5D, 0xC3 }); }
+
+    Blob& scope(uint32_t EnclosingLevel, uint32_t Filter, uint32_t Handler) { return dword(EnclosingLevel).dword(Filter).dword(Handler); }
+};
+
+//Registration of frame i, ebp is 0x10 above it and the EH cookie right below the registration's frame
+static uint32_t registrationOf(size_t i)
+{
+    return Frames + 0x40 * (uint32_t)i + 0x18;
+}
+
+static void resetFrame(std::vector<uint8_t>& image, size_t i, uint32_t Table, bool eh4 = true)
+{
+    uint32_t Registration = registrationOf(i);
+    uint32_t FramePointer = Registration + Scope_Table::framePointerOffset;
+
+    Blob{ image, Registration - 8 }.dword(0).dword(0).dword(0).dword(Stub).dword(eh4 ? Table ^ Cookie : Table).dword(2);
+    Blob{ image, FramePointer - 0x1C }.dword(Cookie ^ FramePointer);
+}
+
+static std::vector<uint8_t> buildFixture()
+{
+    std::vector<uint8_t> image(FixtureSize, 0xCC);
+
+    Blob{ image, Common }.bytes({ 0x55, 0x8B, 0xEC });
+    Blob{ image, CommonThunk }.bytes({ 0xFF, 0x25 }).dword(CommonSlot);
+    Blob{ image, CheckCookie }.bytes({ 0xC3 });
+    Blob{ image, CommonSlot }.dword(Common);
+    Blob{ image, CookieSlot }.dword(Cookie);
+
+    Blob{ image, Stub }.stubPrologue().call(CommonThunk).stubEpilogue();
+    Blob{ image, StubViaSlot }.stubPrologue().bytes({ 0xFF, 0x15 }).dword(CommonSlot).stubEpilogue();
+    Blob{ image, OtherStub }.stubPrologue().call(CheckCookie).stubEpilogue();
+
+    //No GS cookie, EH cookie at ebp-1Ch xored with ebp
+    Blob{ image, ScopeTable }.dword(Scope_Table::noGSCookie).dword(0).dword(0xFFFFFFE4).dword(0)
+        .scope(Topmost, Filter0, Except0).scope(0, 0, Finally1).scope(1, Filter2, Except2);
+    Blob{ image, EH3Table }.scope(0xFFFFFFFF, Filter0, Except0).scope(0, 0, Finally1).scope(1, Filter2, Except2);
+    Blob{ image, LoopTable }.dword(Scope_Table::noGSCookie).dword(0).dword(0xFFFFFFE4).dword(0)
+        .scope(Topmost, Filter0, Except0).scope(1, Filter2, Except2);
+
+    for (size_t i = 0; i < maxFrames; ++i)
+    {
+        resetFrame(image, i, ScopeTable);
+    }
+
+    return image;
+}
+
+//Filters and funclets that only record what they were called for
+struct Runtime
+{
+    std::vector<uint8_t>& image;
+    uint32_t CatchingFrame;     //Filter0 takes the exception in this frame's ebp
+    int filter2Result;
+    size_t filters;
+    size_t finallies;
+    std::vector<uint32_t> calls;
+    bool logging;
+
+    int filter(uint32_t Filter, uint32_t FramePointer)
+    {
+        ++filters;
+        if (logging) calls.push_back(Filter);
+
+        if (Filter == Filter2)
+        {
+            return filter2Result;
+        }
+
+        return (FramePointer == CatchingFrame) ? 1 : 0;
+    }
+
+    void finally(uint32_t Handler, uint32_t)
+    {
+        ++finallies;
+        if (logging) calls.push_back(Handler);
+    }
+
+    void setTryLevel(uint32_t Registration, uint32_t TryLevel)
+    {
+        Blob{ image, Registration + Scope_Table::tryLevelOffset }.dword(TryLevel);
+    }
+};
+
+static uint32_t tryLevelOf(const std::vector<uint8_t>& image, size_t i)
+{
+    return Throw_Sites::load32(&image[registrationOf(i) + Scope_Table::tryLevelOffset - Base]);
+}
+
+static bool decodesFixture(std::vector<uint8_t>& image)
+{
+    Throw_Sites::BufferMemory memory = { image.data(), image.size(), Base };
+    Runtime runtime = { image, registrationOf(0) + Scope_Table::framePointerOffset, 0, 0, 0, {}, true };
+    Scope_Table::Frame frame;
+    uint32_t TargetLevel = 0;
+    bool correct = true;
+
+    correct &= Scope_Table::cookieOf(memory, Stub, Common) == CookieSlot;
+    correct &= Scope_Table::cookieOf(memory, StubViaSlot, Common) == CookieSlot;
+    correct &= Scope_Table::cookieOf(memory, OtherStub, Common) == 0;
+
+    //Innermost filter declines, the outer one takes it, the __finally between isn't a filter
+    correct &= Scope_Table::readFrame(memory, Scope_Table::EH4, registrationOf(0), Cookie, frame) && frame.ScopeTable == ScopeTable;
+    correct &= Scope_Table::cookiesValid(memory, frame, Cookie) && !Scope_Table::cookiesValid(memory, frame, Cookie ^ 1);
+    correct &= Scope_Table::search(memory, frame, runtime, TargetLevel) == Scope_Table::ExecuteHandler && TargetLevel == 0;
+    correct &= runtime.calls == std::vector<uint32_t>{ Filter2, Filter0 };
+
+    //Down to the __except's level, running the __finally on the way
+    runtime.calls.clear();
+    correct &= Scope_Table::localUnwind(memory, frame, TargetLevel, runtime) && frame.TryLevel == 0 && tryLevelOf(image, 0) == 0;
+    correct &= runtime.calls == std::vector<uint32_t>{ Finally1 };
+
+    resetFrame(image, 0, ScopeTable);
+    Scope_Table::readFrame(memory, Scope_Table::EH4, registrationOf(0), Cookie, frame);
+    runtime.filter2Result = -1;
+    correct &= Scope_Table::search(memory, frame, runtime, TargetLevel) == Scope_Table::ContinueExecution;
+
+    runtime.filter2Result = 0;
+    runtime.CatchingFrame = 0;
+    correct &= Scope_Table::search(memory, frame, runtime, TargetLevel) == Scope_Table::ContinueSearch;
+
+    //Damaged EH cookie
+    Blob{ image, frame.FramePointer - 0x1C }.dword(0);
+    correct &= !Scope_Table::cookiesValid(memory, frame, Cookie);
+    resetFrame(image, 0, ScopeTable);
+
+    //EH3: plain pointer, no header, -1 is outside of every __try
+    resetFrame(image, 0, EH3Table, false);
+    runtime.CatchingFrame = registrationOf(0) + Scope_Table::framePointerOffset;
+    correct &= Scope_Table::readFrame(memory, Scope_Table::EH3, registrationOf(0), Cookie, frame) && frame.ScopeTable == EH3Table;
+    correct &= Scope_Table::search(memory, frame, runtime, TargetLevel) == Scope_Table::ExecuteHandler && TargetLevel == 0;
+    correct &= Scope_Table::localUnwind(memory, frame, Scope_Table::topmost(Scope_Table::EH3), runtime) && tryLevelOf(image, 0) == 0xFFFFFFFF;
+
+    //A record that encloses itself is reported instead of walked forever
+    resetFrame(image, 0, LoopTable);
+    Scope_Table::readFrame(memory, Scope_Table::EH4, registrationOf(0), Cookie, frame);
+    frame.TryLevel = 1;
+    correct &= Scope_Table::search(memory, frame, runtime, TargetLevel) == Scope_Table::Corrupt;
+
+    resetFrame(image, 0, ScopeTable);
+    return correct;
+}
+
+//Simulated dispatch through __try frames
+
+static std::vector<uint8_t> fixture;
+static Runtime* runtime = NULL;
+static size_t stubCalls = 0;
+static uint32_t transferredTo = 0;
+
+//The registration the simulated chain links, with the VAs of the frame in the fixture
+struct Eh4Frame
+{
+    Simulated::Registration Node;
+    uint32_t Registration;
+    uint32_t Handler;
+};
+
+//What _except_handler4 does, for a platform's dispatch and unwind
+template <class Platform>
+static Core::Disposition handleFrame(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame)
+{
+    Throw_Sites::BufferMemory memory = { fixture.data(), fixture.size(), Base };
+    const Eh4Frame* Frame = reinterpret_cast<const Eh4Frame*>(EstablisherFrame);
+    Scope_Table::Frame frame;
+
+    if (!Scope_Table::readFrame(memory, Scope_Table::EH4, Frame->Registration, Cookie, frame) || !Scope_Table::cookiesValid(memory, frame, Cookie))
+    {
+        return Core::ContinueSearch;
+    }
+
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        Scope_Table::localUnwind(memory, frame, Topmost, *runtime);
+        return Core::ContinueSearch;
+    }
+
+    uint32_t TargetLevel = 0;
+    Scope_Table::Scope scope;
+
+    switch (Scope_Table::search(memory, frame, *runtime, TargetLevel))
+    {
+    case Scope_Table::ExecuteHandler:
+    {
+        Simulated::Context Context = {};
+
+        Scope_Table::readScope(memory, frame, TargetLevel, scope);
+        Core::Unwind<Platform>(EstablisherFrame, ExceptionRecord, &Context);
+        Scope_Table::localUnwind(memory, frame, TargetLevel, *runtime);
+        runtime->setTryLevel(frame.Registration, scope.EnclosingLevel);
+
+        //Jumping to the __except block is what returning here stands for, with only the frame's own registration left above
+        transferredTo = (Simulated::currentTeb().ExceptionList == EstablisherFrame) ? scope.Handler : 0;
+        return Core::ContinueExecution;
+    }
+
+    case Scope_Table::ContinueExecution:
+        return Core::ContinueExecution;
+
+    default:
+        return Core::ContinueSearch;
+    }
+}
+
+static Core::Disposition StubHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context*, void*)
+{
+    ++stubCalls;
+    return handleFrame<Simulated::Platform>(ExceptionRecord, EstablisherFrame);
+}
+
+//Routes recognized frames to its own handler like platform_win32.h with SCOPE_TABLE_DISPATCH
+struct DecodedPlatform : Simulated::Platform
+{
+    static Core::Disposition DecodedHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context*, void*)
+    {
+        return handleFrame<DecodedPlatform>(ExceptionRecord, EstablisherFrame);
+    }
+
+    static Simulated::Routine frameHandler(const Registration* Frame)
+    {
+        Throw_Sites::BufferMemory memory = { fixture.data(), fixture.size(), Base };
+        uint32_t Handler = reinterpret_cast<const Eh4Frame*>(Frame)->Handler;
+
+        return (Scope_Table::cookieOf(memory, Handler, Common) != 0) ? &DecodedHandler : Frame->Handler;
+    }
+};
+
+//One exception through depth frames whose filters decline and the oldest one whose Filter0 takes it
+template <class Platform>
+static double timeDispatch(Eh4Frame* frames, size_t depth, size_t iterations, bool& correct)
+{
+    Clock::duration total = Clock::duration::zero();
+    Runtime counts = { fixture, registrationOf(depth) + Scope_Table::framePointerOffset, 0, 0, 0, {}, false };
+
+    runtime = &counts;
+    stubCalls = 0;
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        for (size_t f = depth + 1; f-- > 0;)
+        {
+            resetFrame(fixture, f, ScopeTable);
+            frames[f].Registration = registrationOf(f);
+            frames[f].Handler = Stub;
+            Simulated::pushRegistration(frames[f].Node, &StubHandler);
+        }
+
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000005; //STATUS_ACCESS_VIOLATION
+        transferredTo = 0;
+
+        Clock::time_point start = Clock::now();
+        Core::DispatchException<Platform>(&Exception, &Context);
+        total += Clock::now() - start;
+
+        correct &= transferredTo == Except0 && tryLevelOf(fixture, depth) == Topmost;
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    }
+
+    //Both filters of every frame, the __finally of every frame unwound and of the catching one
+    correct &= counts.filters == iterations * 2 * (depth + 1) && counts.finallies == iterations * (depth + 1);
+
+    runtime = NULL;
+    return nanoseconds(total) / iterations;
+}
+
+void benchmarkScopeTable()
+{
+    fixture = buildFixture();
+
+    bool correct = decodesFixture(fixture);
+    printf("scope_table decode %s\n", correct ? "matches _except_handler4" : "WRONG RESULTS");
+
+    //On the real stack, see benchmarkThrow in dispatch.cpp
+    Eh4Frame frames[maxFrames];
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+
+    for (size_t depth : { 1, 4, 16, 64 })
+    {
+        const size_t iterations = 200000 / depth;
+        bool generic = true;
+        bool decoded = true;
+
+        double genericTime = timeDispatch<Simulated::Platform>(frames, depth, iterations, generic);
+        generic &= stubCalls == iterations * (2 * depth + 1); //Every frame searched, the newer ones unwound
+
+        double decodedTime = timeDispatch<DecodedPlatform>(frames, depth, iterations, decoded);
+        decoded &= stubCalls == 0;
+
+        printf("scope_table depth=%-4zu generic %8.1f ns  decoded %8.1f ns  (%s)\n", depth, genericTime, decodedTime,
+            (generic && decoded) ? "same filters, funclets and __except" : "WRONG DISPATCH");
+    }
+}
\ No newline at end of file
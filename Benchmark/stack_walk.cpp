@@ -0,0 +1,159 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "stack_walk.h"
+
+using namespace SEH;
+
+/*
+    Compares the EBP walker used by BOUND_CHECK against the old capture, which held
+    one process-wide lock for the whole walk and collected every frame into a heap
+    vector. Each thread walks its own synthetic x86 stack image.
+*/
+
+typedef uint32_t Address;
+
+static const Address stackBase = 0x00200000;
+static const unsigned int stackFrames = 32;
+
+//Builds an x86 stack image of stackFrames EBP frames, each 0x40 bytes apart
+static std::vector<uint8_t> buildStack(Address& Ebp)
+{
+    const Address frameSize = 0x40;
+    std::vector<uint8_t> image(stackFrames * frameSize);
+
+    for (unsigned int i = 0; i < stackFrames; ++i)
+    {
+        Address Frame = stackBase + i * frameSize;
+        Address SavedEbp = (i + 1 < stackFrames) ? Frame + frameSize : 0;
+        Address ReturnAddress = 0x00401000 + i * 0x10;
+
+        memcpy(&image[i * frameSize], &SavedEbp, sizeof(SavedEbp));
+        memcpy(&image[i * frameSize + sizeof(Address)], &ReturnAddress, sizeof(ReturnAddress));
+    }
+
+    Ebp = stackBase;
+    return image;
+}
+
+static std::mutex stackTraceLock;
+
+//What captureStackTrace used to cost: a global lock and a heap allocated full trace
+static size_t lockedWalk(const Stack_Walk::ImageMemory<Address>& memory, Address Ebp)
+{
+    std::vector<Address> stackTrace;
+    std::lock_guard<std::mutex> lock(stackTraceLock);
+
+    Address Frames[stackFrames + 1];
+    unsigned int count = Stack_Walk::walk(memory, (Address)0x00401234, Ebp, stackBase, stackBase + (Address)memory.Size, Frames, stackFrames + 1);
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        stackTrace.push_back(Frames[i]);
+    }
+
+    return stackTrace.size();
+}
+
+static size_t lockFreeWalk(const Stack_Walk::ImageMemory<Address>& memory, Address Ebp)
+{
+    Address Frames[Stack_Walk::maxFrames];
+    return Stack_Walk::walk(memory, (Address)0x00401234, Ebp, stackBase, stackBase + (Address)memory.Size, Frames, Stack_Walk::maxFrames);
+}
+
+static double runThreads(unsigned int threadCount, size_t iterations, size_t (*walk)(const Stack_Walk::ImageMemory<Address>&, Address))
+{
+    std::atomic<unsigned int> ready(0);
+    std::atomic<size_t> sink(0);
+    std::vector<double> elapsed(threadCount);
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            Address Ebp;
+            std::vector<uint8_t> image = buildStack(Ebp);
+            Stack_Walk::ImageMemory<Address> memory = { image.data(), image.size(), stackBase };
+            size_t frames = 0;
+
+            //Start every thread at once so they actually contend
+            ready.fetch_add(1);
+            while (ready.load() != threadCount) {}
+
+            Clock::time_point start = Clock::now();
+
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                frames += walk(memory, Ebp);
+            }
+
+            elapsed[t] = nanoseconds(Clock::now() - start);
+            sink.fetch_add(frames);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double total = 0;
+
+    for (double time : elapsed)
+    {
+        total += time;
+    }
+
+    return total / threadCount / iterations;
+}
+
+void benchmarkStackWalk()
+{
+    unsigned int maxThreads = std::thread::hardware_concurrency();
+
+    if (maxThreads == 0)
+    {
+        maxThreads = 1;
+    }
+
+    for (unsigned int threadCount = 1; ; threadCount *= 2)
+    {
+        if (threadCount > maxThreads)
+        {
+            threadCount = maxThreads;
+        }
+
+        double locked = runThreads(threadCount, 200000, &lockedWalk);
+        double lockFree = runThreads(threadCount, 2000000, &lockFreeWalk);
+
+        printf("stack_walk threads=%-3u locked %8.1f ns/exception  lock-free %6.1f ns/exception\n", threadCount, locked, lockFree);
+
+        if (threadCount == maxThreads)
+        {
+            break;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,331 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    Checks the statistics aggregation on any host: threads dispatch and unwind on
+    the simulated platform with the recorder enabled while another thread keeps
+    taking snapshots. Every total must only ever grow and must add up exactly once
+    the threads are done. Also reports what recording costs per dispatch.
+*/
+
+struct SteadyClock
+{
+    static uint64_t now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+};
+
+typedef Simulated::BasicPlatform<Statistics::Recorder<SteadyClock>> RecordingPlatform;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    return Core::ContinueExecution;
+}
+
+//Like NtContinue, continuing a context doesn't return to the dispatches the handler was called from
+struct Resumed {};
+
+struct ResumingPlatform : RecordingPlatform
+{
+    static void continueContext(Simulated::Context*, Simulated::Registration*)
+    {
+        throw Resumed();
+    }
+};
+
+//Unwinds to its own frame and resumes, like a C++ catch or __except
+static Core::Disposition CatchHandler(Simulated::Record* ExceptionRecord, Simulated::Registration* EstablisherFrame, Simulated::Context* ContextRecord, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    Core::Unwind<ResumingPlatform>(EstablisherFrame, ExceptionRecord, ContextRecord);
+    return Core::ContinueExecution;
+}
+
+//Raises another exception from its handler, which is caught outside of it
+static Core::Disposition RethrowHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & (Core::Flags::Unwinding | Core::Flags::NestedCall))
+    {
+        return Core::ContinueSearch;
+    }
+
+    Simulated::Record Exception = {};
+    Simulated::Context Context = {};
+    Exception.ExceptionCode = 0xE06D7363;
+
+    Core::DispatchException<ResumingPlatform>(&Exception, &Context);
+    return Core::ContinueExecution;
+}
+
+//Dispatches through frames on the real stack, the oldest catches and the newest is Newest
+static void caught(size_t iterations, Simulated::Routine Newest)
+{
+    Simulated::Registration frames[4];
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xE06D7363;
+
+        Simulated::pushRegistration(frames[3], &CatchHandler);
+        Simulated::pushRegistration(frames[2], &SearchHandler);
+        Simulated::pushRegistration(frames[1], &SearchHandler);
+        Simulated::pushRegistration(frames[0], Newest);
+
+        try
+        {
+            Core::DispatchException<ResumingPlatform>(&Exception, &Context);
+        }
+        catch (const Resumed&)
+        {
+        }
+
+        Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    }
+}
+
+//Returns what's wrong or NULL
+static const char* verifyCaught()
+{
+    const size_t iterations = 1000;
+    static Statistics::Totals before, after;
+
+    /*
+        A catch: 4 frames walked, 3 declining handlers and the catching one that never
+        returns. The unwind declines in the catching handler's nested registration and
+        the 3 frames it pops.
+    */
+    Statistics::aggregate(before);
+    caught(iterations, &SearchHandler);
+    Statistics::aggregate(after);
+
+    if (after.dispatches - before.dispatches != iterations || after.chainDepth[Statistics::bucketOf(4)] - before.chainDepth[Statistics::bucketOf(4)] != iterations)
+    {
+        return "dispatches ending in a catch weren't recorded";
+    }
+
+    if (after.outcomes[Statistics::ContinueSearch] - before.outcomes[Statistics::ContinueSearch] != iterations * 7 || after.handlersExecuted - before.handlersExecuted != iterations * 8)
+    {
+        return "the handlers of dispatches ending in a catch weren't recorded";
+    }
+
+    /*
+        A rethrow from the newest frame's handler: the nested dispatch walks the nested
+        registration and all 4 frames, the catch ends it and the outer one that only
+        got to the newest frame.
+    */
+    Statistics::aggregate(before);
+    caught(iterations, &RethrowHandler);
+    Statistics::aggregate(after);
+
+    if (after.dispatches - before.dispatches != iterations * 2 || after.chainDepth[Statistics::bucketOf(1)] - before.chainDepth[Statistics::bucketOf(1)] != iterations ||
+        after.chainDepth[Statistics::bucketOf(5)] - before.chainDepth[Statistics::bucketOf(5)] != iterations)
+    {
+        return "a dispatch caught outside the handler it was raised from didn't end the outer one";
+    }
+
+    return NULL;
+}
+
+static void pushChain(std::vector<Simulated::Registration>& frames)
+{
+    for (size_t i = frames.size(); i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], (i == frames.size() - 1) ? &ExecuteHandler : &SearchHandler);
+    }
+}
+
+template <class Platform>
+static double dispatch(size_t depth, size_t iterations, uint32_t Code)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+    pushChain(frames);
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = Code;
+
+        Core::DispatchException<Platform>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    return elapsed;
+}
+
+static void unwind(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+    Simulated::Context Context = {};
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        pushChain(frames);
+        Core::Unwind<RecordingPlatform>(Core::chainEnd<Simulated::Registration>(), NULL, &Context);
+    }
+}
+
+//Every value must land in a bucket whose bounds contain it, within 25% of the value
+static bool bucketsContainValues()
+{
+    std::mt19937_64 random(1);
+
+    for (int i = 0; i < 1000000; ++i)
+    {
+        uint64_t value = random() >> (random() % 64);
+        unsigned int bucket = Statistics::bucketOf(value);
+
+        if (bucket >= Statistics::buckets || Statistics::bucketLowerBound(bucket) > value || Statistics::bucketLowerBound(bucket + 1) <= value)
+        {
+            return false;
+        }
+
+        if (value >= 4 && (value - Statistics::bucketLowerBound(bucket)) > value / 4)
+        {
+            return false;
+        }
+    }
+
+    return Statistics::bucketOf(UINT64_MAX) < Statistics::buckets;
+}
+
+static bool grew(const Statistics::Totals& before, const Statistics::Totals& after)
+{
+    return after.dispatches >= before.dispatches && after.handlersExecuted >= before.handlersExecuted &&
+        after.unwinds >= before.unwinds && after.framesPopped >= before.framesPopped;
+}
+
+void benchmarkStatistics()
+{
+    const size_t depth = 16;
+    const size_t iterations = 200000;
+    const size_t unwinds = 20000;
+    const uint32_t codes[] = { 0xC0000005, 0xC0000094, 0xE06D7363 };
+
+    printf("statistics buckets %s\n", bucketsContainValues() ? "contain their values" : "DON'T CONTAIN THEIR VALUES");
+
+    const char* error = verifyCaught();
+    printf("statistics caught %s%s\n", (error != NULL) ? "FAILED: " : "dispatches ending in an unwind are recorded", (error != NULL) ? error : "");
+
+    double disabled = dispatch<Simulated::Platform>(depth, 2000000, codes[0]);
+    double recording = dispatch<RecordingPlatform>(depth, 2000000, codes[0]);
+
+    printf("statistics depth=%zu disabled %6.1f ns  recording %6.1f ns\n", depth, disabled, recording);
+
+    unsigned int threadCount = std::max(4u, std::thread::hardware_concurrency());
+
+    static Statistics::Totals before, after, snapshot, previous;
+    Statistics::aggregate(before);
+    previous = before;
+
+    std::atomic<unsigned int> running(threadCount);
+    std::vector<std::thread> threads;
+    bool monotonic = true;
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            dispatch<RecordingPlatform>(depth, iterations, codes[t % 3]);
+            unwind(depth, unwinds);
+            running.fetch_sub(1);
+        });
+    }
+
+    while (running.load() != 0)
+    {
+        Statistics::aggregate(snapshot);
+        monotonic = monotonic && grew(previous, snapshot);
+        previous = snapshot;
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    Statistics::aggregate(after);
+
+    uint64_t dispatches = (uint64_t)threadCount * iterations;
+    uint64_t unwound = (uint64_t)threadCount * unwinds;
+    uint64_t codeDispatches = 0;
+
+    for (uint32_t i = 0; i < after.codeCount; ++i)
+    {
+        for (uint32_t j = 0; j < before.codeCount; ++j)
+        {
+            if (before.codes[j] == after.codes[i])
+            {
+                codeDispatches -= before.codeDispatches[j];
+            }
+        }
+
+        codeDispatches += after.codeDispatches[i];
+    }
+
+    bool exact = after.dispatches - before.dispatches == dispatches &&
+        after.outcomes[Statistics::ContinueExecution] - before.outcomes[Statistics::ContinueExecution] == dispatches &&
+        after.handlersExecuted - before.handlersExecuted == (dispatches + unwound) * depth &&
+        after.unwinds - before.unwinds == unwound &&
+        after.framesPopped - before.framesPopped == unwound * depth &&
+        after.chainDepth[Statistics::bucketOf(depth)] - before.chainDepth[Statistics::bucketOf(depth)] == dispatches &&
+        codeDispatches == dispatches;
+
+    printf("statistics threads=%-3u snapshots %s  totals %s  dispatch p50 %llu ns p99 %llu ns  unwind p50 %llu ns\n",
+        threadCount, monotonic ? "monotonic" : "WENT BACKWARDS", exact ? "exact" : "WRONG",
+        (unsigned long long)Statistics::percentile(after.dispatchLatency, 50), (unsigned long long)Statistics::percentile(after.dispatchLatency, 99),
+        (unsigned long long)Statistics::percentile(after.unwindLatency, 50));
+}
\ No newline at end of file
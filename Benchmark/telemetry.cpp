@@ -0,0 +1,323 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+#include "telemetry.h"
+
+using namespace SEH;
+
+/*
+    The telemetry segment on any host, in this process's memory instead of shared
+    memory. A reader racing a writer must never get a torn set of counters, a writer
+    must never wait, and publishing must cost the dispatches next to nothing.
+*/
+
+struct SteadyClock
+{
+    static uint64_t now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+};
+
+static Telemetry::Segment segment;
+static uint64_t publicationInterval = 0;
+
+struct MemoryTarget
+{
+    static Telemetry::Segment* segment()
+    {
+        return &::segment;
+    }
+
+    static uint64_t interval()
+    {
+        return publicationInterval;
+    }
+};
+
+typedef Simulated::BasicPlatform<Statistics::Recorder<SteadyClock>> RecordingPlatform;
+typedef Simulated::BasicPlatform<Statistics::Recorder<SteadyClock, Telemetry::Publisher<MemoryTarget>>> PublishingPlatform;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueExecution;
+}
+
+template <class Platform>
+static double dispatch(size_t depth, size_t iterations, uint32_t Code)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    for (size_t i = 0; i < depth; ++i)
+    {
+        frames[i] = { (i + 1 < depth) ? &frames[i + 1] : Core::chainEnd<Simulated::Registration>(), (i + 1 < depth) ? &SearchHandler : &ExecuteHandler };
+    }
+
+    Simulated::currentTeb().ExceptionList = &frames[0];
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = Code;
+
+        Core::DispatchException<Platform>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+    return elapsed;
+}
+
+//Every word of the counters is the same number, a torn read mixes two
+static Telemetry::Counters uniform(uint64_t value)
+{
+    uint64_t words[Telemetry::counterWords];
+    Telemetry::Counters counters;
+
+    for (uint64_t& word : words)
+    {
+        word = value;
+    }
+
+    memcpy(&counters, words, sizeof(counters));
+    return counters;
+}
+
+static bool isUniform(const Telemetry::Counters& counters)
+{
+    uint64_t words[Telemetry::counterWords];
+    memcpy(words, &counters, sizeof(counters));
+
+    for (uint64_t word : words)
+    {
+        if (word != words[0])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t codeDispatches(const Telemetry::Counters& counters, uint32_t Code)
+{
+    for (uint32_t i = 0; i < counters.codeCount; ++i)
+    {
+        if (counters.codes[i] == Code)
+        {
+            return counters.codeDispatches[i];
+        }
+    }
+
+    return 0;
+}
+
+//Returns what's wrong or NULL
+static const char* verify(uint64_t& reads, uint64_t& retried)
+{
+    static Telemetry::Segment scratch;
+    Telemetry::initialize(scratch, 1, 1000000000);
+
+    if (!Telemetry::isSegment(scratch.header))
+    {
+        return "an initialized segment wasn't recognized";
+    }
+
+    //One writer publishing as fast as it can against a reader
+    std::atomic<bool> stop(false);
+    std::thread writer([&]()
+    {
+        for (uint64_t value = 1; !stop.load(std::memory_order_relaxed); ++value)
+        {
+            Telemetry::publish(scratch, uniform(value));
+        }
+    });
+
+    bool torn = false;
+    uint64_t last = 0;
+    reads = retried = 0;
+
+    Clock::time_point end = Clock::now() + std::chrono::milliseconds(200);
+
+    while (Clock::now() < end)
+    {
+        Telemetry::Counters counters;
+
+        if (!Telemetry::read(scratch, counters))
+        {
+            ++retried;
+            continue;
+        }
+
+        torn = torn || !isUniform(counters) || counters.publications < last;
+        last = counters.publications;
+        ++reads;
+    }
+
+    stop.store(true);
+    writer.join();
+
+    if (torn)
+    {
+        return "a reader got a torn or older set of counters";
+    }
+
+    //A writer that died halfway leaves the sequence odd
+    scratch.sequence.store(scratch.sequence.load() + 1);
+    Telemetry::Counters counters;
+
+    if (Telemetry::publish(scratch, uniform(1)))
+    {
+        return "a writer got in while another was publishing";
+    }
+
+    if (Telemetry::read(scratch, counters, 100))
+    {
+        return "a reader took counters being published";
+    }
+
+    //Dispatches publish their totals, every time with no interval
+    Telemetry::initialize(segment, 1, 1000000000);
+    publicationInterval = 0;
+
+    //The thread blocks are shared with the other benchmarks, so compare before and after
+    dispatch<PublishingPlatform>(4, 1, 0xC0000096);
+    Telemetry::Counters before, after;
+
+    if (!Telemetry::read(segment, before))
+    {
+        return "nothing was published";
+    }
+
+    dispatch<PublishingPlatform>(4, 1000, 0xC0000096);
+
+    if (!Telemetry::read(segment, after))
+    {
+        return "the segment was left busy";
+    }
+
+    if (after.dispatches - before.dispatches != 1000 || after.handlersExecuted - before.handlersExecuted != 4000 || codeDispatches(after, 0xC0000096) - codeDispatches(before, 0xC0000096) != 1000)
+    {
+        return "the published dispatch counts are off";
+    }
+
+    if (after.publications <= before.publications || after.dispatchTicks <= before.dispatchTicks || after.outcomes[Statistics::ContinueExecution] - before.outcomes[Statistics::ContinueExecution] != 1000)
+    {
+        return "the publications or time spent weren't published";
+    }
+
+    return NULL;
+}
+
+void benchmarkTelemetry()
+{
+    uint64_t reads = 0, retried = 0;
+    const char* error = verify(reads, retried);
+
+    printf("telemetry %s%s\n", (error != NULL) ? "FAILED: " : "no torn reads, busy writers skip instead of waiting", (error != NULL) ? error : "");
+    printf("telemetry reader against a writer publishing nonstop: %llu reads, %llu gave up after 10000 tries\n", (unsigned long long)reads, (unsigned long long)retried);
+
+    const size_t depth = 16;
+    const size_t iterations = 2000000;
+
+    //The library publishes at most every 10 ms
+    publicationInterval = 10000000;
+
+    double recording = 0, publishing = 0;
+
+    for (int round = 0; round < 4; ++round)
+    {
+        recording += dispatch<RecordingPlatform>(depth, iterations / 4, 0xC0000005);
+        publishing += dispatch<PublishingPlatform>(depth, iterations / 4, 0xC0000005);
+    }
+
+    printf("telemetry depth=%zu recording %6.1f ns  recording+publishing every 10 ms %6.1f ns\n", depth, recording / 4, publishing / 4);
+    result("telemetry", "dispatch depth=16 publishing", publishing / 4, "ns");
+
+    //What one publication costs the thread that does it
+    publicationInterval = 0;
+    const size_t publications = 100000;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < publications; ++i)
+    {
+        Telemetry::Publisher<MemoryTarget>::finished(SteadyClock::now());
+    }
+
+    double publish = nanoseconds(Clock::now() - start) / publications;
+
+    start = Clock::now();
+
+    for (size_t i = 0; i < publications; ++i)
+    {
+        Telemetry::Counters counters;
+        Telemetry::read(segment, counters);
+    }
+
+    double read = nanoseconds(Clock::now() - start) / publications;
+
+    printf("telemetry publish (sum every thread block, write the segment) %6.1f ns  read %6.1f ns\n", publish, read);
+    result("telemetry", "publish", publish, "ns");
+    result("telemetry", "read", read, "ns");
+
+    //Every thread trying to publish after every dispatch, the ones that lose must not wait
+    unsigned int threadCount = std::max(4u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    std::vector<double> perThread(threadCount);
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            perThread[t] = dispatch<PublishingPlatform>(depth, 100000, 0xC0000005);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double slowest = 0;
+
+    for (double elapsed : perThread)
+    {
+        slowest = std::max(slowest, elapsed);
+    }
+
+    printf("telemetry %u threads publishing after every dispatch: slowest thread %6.1f ns per dispatch\n", threadCount, slowest);
+}
\ No newline at end of file
@@ -0,0 +1,177 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "thread_scope.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    What a thread outside of any SEH::ThreadScope pays for an exception when the
+    library is built with THREAD_SCOPE: the scope check in front of the pipeline and
+    nothing else. Next to it, the same dispatch in scope (the full walk) and without
+    the check at all.
+*/
+
+typedef Pipeline::List<> Unscoped;
+typedef Pipeline::List<Thread_Scope::Check> Scoped;
+
+static thread_local size_t handlersCalled = 0;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlersCalled;
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    ++handlersCalled;
+    return Core::ContinueExecution;
+}
+
+template <class Checks>
+static double dispatch(size_t depth, size_t iterations)
+{
+    std::vector<Simulated::Registration> frames(depth);
+
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    for (size_t i = frames.size(); i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], (i == frames.size() - 1) ? &ExecuteHandler : &SearchHandler);
+    }
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        Core::DispatchException<Simulated::Platform, Checks>(&Exception, &Context);
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    return elapsed;
+}
+
+//Nested scopes keep the thread in until the outermost one ends
+static bool nestingCounts()
+{
+    size_t before = handlersCalled;
+    bool counted = true;
+
+    dispatch<Scoped>(1, 1);
+    counted &= (handlersCalled == before);
+
+    Thread_Scope::enter();
+    Thread_Scope::enter();
+    Thread_Scope::leave();
+
+    dispatch<Scoped>(1, 1);
+    counted &= (handlersCalled == before + 1);
+
+    Thread_Scope::leave();
+
+    dispatch<Scoped>(1, 1);
+    counted &= (handlersCalled == before + 1) && Thread_Scope::depth() == 0;
+
+    return counted;
+}
+
+void benchmarkThreadScope()
+{
+    const size_t depths[] = { 1, 16, 256 };
+
+    printf("thread_scope nesting %s\n", nestingCounts() ? "counted" : "MISCOUNTED");
+
+    for (size_t depth : depths)
+    {
+        size_t iterations = 4000000 / depth + 100000;
+
+        double unscoped = dispatch<Unscoped>(depth, iterations);
+        double outside = dispatch<Scoped>(depth, iterations);
+
+        Thread_Scope::enter();
+        double inside = dispatch<Scoped>(depth, iterations);
+        Thread_Scope::leave();
+
+        printf("thread_scope depth=%-4zu unscoped %8.1f ns  outside %6.1f ns  inside %8.1f ns\n", depth, unscoped, outside, inside);
+    }
+
+    /*
+        One thread in scope among threads that aren't. Only the scoped one may reach
+        the handlers, and the others' cost shouldn't depend on it.
+    */
+    const unsigned int threads = 4;
+    const size_t iterations = 1000000;
+
+    std::vector<std::thread> workers;
+    std::vector<double> outside(threads);
+    std::vector<size_t> called(threads);
+
+    for (unsigned int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&, i]()
+        {
+            if (i == 0)
+            {
+                Thread_Scope::enter();
+            }
+
+            outside[i] = dispatch<Scoped>(16, iterations);
+            called[i] = handlersCalled;
+
+            if (i == 0)
+            {
+                Thread_Scope::leave();
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    bool isolated = (called[0] == iterations * 16);
+
+    for (unsigned int i = 1; i < threads; ++i)
+    {
+        isolated &= (called[i] == 0);
+    }
+
+    printf("thread_scope threads=%u scoped %8.1f ns  others", threads, outside[0]);
+
+    for (unsigned int i = 1; i < threads; ++i)
+    {
+        printf(" %6.1f ns", outside[i]);
+    }
+
+    printf("  (%s)\n", isolated ? "only the scoped thread dispatched" : "UNSCOPED THREADS DISPATCHED");
+}
\ No newline at end of file
@@ -0,0 +1,225 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "benchmark.h"
+#include "throw_sites.h"
+
+using namespace SEH;
+
+/*
+    Decodes the return sites BOUND_CHECK needs (src/throw_sites.h) out of a small code
+    fixture laid out like the real thing: a kernel32 stub jumping to kernelbase's
+    RaiseException, which calls RtlRaiseException through its import table, and an
+    incremental linking thunk in front of a statically linked _CxxThrowException that
+    calls RaiseException either through the import table or an import thunk. Both
+    bodies start with calls and bytes that only look like calls, which must be passed,
+    and reads through ImageMemory must not leave the images even when they point out.
+*/
+
+static const uint32_t Base = 0x10000000;
+
+//Where everything is in the fixture
+enum : uint32_t
+{
+    Kernel32Stub = Base + 0x000,      //jmp [RaiseExceptionSlot]
+    RaiseExceptionBody = Base + 0x100,
+    RtlRaiseException = Base + 0x300,
+    CxxThrowThunk = Base + 0x400,     //jmp rel32 to the body, like /INCREMENTAL
+    CxxThrowBody = Base + 0x500,
+    ImportThunk = Base + 0x600,       //jmp [Kernel32Slot], what a call to an import without __declspec(dllimport) reaches
+    OtherFunction = Base + 0x700,
+    Unmapped = Base + 0x800,          //Between the code and the IAT, in no image
+    Kernel32Slot = Base + 0xF00,      //Our IAT entry for RaiseException, points at the kernel32 stub
+    RaiseExceptionSlot = Base + 0xF04,//kernel32's IAT entry, points at kernelbase
+    RtlRaiseExceptionSlot = Base + 0xF08,
+    OtherSlot = Base + 0xF0C,
+    FixtureSize = 0x1000
+};
+
+struct Code
+{
+    std::vector<uint8_t>& image;
+    uint32_t VA;
+
+    Code& bytes(std::initializer_list<uint8_t> values)
+    {
+        for (uint8_t value : values)
+        {
+            image[VA++ - Base] = value;
+        }
+
+        return *this;
+    }
+
+    Code& dword(uint32_t value)
+    {
+        memcpy(&image[VA - Base], &value, sizeof(value));
+        VA += 4;
+        return *this;
+    }
+
+    Code& callSlot(uint32_t slot) { return bytes({ 0xFF, 0x15 }).dword(slot); }
+    Code& jmpSlot(uint32_t slot) { return bytes({ 0xFF, 0x25 }).dword(slot); }
+    Code& call(uint32_t destination) { bytes({ 0xE8 }); return dword(destination - (VA + 4)); }
+    Code& jmp(uint32_t destination) { bytes({ 0xE9 }); return dword(destination - (VA + 4)); }
+};
+
+/*
+    Builds the fixture and returns the two return sites the decoder should find.
+    viaThunk has _CxxThrowException call the import thunk instead of the IAT slot.
+*/
+static std::vector<uint8_t> buildFixture(bool viaThunk, uint32_t& RaiseExceptionSite, uint32_t& CxxThrowSite)
+{
+    std::vector<uint8_t> image(FixtureSize, 0xCC);
+
+    Code{ image, Kernel32Slot }.dword(Kernel32Stub);
+    Code{ image, RaiseExceptionSlot }.dword(RaiseExceptionBody);
+    Code{ image, RtlRaiseExceptionSlot }.dword(RtlRaiseException);
+    Code{ image, OtherSlot }.dword(OtherFunction);
+
+    Code{ image, Kernel32Stub }.bytes({ 0x8B, 0xFF }).jmpSlot(RaiseExceptionSlot); //mov edi, edi
+    Code{ image, ImportThunk }.jmpSlot(Kernel32Slot);
+    Code{ image, OtherFunction }.bytes({ 0xC3 });
+    Code{ image, RtlRaiseException }.bytes({ 0x55, 0x8B, 0xEC, 0xC3 });
+
+    Code RaiseException{ image, RaiseExceptionBody };
+    RaiseException.bytes({ 0x8B, 0xFF, 0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x50 }) //mov edi, edi; push ebp; mov ebp, esp; sub esp, 50h
+        .bytes({ 0xB8, 0xE8, 0x00, 0x00, 0x00 })                             //mov eax, 0E8h, an E8 that isn't a call
+        .bytes({ 0xB9, 0xFF, 0x15, 0x00, 0x00 })                             //mov ecx, 15FFh, a call [slot] that isn't one
+        .callSlot(OtherSlot)                                                 //memcpy of the arguments
+        .bytes({ 0x8D, 0x45, 0xB0, 0x50 })                                   //lea eax, [ebp-50h]; push eax
+        .callSlot(RtlRaiseExceptionSlot);
+    RaiseExceptionSite = RaiseException.VA;
+    RaiseException.bytes({ 0xC9, 0xC2, 0x10, 0x00 });                        //leave; ret 10h
+
+    Code{ image, CxxThrowThunk }.jmp(CxxThrowBody);
+
+    Code CxxThrow{ image, CxxThrowBody };
+    CxxThrow.bytes({ 0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x20 })
+        .call(OtherFunction)                                                 //memcpy of the exception record template
+        .bytes({ 0x8D, 0x45, 0xE0, 0x50, 0x6A, 0x03, 0x6A, 0x01 });          //push the arguments
+    (viaThunk ? CxxThrow.call(ImportThunk) : CxxThrow.callSlot(Kernel32Slot));
+    CxxThrowSite = CxxThrow.VA;
+    CxxThrow.bytes({ 0xC9, 0xC2, 0x08, 0x00 });
+
+    return image;
+}
+
+static bool resolvesFixture(bool viaThunk)
+{
+    uint32_t RaiseExceptionSite, CxxThrowSite;
+    std::vector<uint8_t> image = buildFixture(viaThunk, RaiseExceptionSite, CxxThrowSite);
+    Throw_Sites::BufferMemory memory = { image.data(), image.size(), Base };
+    Throw_Sites::Sites sites;
+
+    //Through the thunks, like GetProcAddress and &_CxxThrowException give them
+    bool found = Throw_Sites::resolve(memory, Kernel32Stub, RtlRaiseException, CxxThrowThunk, sites);
+
+    return found && sites.RaiseException == RaiseExceptionSite && sites._CxxThrowException == CxxThrowSite;
+}
+
+//A RaiseException that never calls RtlRaiseException has to be reported, not guessed at
+static bool rejectsUnknownCode()
+{
+    uint32_t RaiseExceptionSite, CxxThrowSite;
+    std::vector<uint8_t> image = buildFixture(false, RaiseExceptionSite, CxxThrowSite);
+    Throw_Sites::BufferMemory memory = { image.data(), image.size(), Base };
+    Throw_Sites::Sites sites;
+
+    Code{ image, RtlRaiseExceptionSlot }.dword(OtherFunction + 1);
+
+    return !Throw_Sites::resolve(memory, Kernel32Stub, RtlRaiseException, CxxThrowThunk, sites) && sites.RaiseException == 0;
+}
+
+//The fixture as two images, the code and the IAT, with Unmapped in neither
+struct FixtureImages
+{
+    bool find(uint32_t VA, uint32_t& ImageBase, uint32_t& Size) const
+    {
+        if (VA - Base < 0x800)
+        {
+            ImageBase = Base;
+            Size = 0x800;
+            return true;
+        }
+
+        if (VA - Kernel32Slot < FixtureSize - 0xF00)
+        {
+            ImageBase = Kernel32Slot;
+            Size = FixtureSize - 0xF00;
+            return true;
+        }
+
+        return false;
+    }
+};
+
+/*
+    Swaps RaiseException's decoy moves for a call [slot] whose slot lies in Unmapped, and
+    has that slot point at RtlRaiseException. Read, it's a wrong site (in a process, a
+    fault), so ImageMemory must refuse to read it and the real call has to be found.
+*/
+static bool staysInImages()
+{
+    uint32_t RaiseExceptionSite, CxxThrowSite;
+    std::vector<uint8_t> image = buildFixture(false, RaiseExceptionSite, CxxThrowSite);
+    Throw_Sites::BufferMemory buffer = { image.data(), image.size(), Base };
+    Throw_Sites::ImageMemory<FixtureImages, Throw_Sites::BufferMemory> memory;
+    memory.inner = buffer;
+    Throw_Sites::Sites unbounded, bounded;
+
+    Code{ image, RaiseExceptionBody + 8 }.callSlot(Unmapped).bytes({ 0x90, 0x90, 0x90, 0x90 });
+    Code{ image, Unmapped }.dword(RtlRaiseException);
+
+    bool decoyTaken = Throw_Sites::resolve(buffer, Kernel32Stub, RtlRaiseException, CxxThrowThunk, unbounded)
+        && unbounded.RaiseException == RaiseExceptionBody + 14;
+    bool found = Throw_Sites::resolve(memory, Kernel32Stub, RtlRaiseException, CxxThrowThunk, bounded);
+
+    return decoyTaken && found && bounded.RaiseException == RaiseExceptionSite && bounded._CxxThrowException == CxxThrowSite
+        && memory.at(Unmapped, 4) == NULL && memory.at(Base + 0x7FE, 4) == NULL && memory.at(Base + 0x7FC, 4) != NULL;
+}
+
+void benchmarkThrowSites()
+{
+    bool correct = resolvesFixture(false) && resolvesFixture(true) && rejectsUnknownCode() && staysInImages();
+
+    uint32_t RaiseExceptionSite, CxxThrowSite;
+    std::vector<uint8_t> image = buildFixture(false, RaiseExceptionSite, CxxThrowSite);
+    const uint8_t* volatile code = image.data(); //Read again every time so the loop isn't folded into one resolve
+
+    const size_t iterations = 200000;
+    uint32_t checksum = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Throw_Sites::BufferMemory memory = { code, image.size(), Base };
+        Throw_Sites::Sites sites;
+        Throw_Sites::resolve(memory, Kernel32Stub, RtlRaiseException, CxxThrowThunk, sites);
+        checksum += sites.RaiseException ^ sites._CxxThrowException;
+    }
+
+    double elapsed = nanoseconds(Clock::now() - start) / iterations;
+
+    printf("throw_sites resolve %8.1f ns  (%s, %08x)\n", elapsed, correct ? "found the expected sites" : "WRONG SITES", checksum);
+}
\ No newline at end of file
@@ -0,0 +1,298 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "benchmark.h"
+#include "platform_simulated.h"
+
+using namespace SEH;
+
+/*
+    The cost of the dispatch trace per event on the simulated platform, and a dump of
+    what was recorded. Set BENCHMARK_TRACE_DUMP to a path to keep the dump for the
+    trace decoder; the last dispatch traced has a nested exception in it. Also that a
+    thread's first dispatch gets its ring from the allocator the library sets instead
+    of the heap (thread_registry.h).
+*/
+
+//rdtsc like the library where there is one, so the overhead isn't the host's clock
+struct CycleClock
+{
+    static uint64_t now()
+    {
+    #if defined(__x86_64__) || defined(__i386__) || defined(_M_IX86) || defined(_M_X64)
+        return __rdtsc();
+    #else
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    #endif
+    }
+};
+
+//CycleClock ticks per second, measured against the host clock
+static uint64_t cycleFrequency()
+{
+    Clock::time_point start = Clock::now();
+    uint64_t startTicks = CycleClock::now();
+
+    while (Clock::now() - start < std::chrono::milliseconds(20)) {}
+
+    return (uint64_t)((CycleClock::now() - startTicks) / (nanoseconds(Clock::now() - start) / 1e9));
+}
+
+typedef Simulated::BasicPlatform<Statistics::Disabled, Trace::Recorder<CycleClock>> TracingPlatform;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding)
+    {
+        return Core::ContinueSearch;
+    }
+
+    return Core::ContinueExecution;
+}
+
+//Raises a second exception while handling the first one
+static Core::Disposition RaisingHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    if (ExceptionRecord->ExceptionCode != 0xC0000005)
+    {
+        Simulated::Record Nested = {};
+        Simulated::Context Context = {};
+        Nested.ExceptionCode = 0xC0000005; //STATUS_ACCESS_VIOLATION
+
+        Core::DispatchException<TracingPlatform>(&Nested, &Context);
+    }
+
+    return Core::ContinueSearch;
+}
+
+template <class Platform>
+static double dispatch(size_t iterations)
+{
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = 0xC0000094; //STATUS_INTEGER_DIVIDE_BY_ZERO
+
+        Core::DispatchException<Platform>(&Exception, &Context);
+    }
+
+    return nanoseconds(Clock::now() - start) / iterations;
+}
+
+struct MemoryWriter
+{
+    std::vector<uint8_t> data;
+
+    bool operator()(const void* bytes, size_t size)
+    {
+        data.insert(data.end(), (const uint8_t*)bytes, (const uint8_t*)bytes + size);
+        return true;
+    }
+};
+
+struct FileWriter
+{
+    FILE* file;
+
+    bool operator()(const void* bytes, size_t size)
+    {
+        return fwrite(bytes, 1, size, file) == size;
+    }
+};
+
+//Stands in for the library's reserved pages, see SEH.cpp
+namespace Pool
+{
+    alignas(64) static uint8_t memory[4096];
+    static std::atomic<size_t> used(0);
+    static bool exhausted = false;
+
+    static void* allocate(size_t Size, size_t Alignment)
+    {
+        size_t Offset = (used.load() + Alignment - 1) & ~(Alignment - 1);
+
+        if (exhausted || Offset + Size > sizeof(memory))
+        {
+            return NULL;
+        }
+
+        used.store(Offset + Size);
+        return memory + Offset;
+    }
+
+    static bool contains(const void* address)
+    {
+        return (const uint8_t*)address >= memory && (const uint8_t*)address < memory + sizeof(memory);
+    }
+}
+
+//Only this test makes these, so no exited thread's block can be handed out instead
+struct PoolBlock
+{
+    uint64_t value;
+
+    void claim() {}
+};
+
+typedef Thread_Registry::Registry<PoolBlock> PoolRegistry;
+
+static const void* blockOfNewThread()
+{
+    const void* block = NULL;
+    std::thread([&]() { block = &PoolRegistry::local(); }).join();
+    return block;
+}
+
+//Returns what's wrong or NULL
+static const char* verifyAllocator()
+{
+    Thread_Registry::allocator().store(&Pool::allocate);
+
+    const void* first = blockOfNewThread();
+    size_t used = Pool::used.load();
+    const void* reused = blockOfNewThread(); //The first thread exited, its block is handed on
+
+    //With the pooled block in use and the allocator out of room, the next thread's block is new'd
+    std::atomic<int> step(0);
+    Pool::exhausted = true;
+
+    std::thread holder([&]()
+    {
+        PoolRegistry::local();
+        step.store(1);
+
+        while (step.load() != 2)
+        {
+            std::this_thread::yield();
+        }
+    });
+
+    while (step.load() != 1)
+    {
+        std::this_thread::yield();
+    }
+
+    const void* overflow = blockOfNewThread();
+    step.store(2);
+    holder.join();
+
+    Thread_Registry::allocator().store(nullptr);
+
+    if (!Pool::contains(first) || reused != first || Pool::used.load() != used)
+    {
+        return "a new thread's block didn't come from the allocator";
+    }
+
+    if (overflow == NULL || Pool::contains(overflow))
+    {
+        return "an allocator that ran out didn't fall back to the heap";
+    }
+
+    return NULL;
+}
+
+void benchmarkTrace()
+{
+    const char* error = verifyAllocator();
+    printf("trace %s%s\n", (error != NULL) ? "FAILED: " : "thread blocks come from the library's allocator", (error != NULL) ? error : "");
+
+    const size_t depth = 8;
+    const size_t iterations = 2000000;
+
+    //On the real stack, older than the nested registration the dump's dispatch walks through
+    Simulated::Registration frames[depth];
+
+    Simulated::setStackLimits((uintptr_t)frames, (uintptr_t)(frames + depth));
+
+    for (size_t i = depth; i-- > 0;)
+    {
+        Simulated::pushRegistration(frames[i], (i == depth - 1) ? &ExecuteHandler : &SearchHandler);
+    }
+
+    double disabled = dispatch<Simulated::Platform>(iterations);
+    double tracing = dispatch<TracingPlatform>(iterations);
+
+    //Every dispatch records a begin, a call and return per frame and an end
+    double events = 2.0 + 2.0 * depth;
+
+    //Reading the clock is most of an event, and it's slow on some virtual machines
+    Clock::time_point start = Clock::now();
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        CycleClock::now();
+    }
+
+    double clock = nanoseconds(Clock::now() - start) / iterations;
+
+    printf("trace depth=%zu disabled %6.1f ns  tracing %6.1f ns  %5.2f ns/event (%5.2f ns reading the clock)\n",
+        depth, disabled, tracing, (tracing - disabled) / events, clock);
+
+    /*
+        One dispatch with a nested exception for the dump. The nested dispatch walks through
+        the NestedExceptionHandler registration on this thread's real stack, so the simulated
+        stack limits have to allow it.
+    */
+    Simulated::setStackLimits(0, UINTPTR_MAX);
+    frames[0].Handler = &RaisingHandler;
+    dispatch<TracingPlatform>(1);
+
+    Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+
+    uint64_t ticksPerSecond = cycleFrequency();
+
+    MemoryWriter memory;
+    Trace::dump(memory, ticksPerSecond);
+
+    size_t expected = sizeof(Trace::FileHeader) + sizeof(Trace::ThreadHeader) + Trace::ringEvents * sizeof(Trace::Event);
+    printf("trace dump %zu bytes (%s)\n", memory.data.size(), (memory.data.size() == expected) ? "one full ring" : "UNEXPECTED SIZE");
+
+    if (const char* path = getenv("BENCHMARK_TRACE_DUMP"))
+    {
+        FILE* file = fopen(path, "wb");
+
+        if (file != NULL)
+        {
+            FileWriter writer = { file };
+            Trace::dump(writer, ticksPerSecond);
+            fclose(file);
+
+            printf("trace dump written to %s\n", path);
+        }
+    }
+}
\ No newline at end of file
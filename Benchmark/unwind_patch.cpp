@@ -0,0 +1,497 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "unwind_patch.h"
+
+using namespace SEH;
+
+/*
+    Builds PE32 files the way the linker lays them out on disk, one with SEH::Unwind
+    linked statically (exported) and one with it imported from SEH.dll, patches them
+    and checks every site, relocation and the checksum. Then measures how fast the
+    scan goes through a large code section.
+*/
+
+static const uint32_t imageBase = 0x00400000;
+static const uint32_t textRVA = 0x1000;
+static const uint32_t textOffset = 0x400;
+static const char* unwindSymbol = "?Unwind@SEH@@YGXPAX0PAU_EXCEPTION_RECORD@@0@Z";
+static const uint32_t rtlUnwindVA = 0x77F01000; //Where ntdll.dll's RtlUnwind is in a "loaded" fixture
+
+//Where things are in the code section of a fixture
+enum : uint32_t
+{
+    thunkSite = 0x10,        //jmp [RtlUnwind]
+    callSite = 0x100,        //call [RtlUnwind]
+    jmpSite = 0x200,         //jmp [RtlUnwind]
+    directCallSite = 0x300,  //call thunk
+    directJmpSite = 0x400,   //jmp thunk
+    otherImportSite = 0x500, //call [ExitProcess]
+    unrelocatedSite = 0x600, //FF 15 [RtlUnwind] in data, no relocation
+    rtlUnwindSite = 0x700,   //call RtlUnwind, only recognized once its address is known
+    unwindFunction = 0x800,  //SEH::Unwind when linked statically
+    repeatedSites = 0x1000   //call [RtlUnwind] every 4KB from here on
+};
+
+struct Fixture
+{
+    std::vector<uint8_t> file;
+    uint32_t rdataRVA;
+    uint32_t rtlUnwindSlot;  //RVA
+    uint32_t exitProcessSlot;
+    uint32_t unwindSlot;     //Only when imported
+    size_t repeated;         //Number of sites from repeatedSites on
+};
+
+static void write16(std::vector<uint8_t>& file, size_t offset, uint16_t value) { memcpy(&file[offset], &value, sizeof(value)); }
+static void write32(std::vector<uint8_t>& file, size_t offset, uint32_t value) { memcpy(&file[offset], &value, sizeof(value)); }
+
+static void writeString(std::vector<uint8_t>& file, size_t offset, const char* text)
+{
+    memcpy(&file[offset], text, strlen(text) + 1);
+}
+
+static void section(std::vector<uint8_t>& file, size_t header, const char* name, uint32_t RVA, uint32_t size, uint32_t offset, uint32_t characteristics)
+{
+    memcpy(&file[header], name, strlen(name));
+    write32(file, header + 0x08, size);
+    write32(file, header + 0x0C, RVA);
+    write32(file, header + 0x10, size);
+    write32(file, header + 0x14, offset);
+    write32(file, header + 0x24, characteristics);
+}
+
+static Fixture buildFixture(uint32_t textSize, bool imported)
+{
+    const uint32_t ntHeaders = 0x80;
+    const uint32_t rdataSize = 0x1000;
+
+    Fixture fixture;
+    fixture.rdataRVA = textRVA + textSize;
+
+    uint32_t rdataOffset = textOffset + textSize;
+    uint32_t relocRVA = fixture.rdataRVA + rdataSize;
+    uint32_t relocOffset = rdataOffset + rdataSize;
+    uint32_t relocSize = (textSize / 0x1000 + 1) * 0x200;
+
+    std::vector<uint8_t>& file = fixture.file;
+    file.resize(relocOffset + relocSize);
+
+    //Code that is mostly random bytes, there's plenty of E8, E9 and FF in real code too
+    std::mt19937 random(textSize);
+
+    for (uint32_t i = 0; i < textSize; ++i)
+    {
+        file[textOffset + i] = (uint8_t)random();
+    }
+
+    write16(file, 0, 0x5A4D); //MZ
+    write32(file, 0x3C, ntHeaders);
+    write32(file, ntHeaders, 0x00004550); //PE\0\0
+    write16(file, ntHeaders + 4, 0x14C); //i386
+    write16(file, ntHeaders + 6, 3); //NumberOfSections
+    write16(file, ntHeaders + 20, 0xE0); //SizeOfOptionalHeader
+    write16(file, ntHeaders + 0x18, 0x10B); //PE32
+    write32(file, ntHeaders + 0x18 + 0x1C, imageBase);
+    write32(file, ntHeaders + 0x18 + 0x38, relocRVA + relocSize); //SizeOfImage
+    write32(file, ntHeaders + 0x18 + 0x3C, textOffset); //SizeOfHeaders
+    write32(file, ntHeaders + 0x18 + 0x40, 1); //CheckSum, anything but 0 means it's kept up to date
+    write32(file, ntHeaders + 0x18 + 0x5C, 16); //NumberOfRvaAndSizes
+
+    size_t sections = ntHeaders + 0x18 + 0xE0;
+    section(file, sections, ".text", textRVA, textSize, textOffset, 0x60000020);
+    section(file, sections + 0x28, ".rdata", fixture.rdataRVA, rdataSize, rdataOffset, 0x40000040);
+    section(file, sections + 0x50, ".reloc", relocRVA, relocSize, relocOffset, 0x42000040);
+
+    /*
+        .rdata: import descriptors at 0x000, lookup tables at 0x100, IATs at 0x200,
+        hint/names at 0x300, DLL names at 0x500 and the export directory at 0x600
+    */
+    struct Import { const char* Dll; const char* Name; };
+
+    std::vector<Import> imports = { { "KERNEL32.dll", "ExitProcess" }, { "KERNEL32.dll", "RtlUnwind" } };
+
+    if (imported)
+    {
+        imports.push_back({ "SEH.dll", unwindSymbol });
+    }
+
+    uint32_t rdata = rdataOffset, descriptor = 0, slots[3] = {};
+
+    for (size_t i = 0, index = 0; i < imports.size(); ++i, ++index)
+    {
+        //Every DLL gets a descriptor and its own 8 lookup and IAT entries
+        if (i == 0 || strcmp(imports[i - 1].Dll, imports[i].Dll) != 0)
+        {
+            write32(file, rdata + descriptor * 0x14, fixture.rdataRVA + 0x100 + descriptor * 0x20); //OriginalFirstThunk
+            write32(file, rdata + descriptor * 0x14 + 0xC, fixture.rdataRVA + 0x500 + descriptor * 0x20); //Name
+            write32(file, rdata + descriptor * 0x14 + 0x10, fixture.rdataRVA + 0x200 + descriptor * 0x20); //FirstThunk
+            writeString(file, rdata + 0x500 + descriptor * 0x20, imports[i].Dll);
+
+            ++descriptor;
+            index = 0;
+        }
+
+        uint32_t entry = (descriptor - 1) * 0x20 + (uint32_t)index * 4;
+        uint32_t hintName = 0x300 + (uint32_t)i * 0x40;
+
+        writeString(file, rdata + hintName + 2, imports[i].Name);
+        write32(file, rdata + 0x100 + entry, fixture.rdataRVA + hintName);
+        write32(file, rdata + 0x200 + entry, fixture.rdataRVA + hintName);
+        slots[i] = fixture.rdataRVA + 0x200 + entry;
+    }
+
+    fixture.exitProcessSlot = slots[0];
+    fixture.rtlUnwindSlot = slots[1];
+    fixture.unwindSlot = slots[2];
+
+    write32(file, ntHeaders + 0x18 + 0x60 + 1 * 8, fixture.rdataRVA); //IMAGE_DIRECTORY_ENTRY_IMPORT
+    write32(file, ntHeaders + 0x18 + 0x60 + 1 * 8 + 4, descriptor * 0x14 + 0x14);
+
+    if (!imported)
+    {
+        uint32_t exports = fixture.rdataRVA + 0x600;
+
+        write32(file, rdata + 0x600 + 0x14, 1); //NumberOfFunctions
+        write32(file, rdata + 0x600 + 0x18, 1); //NumberOfNames
+        write32(file, rdata + 0x600 + 0x1C, exports + 0x40); //AddressOfFunctions
+        write32(file, rdata + 0x600 + 0x20, exports + 0x44); //AddressOfNames
+        write32(file, rdata + 0x600 + 0x24, exports + 0x48); //AddressOfNameOrdinals
+        write32(file, rdata + 0x640, textRVA + unwindFunction);
+        write32(file, rdata + 0x644, exports + 0x50);
+        writeString(file, rdata + 0x650, unwindSymbol);
+
+        write32(file, ntHeaders + 0x18 + 0x60, exports); //IMAGE_DIRECTORY_ENTRY_EXPORT
+        write32(file, ntHeaders + 0x18 + 0x60 + 4, 0x100);
+    }
+
+    std::vector<uint32_t> relocated;
+
+    auto indirect = [&](uint32_t site, uint8_t operand, uint32_t slot, bool relocate)
+    {
+        file[textOffset + site] = 0xFF;
+        file[textOffset + site + 1] = operand;
+        write32(file, textOffset + site + 2, imageBase + slot);
+
+        if (relocate)
+        {
+            relocated.push_back(textRVA + site + 2);
+        }
+    };
+
+    auto direct = [&](uint32_t site, uint8_t opcode, uint32_t destination)
+    {
+        file[textOffset + site] = opcode;
+        write32(file, textOffset + site + 1, destination - site - 5);
+    };
+
+    indirect(thunkSite, 0x25, fixture.rtlUnwindSlot, true);
+    indirect(callSite, 0x15, fixture.rtlUnwindSlot, true);
+    indirect(jmpSite, 0x25, fixture.rtlUnwindSlot, true);
+    direct(directCallSite, 0xE8, thunkSite);
+    direct(directJmpSite, 0xE9, thunkSite);
+    indirect(otherImportSite, 0x15, fixture.exitProcessSlot, true);
+    indirect(unrelocatedSite, 0x15, fixture.rtlUnwindSlot, false);
+    direct(rtlUnwindSite, 0xE8, rtlUnwindVA - imageBase - textRVA);
+
+    const uint8_t ret16[] = { 0xC2, 0x10, 0x00 };
+    memcpy(&file[textOffset + unwindFunction], ret16, sizeof(ret16));
+
+    fixture.repeated = 0;
+
+    for (uint32_t site = repeatedSites; site + 6 <= textSize; site += 0x1000, ++fixture.repeated)
+    {
+        indirect(site, 0x15, fixture.rtlUnwindSlot, true);
+    }
+
+    //One IMAGE_BASE_RELOCATION block per page
+    uint32_t block = relocOffset;
+
+    for (size_t i = 0; i < relocated.size(); )
+    {
+        uint32_t page = relocated[i] & ~0xFFFu;
+        uint32_t entries = 0;
+
+        for (; i < relocated.size() && (relocated[i] & ~0xFFFu) == page; ++i, ++entries)
+        {
+            write16(file, block + 8 + entries * 2, (uint16_t)(0x3000 | (relocated[i] & 0xFFF)));
+        }
+
+        entries += entries & 1; //Blocks stay 4 byte aligned, the padding entry is IMAGE_REL_BASED_ABSOLUTE
+        write32(file, block, page);
+        write32(file, block + 4, 8 + entries * 2);
+        block += 8 + entries * 2;
+    }
+
+    write32(file, ntHeaders + 0x18 + 0x60 + 5 * 8, relocRVA); //IMAGE_DIRECTORY_ENTRY_BASERELOC
+    write32(file, ntHeaders + 0x18 + 0x60 + 5 * 8 + 4, block - relocOffset);
+
+    return fixture;
+}
+
+static uint8_t* code(Fixture& fixture, uint32_t site)
+{
+    return &fixture.file[textOffset + site];
+}
+
+static bool calls(Fixture& fixture, uint32_t site, uint8_t opcode, uint32_t destination)
+{
+    return code(fixture, site)[0] == opcode && Unwind_Patch::load32(code(fixture, site) + 1) == destination - site - 5;
+}
+
+static bool reads(Fixture& fixture, uint32_t site, uint8_t operand, uint32_t slot)
+{
+    return code(fixture, site)[0] == 0xFF && code(fixture, site)[1] == operand && Unwind_Patch::load32(code(fixture, site) + 2) == imageBase + slot;
+}
+
+//Patches a fixture and checks the result, returns what's wrong or NULL
+static const char* verify(bool imported)
+{
+    Fixture fixture = buildFixture(0x8000, imported);
+    Unwind_Patch::Image image;
+    Unwind_Patch::Report report;
+    Unwind_Patch::Options options;
+
+    if (!image.parse(fixture.file.data(), fixture.file.size(), Unwind_Patch::FileLayout))
+    {
+        return image.error;
+    }
+
+    size_t relocations = image.relocations.size();
+
+    if (!Unwind_Patch::patchImage(image, options, report))
+    {
+        return report.error;
+    }
+
+    if (report.linkage != (imported ? Unwind_Patch::Dynamic : Unwind_Patch::Static))
+    {
+        return "wrong linkage";
+    }
+
+    if (report.sites.size() != 6 + fixture.repeated)
+    {
+        return "wrong number of sites";
+    }
+
+    for (const Unwind_Patch::PatchedSite& site : report.sites)
+    {
+        if (site.action == Unwind_Patch::Unrelocated && site.RVA != textRVA + unrelocatedSite)
+        {
+            return "site with a relocation skipped";
+        }
+    }
+
+    if (!reads(fixture, otherImportSite, 0x15, fixture.exitProcessSlot) || !reads(fixture, unrelocatedSite, 0x15, fixture.rtlUnwindSlot))
+    {
+        return "patched something that isn't a call to RtlUnwind";
+    }
+
+    if (imported)
+    {
+        if (!reads(fixture, thunkSite, 0x25, fixture.unwindSlot) || !reads(fixture, callSite, 0x15, fixture.unwindSlot)
+            || !reads(fixture, jmpSite, 0x25, fixture.unwindSlot) || !reads(fixture, repeatedSites, 0x15, fixture.unwindSlot))
+        {
+            return "indirect site doesn't read SEH::Unwind's IAT entry";
+        }
+
+        if (!calls(fixture, directCallSite, 0xE8, thunkSite) || !calls(fixture, directJmpSite, 0xE9, thunkSite))
+        {
+            return "direct site doesn't go through the thunk";
+        }
+
+        if (image.relocations.size() != relocations)
+        {
+            return "relocation removed";
+        }
+    }
+    else
+    {
+        if (!calls(fixture, thunkSite, 0xE9, unwindFunction) || code(fixture, thunkSite)[5] != 0x90
+            || !calls(fixture, callSite, 0xE8, unwindFunction) || !calls(fixture, jmpSite, 0xE9, unwindFunction)
+            || !calls(fixture, directCallSite, 0xE8, unwindFunction) || !calls(fixture, directJmpSite, 0xE9, unwindFunction)
+            || !calls(fixture, repeatedSites, 0xE8, unwindFunction))
+        {
+            return "site doesn't reach SEH::Unwind";
+        }
+
+        if (image.relocations.size() != relocations - 3 - fixture.repeated || image.isRelocated(textRVA + callSite + 2))
+        {
+            return "relocations not removed";
+        }
+    }
+
+    uint32_t CheckSum = 0;
+    image.read32(image.CheckSumOffset, CheckSum);
+
+    if (!report.checksumUpdated || CheckSum != Unwind_Patch::checksum(fixture.file.data(), fixture.file.size(), image.CheckSumOffset))
+    {
+        return "checksum not updated";
+    }
+
+    //A patched file only has the site that isn't code left
+    std::vector<uint8_t> patched = fixture.file;
+
+    if (!image.parse(fixture.file.data(), fixture.file.size(), Unwind_Patch::FileLayout) || !Unwind_Patch::patchImage(image, options, report)
+        || report.sites.size() != 1 || patched != fixture.file)
+    {
+        return "patching twice changed the file";
+    }
+
+    return NULL;
+}
+
+/*
+    The fixture as the loader would map it: sections at their RVAs, the IAT entry of
+    RtlUnwind resolved and, to take away the names, no OriginalFirstThunk for KERNEL32.dll
+*/
+static std::vector<uint8_t> mapFixture(const Fixture& fixture)
+{
+    Unwind_Patch::Image file;
+    std::vector<uint8_t> copy = fixture.file;
+
+    file.parse(copy.data(), copy.size(), Unwind_Patch::FileLayout);
+
+    std::vector<uint8_t> mapped(file.SizeOfImage);
+    memcpy(mapped.data(), copy.data(), file.SizeOfHeaders);
+
+    for (const Unwind_Patch::Section& section : file.sections)
+    {
+        memcpy(&mapped[section.VirtualAddress], &copy[section.PointerToRawData], section.SizeOfRawData);
+    }
+
+    write32(mapped, fixture.rtlUnwindSlot, rtlUnwindVA);
+    write32(mapped, fixture.rdataRVA, 0); //The first import descriptor is KERNEL32.dll's
+
+    return mapped;
+}
+
+//What EnableSEH finds in a loaded module, returns what's wrong or NULL
+static const char* verifyMapped()
+{
+    Fixture fixture = buildFixture(0x8000, false);
+    std::vector<uint8_t> mapped = mapFixture(fixture);
+    Unwind_Patch::Image image;
+
+    if (!image.parse(mapped.data(), mapped.size(), Unwind_Patch::MappedLayout))
+    {
+        return image.error;
+    }
+
+    Unwind_Patch::Redirection redirection = Unwind_Patch::planRedirection(image, rtlUnwindVA);
+
+    if (redirection.slots.size() != 1 || redirection.slots[0] != imageBase + fixture.rtlUnwindSlot)
+    {
+        return "IAT entry of RtlUnwind not found by its value";
+    }
+
+    if (redirection.branches.size() != 1 || redirection.branches[0] != imageBase + textRVA + rtlUnwindSite)
+    {
+        return "direct call to RtlUnwind not found";
+    }
+
+    if (redirection.sites != 7 + fixture.repeated)
+    {
+        return "wrong number of sites";
+    }
+
+    return NULL;
+}
+
+//scan() next to scanBytewise() over the code of a loaded fixture, the scan EnableSEH does per module
+static void compareScans(uint32_t textSize)
+{
+    Fixture fixture = buildFixture(textSize, false);
+    std::vector<uint8_t> mapped = mapFixture(fixture);
+    Unwind_Patch::Image image;
+
+    image.parse(mapped.data(), mapped.size(), Unwind_Patch::MappedLayout);
+
+    Unwind_Patch::Targets targets = Unwind_Patch::findRtlUnwind(image, rtlUnwindVA);
+    const uint8_t* code = image.atRVA(textRVA, textSize);
+    std::vector<uint32_t> bytewise, prefiltered;
+    double bytewiseTime = 1e30, prefilteredTime = 1e30;
+
+    for (int round = 0; round < 3; ++round)
+    {
+        bytewise.clear();
+        prefiltered.clear();
+
+        Clock::time_point start = Clock::now();
+        Unwind_Patch::scanBytewise(code, textSize, imageBase + textRVA, targets, image, [&](const Unwind_Patch::Site& site) { bytewise.push_back(site.VA); });
+        bytewiseTime = std::min(bytewiseTime, nanoseconds(Clock::now() - start));
+
+        start = Clock::now();
+        Unwind_Patch::scan(code, textSize, imageBase + textRVA, targets, image, [&](const Unwind_Patch::Site& site) { prefiltered.push_back(site.VA); });
+        prefilteredTime = std::min(prefilteredTime, nanoseconds(Clock::now() - start));
+    }
+
+    printf("unwind_patch scan code=%-3u MB bytewise %7.2f ms  prefiltered %7.2f ms (%s)  %zu sites (%s)\n", textSize >> 20,
+        bytewiseTime / 1e6, prefilteredTime / 1e6, UNWIND_PATCH_SSE2 ? "sse2" : "no sse2", prefiltered.size(),
+        (bytewise == prefiltered) ? "same sites" : "SITES DIFFER");
+}
+
+void benchmarkUnwindPatch()
+{
+    const char* problem = verify(false);
+    printf("unwind_patch static  %s\n", (problem == NULL) ? "every site patched" : problem);
+
+    problem = verify(true);
+    printf("unwind_patch dynamic %s\n", (problem == NULL) ? "every site patched" : problem);
+
+    problem = verifyMapped();
+    printf("unwind_patch loaded  %s\n", (problem == NULL) ? "every site redirected" : problem);
+
+    compareScans(0x100000);
+    compareScans(0x3200000);
+
+    const uint32_t textSizes[] = { 0x10000, 0x100000, 0x1000000 };
+
+    for (uint32_t textSize : textSizes)
+    {
+        Fixture fixture = buildFixture(textSize, false);
+        std::vector<uint8_t> original = fixture.file;
+        Unwind_Patch::Image image;
+        Unwind_Patch::Report report;
+        Unwind_Patch::Options options;
+        size_t rounds = 0x4000000 / textSize;
+        double total = 0;
+
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            fixture.file = original;
+
+            Clock::time_point start = Clock::now();
+
+            image.parse(fixture.file.data(), fixture.file.size(), Unwind_Patch::FileLayout);
+            Unwind_Patch::patchImage(image, options, report);
+
+            total += nanoseconds(Clock::now() - start);
+        }
+
+        printf("unwind_patch code=%-6u KB %8.1f us/file  %7.1f MB/s  %zu sites\n", textSize / 1024, total / rounds / 1000,
+            (double)textSize * rounds / total * 1000, report.sites.size());
+    }
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "verdict_cache.h"
+
+using namespace SEH;
+
+/*
+    Many threads asking for the verdicts of a small set of top handlers while
+    another thread keeps invalidating the cache, the way module loads would.
+    Every verdict returned is checked, a torn or stale entry shows up as wrong.
+*/
+
+typedef Verdict_Cache::Cache<4096> Cache;
+
+static const unsigned int handlerCount = 64;
+
+static uint32_t handlerAddress(unsigned int i)
+{
+    return 0x10001000 + i * 0x130;
+}
+
+static bool expectedVerdict(uint32_t Handler)
+{
+    return ((Handler >> 4) & 1) != 0;
+}
+
+static void stress(unsigned int threadCount, size_t iterations, unsigned int invalidateMicroseconds)
+{
+    std::unique_ptr<Cache> cache(new Cache());
+    std::atomic<bool> done(false);
+    std::atomic<size_t> wrong(0);
+    std::atomic<unsigned int> ready(0);
+    std::vector<double> elapsed(threadCount);
+    std::vector<std::thread> threads;
+
+    std::thread invalidator([&]()
+    {
+        while (!done.load())
+        {
+            if (invalidateMicroseconds != 0)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(invalidateMicroseconds));
+                cache->invalidate();
+            }
+            else
+                std::this_thread::yield();
+        }
+    });
+
+    for (unsigned int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            size_t mistakes = 0;
+
+            ready.fetch_add(1);
+            while (ready.load() != threadCount) {}
+
+            Clock::time_point start = Clock::now();
+
+            for (size_t i = 0; i < iterations; ++i)
+            {
+                uint32_t Handler = handlerAddress((unsigned int)((i * 7 + t) % handlerCount));
+                bool verdict;
+
+                if (!cache->lookup(Handler, verdict))
+                {
+                    uint32_t generation = cache->generation();
+                    verdict = expectedVerdict(Handler);
+                    cache->insert(Handler, verdict, generation);
+                }
+
+                mistakes += (verdict != expectedVerdict(Handler));
+            }
+
+            elapsed[t] = nanoseconds(Clock::now() - start);
+            wrong.fetch_add(mistakes);
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    done.store(true);
+    invalidator.join();
+
+    double total = 0;
+
+    for (double time : elapsed)
+    {
+        total += time;
+    }
+
+    Verdict_Cache::Stats stats = cache->stats();
+
+    printf("verdict_cache threads=%-3u invalidate=%4uus %6.1f ns/lookup  hit rate %6.2f%%  wrong verdicts %zu\n",
+        threadCount, invalidateMicroseconds, total / threadCount / iterations,
+        100.0 * stats.hits / (stats.hits + stats.misses), wrong.load());
+}
+
+void benchmarkVerdictCache()
+{
+    unsigned int maxThreads = std::thread::hardware_concurrency();
+
+    if (maxThreads == 0)
+    {
+        maxThreads = 1;
+    }
+
+    for (unsigned int threadCount = 1; ; threadCount *= 2)
+    {
+        if (threadCount > maxThreads)
+        {
+            threadCount = maxThreads;
+        }
+
+        stress(threadCount, 5000000, 0);
+        stress(threadCount, 5000000, 100);
+
+        if (threadCount == maxThreads)
+        {
+            break;
+        }
+    }
+}
\ No newline at end of file
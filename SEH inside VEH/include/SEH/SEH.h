@@ -24,11 +24,189 @@ namespace SEH
     //Adds a custom SEH handler to the bottom of VEH only once
     void EnableSEH();
 
-    //Removes the SEH handler assigned from EnableSEH
-    void DisableSEH();
+    /*
+        Same as EnableSEH, and also sends the calls and jmps to RtlUnwind in Modules to
+        Unwind until DisableSEH, so they don't have to be patched in the file. A NULL
+        module is the one SEH inside VEH is linked into. Returns how many call sites
+        were redirected.
+    */
+    DWORD EnableSEH(const HMODULE* Modules, DWORD Count);
+
+    /*
+        Removes the SEH handler assigned from EnableSEH, exceptions that reach the handler
+        after that go to real SEH. Then waits up to 200 ms for the exceptions other threads
+        were dispatching and tears down what they use. Returns true once everything is torn
+        down, false if a dispatch was still in flight or EnableSEH was called meanwhile, in
+        which case it stays set up for the next EnableSEH. EnableSEH and DisableSEH may be
+        called from any thread, including from a handler.
+    */
+    bool DisableSEH();
     
+    /*
+        With THREAD_SCOPE set to 1 in stdafx.h, only exceptions raised by threads inside a
+        ThreadScope are dispatched, every other thread's exceptions go to real SEH. Scopes
+        may nest, the thread stays in until the outermost one ends. Enter and leave must
+        be called on the same thread and be balanced.
+    */
+    void EnterThreadScope();
+    void LeaveThreadScope();
+
+    class ThreadScope
+    {
+    public:
+        ThreadScope() { EnterThreadScope(); }
+        ~ThreadScope() { LeaveThreadScope(); }
+
+        ThreadScope(const ThreadScope&) = delete;
+        ThreadScope& operator=(const ThreadScope&) = delete;
+    };
+
+    /*
+        With BOUND_CHECK, exceptions are only dispatched if they come from the module the
+        library is linked into or a module added here. May be called at any time from any
+        thread, including while other threads dispatch. Add returns false if Module isn't
+        the base of a loaded PE32 image (NULL included), overlaps one already added, 64
+        modules are already added or the library was built without BOUND_CHECK. The library's own module can't be removed.
+    */
+    bool AddBoundModule(HMODULE Module);
+    bool RemoveBoundModule(HMODULE Module);
+
+    /*
+        Codes of the unhandled exception raised when DispatchException or Unwind finds the
+        registration chain broken, with the exception being dispatched as its ExceptionRecord.
+    */
+    static const DWORD ExceptionChainCorrupt = 0xE000002A; //A frame doesn't lead to an older one, the chain loops or was overwritten
+    static const DWORD ExceptionChainTooDeep = 0xE000002B; //More frames than MAX_CHAIN_DEPTH in stdafx.h
+
+    /*
+        With RESOLUTION_MEMO, the handlers added here aren't called again when a thread raises
+        the same exception from the same place through the same frames and they returned
+        ExceptionContinueSearch for it last time. Only add handlers whose result depends on
+        nothing but the exception's code, flags and address and the frames, and that have
+        no side effects when they return ExceptionContinueSearch. May be called at any time
+        from any thread. Add returns false if 64 handlers are already
+        added or the library was built without RESOLUTION_MEMO.
+    */
+    bool AddMemoSafeHandler(PEXCEPTION_ROUTINE Handler);
+    bool RemoveMemoSafeHandler(PEXCEPTION_ROUTINE Handler);
+
     //An unwind implementation without SafeSEH
     void NTAPI Unwind(PVOID TargetFrame, PVOID TargetIp, PEXCEPTION_RECORD pException, PVOID ReturnValue);
+
+    //What the SEH handler does with an exception code before walking any handlers
+    enum ExceptionCodeAction
+    {
+        ExceptionCodeDefault, //Run the configured exception checks and dispatch as usual
+        ExceptionCodeSkip,    //Return EXCEPTION_CONTINUE_SEARCH, real SEH deals with it
+        ExceptionCodeForce    //Dispatch without running the configured exception checks
+    };
+
+    /*
+        Sets the action for an exception code, may be called at any time from any thread.
+        DBG_PRINTEXCEPTION_C and DBG_PRINTEXCEPTION_WIDE_C are skipped by default.
+        Returns false if too many codes share its slots in the lookup table.
+    */
+    bool SetExceptionCodeAction(DWORD ExceptionCode, ExceptionCodeAction Action);
+
+    //How many exceptions with this code were skipped and forced
+    void GetExceptionCodeCounts(DWORD ExceptionCode, ULONG64* Skipped, ULONG64* Forced);
+
+    //How many exceptions were skipped and forced across every code
+    void GetExceptionCodeTotals(ULONG64* Skipped, ULONG64* Forced);
+
+    /*
+        Histograms are log-linear: buckets 0-3 hold the values 0-3, after that every power
+        of two is split into 4 buckets. GetHistogramBucketBound returns the smallest value
+        a bucket holds.
+    */
+    static const unsigned int HistogramBuckets = 256;
+    static const unsigned int StatisticsCodes = 32;
+
+    struct DispatchStatistics
+    {
+        ULONG64 TicksPerSecond; //Unit of the latency histograms
+
+        ULONG64 Dispatches;
+        ULONG64 HandlersExecuted; //By dispatches and unwinds
+        ULONG64 ContinueExecution;
+        ULONG64 ContinueSearch;
+        ULONG64 NestedException;
+        ULONG64 CollidedUnwind;
+        ULONG64 InvalidDisposition;
+        ULONG64 StackInvalid; //Dispatches stopped by a frame outside the stack, unaligned or on a broken chain
+
+        ULONG64 Unwinds;
+        ULONG64 FramesPopped;
+
+        ULONG64 DispatchTicks; //Spent in DispatchException
+        ULONG64 UnwindTicks;   //Spent in Unwind
+
+        DWORD CodeCount; //Used entries of ExceptionCodes and CodeDispatches
+        DWORD ExceptionCodes[StatisticsCodes];
+        ULONG64 CodeDispatches[StatisticsCodes];
+        ULONG64 OtherCodeDispatches; //Dispatches of codes that didn't fit
+
+        ULONG64 DispatchLatency[HistogramBuckets]; //Ticks
+        ULONG64 UnwindLatency[HistogramBuckets]; //Ticks
+        ULONG64 ChainDepth[HistogramBuckets]; //Frames walked per dispatch
+    };
+
+    //Sums every thread's statistics, returns false if the library was built without DISPATCH_STATISTICS
+    bool GetDispatchStatistics(DispatchStatistics* Statistics);
+
+    ULONG64 GetHistogramBucketBound(unsigned int Bucket);
+
+    //Value below which Percent (0-100) of a histogram's samples fall
+    ULONG64 GetHistogramPercentile(const ULONG64 (&Histogram)[HistogramBuckets], double Percent);
+
+    enum HandlerProfileOrder
+    {
+        HandlerProfileByTotal, //Most cycles spent in the handler overall
+        HandlerProfileByMax,   //Slowest single call
+        HandlerProfileByMean   //Slowest on average
+    };
+
+    struct HandlerProfile
+    {
+        PVOID Handler;
+        ULONG64 Calls;
+        ULONG64 TotalCycles;
+        ULONG64 MaxCycles;
+        ULONG64 ContinueExecution;
+        ULONG64 ContinueSearch;
+        ULONG64 NestedException;
+        ULONG64 CollidedUnwind;
+        ULONG64 InvalidDisposition;
+    };
+
+    /*
+        Fills Profiles with up to Count (at most 32) of the slowest handlers called by
+        dispatches and unwinds, slowest first, and returns how many were filled. Cycles are rdtsc ticks.
+        Returns 0 if the library was built without HANDLER_PROFILING.
+    */
+    DWORD GetSlowestHandlers(HandlerProfile* Profiles, DWORD Count, HandlerProfileOrder Order);
+
+    /*
+        With TELEMETRY_EXPORT and DISPATCH_STATISTICS, publishes the statistics counters into
+        the shared memory Name (NULL for "Local\SEH inside VEH telemetry <process id>") for
+        Tools/Telemetry Scraper and other processes to read. Only starts once, the shared
+        memory stays until the process ends. Returns false if it was already started, Name
+        is taken, or the library was built without either.
+    */
+    bool ExportTelemetry(const wchar_t* Name);
+
+    //Writes every thread's recent dispatch events to Path for the trace decoder, false if it failed or the library was built without DISPATCH_TRACE
+    bool DumpTrace(const wchar_t* Path);
+
+    //Dumps the trace to Path when an exception goes unhandled (only the first time), NULL to stop
+    void SetTraceDumpPath(const wchar_t* Path);
+
+    /*
+        Writes a crash snapshot to Path when an exception goes unhandled (only the first time),
+        NULL to stop. Read it with Tools/Crash Snapshot Reader. Returns false if the library
+        was built without CRASH_SNAPSHOT.
+    */
+    bool SetCrashSnapshotPath(const wchar_t* Path);
 }
 
 /*
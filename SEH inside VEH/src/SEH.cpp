@@ -18,180 +18,219 @@
 
 #include "stdafx.h"
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
 #include "SEH.h"
-#include "handler.h"
 #include "bound_check.h"
+#include "code_filter.h"
+#include "except_handler.h"
+#include "handler_profile.h"
+#include "platform_win32.h"
+#include "module_tracking.h"
+#include "resolution_memo.h"
+#include "snapshot_dump.h"
+#include "thread_registry.h"
+#include "unwind_redirect.h"
 #include "dispatch_exception.h"
-#include "exception_registration.h"
 
 namespace SEH
 {
+    //Enable and disable may be called from any thread, they take turns
+    static std::mutex lifetime;
     static PVOID VEH = NULL;
 
-    void EnableSEH()
+    //What enable sets up and DisableSEH tears down once no dispatch can be using it
+    static bool setUp = false;
+
+    //Bumped by every enable, a disable only tears down if nothing enabled while it waited
+    static uint64_t enables = 0;
+
+    //How long DisableSEH waits for the other threads' dispatches before it leaves everything set up
+    static const std::chrono::milliseconds drainLimit(200);
+
+    /*
+        Where Thread_Registry makes the per-thread blocks (epoch, statistics, trace, module
+        index readers), see thread_registry.h. Reserved once and committed as threads show
+        up; VirtualAlloc takes no heap lock, so a thread's first dispatch can get its blocks
+        even if the code that faulted holds it. Kept until the process ends like the blocks,
+        64MB is about a thousand threads with DISPATCH_TRACE.
+    */
+    namespace Node_Pool
     {
-        if (!VEH)
+        static const SIZE_T reserveSize = 64 * 1024 * 1024;
+        static uint8_t* base = NULL;
+        static std::atomic<SIZE_T> used(0);
+
+        static void* allocate(size_t Size, size_t Alignment)
         {
-        #if EXCEPTION_CHECKING == BOUND_CHECK
-            InitializeCriticalSection(&Bound_Check::stackTrace);
-            Bound_Check::captureThrowStackTrace();
-        #endif
+            SIZE_T Current = used.load(std::memory_order_relaxed);
+            SIZE_T Offset;
 
-            VEH = AddVectoredExceptionHandler(0, &DispatchException);
+            do
+            {
+                Offset = (Current + Alignment - 1) & ~(SIZE_T)(Alignment - 1);
+
+                if (Offset + Size > reserveSize)
+                {
+                    return NULL; //Out of room, Thread_Registry falls back to the heap
+                }
+            } while (!used.compare_exchange_weak(Current, Offset + Size, std::memory_order_relaxed));
+
+            //Commits whole pages, some of them may already be
+            return (VirtualAlloc(base + Offset, Size, MEM_COMMIT, PAGE_READWRITE) != NULL) ? base + Offset : NULL;
+        }
+
+        static void reserve()
+        {
+            if (base == NULL && (base = (uint8_t*)VirtualAlloc(NULL, reserveSize, MEM_RESERVE, PAGE_READWRITE)) != NULL)
+            {
+                Thread_Registry::allocator().store(&allocate, std::memory_order_release);
+            }
         }
     }
 
-    void DisableSEH()
+    //Called with lifetime locked
+    static void enable()
     {
-        if (VEH)
+        ++enables;
+
+        if (!setUp)
         {
-            RemoveVectoredExceptionHandler(VEH);
-            VEH = NULL;
+            Node_Pool::reserve(); //Before anything can dispatch
+        #if EXCEPTION_CODE_FILTER
+            Code_Filter::codes(); //Build the table now rather than during the first exception
+        #endif
 
-        #if EXCEPTION_CHECKING == BOUND_CHECK
-            EnterCriticalSection(&Bound_Check::stackTrace);
-            DeleteCriticalSection(&Bound_Check::stackTrace);
+        #if HANDLER_PROFILING
+            Handler_Profile::profiles();
         #endif
-        }
-    }
 
-    /*
-        For some reason x86 RtlUnwind doesn't actually change the instruction pointer,
-        so parameter "TargetIp" ends up being completely useless. This is weird because 
-        the documentation specifically defines TargetIp as "The continuation address 
-        of the unwind."
+        #if (EXCEPTION_CHECKING & BOUND_CHECK)
+            Bound_Check::modules();
+            Bound_Check::resolveThrowSites();
+        #endif
 
-        https://learn.microsoft.com/en-us/windows/win32/api/winnt/nf-winnt-rtlunwind
-    */
-    void NTAPI Unwind(PVOID TargetFrame, PVOID TargetIp, EXCEPTION_RECORD* pException, PVOID ReturnValue)
-    {
-        CONTEXT Context = {};
-        EXCEPTION_RECORD Exception = {};
-        PEXCEPTION_REGISTRATION_RECORD DispatcherContext = NULL;
+        #if (EXCEPTION_CHECKING & VALID_TOP_HANDLER_CHECK) || HANDLER_MANIFEST || CXX_FAST_PATH || SCOPE_TABLE_DISPATCH
+            Module_Tracking::start();
+        #endif
 
-        //Capture context of caller
-        RtlCaptureContext(&Context);
+        #if RESOLUTION_MEMO
+            Resolution_Memo::watchModules();
+        #endif
 
-        //Pop the current arguments
-        Context.Esp += sizeof(TargetFrame) + sizeof(TargetIp) + sizeof(pException) + sizeof(ReturnValue);
+        #if SCOPE_TABLE_DISPATCH
+            Except_Handler::resolveCommon();
+        #endif
 
-        //Assign EAX (return value)
-        Context.Eax = (DWORD)ReturnValue;
+        #if CRASH_SNAPSHOT
+            Snapshot_Dump::allocate(); //Nothing may be allocated at second chance
+        #endif
 
-        if (pException == NULL)
-        {
-            Exception.ExceptionCode = STATUS_UNWIND;
-            Exception.ExceptionAddress = (PVOID)Context.Eip;
-            pException = &Exception;
+            setUp = true;
         }
 
-        if (TargetFrame == NULL)
+        if (!VEH)
         {
-            //No target set, therefore exit after unwinding.
-            pException->ExceptionFlags |= EXCEPTION_UNWINDING | EXCEPTION_EXIT_UNWIND;
+            Win32::Dispatches::open();
+            VEH = AddVectoredExceptionHandler(0, &DispatchException);
         }
-        else
-            pException->ExceptionFlags |= EXCEPTION_UNWINDING;
+    }
+
+    void EnableSEH()
+    {
+        std::lock_guard<std::mutex> lock(lifetime);
+        enable();
+    }
 
-        //Stack limits
-        DWORD stackLow;
-        DWORD stackHigh;
-        GetCurrentThreadStackLimits(&stackLow, &stackHigh);
+    DWORD EnableSEH(const HMODULE* Modules, DWORD Count)
+    {
+        std::lock_guard<std::mutex> lock(lifetime);
+        DWORD Sites = 0;
 
-        for (PEXCEPTION_REGISTRATION_RECORD Registration = Registration::getRegistrationHead(); Registration != EXCEPTION_CHAIN_END; Registration = Registration->Next)
+        for (DWORD i = 0; i < Count; ++i)
         {
-            if (Registration == TargetFrame)
-            {
-                //Unwind up to but not including the target frame
-                NtContinue(&Context, FALSE);
+            Sites += Unwind_Redirect::redirect(Modules[i]);
+        }
 
-                return; //Should be unreachable
-            }
+        enable();
+        return Sites;
+    }
 
-            if (TargetFrame != NULL && (DWORD)TargetFrame < (DWORD)Registration)
+    bool DisableSEH()
+    {
+        uint64_t Enables;
+
+        {
+            std::lock_guard<std::mutex> lock(lifetime);
+
+            //Nothing to remove, but a disable that gave up waiting may have left everything set up
+            if (!VEH)
             {
-                /*
-                    Target frame is less than Registration indicating it won't show up. This
-                    is because Registration should only contain frames located in ascending 
-                    order on the stack (frames point to older frames).
+                return !setUp;
+            }
 
-                    REMEMBER: Lower values indicate newer on stack
-                */
+            RemoveVectoredExceptionHandler(VEH);
+            VEH = NULL;
 
-                EXCEPTION_RECORD NewException = {};
-                NewException.ExceptionCode = STATUS_INVALID_UNWIND_TARGET;
-                NewException.ExceptionFlags = EXCEPTION_NONCONTINUABLE;
-                NewException.ExceptionRecord = pException;
+            //Late dispatches, with the VEH they got before it was removed, are turned away from here on
+            Win32::Dispatches::close();
+            Enables = enables;
+        }
 
-                RtlRaiseException(&NewException);
-            }
+        /*
+            Wait for the rest without the lock: a handler still in its dispatch may call
+            EnableSEH or DisableSEH itself. A dispatch can also look in flight long after
+            it ended (see epoch.h), so the wait is bounded.
+        */
+        bool Drained = Win32::Dispatches::drain(drainLimit);
 
-            if ((DWORD)Registration < stackLow || ((DWORD)Registration + sizeof(EXCEPTION_REGISTRATION_RECORD)) > stackHigh || ((DWORD)Registration & 0x3) != 0)
-            {
-                /*
-                    Frame outside of stack limits or unaligned on stack
+        std::lock_guard<std::mutex> lock(lifetime);
 
-                    0x1 in binary is  01
-                    0x2 in binary is  10
-                    0x3 in binary is  11
-                    0x4 in binary is 100
+        //Enabled again in the meantime, or something may still be dispatching: keep it all set up, the next enable reuses it
+        if (!Drained || VEH || enables != Enables || !setUp)
+        {
+            return !setUp;
+        }
 
-                    You can see how the bitwise AND is used to identify a 4 byte alignment.
-                */
+    #if (EXCEPTION_CHECKING & VALID_TOP_HANDLER_CHECK) || HANDLER_MANIFEST || CXX_FAST_PATH || SCOPE_TABLE_DISPATCH
+        Module_Tracking::stop();
+    #endif
 
-                EXCEPTION_RECORD NewException = {};
-                NewException.ExceptionCode = STATUS_BAD_STACK;
-                NewException.ExceptionFlags = EXCEPTION_NONCONTINUABLE;
-                NewException.ExceptionRecord = pException;
+    #if RESOLUTION_MEMO
+        Resolution_Memo::unwatchModules();
+    #endif
 
-                RtlRaiseException(&NewException);
-            }
+        Unwind_Redirect::restore();
+        setUp = false;
+        return true;
+    }
 
-            EXCEPTION_DISPOSITION Disposition = Handler::ExecuteHandler(pException, Registration, &Context, DispatcherContext, Registration->Handler, &Handler::NestedExceptionHandler<true>);
+    /*
+        For some reason x86 RtlUnwind doesn't actually change the instruction pointer,
+        so parameter "TargetIp" ends up being completely useless. This is weird because 
+        the documentation specifically defines TargetIp as "The continuation address 
+        of the unwind."
 
-            switch (Disposition)
-            {
-            case ExceptionContinueSearch:
-                break;
-
-            case ExceptionCollidedUnwind:
-                /*
-                    An exception was thrown during an unwind handler. A new call to unwind is
-                    made during the process of handling the exception. Therefore, in the process
-                    of that new unwind we collide here from the NestedExceptionHandler. To pick
-                    up on the old unwind, we assign Registration to the frame of the exception
-                    thrown during the first unwind.
-
-                    This is different from ExceptionNestedException because there are no flags
-                    to be applied to the frames. The unwind should just return to where it was
-                    before to prevent the unwind of frames that are supposed to stay.
-                */
-                Registration = DispatcherContext;
-                break;
-
-            default:
-                EXCEPTION_RECORD NewException = {};
-
-                NewException.ExceptionCode = STATUS_INVALID_DISPOSITION;
-                NewException.ExceptionFlags = EXCEPTION_NONCONTINUABLE;
-                NewException.ExceptionRecord = pException;
-
-                RtlRaiseException(&NewException);
-                break;
-            }
+        https://learn.microsoft.com/en-us/windows/win32/api/winnt/nf-winnt-rtlunwind
+    */
+    void NTAPI Unwind(PVOID TargetFrame, PVOID TargetIp, EXCEPTION_RECORD* pException, PVOID ReturnValue)
+    {
+        CONTEXT Context = {};
 
-            Registration::popRegistrationHead();
-        }
+        /*
+            Capture context of caller. This has to happen in this frame, RtlCaptureContext
+            records the context of whoever called Unwind so that continuing it returns there.
+        */
+        RtlCaptureContext(&Context);
 
-        if (TargetFrame == EXCEPTION_CHAIN_END)
-        {
-            //Caller wanted all frames to be unwound
-            NtContinue(&Context, FALSE);
+        //Pop the current arguments
+        Context.Esp += sizeof(TargetFrame) + sizeof(TargetIp) + sizeof(pException) + sizeof(ReturnValue);
 
-            return; //Should be unreachable
-        }
+        //Assign EAX (return value)
+        Context.Eax = (DWORD)ReturnValue;
 
-        //EXCEPTION_EXIT_UNWIND from NULL TargetFrame or nonexistent TargetFrame
-        NtRaiseException(pException, &Context, FALSE);
+        Core::Unwind<Win32::Platform>((PEXCEPTION_REGISTRATION_RECORD)TargetFrame, pException, &Context);
     }
 }
\ No newline at end of file
@@ -17,11 +17,16 @@
 */
 
 #include "stdafx.h"
+#include "SEH.h"
 #include "bound_check.h"
+#include "stack_walk.h"
+#include "throw_sites.h"
+#include "loaded_images.h"
 
-#if EXCEPTION_CHECKING == BOUND_CHECK
+#if (EXCEPTION_CHECKING & BOUND_CHECK)
 
-#pragma comment(lib, "Dbghelp.lib")
+//What throw compiles to, linked statically with /MT
+EXTERN_C __declspec(noreturn) void __stdcall _CxxThrowException(void* pExceptionObject, _ThrowInfo* pThrowInfo);
 
 /*
     Bound checking makes some compromises because we can't be sure that 
@@ -62,54 +67,85 @@ namespace SEH
 {
     namespace Bound_Check
     {
-        CRITICAL_SECTION stackTrace = {};
-
         static DWORD RaiseException = 0;
         static DWORD _CxxThrowException = 0;
 
-        static std::vector<DWORD> captureStackTrace(CONTEXT Context)
+        static DWORD imageSize(HMODULE Module)
         {
-            STACKFRAME stackFrame = {};
+            IMAGE_DOS_HEADER* DOSHeader = (IMAGE_DOS_HEADER*)Module;
+            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)Module + DOSHeader->e_lfanew);
 
-            stackFrame.AddrPC.Offset = Context.Eip;
-            stackFrame.AddrPC.Mode = AddrModeFlat;
+            return NTHeaders->OptionalHeader.SizeOfImage;
+        }
 
-            stackFrame.AddrFrame.Offset = Context.Ebp;
-            stackFrame.AddrFrame.Mode = AddrModeFlat;
+        //SizeOfImage of a module the caller handed in, 0 unless it's the base of a loaded PE image
+        static DWORD loadedImageSize(HMODULE Module)
+        {
+            HMODULE Loaded = NULL;
 
-            stackFrame.AddrStack.Offset = Context.Esp;
-            stackFrame.AddrStack.Mode = AddrModeFlat;
+            //Only an address inside a loaded image is safe to read, and it has to be the image's base
+            if (Module == NULL || !GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)Module, &Loaded) || Loaded != Module)
+            {
+                return 0;
+            }
 
-            std::vector<DWORD> stackTrace;
+            IMAGE_DOS_HEADER* DOSHeader = (IMAGE_DOS_HEADER*)Module;
 
-            EnterCriticalSection(&Bound_Check::stackTrace);
+            if (DOSHeader->e_magic != IMAGE_DOS_SIGNATURE || DOSHeader->e_lfanew <= 0)
+            {
+                return 0;
+            }
+
+            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)Module + DOSHeader->e_lfanew);
+
+            if (NTHeaders->Signature != IMAGE_NT_SIGNATURE || NTHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR32_MAGIC)
+            {
+                return 0;
+            }
+
+            return imageSize(Module);
+        }
 
-            while (StackWalk(IMAGE_FILE_MACHINE_I386, GetCurrentProcess(), GetCurrentThread(), &stackFrame, &Context, NULL, NULL, NULL, NULL))
+        //Starts out with the module the library is linked into, like the single range this used to be
+        struct DefaultModules : Modules
+        {
+            DefaultModules()
             {
-                if (stackFrame.AddrPC.Offset != 0)
-                {
-                    stackTrace.push_back(stackFrame.AddrPC.Offset);
-                }
-                else
-                {
-                    break;
-                }
+                add((DWORD)&__ImageBase, imageSize((HMODULE)&__ImageBase));
             }
+        };
 
-            LeaveCriticalSection(&Bound_Check::stackTrace);
+        Modules& modules()
+        {
+            static DefaultModules ranges;
+            return ranges;
+        }
 
-            return stackTrace;
+        /*
+            Only the first few frames matter so the walk stops there. There is no lock and
+            nothing is allocated; stackTrace is a fixed buffer on the faulting thread's stack.
+        */
+        static unsigned int captureStackTrace(const CONTEXT& Context, DWORD (&stackTrace)[Stack_Walk::maxFrames])
+        {
+            //Stack limits
+            DWORD stackLow;
+            DWORD stackHigh;
+            GetCurrentThreadStackLimits(&stackLow, &stackHigh);
+
+            return Stack_Walk::walk(Stack_Walk::DirectMemory<DWORD>(), (DWORD)Context.Eip, (DWORD)Context.Ebp, stackLow, stackHigh, stackTrace, Stack_Walk::maxFrames);
         }
 
         static LONG NTAPI emulateThrow(EXCEPTION_POINTERS* ExceptionInfo)
         {
             CONTEXT* Context = ExceptionInfo->ContextRecord;
-            std::vector<DWORD> stackTrace = captureStackTrace(*Context);
 
-            if (stackTrace.size() >= 2)
+            DWORD stackTrace[Stack_Walk::maxFrames];
+            unsigned int frameCount = captureStackTrace(*Context, stackTrace);
+
+            if (frameCount >= 2)
             {
-                RaiseException = stackTrace.at(0);
-                _CxxThrowException = stackTrace.at(1);
+                RaiseException = stackTrace[0];
+                _CxxThrowException = stackTrace[1];
             }
             else
             {
@@ -127,7 +163,8 @@ namespace SEH
 
     #pragma optimize( "", off )
 
-        void captureThrowStackTrace() //Only necessary for C++ exception support
+        //Only used when the throw sites can't be found in the code, see resolveThrowSites
+        static void emulateThrowStackTrace()
         {
             /*
                 emulateThrow will handle the throw in this function and view the stack trace.
@@ -146,6 +183,34 @@ namespace SEH
         }
 
     #pragma optimize( "", on )
+
+        void resolveThrowSites() //Only necessary for C++ exception support
+        {
+            /*
+                The return addresses a throw leaves at the top of the stack, found by decoding
+                RaiseException (through the kernel32 stub to kernelbase) and our statically
+                linked _CxxThrowException, see throw_sites.h. No exception and no stack walk,
+                so it doesn't care about frame pointers in either of them. Reads stay inside
+                the loaded images, a decoy jmp or call [slot] can't send them anywhere else.
+            */
+            if (RaiseException != 0)
+            {
+                return; //Code doesn't move, once is enough
+            }
+
+            DWORD RaiseExceptionAddress = (DWORD)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "RaiseException");
+            DWORD RtlRaiseExceptionAddress = (DWORD)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "RtlRaiseException");
+
+            Throw_Sites::Sites sites;
+
+            if (Throw_Sites::resolve(Throw_Sites::ImageMemory<Loaded_Images::Loader>(), RaiseExceptionAddress, RtlRaiseExceptionAddress, (DWORD)&::_CxxThrowException, sites))
+            {
+                RaiseException = sites.RaiseException;
+                _CxxThrowException = sites._CxxThrowException;
+            }
+            else
+                emulateThrowStackTrace(); //Unrecognized code, throw once and look
+        }
     
     #pragma warning( push )
     #pragma warning( disable : 4715 ) //Not all control paths return a value
@@ -153,15 +218,17 @@ namespace SEH
         bool exceptionInBounds(EXCEPTION_POINTERS* ExceptionInfo)
         {
             CONTEXT* Context = ExceptionInfo->ContextRecord;
-            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)&__ImageBase + __ImageBase.e_lfanew);
-            std::vector<DWORD> stackTrace = captureStackTrace(*Context);
 
-            for (unsigned int i = 0; i < stackTrace.size(); ++i)
-            {
-                if (stackTrace.at(i) == RaiseException) { ++i; }
-                if (stackTrace.at(i) == _CxxThrowException) { ++i; } //_CxxThrowException calls RaiseException
+            DWORD stackTrace[Stack_Walk::maxFrames];
+            unsigned int frameCount = captureStackTrace(*Context, stackTrace);
+            unsigned int i = 0;
 
-                return ((stackTrace.at(i) > (DWORD)&__ImageBase) && (stackTrace.at(i) < ((DWORD)&__ImageBase + NTHeaders->OptionalHeader.SizeOfImage)));
+            if (i < frameCount && stackTrace[i] == RaiseException) { ++i; }
+            if (i < frameCount && stackTrace[i] == _CxxThrowException) { ++i; } //_CxxThrowException calls RaiseException
+
+            if (i < frameCount)
+            {
+                return modules().contains(stackTrace[i]);
             }
 
             EXCEPTION_RECORD NewException = {};
@@ -176,6 +243,32 @@ namespace SEH
 
     #pragma warning( pop )
     }
+
+    bool AddBoundModule(HMODULE Module)
+    {
+        DWORD Size = Bound_Check::loadedImageSize(Module);
+        return Size != 0 && Bound_Check::modules().add((DWORD)Module, Size);
+    }
+
+    bool RemoveBoundModule(HMODULE Module)
+    {
+        return Module != (HMODULE)&__ImageBase && Bound_Check::modules().remove((DWORD)Module);
+    }
+}
+
+#else
+
+namespace SEH
+{
+    bool AddBoundModule(HMODULE)
+    {
+        return false;
+    }
+
+    bool RemoveBoundModule(HMODULE)
+    {
+        return false;
+    }
 }
 
 #endif
\ No newline at end of file
@@ -17,16 +17,43 @@
 */
 
 #pragma once
+#include "bound_index.h"
+#include "dispatch_pipeline.h"
 
 namespace SEH
 {
     namespace Bound_Check
     {
-        extern CRITICAL_SECTION stackTrace;
-        
+        typedef Bound_Index::Ranges<> Modules;
+
+        //Images exceptions have to come from to be dispatched, starts out with the module the library is linked into
+        Modules& modules();
+
         //Only necessary for C++ exception support
-        void captureThrowStackTrace();
+        void resolveThrowSites();
         
         bool exceptionInBounds(EXCEPTION_POINTERS* ExceptionInfo);
+
+        //BOUND_CHECK as a DispatchException pipeline stage
+        struct Check
+        {
+            static const bool enabled = (EXCEPTION_CHECKING & BOUND_CHECK) != 0;
+            static const unsigned int cost = 3; //Walks the stack
+
+            template <class Platform>
+            static Pipeline::Verdict filter(EXCEPTION_RECORD* Exception, CONTEXT* Context)
+            {
+                EXCEPTION_POINTERS ExceptionInfo = { Exception, Context };
+
+                /*
+                    Check if the exception originated in our module or a registered one.
+                    If so, we have responsibility to deal with it.
+
+                    ASSUMPTION: Exceptions shouldn't be dealt with across modules;
+                    however, they can be in specific scenarios.
+                */
+                return exceptionInBounds(&ExceptionInfo) ? Pipeline::Next : Pipeline::Skip;
+            }
+        };
     }
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/*
+    The image ranges BOUND_CHECK treats as ours: the module the library is linked into
+    and whatever plugins were registered with SEH::AddBoundModule.
+
+    Ranges are kept sorted by base in a fixed array, each one packed into a single word
+    (base in the high half, last byte in the low half) so a range is never seen half
+    written. Lookups are a binary search under a seqlock: no lock and nothing to free,
+    a lookup that raced a change just searches again. Writers are serialized by a mutex
+    and only ever hold it for a few stores.
+*/
+
+namespace SEH
+{
+    namespace Bound_Index
+    {
+        //At most capacity ranges, they may not overlap
+        template <size_t capacity = 64>
+        class Ranges
+        {
+        public:
+            Ranges() : sequence(0), count(0)
+            {
+                for (std::atomic<uint64_t>& entry : entries)
+                {
+                    entry.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            //Returns false if the range is empty, overlaps another one or there's no room left
+            bool add(uint32_t Base, uint32_t Size)
+            {
+                if (Size == 0 || (uint64_t)Base + Size > ((uint64_t)1 << 32))
+                {
+                    return false;
+                }
+
+                uint64_t range = pack(Base, Base + (Size - 1));
+
+                std::lock_guard<std::mutex> lock(writer);
+
+                size_t used = count.load(std::memory_order_relaxed);
+                size_t index = upperBound(Base, used);
+
+                if (index != 0)
+                {
+                    uint64_t previous = entries[index - 1].load(std::memory_order_relaxed);
+
+                    if (previous == range)
+                    {
+                        return true; //Already added
+                    }
+
+                    if (last(previous) >= Base)
+                    {
+                        return false;
+                    }
+                }
+
+                if (index != used && base(entries[index].load(std::memory_order_relaxed)) <= last(range))
+                {
+                    return false;
+                }
+
+                if (used == capacity)
+                {
+                    return false;
+                }
+
+                beginWrite();
+
+                for (size_t i = used; i > index; --i)
+                {
+                    entries[i].store(entries[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+
+                entries[index].store(range, std::memory_order_relaxed);
+                count.store(used + 1, std::memory_order_relaxed);
+
+                endWrite();
+                return true;
+            }
+
+            //Removes the range starting at Base, returns false if there is none
+            bool remove(uint32_t Base)
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                size_t used = count.load(std::memory_order_relaxed);
+                size_t index = upperBound(Base, used);
+
+                if (index == 0 || base(entries[index - 1].load(std::memory_order_relaxed)) != Base)
+                {
+                    return false;
+                }
+
+                beginWrite();
+
+                for (size_t i = index; i < used; ++i)
+                {
+                    entries[i - 1].store(entries[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+
+                entries[used - 1].store(0, std::memory_order_relaxed);
+                count.store(used - 1, std::memory_order_relaxed);
+
+                endWrite();
+                return true;
+            }
+
+            //O(log n), never blocks on a writer for longer than its few stores
+            bool contains(uint32_t address) const
+            {
+                for (;;)
+                {
+                    uint32_t before = sequence.load(std::memory_order_acquire);
+
+                    if ((before & 1) == 0)
+                    {
+                        //A torn count still has to stay inside the array
+                        size_t used = count.load(std::memory_order_relaxed);
+                        size_t index = upperBound(address, (used < capacity) ? used : capacity);
+                        bool inside = (index != 0 && last(entries[index - 1].load(std::memory_order_relaxed)) >= address);
+
+                        std::atomic_thread_fence(std::memory_order_acquire);
+
+                        if (sequence.load(std::memory_order_relaxed) == before)
+                        {
+                            return inside;
+                        }
+                    }
+                    else
+                        std::this_thread::yield(); //A writer was preempted in the middle of a change
+                }
+            }
+
+            size_t size() const
+            {
+                return count.load(std::memory_order_relaxed);
+            }
+
+        private:
+            static uint64_t pack(uint32_t Base, uint32_t Last)
+            {
+                return ((uint64_t)Base << 32) | Last;
+            }
+
+            static uint32_t base(uint64_t range) { return (uint32_t)(range >> 32); }
+            static uint32_t last(uint64_t range) { return (uint32_t)range; }
+
+            /*
+                Index of the first of the used ranges that starts after address. Written so
+                the compiler picks conditional moves, the addresses looked up are as good as
+                random so a branch would mispredict half the time.
+            */
+            size_t upperBound(uint32_t address, size_t used) const
+            {
+                if (used == 0)
+                {
+                    return 0;
+                }
+
+                uint64_t key = pack(address, UINT32_MAX); //Above every range starting at address
+                size_t low = 0;
+
+                while (used > 1)
+                {
+                    size_t half = used / 2;
+
+                    low = (entries[low + half].load(std::memory_order_relaxed) <= key) ? low + half : low;
+                    used -= half;
+                }
+
+                return low + (entries[low].load(std::memory_order_relaxed) <= key);
+            }
+
+            void beginWrite()
+            {
+                sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+
+            void endWrite()
+            {
+                sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+
+            std::atomic<uint32_t> sequence; //Odd while a writer is changing the ranges
+            std::atomic<size_t> count;
+            std::atomic<uint64_t> entries[capacity];
+            std::mutex writer;
+        };
+    }
+}
\ No newline at end of file
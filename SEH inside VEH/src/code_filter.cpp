@@ -0,0 +1,67 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include "SEH.h"
+#include "code_filter.h"
+
+namespace SEH
+{
+    namespace Code_Filter
+    {
+        //Starts out skipping the codes real SEH always handles fine by itself
+        struct DefaultCodes : Codes
+        {
+            DefaultCodes()
+            {
+                //Raised by OutputDebugString, kernel32 catches them itself
+                set(DBG_PRINTEXCEPTION_C, Skip);
+                set(DBG_PRINTEXCEPTION_WIDE_C, Skip);
+            }
+        };
+
+        Codes& codes()
+        {
+            static DefaultCodes table;
+            return table;
+        }
+    }
+
+    bool SetExceptionCodeAction(DWORD ExceptionCode, ExceptionCodeAction Action)
+    {
+        Code_Filter::Action action = (Action == ExceptionCodeSkip) ? Code_Filter::Skip : (Action == ExceptionCodeForce) ? Code_Filter::Force : Code_Filter::Default;
+        return Code_Filter::codes().set(ExceptionCode, action);
+    }
+
+    void GetExceptionCodeCounts(DWORD ExceptionCode, ULONG64* Skipped, ULONG64* Forced)
+    {
+        Code_Filter::Stats stats = Code_Filter::codes().stats(ExceptionCode);
+
+        *Skipped = stats.skipped;
+        *Forced = stats.forced;
+    }
+
+    void GetExceptionCodeTotals(ULONG64* Skipped, ULONG64* Forced)
+    {
+        Code_Filter::Stats stats = Code_Filter::codes().stats();
+
+        *Skipped = stats.skipped;
+        *Forced = stats.forced;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,270 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "dispatch_pipeline.h"
+
+/*
+    Exception codes DispatchException decides on before anything else. A code can be
+    skipped (straight to EXCEPTION_CONTINUE_SEARCH, real SEH deals with it) or forced
+    (dispatched without asking the other checks).
+
+    Lookups are constant time and lock-free. A 256-bit bitmap answers "not listed" for
+    almost every code with one load, listed codes are then found within maxProbes slots
+    of an open-addressing table. Writers are serialized by a mutex and only ever store
+    whole words, so a lookup racing a change sees either the old or the new action.
+*/
+
+#ifndef EXCEPTION_CODE_FILTER
+#define EXCEPTION_CODE_FILTER 1
+#endif
+
+namespace SEH
+{
+    namespace Code_Filter
+    {
+        enum Action
+        {
+            Default, //Run the enabled checks as usual
+            Skip,    //Never dispatch
+            Force    //Always dispatch
+        };
+
+        struct Stats
+        {
+            uint64_t skipped;
+            uint64_t forced;
+        };
+
+        //capacity must be a power of two
+        template <size_t capacity = 64>
+        class Table
+        {
+            static_assert(capacity != 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+        public:
+            static const unsigned int maxProbes = 4;
+
+            Table()
+            {
+                for (std::atomic<uint64_t>& word : bitmap)
+                {
+                    word.store(0, std::memory_order_relaxed);
+                }
+
+                for (Entry& entry : entries)
+                {
+                    entry.value.store(0, std::memory_order_relaxed);
+                    entry.skipped.store(0, std::memory_order_relaxed);
+                    entry.forced.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            //Returns false if every slot Code may use holds another code
+            bool set(uint32_t Code, Action action)
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                size_t slot = home(Code);
+                size_t freeSlot = capacity;
+
+                for (unsigned int i = 0; i < maxProbes; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t value = entries[slot].value.load(std::memory_order_relaxed);
+
+                    if (value != 0 && entryCode(value) == Code)
+                    {
+                        //Codes set back to Default keep their slot so the codes probed past it are still found
+                        entries[slot].value.store(pack(Code, action), std::memory_order_release);
+                        return true;
+                    }
+
+                    if (value == 0 && freeSlot == capacity)
+                    {
+                        freeSlot = slot;
+                    }
+                }
+
+                if (action == Default)
+                {
+                    return true;
+                }
+
+                if (freeSlot == capacity)
+                {
+                    return false;
+                }
+
+                entries[freeSlot].value.store(pack(Code, action), std::memory_order_release);
+
+                //Bits are never cleared, a set bit only means "might be listed"
+                size_t bit = bitmapBit(Code);
+                bitmap[bit / 64].fetch_or((uint64_t)1 << (bit % 64), std::memory_order_release);
+
+                return true;
+            }
+
+            Action lookup(uint32_t Code) const
+            {
+                size_t slot;
+                return find(Code, slot);
+            }
+
+            //lookup that also counts skipped and forced codes, used by DispatchException
+            Action classify(uint32_t Code)
+            {
+                size_t slot;
+                Action action = find(Code, slot);
+
+                if (action == Skip)
+                    entries[slot].skipped.fetch_add(1, std::memory_order_relaxed);
+                else if (action == Force)
+                    entries[slot].forced.fetch_add(1, std::memory_order_relaxed);
+
+                return action;
+            }
+
+            //Counts for one code, zero if it was never listed
+            Stats stats(uint32_t Code) const
+            {
+                Stats stats = {};
+                size_t slot = home(Code);
+
+                for (unsigned int i = 0; i < maxProbes; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t value = entries[slot].value.load(std::memory_order_acquire);
+
+                    if (value != 0 && entryCode(value) == Code)
+                    {
+                        stats.skipped = entries[slot].skipped.load(std::memory_order_relaxed);
+                        stats.forced = entries[slot].forced.load(std::memory_order_relaxed);
+                        break;
+                    }
+                }
+
+                return stats;
+            }
+
+            //Counts for every code
+            Stats stats() const
+            {
+                Stats stats = {};
+
+                for (const Entry& entry : entries)
+                {
+                    stats.skipped += entry.skipped.load(std::memory_order_relaxed);
+                    stats.forced += entry.forced.load(std::memory_order_relaxed);
+                }
+
+                return stats;
+            }
+
+        private:
+            static const uint64_t listed = 0x100; //Lets code 0 be listed, 0 marks empty slots
+
+            struct Entry
+            {
+                std::atomic<uint64_t> value;
+                std::atomic<uint64_t> skipped;
+                std::atomic<uint64_t> forced;
+            };
+
+            static uint64_t pack(uint32_t Code, Action action)
+            {
+                return ((uint64_t)Code << 32) | listed | (uint64_t)action;
+            }
+
+            static uint32_t entryCode(uint64_t value) { return (uint32_t)(value >> 32); }
+            static Action entryAction(uint64_t value) { return (Action)(value & 0xFF); }
+
+            static uint64_t hash(uint32_t Code)
+            {
+                return (uint64_t)Code * 0x9E3779B97F4A7C15ull;
+            }
+
+            static size_t home(uint32_t Code)
+            {
+                return (size_t)(hash(Code) >> 32) & (capacity - 1);
+            }
+
+            static size_t bitmapBit(uint32_t Code)
+            {
+                return (size_t)(hash(Code) >> 56);
+            }
+
+            Action find(uint32_t Code, size_t& slot) const
+            {
+                size_t bit = bitmapBit(Code);
+
+                if ((bitmap[bit / 64].load(std::memory_order_acquire) & ((uint64_t)1 << (bit % 64))) == 0)
+                {
+                    return Default;
+                }
+
+                slot = home(Code);
+
+                for (unsigned int i = 0; i < maxProbes; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t value = entries[slot].value.load(std::memory_order_acquire);
+
+                    if (value != 0 && entryCode(value) == Code)
+                    {
+                        return entryAction(value);
+                    }
+                }
+
+                return Default;
+            }
+
+            std::atomic<uint64_t> bitmap[4];
+            Entry entries[capacity];
+            std::mutex writer;
+        };
+
+        typedef Table<> Codes;
+
+        //The codes DispatchException consults, defined by whoever links the library (code_filter.cpp)
+        Codes& codes();
+
+        //Code_Filter as a DispatchException pipeline stage, runs before every check but Thread_Scope
+        struct Check
+        {
+            static const bool enabled = (EXCEPTION_CODE_FILTER != 0);
+            static const unsigned int cost = 1;
+
+            template <class Platform>
+            static Pipeline::Verdict filter(typename Platform::Record* Exception, typename Platform::Context*)
+            {
+                switch (codes().classify(Exception->ExceptionCode))
+                {
+                case Skip:
+                    return Pipeline::Skip;
+                case Force:
+                    return Pipeline::Dispatch;
+                default:
+                    return Pipeline::Next;
+                }
+            }
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,287 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "dispatch_core.h"
+
+/*
+    A compact snapshot of an exception that went unhandled, captured at second chance
+    into a buffer allocated long before (EnableSEH), so nothing is allocated and no lock
+    is taken while the process is dying. It is written out with one write for the crash
+    snapshot reader (Tools/Crash Snapshot Reader).
+
+    It holds the exception record chain, the context and every frame of the registration
+    chain with its handler and the handler's module and RVA. The chain is walked again
+    with the same checks DispatchException makes, stopping at the first frame that fails
+    one, so the snapshot also says why a dispatch ended with EXCEPTION_STACK_INVALID.
+
+    File layout, all little endian, every part a multiple of 8 bytes:
+
+        FileHeader
+        Record[FileHeader::recordCount]   //The exception first, then its ExceptionRecord chain
+        Frame[FileHeader::frameCount]     //From the chain head
+        Context bytes, FileHeader::contextSize of them, padded to 8
+*/
+
+namespace SEH
+{
+    namespace Crash_Snapshot
+    {
+        static const uint32_t version = 1;
+
+        static const uint32_t maxRecords = 8;
+        static const uint32_t maxFrames = 64;
+        static const uint32_t maxContext = 1024; //A CONTEXT is 716 bytes on x86
+
+        //How to read the context bytes
+        enum Architecture : uint32_t
+        {
+            UnknownArchitecture,
+            X86,      //Windows x86 CONTEXT
+            Simulated //Simulated::Context, Eip, Esp, Ebp and Eax as pointer sized fields
+        };
+
+        //Offsets into a Windows x86 CONTEXT, the reader doesn't have winnt.h
+        namespace X86Context
+        {
+            enum : uint32_t
+            {
+                ContextFlags = 0x00,
+                SegGs = 0x8C,
+                SegFs = 0x90,
+                SegEs = 0x94,
+                SegDs = 0x98,
+                Edi = 0x9C,
+                Esi = 0xA0,
+                Ebx = 0xA4,
+                Edx = 0xA8,
+                Ecx = 0xAC,
+                Eax = 0xB0,
+                Ebp = 0xB4,
+                Eip = 0xB8,
+                SegCs = 0xBC,
+                EFlags = 0xC0,
+                Esp = 0xC4,
+                SegSs = 0xC8,
+                size = 0x2CC
+            };
+        }
+
+        //Why the exception went unhandled
+        enum Reason : uint32_t
+        {
+            NoHandler,    //Every handler returned ExceptionContinueSearch
+            StackInvalid, //EXCEPTION_STACK_INVALID, the last frame's status says why
+            ChainCorrupt, //SEH::ExceptionChainCorrupt, a frame doesn't lead to an older one
+            ChainTooDeep, //SEH::ExceptionChainTooDeep
+            UnwindTarget  //An unwind went through the whole chain without finding its target
+        };
+
+        enum FrameStatus : uint32_t
+        {
+            Valid,
+            OutsideStack,      //Not inside the stack limits, its contents weren't read
+            Unaligned,         //Its contents weren't read
+            HandlerNotAllowed, //The platform wouldn't call its handler (handler manifests)
+            OutOfOrder,        //Not older than the frame before it
+            TooDeep            //Past the platform's maxChainDepth
+        };
+
+        struct FileHeader
+        {
+            char magic[8];         //"SEHCRASH"
+            uint32_t version;
+            uint32_t size;         //Of the whole snapshot
+            uint32_t pointerSize;  //Of the crashed process
+            uint32_t architecture;
+            uint32_t processId;
+            uint32_t threadId;
+            uint32_t reason;
+            uint32_t recordCount;
+            uint32_t frameCount;
+            uint32_t contextSize;
+            uint64_t stackLow;
+            uint64_t stackHigh;
+            uint64_t chainHead;
+            uint32_t chainTruncated; //More frames than maxFrames were valid
+            uint32_t reserved;
+        };
+
+        struct Record
+        {
+            uint32_t code;
+            uint32_t flags;
+            uint64_t address;
+            uint32_t numberParameters;
+            uint32_t reserved;
+            uint64_t information[15];
+        };
+
+        struct Frame
+        {
+            uint64_t frame;
+            uint64_t handler;    //0 if the frame couldn't be read
+            uint64_t moduleBase; //0 if the handler isn't in a module
+            uint32_t handlerRva;
+            uint32_t status;
+        };
+
+        static_assert(sizeof(FileHeader) == 80, "FileHeader is part of the file format");
+        static_assert(sizeof(Record) == 144, "Record is part of the file format");
+        static_assert(sizeof(Frame) == 32, "Frame is part of the file format");
+
+        //Largest snapshot capture writes, the buffer given to it must be at least this big
+        static const size_t bufferSize = sizeof(FileHeader) + maxRecords * sizeof(Record) + maxFrames * sizeof(Frame) + maxContext;
+
+        inline Reason reasonOf(uint32_t Code, uint32_t Flags)
+        {
+            if (Code == Core::Status::ChainCorrupt)
+                return ChainCorrupt;
+            if (Code == Core::Status::ChainTooDeep)
+                return ChainTooDeep;
+            if (Flags & Core::Flags::StackInvalid)
+                return StackInvalid;
+            if (Flags & (Core::Flags::Unwinding | Core::Flags::ExitUnwind))
+                return UnwindTarget;
+
+            return NoHandler;
+        }
+
+        /*
+            Fills Buffer (bufferSize bytes) with a snapshot of Exception and Context on the
+            calling thread, returns its size. module(Address, Base) returns true and sets Base
+            if Address is in a module. Only reads what the platform policy and the records
+            point at, and never follows a frame that fails the dispatcher's checks.
+        */
+        template <class Platform, class ModuleLookup>
+        size_t capture(uint8_t* Buffer, const typename Platform::Record* Exception, const typename Platform::Context* Context, uint32_t architecture, uint32_t processId, uint32_t threadId, ModuleLookup& module)
+        {
+            typedef typename Platform::Address Address;
+            typedef typename Platform::Registration Registration;
+            typedef typename Platform::Record PlatformRecord;
+
+            FileHeader& header = *reinterpret_cast<FileHeader*>(Buffer);
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "SEHCRASH", sizeof(header.magic));
+            header.version = version;
+            header.pointerSize = sizeof(void*);
+            header.architecture = architecture;
+            header.processId = processId;
+            header.threadId = threadId;
+
+            //Records, the reason is decided by the one being dispatched
+            uint8_t* Next = Buffer + sizeof(FileHeader);
+            header.reason = reasonOf(Exception->ExceptionCode, Exception->ExceptionFlags);
+
+            for (const PlatformRecord* Source = Exception; Source != NULL && header.recordCount < maxRecords; Source = Source->ExceptionRecord)
+            {
+                Record& record = *reinterpret_cast<Record*>(Next);
+                memset(&record, 0, sizeof(record));
+
+                record.code = Source->ExceptionCode;
+                record.flags = Source->ExceptionFlags;
+                record.address = (uint64_t)(uintptr_t)Source->ExceptionAddress;
+                record.numberParameters = (Source->NumberParameters < 15) ? Source->NumberParameters : 15;
+
+                for (uint32_t i = 0; i < record.numberParameters; ++i)
+                {
+                    record.information[i] = (uint64_t)Source->ExceptionInformation[i];
+                }
+
+                Next += sizeof(Record);
+                ++header.recordCount;
+            }
+
+            //Frames, walked like DispatchException does
+            Address stackLow;
+            Address stackHigh;
+            Platform::getStackLimits(stackLow, stackHigh);
+
+            Registration* Head = Platform::getRegistrationHead();
+            header.stackLow = (uint64_t)stackLow;
+            header.stackHigh = (uint64_t)stackHigh;
+            header.chainHead = (uint64_t)(uintptr_t)Head;
+
+            Address Previous = 0;
+            unsigned int Depth = 0;
+
+            for (Registration* Current = Head; Current != Core::chainEnd<Registration>(); Current = Current->Next)
+            {
+                if (header.frameCount == maxFrames)
+                {
+                    header.chainTruncated = 1;
+                    break;
+                }
+
+                Frame& frame = *reinterpret_cast<Frame*>(Next);
+                memset(&frame, 0, sizeof(frame));
+
+                frame.frame = (uint64_t)(uintptr_t)Current;
+                Next += sizeof(Frame);
+                ++header.frameCount;
+
+                if (!Core::isRegistrationValid<Platform>(Current, stackLow, stackHigh))
+                {
+                    frame.status = ((Address)Current & Platform::alignmentMask) ? Unaligned : OutsideStack;
+                    break;
+                }
+
+                frame.handler = (uint64_t)(uintptr_t)Current->Handler;
+
+                uint64_t Base = 0;
+
+                if (module(frame.handler, Base))
+                {
+                    frame.moduleBase = Base;
+                    frame.handlerRva = (uint32_t)(frame.handler - Base);
+                }
+
+                if (!Platform::isHandlerAllowed(Current))
+                {
+                    frame.status = HandlerNotAllowed;
+                    break;
+                }
+
+                if (uint32_t Code = Core::checkChain<Platform>((Address)Current, Previous, Depth))
+                {
+                    frame.status = (Code == Core::Status::ChainTooDeep) ? TooDeep : OutOfOrder;
+                    break;
+                }
+            }
+
+            //The context last, it is the only part whose size depends on the platform
+            size_t contextSize = (sizeof(*Context) < maxContext) ? sizeof(*Context) : maxContext;
+            memcpy(Next, Context, contextSize);
+            header.contextSize = (uint32_t)contextSize;
+
+            Next += contextSize;
+
+            while ((Next - Buffer) % 8 != 0)
+            {
+                *Next++ = 0;
+            }
+
+            header.size = (uint32_t)(Next - Buffer);
+            return header.size;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,473 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "throw_sites.h"
+
+/*
+    Reads the metadata MSVC emits for C++ exceptions on x86 and answers the question
+    __CxxFrameHandler3 answers while searching: does this frame catch this throw?
+
+        ThrowInfo           attached to the exception (ExceptionInformation[2]), lists
+                            every type the thrown object can be caught as
+        FuncInfo            behind each function's frame handler thunk
+                                mov eax, offset FuncInfo
+                                jmp __CxxFrameHandler3
+        TryBlockMap         the try blocks, each with its state range and catch handlers
+        UnwindMap           per state, the state before it and the destructor to run
+
+    The frame's registration is an EHRegistrationNode: Next, Handler and the current
+    state right after them.
+
+    Everything is read through a memory policy (the one unwind_patch.h and
+    throw_sites.h use) so captured metadata can be decoded on any host:
+
+        const uint8_t* at(uint32_t VA, size_t size) const; //NULL if not readable
+
+    Anything that can't be read or doesn't look right is reported as "may catch", a
+    frame is only ever skipped when the tables say for certain it won't catch.
+*/
+
+namespace SEH
+{
+    namespace Cxx_EH
+    {
+        const uint32_t ExceptionCode = 0xE06D7363; //'msc' | 0xE0000000
+        const uint32_t Magic1 = 0x19930520;
+        const uint32_t Magic2 = 0x19930521;        //Adds pESTypeList
+        const uint32_t Magic3 = 0x19930522;        //Adds EHFlags
+
+        //ThrowInfo attributes
+        enum : uint32_t
+        {
+            ThrowConst = 0x1,
+            ThrowVolatile = 0x2,
+            ThrowUnaligned = 0x4
+        };
+
+        //CatchableType properties
+        enum : uint32_t
+        {
+            CatchByReferenceOnly = 0x2
+        };
+
+        //HandlerType adjectives
+        enum : uint32_t
+        {
+            HandlerConst = 0x1,
+            HandlerVolatile = 0x2,
+            HandlerUnaligned = 0x4,
+            HandlerReference = 0x8
+        };
+
+        //FuncInfo EHFlags
+        enum : uint32_t
+        {
+            FunctionNoexcept = 0x4
+        };
+
+        //How many types a throw can be caught as, more than any real class hierarchy has
+        const unsigned int maxCatchableTypes = 32;
+
+        using Throw_Sites::load32;
+
+        struct CatchableType
+        {
+            uint32_t properties;
+            uint32_t TypeDescriptor;
+        };
+
+        struct ThrowTypes
+        {
+            uint32_t attributes;
+            unsigned int count;
+            CatchableType types[maxCatchableTypes];
+        };
+
+        //From a ThrowInfo, false if it can't be read (a rethrow has none at all)
+        template <class Memory>
+        bool readThrowInfo(const Memory& memory, uint32_t ThrowInfo, ThrowTypes& throwTypes)
+        {
+            const uint8_t* info = (ThrowInfo != 0) ? memory.at(ThrowInfo, 16) : NULL;
+            const uint8_t* array = (info != NULL) ? memory.at(load32(info + 12), 4) : NULL;
+
+            if (array == NULL)
+            {
+                return false;
+            }
+
+            uint32_t count = load32(array);
+
+            if (count == 0 || count > maxCatchableTypes || (array = memory.at(load32(info + 12), 4 + 4 * count)) == NULL)
+            {
+                return false;
+            }
+
+            throwTypes.attributes = load32(info);
+            throwTypes.count = count;
+
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                const uint8_t* type = memory.at(load32(array + 4 + 4 * i), 8);
+
+                if (type == NULL)
+                {
+                    return false;
+                }
+
+                throwTypes.types[i].properties = load32(type);
+                throwTypes.types[i].TypeDescriptor = load32(type + 4);
+            }
+
+            return true;
+        }
+
+        //Only C++ throws from a compiler we know carry a ThrowInfo, NULL for anything else
+        template <class Record>
+        uint32_t throwInfoOf(const Record* Exception)
+        {
+            if (Exception->ExceptionCode != ExceptionCode || Exception->NumberParameters < 3)
+            {
+                return 0;
+            }
+
+            uint32_t magic = (uint32_t)Exception->ExceptionInformation[0];
+
+            if (magic != Magic1 && magic != Magic2 && magic != Magic3)
+            {
+                return 0;
+            }
+
+            return (uint32_t)Exception->ExceptionInformation[2];
+        }
+
+        struct FuncInfo
+        {
+            uint32_t magic;
+            int32_t maxState;
+            uint32_t UnwindMap;
+            uint32_t tryBlocks;
+            uint32_t TryBlockMap;
+            uint32_t ESTypeList; //0 before Magic2
+            uint32_t EHFlags;    //0 before Magic3
+        };
+
+        template <class Memory>
+        bool readFuncInfo(const Memory& memory, uint32_t VA, FuncInfo& info)
+        {
+            const uint8_t* bytes = memory.at(VA, 20);
+
+            if (bytes == NULL)
+            {
+                return false;
+            }
+
+            info = FuncInfo();
+            info.magic = load32(bytes) & 0x1FFFFFFF; //The top 3 bits are bbtFlags
+            info.maxState = (int32_t)load32(bytes + 4);
+            info.UnwindMap = load32(bytes + 8);
+            info.tryBlocks = load32(bytes + 12);
+            info.TryBlockMap = load32(bytes + 16);
+
+            if (info.magic != Magic1 && info.magic != Magic2 && info.magic != Magic3)
+            {
+                return false;
+            }
+
+            if (info.magic >= Magic2)
+            {
+                if ((bytes = memory.at(VA, 32)) == NULL) return false;
+                info.ESTypeList = load32(bytes + 28);
+            }
+
+            if (info.magic >= Magic3)
+            {
+                if ((bytes = memory.at(VA, 36)) == NULL) return false;
+                info.EHFlags = load32(bytes + 32);
+            }
+
+            return true;
+        }
+
+        /*
+            The FuncInfo a frame handler thunk passes to FrameHandler (__CxxFrameHandler3
+            with any import thunks already followed), or 0 if Handler isn't such a thunk.
+            The thunk may check the stack cookie first, so the mov eax / jmp pair is looked
+            for in its first bytes.
+        */
+        template <class Memory>
+        uint32_t funcInfoOf(const Memory& memory, uint32_t Handler, uint32_t FrameHandler)
+        {
+            //The thunk may be the last code that's readable, shrink the window until it isn't past it
+            size_t window = 48;
+            const uint8_t* code = NULL;
+
+            while (window >= 10 && (code = memory.at(Handler, window)) == NULL)
+            {
+                window -= 8;
+            }
+
+            if (code == NULL || FrameHandler == 0)
+            {
+                return 0;
+            }
+
+            //Only the mov eax opcodes need a closer look
+            for (const uint8_t* mov = code; (mov = static_cast<const uint8_t*>(memchr(mov, 0xB8, code + window - 9 - mov))) != NULL; ++mov)
+            {
+                uint32_t i = (uint32_t)(mov - code);
+
+                if (mov[5] == 0xE9 && Throw_Sites::followThunks(memory, Handler + i + 10 + load32(mov + 6)) == FrameHandler)
+                {
+                    return load32(mov + 1);
+                }
+            }
+
+            return 0;
+        }
+
+        struct HandlerType
+        {
+            uint32_t adjectives;
+            uint32_t TypeDescriptor; //0 for catch(...)
+            int32_t catchObjectOffset;
+            uint32_t address;        //The catch block
+        };
+
+        //Same type if it's the same descriptor or one with the same decorated name (another module's copy)
+        template <class Memory>
+        bool sameType(const Memory& memory, uint32_t first, uint32_t second)
+        {
+            if (first == second)
+            {
+                return true;
+            }
+
+            //TypeDescriptor: pVFTable, spare, then the name
+            const size_t maxName = 256;
+            const uint8_t* a = memory.at(first + 8, 1);
+            const uint8_t* b = memory.at(second + 8, 1);
+
+            for (size_t i = 0; a != NULL && b != NULL && i < maxName; ++i)
+            {
+                a = memory.at(first + 8 + (uint32_t)i, 1);
+                b = memory.at(second + 8 + (uint32_t)i, 1);
+
+                if (a == NULL || b == NULL || *a != *b)
+                {
+                    return false;
+                }
+
+                if (*a == 0)
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        //Whether handler catches a throw that can be caught as type, the checks TypeMatch makes
+        template <class Memory>
+        bool typeMatches(const Memory& memory, const HandlerType& handler, const CatchableType& type, uint32_t attributes)
+        {
+            if (handler.TypeDescriptor == 0)
+            {
+                return true; //catch(...)
+            }
+
+            if (!sameType(memory, handler.TypeDescriptor, type.TypeDescriptor))
+            {
+                return false;
+            }
+
+            if ((type.properties & CatchByReferenceOnly) && !(handler.adjectives & HandlerReference)) return false;
+            if ((attributes & ThrowConst) && !(handler.adjectives & HandlerConst)) return false;
+            if ((attributes & ThrowVolatile) && !(handler.adjectives & HandlerVolatile)) return false;
+            if ((attributes & ThrowUnaligned) && !(handler.adjectives & HandlerUnaligned)) return false;
+
+            return true;
+        }
+
+        enum Verdict
+        {
+            Unknown,   //Couldn't tell, the frame handler has to decide
+            Catches,   //A catch block of this frame takes the throw
+            Terminates,//Nothing catches but the function is noexcept or has a throw() list, the CRT decides what happens
+            Passes     //Nothing in this frame can take the throw
+        };
+
+        /*
+            What the frame does with the throw in state, like FindHandler: the try blocks
+            whose state range holds state are tried in order, first match wins. Found
+            holds the catch block on Catches.
+        */
+        template <class Memory>
+        Verdict findCatch(const Memory& memory, const FuncInfo& info, int32_t state, const ThrowTypes& throwTypes, HandlerType* Found = NULL)
+        {
+            if (state < -1 || state >= info.maxState)
+            {
+                return Unknown;
+            }
+
+            for (uint32_t block = 0; block < info.tryBlocks; ++block)
+            {
+                const uint8_t* entry = memory.at(info.TryBlockMap + 20 * block, 20);
+
+                if (entry == NULL)
+                {
+                    return Unknown;
+                }
+
+                int32_t tryLow = (int32_t)load32(entry);
+                int32_t tryHigh = (int32_t)load32(entry + 4);
+                uint32_t catches = load32(entry + 12);
+                uint32_t HandlerArray = load32(entry + 16);
+
+                if (state < tryLow || state > tryHigh)
+                {
+                    continue;
+                }
+
+                for (uint32_t c = 0; c < catches; ++c)
+                {
+                    const uint8_t* bytes = memory.at(HandlerArray + 16 * c, 16);
+
+                    if (bytes == NULL)
+                    {
+                        return Unknown;
+                    }
+
+                    HandlerType handler = { load32(bytes), load32(bytes + 4), (int32_t)load32(bytes + 8), load32(bytes + 12) };
+
+                    for (unsigned int t = 0; t < throwTypes.count; ++t)
+                    {
+                        if (typeMatches(memory, handler, throwTypes.types[t], throwTypes.attributes))
+                        {
+                            if (Found != NULL)
+                            {
+                                *Found = handler;
+                            }
+
+                            return Catches;
+                        }
+                    }
+                }
+            }
+
+            if (info.ESTypeList != 0 || (info.EHFlags & FunctionNoexcept))
+            {
+                return Terminates;
+            }
+
+            return Passes;
+        }
+
+        /*
+            Calls visit(state, action) for every destructor unwinding from state down to
+            toState runs, newest first, the way the unwind map chains them. Returns false
+            if the map is broken.
+        */
+        template <class Memory, class Visitor>
+        bool forEachUnwindAction(const Memory& memory, const FuncInfo& info, int32_t state, int32_t toState, Visitor&& visit)
+        {
+            for (int32_t steps = 0; state > toState; ++steps)
+            {
+                const uint8_t* entry = (state < info.maxState && steps <= info.maxState) ? memory.at(info.UnwindMap + 8 * (uint32_t)state, 8) : NULL;
+
+                if (entry == NULL)
+                {
+                    return false;
+                }
+
+                uint32_t action = load32(entry + 4);
+
+                if (action != 0)
+                {
+                    visit(state, action);
+                }
+
+                state = (int32_t)load32(entry);
+            }
+
+            return state == toState;
+        }
+
+        /*
+            The frame handler doesn't need to be called while searching for this throw's
+            catch: the frame is a FrameHandler frame and its tables say it won't catch
+            the throw or do anything else about it. Handler and state are the frame's
+            EHRegistrationNode fields.
+        */
+        template <class Memory>
+        bool passes(const Memory& memory, const ThrowTypes& throwTypes, uint32_t Handler, int32_t state, uint32_t FrameHandler)
+        {
+            FuncInfo info;
+            uint32_t VA = funcInfoOf(memory, Handler, FrameHandler);
+
+            return VA != 0 && readFuncInfo(memory, VA, info) && findCatch(memory, info, state, throwTypes) == Passes;
+        }
+
+        /*
+            The types of the throw being dispatched, so they're read once per dispatch and
+            not once per frame. Keyed by the record, the thrown object and its ThrowInfo,
+            a ThrowInfo is in a module's read-only data and doesn't change while loaded.
+        */
+        struct ThrowCache
+        {
+            const void* Exception;
+            uint64_t Object;
+            uint32_t ThrowInfo;
+            bool readable;
+            ThrowTypes throwTypes;
+        };
+
+        /*
+            passes for an exception being dispatched. Only first chance C++ throws are
+            considered, rethrows and exceptions raised while a handler runs (NestedCall)
+            always go to the frame handler.
+        */
+        template <class Memory, class Record>
+        bool canSkip(const Memory& memory, ThrowCache& cache, const Record* Exception, uint32_t Handler, int32_t state, uint32_t FrameHandler)
+        {
+            const uint32_t busy = 0x2 | 0x4 | 0x10; //Unwinding, ExitUnwind and NestedCall, see Core::Flags
+            uint32_t ThrowInfo = throwInfoOf(Exception);
+
+            if (ThrowInfo == 0 || (Exception->ExceptionFlags & busy))
+            {
+                return false;
+            }
+
+            uint64_t Object = (uint64_t)Exception->ExceptionInformation[1];
+
+            if (cache.Exception != Exception || cache.Object != Object || cache.ThrowInfo != ThrowInfo)
+            {
+                cache.Exception = Exception;
+                cache.Object = Object;
+                cache.ThrowInfo = ThrowInfo;
+                cache.readable = readThrowInfo(memory, ThrowInfo, cache.throwTypes);
+            }
+
+            return cache.readable && passes(memory, cache.throwTypes, Handler, state, FrameHandler);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "cxx_eh.h"
+#include "cxx_fast_path.h"
+#include "module_tracking.h"
+
+//Every function with try or objects to destroy has its frame handler jmp here, linked statically with /MT
+EXTERN_C EXCEPTION_DISPOSITION __cdecl __CxxFrameHandler3(PEXCEPTION_RECORD, PVOID, PCONTEXT, PVOID);
+
+namespace SEH
+{
+    namespace Cxx_Fast_Path
+    {
+        //EHRegistrationNode, the registration a C++ frame pushes
+        struct Registration
+        {
+            EXCEPTION_REGISTRATION_RECORD Node;
+            int state;
+        };
+
+        /*
+            The handler thunk, FuncInfo, ThrowInfo and type descriptors are all found through
+            pointers a damaged or foreign frame can put anywhere, so every read has to stay
+            inside an image Module_Tracking has indexed. Anything outside isn't skipped.
+        */
+        typedef Throw_Sites::ImageMemory<Module_Tracking::Images> Memory;
+
+        bool skip(const EXCEPTION_RECORD* Exception, const EXCEPTION_REGISTRATION_RECORD* Frame)
+        {
+            //Where the frame handler thunks of /MD modules end up as well, through the import thunk
+            static const DWORD FrameHandler = Throw_Sites::followThunks(Memory(), (DWORD)&__CxxFrameHandler3);
+            static thread_local Cxx_EH::ThrowCache cache = {};
+
+            if (Exception->ExceptionCode != Cxx_EH::ExceptionCode)
+            {
+                return false;
+            }
+
+            const Registration* Node = reinterpret_cast<const Registration*>(Frame);
+            return Cxx_EH::canSkip(Memory(), cache, Exception, (DWORD)Frame->Handler, Node->state, FrameHandler);
+        }
+    }
+}
\ No newline at end of file
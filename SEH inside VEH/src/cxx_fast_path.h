@@ -0,0 +1,32 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace SEH
+{
+    namespace Cxx_Fast_Path
+    {
+        /*
+            True if Frame belongs to a function compiled against the CRT the library is
+            linked with and its EH tables say __CxxFrameHandler3 would only return
+            ExceptionContinueSearch for this C++ throw, see cxx_eh.h.
+        */
+        bool skip(const EXCEPTION_RECORD* Exception, const EXCEPTION_REGISTRATION_RECORD* Frame);
+    }
+}
\ No newline at end of file
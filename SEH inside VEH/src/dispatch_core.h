@@ -0,0 +1,581 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "trace.h"
+#include "statistics.h"
+#include "dispatch_pipeline.h"
+#include "resolution_memo.h"
+
+/*
+    The chain walking state machine behind DispatchException and Unwind.
+
+    Everything that touches the real thread (fs:[0], the stack limits, NtContinue,
+    NtRaiseException, ExecuteHandler) is reached through a platform policy so this
+    header doesn't need any Windows headers. platform_win32.h is the policy the
+    library itself uses, platform_simulated.h keeps the registration chain and
+    the stack limits in a simulated TEB so the same code can run anywhere.
+
+    A platform policy has to provide:
+
+        typedef ... Record;         //Has ExceptionCode, ExceptionFlags, ExceptionRecord, ExceptionAddress
+        typedef ... Context;
+        typedef ... Registration;   //Has Next and Handler, like EXCEPTION_REGISTRATION_RECORD
+        typedef ... Address;        //Integer type the size of a pointer
+        typedef ... Statistics;     //Statistics::Recorder<Clock, Publisher> or Statistics::Disabled, see statistics.h
+        typedef ... Tracer;         //Trace::Recorder<Clock> or Trace::Disabled, see trace.h
+
+        static const Address alignmentMask;
+        static const bool checkChainOrder;          //Every frame has to be older (higher on the stack) than the one before it
+        static const unsigned int maxChainDepth;    //Most frames one dispatch or unwind walks, 0 for no limit
+
+        static Registration* getRegistrationHead();
+        static void popRegistrationHead();
+        static void getStackLimits(Address& stackLow, Address& stackHigh);
+        static Address getInstructionPointer(const Context& Context);
+
+        template <bool unwind>
+        static Disposition executeHandler(Record*, Registration*, Context*, Registration*& DispatcherContext, Handler);
+
+        //False if the frame's handler may not be called (RtlIsValidHandler), the dispatch stops there as if the stack were invalid
+        static bool isHandlerAllowed(const Registration* Frame);
+
+        //True if the frame's handler is known to return ContinueSearch for the exception without side effects, it isn't called then
+        static bool skipHandler(const Record* Exception, const Registration* Frame);
+
+        //What executeHandler calls for the frame, Frame->Handler unless the platform does that kind of frame itself
+        static Handler frameHandler(const Registration* Frame);
+
+        static const bool resolutionMemo;                       //Remember which handlers repeated exceptions can skip, see resolution_memo.h
+        static bool isMemoSafe(const Registration* Frame);      //The frame's handler decides by the memo's key alone and declines without side effects
+        static uint64_t memoGeneration();                       //Changes whenever a remembered path may no longer hold
+
+        static void continueContext(Context* Context, Registration* TargetFrame); //NtContinue, resuming the function that registered TargetFrame
+        static void raiseException(Record* Exception);                 //RtlRaiseException
+        static void raiseUnhandled(Record* Exception, Context* Context);//NtRaiseException with FirstChance FALSE
+
+    The three last functions never return on Windows. Other platforms are allowed to
+    return from them, in which case the core returns right after as well.
+*/
+
+namespace SEH
+{
+    namespace Core
+    {
+        //Same values as winnt.h, they are macros there so they get their own names here
+        namespace Flags
+        {
+            enum : uint32_t
+            {
+                NonContinuable = 0x1,
+                Unwinding = 0x2,
+                ExitUnwind = 0x4,
+                StackInvalid = 0x8,
+                NestedCall = 0x10
+            };
+        }
+
+        //Same values as ntstatus.h
+        namespace Status
+        {
+            enum : uint32_t
+            {
+                NonContinuableException = 0xC0000025,
+                InvalidDisposition = 0xC0000026,
+                Unwind = 0xC0000027,
+                BadStack = 0xC0000028,
+                InvalidUnwindTarget = 0xC0000029,
+
+                //Not from ntstatus.h, the library's own like the ones in bound_check.cpp
+                ChainCorrupt = 0xE000002A,  //A frame doesn't lead to an older one, the chain loops or was overwritten
+                ChainTooDeep = 0xE000002B   //More frames than the platform's maxChainDepth
+            };
+        }
+
+        //Same values as EXCEPTION_DISPOSITION
+        enum Disposition
+        {
+            ContinueExecution,
+            ContinueSearch,
+            NestedException,
+            CollidedUnwind
+        };
+
+        //Same values as EXCEPTION_CONTINUE_EXECUTION and EXCEPTION_CONTINUE_SEARCH
+        enum : long
+        {
+            ContinueExecutionFilter = -1,
+            ContinueSearchFilter = 0
+        };
+
+        //EXCEPTION_CHAIN_END
+        template <class Registration>
+        inline Registration* chainEnd()
+        {
+            return reinterpret_cast<Registration*>(static_cast<intptr_t>(-1));
+        }
+
+        //Frame inside stack limits and aligned on stack
+        template <class Platform>
+        inline bool isRegistrationValid(const typename Platform::Registration* Registration, typename Platform::Address stackLow, typename Platform::Address stackHigh)
+        {
+            typedef typename Platform::Address Address;
+
+            return !((Address)Registration < stackLow || ((Address)Registration + sizeof(typename Platform::Registration)) > stackHigh || ((Address)Registration & Platform::alignmentMask) != 0);
+        }
+
+        /*
+            A sane chain only leads to older frames, which are higher on the stack. One that
+            doesn't has been overwritten and may well loop back on itself, and following it
+            would never end. With the order checked a walk can't take more frames than fit
+            on the stack, maxChainDepth bounds it further. Previous is the frame walked
+            before (0 for the first) and Depth the frames walked so far, returns the code
+            to fail with or 0.
+        */
+        template <class Platform>
+        inline uint32_t checkChain(typename Platform::Address Frame, typename Platform::Address& Previous, unsigned int& Depth)
+        {
+            if (Platform::checkChainOrder && Frame <= Previous)
+            {
+                return Status::ChainCorrupt;
+            }
+
+            if (Platform::maxChainDepth != 0 && ++Depth > Platform::maxChainDepth)
+            {
+                return Status::ChainTooDeep;
+            }
+
+            Previous = Frame;
+            return 0;
+        }
+
+        /*
+            What the running DispatchException already knows about the chain, for the Unwind
+            its handlers call (that's how C++ catch blocks and __except get control): the
+            stack limits it read, so Unwind doesn't read them again. Head is NULL when no
+            dispatch on this thread is running handlers.
+
+            Frames are still checked against the limits one by one. A handler that returned
+            ContinueSearch may have changed a Next the dispatch already walked, so having
+            been walked says nothing about the frame that is there now. A snapshot left
+            behind by a dispatch that never returned (RtlRaiseException) only hands out the
+            limits of the stack the thread is still on.
+        */
+        template <class Platform>
+        struct ChainSnapshot
+        {
+            typename Platform::Registration* Head;
+            typename Platform::Address stackLow;
+            typename Platform::Address stackHigh;
+        };
+
+        template <class Platform>
+        inline ChainSnapshot<Platform>& chainSnapshot()
+        {
+            thread_local ChainSnapshot<Platform> Snapshot = {};
+            return Snapshot;
+        }
+
+        //Puts back the snapshot of the dispatch this one is nested in when it returns
+        template <class Platform>
+        struct SnapshotScope
+        {
+            ChainSnapshot<Platform>& Snapshot;
+            ChainSnapshot<Platform> Outer;
+
+            ~SnapshotScope()
+            {
+                Snapshot = Outer;
+            }
+        };
+
+        /*
+            Iterate through SEH handlers
+
+            Checks is a Pipeline::Stages<...> of filters that decide whether the exception is
+            ours to dispatch at all, see dispatch_pipeline.h.
+        */
+        template <class Platform, class Checks = Pipeline::List<>>
+        long DispatchException(typename Platform::Record* Exception, typename Platform::Context* Context)
+        {
+            typedef typename Platform::Address Address;
+            typedef typename Platform::Registration Registration;
+            typedef typename Platform::Record Record;
+
+            if constexpr (!Checks::empty)
+            {
+                if (!Checks::template run<Platform>(Exception, Context))
+                {
+                    return ContinueSearchFilter;
+                }
+            }
+
+            typedef typename Platform::Tracer Tracer;
+            typename Platform::Statistics::Dispatch Statistics(Exception->ExceptionCode);
+
+            Tracer::dispatchBegin(Exception->ExceptionCode, (const void*)Exception->ExceptionAddress, Exception->ExceptionFlags);
+
+            Registration* DispatcherContext = NULL;
+            Registration* NestedFrame = NULL;
+
+            //Stack limits
+            Address stackLow;
+            Address stackHigh;
+            Platform::getStackLimits(stackLow, stackHigh);
+
+            ChainSnapshot<Platform>& Snapshot = chainSnapshot<Platform>();
+            SnapshotScope<Platform> Scope = { Snapshot, Snapshot };
+            Snapshot = { Platform::getRegistrationHead(), stackLow, stackHigh };
+
+            Address Previous = 0;
+            unsigned int Depth = 0;
+
+            Resolution_Memo::Walk<Platform> Memo(Exception, Snapshot.Head);
+
+            for (Registration* Frame = Snapshot.Head; Frame != chainEnd<Registration>(); Frame = Frame->Next)
+            {
+                if (!isRegistrationValid<Platform>(Frame, stackLow, stackHigh) || !Platform::isHandlerAllowed(Frame))
+                {
+                    /*
+                        Frame outside of stack limits, unaligned on stack or its handler isn't allowed
+
+                        0x1 in binary is  01
+                        0x2 in binary is  10
+                        0x3 in binary is  11
+                        0x4 in binary is 100
+
+                        You can see how the bitwise AND is used to identify a 4 byte alignment.
+
+                        I think a flag is used instead of a new exception here because the exception can't be
+                        handled due to the bad frame. This way the exception at the end will appear as an unhandled
+                        exception. Personally, I think a new exception would be less ambiguous. A new exception could
+                        simply be passed to NtRaiseException with FirstChance/HandleException to FALSE.
+                    */
+
+                    Exception->ExceptionFlags |= Flags::StackInvalid;
+                    Statistics.stackInvalid();
+                    Tracer::stackInvalid(Frame);
+                    break; //Can't raise a new exception otherwise we'd end up in an infinite loop
+                }
+
+                if (uint32_t Code = checkChain<Platform>((Address)Frame, Previous, Depth))
+                {
+                    /*
+                        Dispatching a new exception would walk the same chain, so it goes straight
+                        to second chance: a crash with the cause in the record beats a hung thread.
+                    */
+                    Record NewException = {};
+                    NewException.ExceptionCode = Code;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = Exception;
+                    NewException.ExceptionAddress = Exception->ExceptionAddress;
+
+                    Statistics.stackInvalid();
+                    Statistics.finish();
+                    Tracer::raise(false, Code);
+                    Platform::raiseUnhandled(&NewException, Context);
+                    return ContinueSearchFilter;
+                }
+
+                Statistics.walk(Frame);
+                Disposition Disposition = ContinueSearch;
+
+                //The memo or the platform may know the handler would only say ContinueSearch
+                if (!Memo.skip(Frame) && !Platform::skipHandler(Exception, Frame))
+                {
+                    Tracer::handlerCall(false, Frame, (const void*)Frame->Handler);
+                    Disposition = Platform::template executeHandler<false>(Exception, Frame, Context, DispatcherContext, Platform::frameHandler(Frame));
+                    Statistics.handler(Disposition);
+                    Tracer::handlerReturn(false, Frame, Disposition);
+                }
+
+                Memo.record(Frame, Disposition);
+
+                if (Frame == NestedFrame)
+                {
+                    /*
+                        Currently in the throwing frame. We passed EXCEPTION_NESTED_CALL to
+                        it so now the flag can be removed and NestedFrame reset.
+                    */
+                    Exception->ExceptionFlags &= ~Flags::NestedCall;
+                    NestedFrame = NULL;
+                }
+
+                switch (Disposition)
+                {
+                case ContinueExecution:
+
+                    if (Exception->ExceptionFlags & Flags::NonContinuable)
+                    {
+                        Record NewException = {};
+                        NewException.ExceptionCode = Status::NonContinuableException;
+                        NewException.ExceptionFlags = Flags::NonContinuable;
+                        NewException.ExceptionRecord = Exception;
+
+                        Statistics.finish();
+                        Tracer::raise(false, NewException.ExceptionCode);
+                        Platform::raiseException(&NewException);
+                        return ContinueSearchFilter;
+                    }
+
+                    Statistics.finish();
+                    Tracer::dispatchEnd(ContinueExecutionFilter);
+                    return ContinueExecutionFilter;
+
+                case ContinueSearch:
+
+                    if (Exception->ExceptionFlags & Flags::StackInvalid)
+                    {
+                        goto error;
+                    }
+
+                    break;
+
+                case NestedException:
+                    //Assign EXCEPTION_NESTED_CALL to flags for all upcoming frames
+                    Exception->ExceptionFlags |= Flags::NestedCall;
+
+                    /*
+                        Is DispatcherContext (the EstablisherFrame of the nested exception) > NestedFrame?
+
+                        NOTE: EstablisherFrame is a pointer to a EXCEPTION_REGISTRATION_RECORD
+
+                        This identifies the oldest throwing frame; greater value means older in stack.
+                        Getting the oldest throwing frame allows EXCEPTION_NESTED_CALL to be enabled
+                        up to the last throwing frame.
+
+                        REMEMBER: The Nested Exception Handlers aren't removed off the SEH list
+                        therefore it is necessary to find the oldest throwing frame. Otherwise,
+                        if a newer frame throws and then an old one throws later, the new frame's
+                        nested handler would override the old frame's nested handler. Don't forget
+                        the nested handlers get put at the top of the list. Overall, this requires
+                        the frames to be on the stack in order for addresses to correspond to age.
+                        There is a visual attached in the "SEH inside VEH" project folder.
+                    */
+                    if ((Address)DispatcherContext > (Address)NestedFrame)
+                    {
+                        //Store the frame that threw to identify it later
+                        NestedFrame = DispatcherContext;
+                    }
+
+                    break;
+
+                default:
+                    Record NewException = {};
+                    NewException.ExceptionCode = Status::InvalidDisposition;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = Exception;
+
+                    Statistics.finish();
+                    Tracer::raise(false, NewException.ExceptionCode);
+                    Platform::raiseException(&NewException);
+                    return ContinueSearchFilter;
+                }
+            }
+
+        error:
+            //No appropriate handler found or bad conditions encountered
+            Statistics.finish();
+            Tracer::unhandled(false, Exception->ExceptionCode);
+            Platform::raiseUnhandled(Exception, Context);
+            return ContinueSearchFilter;
+        }
+
+        /*
+            Unwinds every frame up to but not including TargetFrame. The caller is
+            responsible for capturing Context so that continuing it returns from the
+            caller, see SEH::Unwind.
+        */
+        template <class Platform>
+        void Unwind(typename Platform::Registration* TargetFrame, typename Platform::Record* pException, typename Platform::Context* Context)
+        {
+            typedef typename Platform::Address Address;
+            typedef typename Platform::Registration Registration;
+            typedef typename Platform::Record Record;
+
+            typedef typename Platform::Tracer Tracer;
+            typename Platform::Statistics::Unwind Statistics;
+
+            Record Exception = {};
+            Registration* DispatcherContext = NULL;
+
+            if (pException == NULL)
+            {
+                Exception.ExceptionCode = Status::Unwind;
+                Exception.ExceptionAddress = (decltype(Exception.ExceptionAddress))Platform::getInstructionPointer(*Context);
+                pException = &Exception;
+            }
+
+            if (TargetFrame == NULL)
+            {
+                //No target set, therefore exit after unwinding.
+                pException->ExceptionFlags |= Flags::Unwinding | Flags::ExitUnwind;
+            }
+            else
+                pException->ExceptionFlags |= Flags::Unwinding;
+
+            Tracer::unwindBegin(pException->ExceptionCode, TargetFrame, pException->ExceptionFlags);
+
+            //Called from a handler of a running dispatch, the stack limits it read are still good, see ChainSnapshot
+            ChainSnapshot<Platform>& Snapshot = chainSnapshot<Platform>();
+
+            Address Previous = 0;
+            unsigned int Depth = 0;
+
+            Address stackLow;
+            Address stackHigh;
+
+            if (Snapshot.Head != NULL)
+            {
+                stackLow = Snapshot.stackLow;
+                stackHigh = Snapshot.stackHigh;
+            }
+            else
+                Platform::getStackLimits(stackLow, stackHigh);
+
+            for (Registration* Frame = Platform::getRegistrationHead(); Frame != chainEnd<Registration>(); Frame = Frame->Next)
+            {
+                if (Frame == TargetFrame)
+                {
+                    //Unwind up to but not including the target frame
+                    Snapshot.Head = NULL; //The dispatch is over once its handler gets control back
+                    Statistics.finish();
+                    Platform::Statistics::Dispatch::unwound(TargetFrame); //And never finishes itself
+                    Tracer::unwindEnd(TargetFrame);
+                    Platform::continueContext(Context, TargetFrame);
+
+                    return; //Unreachable on Windows
+                }
+
+                if (TargetFrame != NULL && (Address)TargetFrame < (Address)Frame)
+                {
+                    /*
+                        Target frame is less than Registration indicating it won't show up. This
+                        is because Registration should only contain frames located in ascending
+                        order on the stack (frames point to older frames).
+
+                        REMEMBER: Lower values indicate newer on stack
+                    */
+
+                    Record NewException = {};
+                    NewException.ExceptionCode = Status::InvalidUnwindTarget;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = pException;
+
+                    Statistics.finish();
+                    Tracer::raise(true, NewException.ExceptionCode);
+                    Platform::raiseException(&NewException);
+                    return;
+                }
+
+                if (!isRegistrationValid<Platform>(Frame, stackLow, stackHigh))
+                {
+                    //Frame outside of stack limits or unaligned on stack
+
+                    Record NewException = {};
+                    NewException.ExceptionCode = Status::BadStack;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = pException;
+
+                    Statistics.finish();
+                    Tracer::raise(true, NewException.ExceptionCode);
+                    Platform::raiseException(&NewException);
+                    return;
+                }
+
+                if (uint32_t Code = checkChain<Platform>((Address)Frame, Previous, Depth))
+                {
+                    //Same as in DispatchException, a dispatch of it would walk the same chain
+                    Record NewException = {};
+                    NewException.ExceptionCode = Code;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = pException;
+                    NewException.ExceptionAddress = pException->ExceptionAddress;
+
+                    Statistics.finish();
+                    Tracer::raise(true, Code);
+                    Platform::raiseUnhandled(&NewException, Context);
+                    return;
+                }
+
+                Tracer::handlerCall(true, Frame, (const void*)Frame->Handler);
+                Disposition Disposition = Platform::template executeHandler<true>(pException, Frame, Context, DispatcherContext, Platform::frameHandler(Frame));
+                Statistics.handler(Disposition);
+                Tracer::handlerReturn(true, Frame, Disposition);
+
+                switch (Disposition)
+                {
+                case ContinueSearch:
+                    break;
+
+                case CollidedUnwind:
+                    /*
+                        An exception was thrown during an unwind handler. A new call to unwind is
+                        made during the process of handling the exception. Therefore, in the process
+                        of that new unwind we collide here from the NestedExceptionHandler. To pick
+                        up on the old unwind, we assign Registration to the frame of the exception
+                        thrown during the first unwind.
+
+                        This is different from ExceptionNestedException because there are no flags
+                        to be applied to the frames. The unwind should just return to where it was
+                        before to prevent the unwind of frames that are supposed to stay.
+                    */
+                    Frame = DispatcherContext;
+                    Previous = (Address)Frame;
+                    Tracer::collided(Frame);
+                    break;
+
+                default:
+                    Record NewException = {};
+
+                    NewException.ExceptionCode = Status::InvalidDisposition;
+                    NewException.ExceptionFlags = Flags::NonContinuable;
+                    NewException.ExceptionRecord = pException;
+
+                    Statistics.finish();
+                    Tracer::raise(true, NewException.ExceptionCode);
+                    Platform::raiseException(&NewException);
+                    return;
+                }
+
+                Platform::popRegistrationHead();
+                Statistics.popped();
+            }
+
+            if (TargetFrame == chainEnd<Registration>())
+            {
+                //Caller wanted all frames to be unwound
+                Snapshot.Head = NULL;
+                Statistics.finish();
+                Platform::Statistics::Dispatch::unwound(TargetFrame);
+                Tracer::unwindEnd(TargetFrame);
+                Platform::continueContext(Context, TargetFrame);
+
+                return; //Unreachable on Windows
+            }
+
+            //EXCEPTION_EXIT_UNWIND from NULL TargetFrame or nonexistent TargetFrame
+            Statistics.finish();
+            Tracer::unhandled(true, pException->ExceptionCode);
+            Platform::raiseUnhandled(pException, Context);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,137 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <type_traits>
+
+/*
+    The checks that run before DispatchException walks the chain, put together at
+    compile time. A stage looks like this:
+
+        struct SomeCheck
+        {
+            static const bool enabled = true;   //false removes the stage entirely
+            static const unsigned int cost = 2; //Cheaper stages run first
+
+            template <class Platform>
+            static Pipeline::Verdict filter(typename Platform::Record* Exception, typename Platform::Context* Context);
+        };
+
+    Stages<...> drops disabled stages and sorts the rest by cost, keeping the given
+    order between stages of equal cost. The first stage that doesn't return Next
+    decides, if every stage returns Next the exception is dispatched. When nothing is left DispatchException uses
+    `if constexpr` to skip the pipeline, so an empty pipeline is not even a branch;
+    the same way NestedExceptionHandler<bool unwind> has no code for the other mode.
+*/
+
+namespace SEH
+{
+    namespace Pipeline
+    {
+        enum Verdict
+        {
+            Skip,    //Not ours, return EXCEPTION_CONTINUE_SEARCH without walking the chain
+            Next,    //No opinion, ask the next stage
+            Dispatch //Ours, walk the chain without asking the remaining stages
+        };
+
+        template <class... Stages>
+        struct List
+        {
+            static const bool empty = (sizeof...(Stages) == 0);
+
+            //Returns true if the exception should be dispatched
+            template <class Platform>
+            static bool run(typename Platform::Record*, typename Platform::Context*)
+            {
+                return true;
+            }
+        };
+
+        template <class Stage, class... Rest>
+        struct List<Stage, Rest...>
+        {
+            static const bool empty = false;
+
+            template <class Platform>
+            static bool run(typename Platform::Record* Exception, typename Platform::Context* Context)
+            {
+                Verdict verdict = Stage::template filter<Platform>(Exception, Context);
+
+                if (verdict != Next)
+                {
+                    return verdict == Dispatch;
+                }
+
+                return List<Rest...>::template run<Platform>(Exception, Context);
+            }
+        };
+
+        template <class Stage, class Tail>
+        struct Prepend;
+
+        template <class Stage, class... Stages>
+        struct Prepend<Stage, List<Stages...>>
+        {
+            typedef List<Stage, Stages...> type;
+        };
+
+        //Inserts Stage before the first stage that costs the same or more
+        template <class Stage, class Sorted>
+        struct Insert;
+
+        template <class Stage>
+        struct Insert<Stage, List<>>
+        {
+            typedef List<Stage> type;
+        };
+
+        template <class Stage, class Head, class... Rest>
+        struct Insert<Stage, List<Head, Rest...>>
+        {
+            typedef typename std::conditional<(Stage::cost <= Head::cost),
+                List<Stage, Head, Rest...>,
+                typename Prepend<Head, typename Insert<Stage, List<Rest...>>::type>::type>::type type;
+        };
+
+        //Insertion sort of the enabled stages, done by the compiler
+        template <class... Stages>
+        struct Sort;
+
+        template <>
+        struct Sort<>
+        {
+            typedef List<> type;
+        };
+
+        template <class Stage, class... Rest>
+        struct Sort<Stage, Rest...>
+        {
+            typedef typename Sort<Rest...>::type sorted;
+
+            //Stage came before everything in sorted, so it goes in front of the stages that cost the same
+            typedef typename std::conditional<Stage::enabled,
+                typename Insert<Stage, sorted>::type,
+                sorted>::type type;
+        };
+
+        //The pipeline DispatchException runs
+        template <class... Checks>
+        using Stages = typename Sort<Checks...>::type;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,227 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "thread_registry.h"
+
+/*
+    Lets DisableSEH wait for the dispatches already in flight on other threads before
+    it tears anything down, without a lock on the dispatch path.
+
+    Every thread counts the dispatches it is in (they nest when a handler raises).
+    Entering stores the count and then reads whether the domain is open; closing
+    stores that it isn't and then reads every thread's count. Either the closer sees
+    the thread's store or the thread sees the domain closed, as long as each side
+    orders its store before its load. Barrier decides how: a full fence on both
+    sides works anywhere, an asymmetric barrier (FlushProcessWriteBuffers,
+    membarrier) lets the dispatch side get away with a compiler barrier and makes
+    the rare close pay for it instead.
+
+    Next to the count, the thread keeps where on its stack each of its dispatches
+    is. A dispatch that is never returned from ends one of two ways:
+
+    - An unwind continues a context (a C++ catch or __except resuming). abandon()
+      with the frame it unwound to ends the dispatches under that frame, a dispatch
+      further up whose handler registered the frame goes on.
+    - Something else took the thread out of it (the real RtlUnwind, a longjmp). The
+      next enter or leave on the thread is further up the stack than the dispatch
+      was, which ends it then. Until the thread dispatches again the dispatch looks
+      in flight, so drain() only waits so long.
+*/
+
+namespace SEH
+{
+    namespace Epoch
+    {
+        //A full fence on both sides
+        struct SymmetricBarrier
+        {
+            static void light()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+
+            static void heavy()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        };
+
+        //Everything is static, there is one domain per Barrier
+        template <class Barrier>
+        class Domain
+        {
+        public:
+            /*
+                Position is where the dispatch is on the stack, any address in its frame.
+                Returns false if the domain is closed, the dispatch must not go on and not
+                call leave.
+            */
+            static bool enter(uintptr_t Position)
+            {
+                Block& block = Registry::local();
+
+                //Dispatches at or below this one were left without leave or abandon
+                block.popBelow(Position + 1);
+                block.push(Position);
+                Barrier::light();
+
+                if (!state().open.load(std::memory_order_relaxed))
+                {
+                    leave(Position);
+                    return false;
+                }
+
+                return true;
+            }
+
+            //The same Position as enter, also ends anything left on the stack under it
+            static void leave(uintptr_t Position)
+            {
+                //Nothing to do if an unwind abandoned this dispatch and a handler returned into it anyway
+                Registry::local().popBelow(Position + 1);
+            }
+
+            //The thread resumes in the function that registered TargetFrame, ends the dispatches under it
+            static void abandon(uintptr_t TargetFrame)
+            {
+                Registry::local().popBelow(TargetFrame);
+            }
+
+            /*
+                Stops new dispatches. The ones in flight go on, drain waits for them.
+                Closing and opening have to be serialized by the caller.
+            */
+            static void close()
+            {
+                state().open.store(false, std::memory_order_relaxed);
+                Barrier::heavy();
+            }
+
+            /*
+                Waits up to Limit for the dispatches other threads were in when the domain
+                closed. The caller's own dispatches aren't waited for, DisableSEH may be
+                called by a handler. Returns false if some are still in flight, or if the
+                domain was opened again in the meantime.
+            */
+            static bool drain(std::chrono::milliseconds Limit)
+            {
+                const Block* own = &Registry::local();
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + Limit;
+                bool drained = true;
+
+                Registry::forEachInUse([&](const Block& block)
+                {
+                    if (&block == own)
+                    {
+                        return;
+                    }
+
+                    while (drained && block.depth.load(std::memory_order_acquire) != 0)
+                    {
+                        drained = !isOpen() && std::chrono::steady_clock::now() < deadline;
+                        std::this_thread::yield();
+                    }
+                });
+
+                return drained && !isOpen();
+            }
+
+            static void open()
+            {
+                state().open.store(true, std::memory_order_release);
+            }
+
+            static bool isOpen()
+            {
+                return state().open.load(std::memory_order_relaxed);
+            }
+
+            //Dispatches the calling thread is in
+            static uint32_t depth()
+            {
+                return Registry::local().depth.load(std::memory_order_relaxed);
+            }
+
+        private:
+            //Deeper nesting than this shares the deepest position, see push
+            static const uint32_t maxPositions = 16;
+
+            struct Block
+            {
+                std::atomic<uint32_t> depth;
+                uintptr_t positions[maxPositions]; //Only the owning thread reads them
+
+                //A thread that exited in the middle of a dispatch isn't in it anymore
+                void claim()
+                {
+                    depth.store(0, std::memory_order_relaxed);
+                }
+
+                /*
+                    The stack grows down, so a nested dispatch is always below the one it's
+                    nested in. Past maxPositions the newest dispatches are merged into the
+                    deepest slot at the lowest position, which at worst lets an unwind into
+                    one of them end the rest of them early.
+                */
+                void push(uintptr_t Position)
+                {
+                    uint32_t current = depth.load(std::memory_order_relaxed);
+                    positions[(current < maxPositions) ? current : maxPositions - 1] = Position;
+                    depth.store(current + 1, std::memory_order_relaxed);
+                }
+
+                //Ends every dispatch at a position lower than Limit
+                void popBelow(uintptr_t Limit)
+                {
+                    uint32_t current = depth.load(std::memory_order_relaxed);
+                    uint32_t remaining = current;
+
+                    while (remaining != 0 && positions[(remaining <= maxPositions) ? remaining - 1 : maxPositions - 1] < Limit)
+                    {
+                        remaining = (remaining > maxPositions) ? maxPositions - 1 : remaining - 1;
+                    }
+
+                    if (remaining != current)
+                    {
+                        depth.store(remaining, std::memory_order_release);
+                    }
+                }
+            };
+
+            typedef Thread_Registry::Registry<Block> Registry;
+
+            struct State
+            {
+                std::atomic<bool> open;
+            };
+
+            //Starts out open so dispatching works without anyone calling open first
+            static State& state()
+            {
+                static State domain = { { true } };
+                return domain;
+            }
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,227 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "SEH.h"
+#include "scope_table.h"
+#include "except_handler.h"
+#include "loaded_images.h"
+#include "module_tracking.h"
+
+#if SCOPE_TABLE_DISPATCH
+
+//What every _except_handler4 stub calls, linked statically with /MT
+EXTERN_C EXCEPTION_DISPOSITION __cdecl _except_handler4_common(PUINT_PTR CookiePointer, void (__fastcall* CookieCheckFunction)(UINT_PTR), PEXCEPTION_RECORD ExceptionRecord, PEXCEPTION_REGISTRATION_RECORD EstablisherFrame, PCONTEXT ContextRecord, PVOID DispatcherContext);
+
+namespace SEH
+{
+    namespace Except_Handler
+    {
+        //The library's own and the one in vcruntime140.dll, the same one with /MD
+        static DWORD Commons[2] = {};
+
+        void resolveCommon()
+        {
+            HMODULE VCRuntime = GetModuleHandleW(L"vcruntime140.dll");
+
+            Commons[0] = Throw_Sites::followThunks(Throw_Sites::ImageMemory<Loaded_Images::Loader>(), (DWORD)&::_except_handler4_common);
+            Commons[1] = (VCRuntime != NULL) ? (DWORD)GetProcAddress(VCRuntime, "_except_handler4_common") : 0;
+
+            if (Commons[1] == Commons[0])
+            {
+                Commons[1] = 0;
+            }
+        }
+
+        /*
+            Address of the __security_cookie the stub Handler passes, 0 if it isn't an EH4 stub.
+            Handler can point anywhere, so the stub is only decoded inside an indexed image.
+        */
+        static DWORD cookieOf(PEXCEPTION_ROUTINE Handler)
+        {
+            Throw_Sites::ImageMemory<Module_Tracking::Images> memory;
+
+            for (DWORD Common : Commons)
+            {
+                DWORD Cookie = (Common != 0) ? Scope_Table::cookieOf(memory, (DWORD)Handler, Common) : 0;
+
+                if (Cookie != 0)
+                {
+                    return Cookie;
+                }
+            }
+
+            return 0;
+        }
+
+        /*
+            _EH4_CallFilterFunc: filters and __finally funclets are part of the function that
+            registered the frame and address its locals through ebp, but run on this stack
+        */
+        static __declspec(naked) int __fastcall callFunclet(DWORD Funclet, DWORD FramePointer)
+        {
+            __asm
+            {
+                push ebp
+                push esi
+                push edi
+                push ebx
+
+                mov ebp, edx
+                xor eax, eax
+                xor ebx, ebx
+                xor edx, edx
+                xor esi, esi
+                xor edi, edi
+                call ecx
+
+                pop ebx
+                pop edi
+                pop esi
+                pop ebp
+                ret
+            }
+        }
+
+        //_EH4_TransferToHandler: the __except block restores esp from the frame ([ebp-18h]) itself
+        static __declspec(naked) void __fastcall transferToHandler(DWORD Handler, DWORD FramePointer)
+        {
+            __asm
+            {
+                mov ebp, edx
+                mov eax, ecx
+                xor ebx, ebx
+                xor ecx, ecx
+                xor edx, edx
+                xor esi, esi
+                xor edi, edi
+                jmp eax
+            }
+        }
+
+        struct Runtime
+        {
+            int filter(uint32_t Filter, uint32_t FramePointer)
+            {
+                return callFunclet(Filter, FramePointer);
+            }
+
+            void finally(uint32_t Handler, uint32_t FramePointer)
+            {
+                callFunclet(Handler, FramePointer);
+            }
+
+            void setTryLevel(uint32_t Registration, uint32_t TryLevel)
+            {
+                *reinterpret_cast<DWORD*>(Registration + Scope_Table::tryLevelOffset) = TryLevel;
+            }
+        };
+
+        /*
+            _except_handler4 without RtlUnwind: the global unwind goes straight to SEH::Unwind,
+            so __try frames work without RtlUnwind being patched in their module. Anything
+            this doesn't vouch for goes to the frame's own handler, including bad cookies,
+            which it fails fast on.
+        */
+        static EXCEPTION_DISPOSITION NTAPI _Function_class_(EXCEPTION_ROUTINE) ExceptHandler4(EXCEPTION_RECORD* ExceptionRecord, PVOID EstablisherFrame, CONTEXT* ContextRecord, PVOID DispatcherContext)
+        {
+            PEXCEPTION_REGISTRATION_RECORD Registration = static_cast<PEXCEPTION_REGISTRATION_RECORD>(EstablisherFrame);
+            bool unwinding = (ExceptionRecord->ExceptionFlags & (EXCEPTION_UNWINDING | EXCEPTION_EXIT_UNWIND)) != 0;
+
+            Throw_Sites::ProcessMemory memory;
+            Scope_Table::Frame frame;
+            Runtime runtime;
+
+            /*
+                Decoded again rather than kept from frameHandler: a filter can raise, and the
+                nested dispatch decodes other frames before this one reads anything.
+            */
+            DWORD CookieAddress = cookieOf(Registration->Handler);
+            DWORD Cookie = (CookieAddress != 0) ? *reinterpret_cast<DWORD*>(CookieAddress) : 0;
+
+            /*
+                A C++ exception caught by __except has its object destroyed by the CRT
+                (__DestructExceptionObject), which can't be reached from here.
+            */
+            bool cxx = ExceptionRecord->ExceptionCode == 0xE06D7363;
+
+            if (CookieAddress == 0 || (cxx && !unwinding)
+                || !Scope_Table::readFrame(memory, Scope_Table::EH4, (DWORD)Registration, Cookie, frame)
+                || !Scope_Table::cookiesValid(memory, frame, Cookie))
+            {
+                return Registration->Handler(ExceptionRecord, EstablisherFrame, ContextRecord, DispatcherContext);
+            }
+
+            if (unwinding)
+            {
+                //Leaving the function, every __finally still pending runs
+                if (!Scope_Table::localUnwind(memory, frame, Scope_Table::topmost(Scope_Table::EH4), runtime))
+                {
+                    return Registration->Handler(ExceptionRecord, EstablisherFrame, ContextRecord, DispatcherContext);
+                }
+
+                return ExceptionContinueSearch;
+            }
+
+            //The filters read GetExceptionInformation() from the frame
+            EXCEPTION_POINTERS ExceptionPointers = { ExceptionRecord, ContextRecord };
+            *reinterpret_cast<EXCEPTION_POINTERS**>((DWORD)Registration - Scope_Table::exceptionPointersOffset) = &ExceptionPointers;
+
+            DWORD TargetLevel = 0;
+            Scope_Table::Scope scope;
+
+            switch (Scope_Table::search(memory, frame, runtime, TargetLevel))
+            {
+            case Scope_Table::ContinueSearch:
+                return ExceptionContinueSearch;
+
+            case Scope_Table::ContinueExecution:
+                return ExceptionContinueExecution;
+
+            case Scope_Table::ExecuteHandler:
+                Scope_Table::readScope(memory, frame, TargetLevel, scope);
+
+                //Newer frames first, then the __finally blocks inside the __try that takes the exception
+                SEH::Unwind(EstablisherFrame, NULL, ExceptionRecord, NULL);
+                Scope_Table::localUnwind(memory, frame, TargetLevel, runtime);
+
+                frame.TryLevel = scope.EnclosingLevel;
+                runtime.setTryLevel(frame.Registration, frame.TryLevel);
+
+                if (!Scope_Table::cookiesValid(memory, frame, Cookie))
+                {
+                    __fastfail(FAST_FAIL_STACK_COOKIE_CHECK_FAILURE); //What __security_check_cookie would end in
+                }
+
+                transferToHandler(scope.Handler, frame.FramePointer);
+                return ExceptionContinueSearch; //Unreachable
+
+            default:
+                //A scope table that doesn't nest, the handler would walk it forever
+                return Registration->Handler(ExceptionRecord, EstablisherFrame, ContextRecord, DispatcherContext);
+            }
+        }
+
+        PEXCEPTION_ROUTINE frameHandler(const EXCEPTION_REGISTRATION_RECORD* Frame)
+        {
+            return (cookieOf(Frame->Handler) != 0) ? &ExceptHandler4 : Frame->Handler;
+        }
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,35 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace SEH
+{
+    namespace Except_Handler
+    {
+        //Finds the _except_handler4_common the EH4 stubs call, the library's own and vcruntime's
+        void resolveCommon();
+
+        /*
+            The handler DispatchException and Unwind call for Frame: one that decodes the
+            scope table itself when Frame is a __try frame of _except_handler4, see
+            scope_table.h, otherwise Frame's own handler.
+        */
+        PEXCEPTION_ROUTINE frameHandler(const EXCEPTION_REGISTRATION_RECORD* Frame);
+    }
+}
\ No newline at end of file
@@ -18,13 +18,15 @@
 
 #include "stdafx.h"
 #include "handler.h"
+#include "platform_win32.h"
+#include "module_tracking.h"
 #include "exception_registration.h"
 
 namespace SEH
 {
     namespace Handler
     {
-    #if EXCEPTION_CHECKING == VALID_TOP_HANDLER_CHECK
+    #if (EXCEPTION_CHECKING & VALID_TOP_HANDLER_CHECK)
         /*
             This is not an emulation of RtlIsValidHandler. There is no DEP enforcement
             here. It can only accurately identify when a valid SafeSEH handler can be
@@ -38,25 +40,18 @@ namespace SEH
             Pseudocode of RtlIsValidHandler
             https://repo.zenk-security.com/Techniques%20d.attaques%20%20.%20%20Failles/EN-Bypassing%20SEHOP.pdf#page=4
         */
-        bool isTopHandlerValid()
+        static bool isHandlerValid(PEXCEPTION_ROUTINE Handler)
         {
-            PEXCEPTION_ROUTINE Handler = Registration::getRegistrationHead()->Handler;
-
-            HMODULE module = NULL;
-            GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)Handler, &module);
-
-            if (module == NULL)
+            /*
+                The module of the handler and its SafeSEH table come from the index kept by
+                Module_Tracking, so there is no GetModuleHandleExW (loader lock) or PE parsing here.
+            */
+            switch (Module_Tracking::index().lookup((DWORD)Handler))
             {
-                return false; //Not in a registered module, our custom SEH allows handlers from anywhere
-            }
-
-            //Traverse PE structure to find the SafeSEH table
-            IMAGE_DOS_HEADER* DosHeader = (IMAGE_DOS_HEADER*)module;
-            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)DosHeader + DosHeader->e_lfanew);
-            IMAGE_DATA_DIRECTORY* ImageDirectory_LoadConfig = &NTHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG];
-            IMAGE_LOAD_CONFIG_DIRECTORY* LoadConfigDirectory = (IMAGE_LOAD_CONFIG_DIRECTORY*)((DWORD)DosHeader + ImageDirectory_LoadConfig->VirtualAddress);
+            case Safe_SEH::Listed:
+                return true; //Found the handler in the SafeSEH table
 
-            if (NTHeaders->OptionalHeader.DllCharacteristics & IMAGE_DLLCHARACTERISTICS_NO_SEH)
+            case Safe_SEH::NoSEH:
             {
                 EXCEPTION_RECORD Exception = {};
 
@@ -64,53 +59,38 @@ namespace SEH
                 Exception.ExceptionFlags = EXCEPTION_NONCONTINUABLE;
 
                 RtlRaiseException(&Exception); //Why are we attempting SEH on a non-SEH image?
+                return false;
             }
 
-            if (ImageDirectory_LoadConfig->VirtualAddress == 0)
-            {
-                return false; //SafeSEH isn't possible without IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG
+            case Safe_SEH::NotInImage:
+                return false; //Not in a registered module, our custom SEH allows handlers from anywhere
+
+            default:
+                return false; //Handler is not in SafeSEH table or the table doesn't exist for the handler's module, we will dispatch the exception
             }
+        }
 
-            //SafeSEH info
-            DWORD SEHandlerCount = LoadConfigDirectory->SEHandlerCount; //Amount of safe handlers
-            DWORD* SEHandlerTable = (DWORD*)LoadConfigDirectory->SEHandlerTable; //A sorted table of the RVAs of safe handlers
-            DWORD HandlerRVA = (DWORD)Handler - (DWORD)DosHeader; //Get RVA of handler (relative virtual addresses)
+        bool isTopHandlerValid()
+        {
+            PEXCEPTION_ROUTINE Handler = Registration::getRegistrationHead()->Handler;
+            Module_Tracking::VerdictCache& verdicts = Module_Tracking::verdicts();
 
-            if (SEHandlerTable != NULL && SEHandlerCount != 0)
-            {
-                /*
-                    Binary search to find the handler in SafeSEH table
-                */
+            /*
+                The same few handlers (_except_handler4, __CxxFrameHandler3 thunks) tend to be on top
+                for every exception, so their verdicts are memoized until a module loads or unloads.
+            */
+            bool valid;
 
-                DWORD lowerBound = 0;
-                DWORD upperBound = SEHandlerCount - 1;
-
-                while (lowerBound <= upperBound && upperBound != (DWORD)-1)
-                {
-                    DWORD middle = lowerBound + ((upperBound - lowerBound) / 2);
-
-                    if (SEHandlerTable[middle] < HandlerRVA)
-                    {
-                        /*
-                            Won't ever overflow to 0 because if lowerBound ever reaches MAXDWORD,
-                            the loop will end from the condition lowerBound <= upperBound.
-                        */
-                        lowerBound = middle + 1;
-                    }
-                    else if (SEHandlerTable[middle] > HandlerRVA)
-                    {
-                        /*
-                            UpperBound could overflow to MAXDWORD so a check for that is used in
-                            the while conditions.
-                        */
-                        upperBound = middle - 1;
-                    }
-                    else
-                        return true; //Found the handler in the SafeSEH table
-                }
+            if (verdicts.lookup((DWORD)Handler, valid))
+            {
+                return valid;
             }
 
-            return false; //Handler is not in SafeSEH table or the table doesn't exist for the handler's module, we will dispatch the exception
+            uint32_t generation = verdicts.generation();
+            valid = isHandlerValid(Handler);
+            verdicts.insert((DWORD)Handler, valid, generation);
+
+            return valid;
         }
     #endif
 
@@ -135,6 +115,7 @@ namespace SEH
                 */
 
                 DispatcherContext = *reinterpret_cast<PEXCEPTION_REGISTRATION_RECORD*>((DWORD)EstablisherFrame + sizeof(EXCEPTION_REGISTRATION_RECORD));
+                Win32::Platform::Tracer::nested(unwind, DispatcherContext);
                 return disposition;
             }
             else
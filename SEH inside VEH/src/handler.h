@@ -17,6 +17,7 @@
 */
 
 #pragma once
+#include "dispatch_pipeline.h"
 
 namespace SEH
 {
@@ -25,6 +26,25 @@ namespace SEH
         //Check if top handler is a valid SafeSEH handler
         bool isTopHandlerValid();
 
+        //VALID_TOP_HANDLER_CHECK as a DispatchException pipeline stage
+        struct TopHandlerCheck
+        {
+            static const bool enabled = (EXCEPTION_CHECKING & VALID_TOP_HANDLER_CHECK) != 0;
+            static const unsigned int cost = 2; //Usually answered by the verdict cache
+
+            template <class Platform>
+            static Pipeline::Verdict filter(EXCEPTION_RECORD*, CONTEXT*)
+            {
+                /*
+                    Check if the first handler is in the SafeSEH table. If so, let
+                    original SEH deal with this exception.
+
+                    ASSUMPTION: Top handler handles exceptions
+                */
+                return isTopHandlerValid() ? Pipeline::Skip : Pipeline::Next;
+            }
+        };
+
         //Used to catch exceptions inside other SEH handlers
         template <bool unwind, EXCEPTION_DISPOSITION disposition = unwind ? ExceptionCollidedUnwind : ExceptionNestedException>
         EXCEPTION_DISPOSITION NTAPI _Function_class_(EXCEPTION_ROUTINE) NestedExceptionHandler(EXCEPTION_RECORD*, PEXCEPTION_REGISTRATION_RECORD, PCONTEXT, PEXCEPTION_REGISTRATION_RECORD&);
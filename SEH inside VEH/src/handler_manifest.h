@@ -0,0 +1,347 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+    Every exception handler a PE32 image can register, listed offline by
+    Tools/Handler Manifest and stored in the image's ".sehm" section. With it, the
+    runtime knows whether a registration's handler belongs to the image with one hash
+    lookup instead of parsing the image's headers (see handler_scan.h for how the
+    list is made).
+
+    Layout, little endian and every field 32 bits:
+
+        header          magic 'SEHM', version, count, seed, buckets, slots, 2 reserved
+        displacements   one per bucket
+        slots           index of the entry + 1, 0 for an empty slot
+        entries         RVA, kinds, data; sorted by RVA, one per RVA
+
+    The hash is hash-and-displace: a key's bucket comes from hashing it with the seed
+    and its slot from hashing it with its bucket's displacement. The builder picks the
+    displacements so that no two keys share a slot, so a lookup is two hashes and
+    three loads however many entries there are. The entries stay sorted so a
+    manifest can be listed or binary searched as it is.
+*/
+
+namespace SEH
+{
+    namespace Handler_Manifest
+    {
+        const uint32_t Magic = 0x4D484553; //'SEHM'
+        const uint32_t Version = 1;
+        const char SectionName[8] = { '.', 's', 'e', 'h', 'm', 0, 0, 0 };
+
+        //What an RVA is, an entry can be several of these
+        enum : uint32_t
+        {
+            SafeSEH = 0x1,        //In the load config's SEHandlerTable
+            Registered = 0x2,     //Pushed as a handler by a function's prologue
+            CxxHandler = 0x4,     //A C++ frame handler thunk, Data is its FuncInfo
+            ExceptHandler4 = 0x8, //An _except_handler4 stub, Data is the __security_cookie it passes
+            ExceptHandler3 = 0x10,//Registered with EH3 scope tables
+            ScopeTable = 0x20,    //A __try scope table, Data is the handler registered with it
+            FuncInfo = 0x40,      //A C++ FuncInfo, Data is the thunk passing it
+
+            //Kinds that make an RVA a handler a registration may have
+            Handler = SafeSEH | Registered | CxxHandler | ExceptHandler4 | ExceptHandler3
+        };
+
+        struct Entry
+        {
+            uint32_t RVA;
+            uint32_t Kinds;
+            uint32_t Data;
+        };
+
+        const size_t headerSize = 32;
+        const size_t entrySize = 12;
+
+        //murmur3's finalizer, with the seed folded in first
+        inline uint32_t hash(uint32_t key, uint32_t seed)
+        {
+            uint32_t h = key ^ (seed * 0x9E3779B9);
+
+            h ^= h >> 16;
+            h *= 0x85EBCA6B;
+            h ^= h >> 13;
+            h *= 0xC2B2AE35;
+            h ^= h >> 16;
+
+            return h;
+        }
+
+        //Maps a hash onto [0, range) with a multiply instead of a division
+        inline uint32_t reduce(uint32_t h, uint32_t range)
+        {
+            return (uint32_t)(((uint64_t)h * range) >> 32);
+        }
+
+        inline uint32_t read32(const uint8_t* bytes)
+        {
+            uint32_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        inline void write32(uint8_t* bytes, uint32_t value)
+        {
+            memcpy(bytes, &value, sizeof(value));
+        }
+
+        /*
+            Gives every key its own slot, false if some bucket's keys can't all be placed
+            with any displacement tried. Buckets with the most keys are placed first,
+            while most slots are still free.
+        */
+        inline bool place(const std::vector<Entry>& entries, uint32_t seed, std::vector<uint32_t>& displacements, std::vector<uint32_t>& slots)
+        {
+            const uint32_t maxDisplacement = 1 << 16;
+
+            uint32_t buckets = (uint32_t)displacements.size();
+            std::vector<std::vector<uint32_t>> members(buckets);
+            std::vector<uint32_t> order(buckets);
+            std::vector<uint32_t> taken;
+
+            for (uint32_t i = 0; i < (uint32_t)entries.size(); ++i)
+            {
+                members[reduce(hash(entries[i].RVA, seed), buckets)].push_back(i);
+            }
+
+            for (uint32_t i = 0; i < buckets; ++i)
+            {
+                order[i] = i;
+            }
+
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return members[a].size() > members[b].size(); });
+            std::fill(slots.begin(), slots.end(), 0);
+
+            for (uint32_t bucket : order)
+            {
+                if (members[bucket].empty())
+                {
+                    break;
+                }
+
+                uint32_t displacement = 1;
+
+                for (; displacement < maxDisplacement; ++displacement)
+                {
+                    taken.clear();
+
+                    for (uint32_t i : members[bucket])
+                    {
+                        uint32_t slot = reduce(hash(entries[i].RVA, displacement), (uint32_t)slots.size());
+
+                        if (slots[slot] != 0 || std::find(taken.begin(), taken.end(), slot) != taken.end())
+                        {
+                            break;
+                        }
+
+                        taken.push_back(slot);
+                    }
+
+                    if (taken.size() == members[bucket].size())
+                    {
+                        break;
+                    }
+                }
+
+                if (displacement == maxDisplacement)
+                {
+                    return false;
+                }
+
+                displacements[bucket] = displacement;
+
+                for (size_t i = 0; i < taken.size(); ++i)
+                {
+                    slots[taken[i]] = members[bucket][i] + 1;
+                }
+            }
+
+            return true;
+        }
+
+        /*
+            Lays out a manifest of entries. Entries with the same RVA are merged, their
+            kinds combined and the first nonzero Data kept. False only if no seed gives a
+            perfect hash, which doesn't happen for distinct keys in practice.
+        */
+        inline bool build(std::vector<Entry> entries, std::vector<uint8_t>& manifest)
+        {
+            std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.RVA < b.RVA; });
+
+            size_t count = 0;
+
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                if (count != 0 && entries[count - 1].RVA == entries[i].RVA)
+                {
+                    entries[count - 1].Kinds |= entries[i].Kinds;
+                    entries[count - 1].Data = (entries[count - 1].Data != 0) ? entries[count - 1].Data : entries[i].Data;
+                }
+                else
+                {
+                    entries[count++] = entries[i];
+                }
+            }
+
+            entries.resize(count);
+
+            //About 4 keys per bucket and a slot table 80% full
+            std::vector<uint32_t> displacements(count / 4 + 1);
+            std::vector<uint32_t> slots(count + count / 4 + 1);
+            uint32_t seed = 1;
+
+            while (!place(entries, seed, displacements, slots))
+            {
+                if (++seed == 64)
+                {
+                    return false;
+                }
+            }
+
+            manifest.assign(headerSize + (displacements.size() + slots.size()) * 4 + count * entrySize, 0);
+
+            uint8_t* out = manifest.data();
+            const uint32_t header[8] = { Magic, Version, (uint32_t)count, seed, (uint32_t)displacements.size(), (uint32_t)slots.size(), 0, 0 };
+
+            for (uint32_t field : header)
+            {
+                write32(out, field);
+                out += 4;
+            }
+
+            for (uint32_t displacement : displacements)
+            {
+                write32(out, displacement);
+                out += 4;
+            }
+
+            for (uint32_t slot : slots)
+            {
+                write32(out, slot);
+                out += 4;
+            }
+
+            for (const Entry& entry : entries)
+            {
+                write32(out, entry.RVA);
+                write32(out + 4, entry.Kinds);
+                write32(out + 8, entry.Data);
+                out += entrySize;
+            }
+
+            return true;
+        }
+
+        //A manifest read in place, from a file or from the section of a loaded image
+        class View
+        {
+        public:
+            //False if Data isn't a manifest or its tables don't fit in Size
+            bool open(const uint8_t* Data, size_t Size)
+            {
+                *this = View();
+
+                if (Data == NULL || Size < headerSize || read32(Data) != Magic || read32(Data + 4) != Version)
+                {
+                    return false;
+                }
+
+                uint64_t count = read32(Data + 8), buckets = read32(Data + 16), slotCount = read32(Data + 20);
+
+                if (buckets == 0 || slotCount < count || headerSize + (buckets + slotCount) * 4 + count * entrySize > Size)
+                {
+                    return false;
+                }
+
+                seed = read32(Data + 12);
+                bucketCount = (uint32_t)buckets;
+                slotsCount = (uint32_t)slotCount;
+                entryCount = (uint32_t)count;
+                displacements = Data + headerSize;
+                slots = displacements + buckets * 4;
+                entries = slots + slotCount * 4;
+
+                return true;
+            }
+
+            bool valid() const
+            {
+                return entries != NULL;
+            }
+
+            //The entry of RVA, false if the image doesn't list it
+            bool find(uint32_t RVA, Entry& entry) const
+            {
+                if (entries == NULL)
+                {
+                    return false;
+                }
+
+                uint32_t displacement = read32(displacements + reduce(hash(RVA, seed), bucketCount) * 4);
+                uint32_t index = read32(slots + reduce(hash(RVA, displacement), slotsCount) * 4);
+
+                //Unsigned, so an empty slot (0) wraps around and fails the bound check too
+                if (index - 1 >= entryCount || read32(entries + (index - 1) * entrySize) != RVA)
+                {
+                    return false;
+                }
+
+                entry = at(index - 1);
+                return true;
+            }
+
+            //True if RVA is listed with any of Kinds
+            bool contains(uint32_t RVA, uint32_t Kinds) const
+            {
+                Entry entry;
+                return find(RVA, entry) && (entry.Kinds & Kinds) != 0;
+            }
+
+            uint32_t size() const
+            {
+                return entryCount;
+            }
+
+            //Entries in RVA order
+            Entry at(uint32_t index) const
+            {
+                const uint8_t* bytes = entries + index * entrySize;
+                return { read32(bytes), read32(bytes + 4), read32(bytes + 8) };
+            }
+
+        private:
+            const uint8_t* displacements = NULL;
+            const uint8_t* slots = NULL;
+            const uint8_t* entries = NULL;
+            uint32_t seed = 0;
+            uint32_t bucketCount = 0;
+            uint32_t slotsCount = 0;
+            uint32_t entryCount = 0;
+        };
+    }
+}
\ No newline at end of file
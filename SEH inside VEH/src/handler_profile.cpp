@@ -0,0 +1,66 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include "SEH.h"
+#include "handler_profile.h"
+
+namespace SEH
+{
+    namespace Handler_Profile
+    {
+        Profiles& profiles()
+        {
+            static Profiles table;
+            return table;
+        }
+    }
+
+    DWORD GetSlowestHandlers(HandlerProfile* Profiles, DWORD Count, HandlerProfileOrder Order)
+    {
+    #if HANDLER_PROFILING
+        Handler_Profile::Profile profiles[32]; //Top 32 at most, a report not a dump
+        Handler_Profile::Order order = (Order == HandlerProfileByMax) ? Handler_Profile::ByMax : (Order == HandlerProfileByMean) ? Handler_Profile::ByMean : Handler_Profile::ByTotal;
+
+        if (Count > ARRAYSIZE(profiles))
+        {
+            Count = ARRAYSIZE(profiles);
+        }
+
+        DWORD found = (DWORD)Handler_Profile::profiles().top(profiles, Count, order);
+
+        for (DWORD i = 0; i < found; ++i)
+        {
+            Profiles[i].Handler = (PVOID)profiles[i].handler;
+            Profiles[i].Calls = profiles[i].calls;
+            Profiles[i].TotalCycles = profiles[i].total;
+            Profiles[i].MaxCycles = profiles[i].max;
+            Profiles[i].ContinueExecution = profiles[i].outcomes[Statistics::ContinueExecution];
+            Profiles[i].ContinueSearch = profiles[i].outcomes[Statistics::ContinueSearch];
+            Profiles[i].NestedException = profiles[i].outcomes[Statistics::NestedException];
+            Profiles[i].CollidedUnwind = profiles[i].outcomes[Statistics::CollidedUnwind];
+            Profiles[i].InvalidDisposition = profiles[i].outcomes[Statistics::InvalidDisposition];
+        }
+
+        return found;
+    #else
+        return 0;
+    #endif
+    }
+}
\ No newline at end of file
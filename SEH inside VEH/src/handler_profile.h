@@ -0,0 +1,216 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "statistics.h"
+
+/*
+    Time spent inside every handler ExecuteHandler called, per handler address.
+
+    The table is fixed size and shared by every thread. A handler claims its slot
+    with one compare-exchange the first time it's seen and after that recording is
+    a handful of relaxed fetch_adds, no locks. Handlers that don't fit are only
+    counted in dropped().
+
+    Times are in whatever unit the caller measures with, the library uses rdtsc
+    cycles. A handler that never returns (one that unwinds and resumes execution
+    itself, like __except blocks do) isn't recorded for that call.
+*/
+
+namespace SEH
+{
+    namespace Handler_Profile
+    {
+        enum Order
+        {
+            ByTotal, //Most time spent in the handler overall
+            ByMax,   //Slowest single call
+            ByMean   //Slowest on average
+        };
+
+        //A copy of one handler's entry
+        struct Profile
+        {
+            uint64_t handler;
+            uint64_t calls;
+            uint64_t total;
+            uint64_t max;
+            uint64_t outcomes[Statistics::outcomes]; //Dispositions returned, see Statistics::Outcome
+        };
+
+        inline uint64_t key(const Profile& profile, Order order)
+        {
+            switch (order)
+            {
+            case ByMax:
+                return profile.max;
+            case ByMean:
+                return profile.calls ? profile.total / profile.calls : 0;
+            default:
+                return profile.total;
+            }
+        }
+
+        //capacity must be a power of two
+        template <size_t capacity = 256>
+        class Table
+        {
+            static_assert(capacity != 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+        public:
+            Table() : droppedCalls(0)
+            {
+                for (Entry& entry : entries)
+                {
+                    entry.handler.store(0, std::memory_order_relaxed);
+                    entry.calls.store(0, std::memory_order_relaxed);
+                    entry.total.store(0, std::memory_order_relaxed);
+                    entry.max.store(0, std::memory_order_relaxed);
+
+                    for (std::atomic<uint64_t>& outcome : entry.outcomes)
+                    {
+                        outcome.store(0, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            void record(uint64_t Handler, uint64_t elapsed, unsigned int disposition)
+            {
+                Entry* entry = find(Handler);
+
+                if (entry == nullptr)
+                {
+                    droppedCalls.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+
+                entry->calls.fetch_add(1, std::memory_order_relaxed);
+                entry->total.fetch_add(elapsed, std::memory_order_relaxed);
+                entry->outcomes[Statistics::outcomeOf(disposition)].fetch_add(1, std::memory_order_relaxed);
+
+                uint64_t max = entry->max.load(std::memory_order_relaxed);
+
+                while (elapsed > max && !entry->max.compare_exchange_weak(max, elapsed, std::memory_order_relaxed)) {}
+            }
+
+            //Copies up to count of the slowest handlers to profiles, slowest first. Returns how many were copied
+            size_t top(Profile* profiles, size_t count, Order order) const
+            {
+                size_t found = 0;
+
+                for (const Entry& entry : entries)
+                {
+                    Profile profile = {};
+                    profile.handler = entry.handler.load(std::memory_order_acquire);
+
+                    if (profile.handler == 0)
+                    {
+                        continue;
+                    }
+
+                    profile.calls = entry.calls.load(std::memory_order_relaxed);
+                    profile.total = entry.total.load(std::memory_order_relaxed);
+                    profile.max = entry.max.load(std::memory_order_relaxed);
+
+                    for (unsigned int i = 0; i < Statistics::outcomes; ++i)
+                    {
+                        profile.outcomes[i] = entry.outcomes[i].load(std::memory_order_relaxed);
+                    }
+
+                    //Insertion into the sorted output, count is expected to be small
+                    size_t position = found;
+
+                    while (position > 0 && key(profiles[position - 1], order) < key(profile, order))
+                    {
+                        if (position < count)
+                        {
+                            profiles[position] = profiles[position - 1];
+                        }
+
+                        --position;
+                    }
+
+                    if (position < count)
+                    {
+                        profiles[position] = profile;
+
+                        if (found < count)
+                        {
+                            ++found;
+                        }
+                    }
+                }
+
+                return found;
+            }
+
+            //Calls that weren't recorded because every slot held another handler
+            uint64_t dropped() const
+            {
+                return droppedCalls.load(std::memory_order_relaxed);
+            }
+
+        private:
+            struct alignas(64) Entry
+            {
+                std::atomic<uint64_t> handler; //0 marks an empty slot
+                std::atomic<uint64_t> calls;
+                std::atomic<uint64_t> total;
+                std::atomic<uint64_t> max;
+                std::atomic<uint64_t> outcomes[Statistics::outcomes];
+            };
+
+            Entry* find(uint64_t Handler)
+            {
+                size_t slot = (size_t)((Handler * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+
+                for (size_t i = 0; i < capacity; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t current = entries[slot].handler.load(std::memory_order_acquire);
+
+                    if (current == Handler)
+                    {
+                        return &entries[slot];
+                    }
+
+                    if (current == 0)
+                    {
+                        if (entries[slot].handler.compare_exchange_strong(current, Handler, std::memory_order_acq_rel) || current == Handler)
+                        {
+                            return &entries[slot];
+                        }
+                    }
+                }
+
+                return nullptr;
+            }
+
+            Entry entries[capacity];
+            std::atomic<uint64_t> droppedCalls;
+        };
+
+        typedef Table<> Profiles;
+
+        //The table ExecuteHandler records into, defined by whoever links the library (handler_profile.cpp)
+        Profiles& profiles();
+    }
+}
\ No newline at end of file
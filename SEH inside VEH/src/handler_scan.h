@@ -0,0 +1,474 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "cxx_eh.h"
+#include "scope_table.h"
+#include "unwind_patch.h"
+#include "handler_manifest.h"
+
+/*
+    Lists the handlers a PE32 image can register without running it, what
+    Tools/Handler Manifest puts in a manifest (see handler_manifest.h).
+
+    SafeSEH         the load config's SEHandlerTable, when the image has one
+    Prologues       a handler only gets on the chain by being stored next to fs:[0],
+                    so the code is searched for the ways MSVC does it:
+
+                        push offset handler     68 imm32
+                        mov eax, fs:[0]         64 A1 00000000  (or push fs:[0], 64 FF 35 00000000)
+
+                    __SEH_prolog4 is such a function that pushes _except_handler4 for its
+                    callers, and __EH_prolog3 pushes whatever handler its callers put in eax
+                    (mov eax, offset handler / call __EH_prolog3).
+    Scope tables    pushed right before the handler (push -2 / push offset table) or right
+                    before calling __SEH_prolog4. Only kept if the first record decodes.
+    FuncInfo        behind every handler that is a C++ frame handler thunk
+                    (mov eax, offset FuncInfo / jmp __CxxFrameHandler3)
+
+    Pushed addresses have to be inside an executable section, and carry a base
+    relocation when the image has relocations, so data that happens to look like a
+    prologue isn't listed. Offline, imports aren't bound, so thunks and stubs are
+    recognized by what they pass (a FuncInfo that decodes, a cookie in writable
+    data) rather than by what they call.
+*/
+
+namespace SEH
+{
+    namespace Handler_Scan
+    {
+        using Unwind_Patch::Image;
+        using Unwind_Patch::Section;
+        using Handler_Manifest::Entry;
+
+        //IMAGE_SCN_CNT_CODE or IMAGE_SCN_MEM_EXECUTE, and IMAGE_SCN_MEM_WRITE
+        const uint32_t executable = 0x20000020;
+        const uint32_t writable = 0x80000000;
+
+        //Bytes a stub or thunk is looked at from its start
+        const size_t stubWindow = 48;
+
+        inline bool inSection(const Image& image, uint32_t RVA, uint32_t Characteristics)
+        {
+            const Section* section = image.sectionOf(RVA);
+            return section != NULL && (section->Characteristics & Characteristics) != 0;
+        }
+
+        //RVA of the address stored at Operand (an RVA), false unless it's in the image and relocated like an address would be
+        inline bool addressAt(const Image& image, const uint8_t* code, uint32_t Operand, uint32_t& RVA)
+        {
+            uint32_t VA = Throw_Sites::load32(code);
+            RVA = VA - image.ImageBase;
+
+            return VA >= image.ImageBase && RVA < image.SizeOfImage && (!image.hasRelocations || image.isRelocated(Operand));
+        }
+
+        //The first record of a scope table has to be outside of every __try and have a handler
+        inline bool isScopeTable(const Image& image, uint32_t RVA, Scope_Table::Variant variant)
+        {
+            Scope_Table::Frame frame = { variant, 0, 0, image.ImageBase + RVA, 0 };
+            Scope_Table::Scope scope;
+
+            return Scope_Table::readScope(image, frame, 0, scope) && scope.EnclosingLevel == Scope_Table::topmost(variant)
+                && inSection(image, scope.Handler - image.ImageBase, executable);
+        }
+
+        //The code of an executable section, up to VirtualSize
+        inline const uint8_t* codeOf(const Image& image, const Section& section, uint32_t& size)
+        {
+            size = section.SizeOfRawData;
+
+            if (image.layout == Unwind_Patch::MappedLayout || (section.VirtualSize != 0 && section.VirtualSize < size))
+            {
+                size = section.VirtualSize;
+            }
+
+            return image.atRVA(section.VirtualAddress, size);
+        }
+
+        inline void addSafeSEH(const Image& image, std::vector<Entry>& entries)
+        {
+            uint32_t loadConfig, size;
+
+            if (!image.directory(10, loadConfig, size)) //IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG
+            {
+                return;
+            }
+
+            const uint8_t* config = image.atRVA(loadConfig, 0x48);
+
+            if (config == NULL || Throw_Sites::load32(config) < 0x48)
+            {
+                return; //Too old to have SEHandlerTable and SEHandlerCount
+            }
+
+            uint32_t table = Throw_Sites::load32(config + 0x40) - image.ImageBase;
+            uint32_t count = Throw_Sites::load32(config + 0x44);
+            const uint8_t* handlers = (count != 0 && count < image.SizeOfImage / 4) ? image.atRVA(table, count * 4) : NULL;
+
+            for (uint32_t i = 0; handlers != NULL && i < count; ++i)
+            {
+                entries.push_back({ Throw_Sites::load32(handlers + i * 4), Handler_Manifest::SafeSEH, 0 });
+            }
+        }
+
+        //What a prologue helper does with the handler
+        struct Helper
+        {
+            uint32_t RVA;
+            uint32_t Handler; //0 when it takes the handler in eax
+        };
+
+        /*
+            The registrations written inline and the helpers that write them for their
+            callers, going over the code once per fs:[0] access.
+        */
+        inline void addPrologues(const Image& image, std::vector<Entry>& entries, std::vector<Helper>& helpers)
+        {
+            for (const Section& section : image.sections)
+            {
+                uint32_t size;
+                const uint8_t* code = ((section.Characteristics & executable) != 0) ? codeOf(image, section, size) : NULL;
+
+                if (code == NULL)
+                {
+                    continue;
+                }
+
+                const uint8_t* end = code + size;
+                static const uint8_t zero[4] = {};
+
+                for (const uint8_t* fs = code; (fs = static_cast<const uint8_t*>(memchr(fs, 0x64, end - fs))) != NULL && end - fs >= 7; ++fs)
+                {
+                    //mov eax, fs:[0] or push fs:[0]
+                    if (!((fs[1] == 0xA1 && memcmp(fs + 2, zero, 4) == 0) || (fs[1] == 0xFF && fs[2] == 0x35 && memcmp(fs + 3, zero, 4) == 0)))
+                    {
+                        continue;
+                    }
+
+                    uint32_t at = section.VirtualAddress + (uint32_t)(fs - code);
+                    uint32_t Handler;
+
+                    if (fs - code >= 5 && fs[-5] == 0x68 && addressAt(image, fs - 4, at - 4, Handler) && inSection(image, Handler, executable))
+                    {
+                        entries.push_back({ Handler, Handler_Manifest::Registered, 0 });
+                        helpers.push_back({ at - 5, Handler });
+
+                        //push -2 or -1 / push offset table right before it
+                        uint32_t Table;
+
+                        if (fs - code >= 12 && fs[-10] == 0x68 && fs[-12] == 0x6A && (fs[-11] == 0xFE || fs[-11] == 0xFF) && addressAt(image, fs - 9, at - 9, Table))
+                        {
+                            Scope_Table::Variant variant = (fs[-11] == 0xFE) ? Scope_Table::EH4 : Scope_Table::EH3;
+
+                            if (isScopeTable(image, Table, variant))
+                            {
+                                entries.push_back({ Table, Handler_Manifest::ScopeTable, Handler });
+
+                                if (variant == Scope_Table::EH3)
+                                {
+                                    entries.push_back({ Handler, Handler_Manifest::ExceptHandler3, 0 });
+                                }
+                            }
+                        }
+                    }
+                    else if (fs - code >= 1 && fs[-1] == 0x50) //push eax
+                    {
+                        helpers.push_back({ at - 1, 0 });
+                    }
+                }
+            }
+        }
+
+        //Callers of the helpers: mov eax, offset handler / call helper, and push offset table / call helper
+        inline void addHelperCalls(const Image& image, std::vector<Entry>& entries, std::vector<Helper>& helpers)
+        {
+            std::sort(helpers.begin(), helpers.end(), [](const Helper& a, const Helper& b) { return a.RVA < b.RVA; });
+
+            for (const Section& section : image.sections)
+            {
+                uint32_t size;
+                const uint8_t* code = ((section.Characteristics & executable) != 0) ? codeOf(image, section, size) : NULL;
+
+                if (code == NULL)
+                {
+                    continue;
+                }
+
+                const uint8_t* end = code + size;
+
+                for (const uint8_t* call = code + 5; call < end && (call = static_cast<const uint8_t*>(memchr(call, 0xE8, end - call))) != NULL && end - call >= 5; ++call)
+                {
+                    if (call[-5] != 0xB8 && call[-5] != 0x68)
+                    {
+                        continue;
+                    }
+
+                    uint32_t at = section.VirtualAddress + (uint32_t)(call - code);
+                    uint32_t Destination = at + 5 + Throw_Sites::load32(call + 1);
+
+                    auto helper = std::lower_bound(helpers.begin(), helpers.end(), Destination, [](const Helper& h, uint32_t RVA) { return h.RVA < RVA; });
+                    uint32_t Address;
+
+                    if (helper == helpers.end() || helper->RVA != Destination || !addressAt(image, call - 4, at - 4, Address))
+                    {
+                        continue;
+                    }
+
+                    if (call[-5] == 0xB8 && helper->Handler == 0 && inSection(image, Address, executable))
+                    {
+                        entries.push_back({ Address, Handler_Manifest::Registered, 0 });
+                    }
+                    else if (call[-5] == 0x68 && helper->Handler != 0)
+                    {
+                        bool eh4 = isScopeTable(image, Address, Scope_Table::EH4);
+
+                        if (eh4 || isScopeTable(image, Address, Scope_Table::EH3))
+                        {
+                            entries.push_back({ Address, Handler_Manifest::ScopeTable, helper->Handler });
+
+                            if (!eh4)
+                            {
+                                entries.push_back({ helper->Handler, Handler_Manifest::ExceptHandler3, 0 });
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        //The start of a stub or thunk, shorter if it's the last code in its section
+        inline const uint8_t* stubOf(const Image& image, uint32_t Handler, size_t& window)
+        {
+            const uint8_t* code = NULL;
+
+            for (window = stubWindow; window >= 16 && (code = image.atRVA(Handler, window)) == NULL; window -= 8)
+            {
+            }
+
+            return code;
+        }
+
+        /*
+            mov eax, offset FuncInfo / jmp rel32, the FuncInfo RVA or 0. The jmp's target
+            isn't checked, __CxxFrameHandler3 is an import (or unnamed in a /MT image).
+        */
+        inline uint32_t funcInfoOf(const Image& image, uint32_t Handler)
+        {
+            size_t window;
+            const uint8_t* code = stubOf(image, Handler, window);
+
+            for (const uint8_t* mov = code; code != NULL && (mov = static_cast<const uint8_t*>(memchr(mov, 0xB8, code + window - 9 - mov))) != NULL; ++mov)
+            {
+                uint32_t RVA;
+                Cxx_EH::FuncInfo info;
+
+                if (mov[5] == 0xE9 && addressAt(image, mov + 1, Handler + (uint32_t)(mov - code) + 1, RVA)
+                    && Cxx_EH::readFuncInfo(image, image.ImageBase + RVA, info))
+                {
+                    return RVA;
+                }
+            }
+
+            return 0;
+        }
+
+        //push offset __security_check_cookie / push offset __security_cookie / call, the cookie RVA or 0
+        inline uint32_t cookieOf(const Image& image, uint32_t Handler)
+        {
+            size_t window;
+            const uint8_t* code = stubOf(image, Handler, window);
+
+            for (const uint8_t* push = code; code != NULL && (push = static_cast<const uint8_t*>(memchr(push, 0x68, code + window - 16 - push))) != NULL; ++push)
+            {
+                uint32_t at = Handler + (uint32_t)(push - code);
+                uint32_t Check, Cookie;
+
+                if (push[5] == 0x68 && (push[10] == 0xE8 || (push[10] == 0xFF && push[11] == 0x15))
+                    && addressAt(image, push + 1, at + 1, Check) && inSection(image, Check, executable)
+                    && addressAt(image, push + 6, at + 6, Cookie) && inSection(image, Cookie, writable))
+                {
+                    return Cookie;
+                }
+            }
+
+            return 0;
+        }
+
+        //Every handler, scope table and FuncInfo of image, unsorted and with an RVA listed more than once (build() merges them)
+        inline std::vector<Entry> scanImage(const Image& image)
+        {
+            std::vector<Entry> entries;
+            std::vector<Helper> helpers;
+
+            addSafeSEH(image, entries);
+            addPrologues(image, entries, helpers);
+            addHelperCalls(image, entries, helpers);
+
+            //Each handler is classified once however many functions register it
+            std::vector<uint32_t> handlers;
+
+            for (const Entry& entry : entries)
+            {
+                if (entry.Kinds & (Handler_Manifest::SafeSEH | Handler_Manifest::Registered))
+                {
+                    handlers.push_back(entry.RVA);
+                }
+            }
+
+            std::sort(handlers.begin(), handlers.end());
+            handlers.erase(std::unique(handlers.begin(), handlers.end()), handlers.end());
+
+            for (uint32_t Handler : handlers)
+            {
+                uint32_t Data;
+
+                if ((Data = funcInfoOf(image, Handler)) != 0)
+                {
+                    entries.push_back({ Handler, Handler_Manifest::CxxHandler, Data });
+                    entries.push_back({ Data, Handler_Manifest::FuncInfo, Handler });
+                }
+                else if ((Data = cookieOf(image, Handler)) != 0)
+                {
+                    entries.push_back({ Handler, Handler_Manifest::ExceptHandler4, Data });
+                }
+            }
+
+            return entries;
+        }
+
+        inline uint32_t alignUp(uint32_t value, uint32_t alignment)
+        {
+            return (alignment != 0) ? (value + alignment - 1) / alignment * alignment : value;
+        }
+
+        /*
+            Stores manifest as the ".sehm" section of a PE32 file, appended after the last
+            section. An existing ".sehm" section is replaced if it's the last one. Fails
+            for files with a certificate (the signature would break) or data past their
+            last section, and when the headers have no room for one more section header.
+        */
+        inline bool embed(std::vector<uint8_t>& file, const std::vector<uint8_t>& manifest, const char*& error)
+        {
+            Image image;
+
+            if (!image.parse(file.data(), file.size(), Unwind_Patch::FileLayout))
+            {
+                error = image.error;
+                return false;
+            }
+
+            uint32_t ntHeaders = 0, security, securitySize, SectionAlignment, FileAlignment, SizeOfInitializedData;
+            uint16_t optionalSize;
+
+            if (!image.read32(0x3C, ntHeaders) || !image.read16(ntHeaders + 20, optionalSize) || !image.read32(ntHeaders + 0x18 + 0x20, SectionAlignment)
+                || !image.read32(ntHeaders + 0x18 + 0x24, FileAlignment) || !image.read32(ntHeaders + 0x18 + 0x08, SizeOfInitializedData))
+            {
+                error = "truncated optional header";
+                return false;
+            }
+
+            if (image.directory(4, security, securitySize)) //IMAGE_DIRECTORY_ENTRY_SECURITY
+            {
+                error = "the file is signed, a new section would invalidate the signature";
+                return false;
+            }
+
+            size_t sectionHeaders = ntHeaders + 0x18 + optionalSize;
+            std::vector<Section> sections = image.sections;
+
+            //Replace an existing manifest by dropping it first, only possible if nothing comes after it
+            if (!sections.empty() && memcmp(&file[sectionHeaders + (sections.size() - 1) * 0x28], Handler_Manifest::SectionName, 8) == 0)
+            {
+                const Section& last = sections.back();
+
+                file.resize(std::min<size_t>(file.size(), last.PointerToRawData));
+                SizeOfInitializedData -= last.SizeOfRawData;
+                memset(&file[sectionHeaders + (sections.size() - 1) * 0x28], 0, 0x28);
+                sections.pop_back();
+            }
+
+            uint32_t VirtualEnd = image.SizeOfHeaders, RawEnd = image.SizeOfHeaders, FirstRaw = UINT32_MAX;
+
+            for (const Section& section : sections)
+            {
+                if (memcmp(&file[sectionHeaders + (&section - sections.data()) * 0x28], Handler_Manifest::SectionName, 8) == 0)
+                {
+                    error = "the file has a .sehm section that isn't the last one";
+                    return false;
+                }
+
+                VirtualEnd = std::max(VirtualEnd, section.VirtualAddress + std::max(section.VirtualSize, section.SizeOfRawData));
+
+                if (section.SizeOfRawData != 0)
+                {
+                    RawEnd = std::max(RawEnd, section.PointerToRawData + section.SizeOfRawData);
+                    FirstRaw = std::min(FirstRaw, section.PointerToRawData);
+                }
+            }
+
+            size_t header = sectionHeaders + sections.size() * 0x28;
+
+            if (header + 0x28 > image.SizeOfHeaders || header + 0x28 > FirstRaw)
+            {
+                error = "no room for another section header";
+                return false;
+            }
+
+            if (file.size() > RawEnd)
+            {
+                error = "the file has data past its last section";
+                return false;
+            }
+
+            uint32_t VirtualAddress = alignUp(VirtualEnd, SectionAlignment);
+            uint32_t PointerToRawData = alignUp(RawEnd, FileAlignment);
+            uint32_t SizeOfRawData = alignUp((uint32_t)manifest.size(), FileAlignment);
+
+            file.resize(PointerToRawData + SizeOfRawData, 0);
+            memcpy(&file[PointerToRawData], manifest.data(), manifest.size());
+
+            memcpy(&file[header], Handler_Manifest::SectionName, 8);
+            Unwind_Patch::store32(&file[header + 0x08], (uint32_t)manifest.size());
+            Unwind_Patch::store32(&file[header + 0x0C], VirtualAddress);
+            Unwind_Patch::store32(&file[header + 0x10], SizeOfRawData);
+            Unwind_Patch::store32(&file[header + 0x14], PointerToRawData);
+            Unwind_Patch::store32(&file[header + 0x24], 0x40000040); //IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ
+
+            uint16_t sectionCount = (uint16_t)(sections.size() + 1);
+            memcpy(&file[ntHeaders + 6], &sectionCount, sizeof(sectionCount));
+            Unwind_Patch::store32(&file[ntHeaders + 0x18 + 0x08], SizeOfInitializedData + SizeOfRawData);
+            Unwind_Patch::store32(&file[ntHeaders + 0x18 + 0x38], alignUp(VirtualAddress + (uint32_t)manifest.size(), SectionAlignment));
+
+            //A zero CheckSum is never checked, anything else has to stay correct
+            if (Throw_Sites::load32(&file[image.CheckSumOffset]) != 0)
+            {
+                Unwind_Patch::store32(&file[image.CheckSumOffset], Unwind_Patch::checksum(file.data(), file.size(), image.CheckSumOffset));
+            }
+
+            return true;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace SEH
+{
+    namespace Loaded_Images
+    {
+        /*
+            Finds the loaded module an address is in for Throw_Sites::ImageMemory, asking the
+            loader. Takes the loader lock, so for setup code only, never from the VEH.
+        */
+        struct Loader
+        {
+            bool find(uint32_t VA, uint32_t& Base, uint32_t& Size) const
+            {
+                HMODULE Module = NULL;
+
+                if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR)(uintptr_t)VA, &Module))
+                {
+                    return false;
+                }
+
+                IMAGE_DOS_HEADER* DosHeader = (IMAGE_DOS_HEADER*)Module;
+                IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)DosHeader + DosHeader->e_lfanew);
+
+                Base = (uint32_t)(uintptr_t)Module;
+                Size = NTHeaders->OptionalHeader.SizeOfImage;
+                return true;
+            }
+        };
+    }
+}
\ No newline at end of file
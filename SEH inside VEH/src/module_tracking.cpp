@@ -0,0 +1,107 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include "module_tracking.h"
+
+#if (EXCEPTION_CHECKING & VALID_TOP_HANDLER_CHECK) || HANDLER_MANIFEST || CXX_FAST_PATH || SCOPE_TABLE_DISPATCH
+
+namespace SEH
+{
+    namespace Module_Tracking
+    {
+        static PVOID Cookie = NULL;
+
+        Safe_SEH::ModuleIndex& index()
+        {
+            static Safe_SEH::ModuleIndex modules;
+            return modules;
+        }
+
+        VerdictCache& verdicts()
+        {
+            static VerdictCache cache;
+            return cache;
+        }
+
+        static void addModule(PVOID DllBase)
+        {
+            IMAGE_DOS_HEADER* DosHeader = (IMAGE_DOS_HEADER*)DllBase;
+            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)DosHeader + DosHeader->e_lfanew);
+
+            Safe_SEH::ImageView image = { (const uint8_t*)DllBase, NTHeaders->OptionalHeader.SizeOfImage };
+            index().addImage(image, (DWORD)DllBase);
+        }
+
+        /*
+            Called by the loader with the loader lock held. Only changes to the index take its
+            lock and nothing that holds it waits on the loader lock; lookups, the VEH's, take
+            none, so a fault while the index is changing doesn't deadlock either.
+        */
+        static VOID CALLBACK notification(ULONG NotificationReason, const LDR_DLL_NOTIFICATION_DATA* NotificationData, PVOID Context)
+        {
+            if (NotificationReason == LDR_DLL_NOTIFICATION_REASON_LOADED)
+            {
+                addModule(NotificationData->DllBase);
+            }
+            else if (NotificationReason == LDR_DLL_NOTIFICATION_REASON_UNLOADED)
+            {
+                index().removeImage((DWORD)NotificationData->DllBase);
+            }
+
+            //After the index changed, otherwise a verdict from the old index could be cached as current
+            verdicts().invalidate();
+        }
+
+        void start()
+        {
+            /*
+                Register first so nothing loaded during the enumeration is missed. A module
+                showing up in both just gets parsed twice; adding the same base replaces it.
+            */
+            LdrRegisterDllNotification(0, &notification, NULL, &Cookie);
+
+            HMODULE modules[1024];
+            DWORD size = 0;
+
+            if (EnumProcessModules(GetCurrentProcess(), modules, sizeof(modules), &size))
+            {
+                for (DWORD i = 0; i < size / sizeof(HMODULE) && i < ARRAYSIZE(modules); ++i)
+                {
+                    addModule(modules[i]);
+                }
+            }
+
+            verdicts().invalidate();
+        }
+
+        void stop()
+        {
+            if (Cookie)
+            {
+                LdrUnregisterDllNotification(Cookie);
+                Cookie = NULL;
+            }
+
+            index().clear();
+            verdicts().invalidate();
+        }
+    }
+}
+
+#endif
\ No newline at end of file
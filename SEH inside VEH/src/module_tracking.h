@@ -0,0 +1,49 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "safeseh_index.h"
+#include "verdict_cache.h"
+
+namespace SEH
+{
+    namespace Module_Tracking
+    {
+        //Indexes every loaded module and keeps the index updated as modules load and unload
+        void start();
+
+        //Stops listening for module loads and unloads and empties the index
+        void stop();
+
+        //Loaded modules, their SafeSEH tables and handler manifests
+        Safe_SEH::ModuleIndex& index();
+
+        //Finds an indexed image for Throw_Sites::ImageMemory, no loader lock so the VEH can use it
+        struct Images
+        {
+            bool find(uint32_t VA, uint32_t& Base, uint32_t& Size) const
+            {
+                return index().image(VA, Base, Size);
+            }
+        };
+
+        //Memo of isTopHandlerValid verdicts, invalidated whenever a module loads or unloads
+        typedef Verdict_Cache::Cache<4096> VerdictCache;
+        VerdictCache& verdicts();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,752 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#if !defined(__linux__) || !(defined(__x86_64__) || defined(__i386__))
+#error platform_posix.h is for Linux on x86 and x86-64
+#endif
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "dispatch_core.h"
+
+/*
+    A platform for dispatch_core.h on Linux, where the faults come as signals instead
+    of through KiUserExceptionDispatcher. Registrations, the order handlers are called
+    in, nested and collided exceptions and Unwind all work the way they do on Windows.
+
+    The chain head lives in a thread-local TEB instead of fs:[0]. SIGSEGV, SIGBUS,
+    SIGFPE and SIGILL are delivered on an alternate stack, where the handler does what
+    the kernel does on Windows: it copies the interrupted context (with its FPU state)
+    onto the thread's stack below the faulting instruction's stack pointer, turns the
+    signal into an exception record and returns into dispatchDelivery there. The
+    dispatch then runs as ordinary code with the thread's own signal mask, so handlers
+    may fault again. ContinueExecution resumes the context with rt_sigreturn, which is
+    what NtContinue is to Windows: every register, the flags and the FPU state.
+
+    Guard is the cheap way to recover from a fault, see below. A fault nobody handles
+    goes to whatever handled the signal before enableSignals, or kills the process
+    the way it would have without this.
+
+    Each thread has to call enterThread before it registers frames: that's where the
+    alternate stack is made and the stack limits are read, neither can be done in a
+    signal handler. Faults without enough stack left to dispatch on (a stack overflow)
+    aren't dispatched.
+*/
+
+namespace SEH
+{
+    namespace Posix
+    {
+        struct Registration;
+
+        //Laid out like EXCEPTION_RECORD but with pointer sized fields for the host
+        struct Record
+        {
+            uint32_t ExceptionCode;
+            uint32_t ExceptionFlags;
+            Record* ExceptionRecord;
+            void* ExceptionAddress;
+            uint32_t NumberParameters;
+            uintptr_t ExceptionInformation[15];
+        };
+
+        //Handlers change the registers in uc_mcontext.gregs to resume somewhere else
+        typedef ucontext_t Context;
+
+        typedef Core::Disposition(*Routine)(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, void* DispatcherContext);
+
+        struct Registration
+        {
+            Registration* Next;
+            Routine Handler;
+        };
+
+        struct Delivery;
+
+        //The parts of the TEB the dispatcher reads, plus what the signal handler needs
+        struct Teb
+        {
+            Registration* ExceptionList;
+            uintptr_t StackLimit;           //0 until enterThread
+            uintptr_t StackBase;
+            void* AlternateStack;
+            size_t AlternateSize;
+            Delivery* Current;              //Innermost fault being dispatched
+            int Forward;                    //Signal to give straight to the old handler when it comes again
+        };
+
+        /*
+            Initial-exec so the signal handler never ends up in __tls_get_addr, which may
+            allocate. Fine for executables and for libraries loaded at startup.
+        */
+        inline Teb& currentTeb()
+        {
+            static thread_local Teb teb __attribute__((tls_model("initial-exec"))) = { Core::chainEnd<Registration>(), 0, 0, NULL, 0, NULL, 0 };
+            return teb;
+        }
+
+        //Same values as ntstatus.h
+        namespace Status
+        {
+            enum : uint32_t
+            {
+                DatatypeMisalignment = 0x80000002,
+                AccessViolation = 0xC0000005,
+                InPageError = 0xC0000006,
+                IllegalInstruction = 0xC000001D,
+                ArrayBoundsExceeded = 0xC000008C,
+                FloatDenormalOperand = 0xC000008D,
+                FloatDivideByZero = 0xC000008E,
+                FloatInexactResult = 0xC000008F,
+                FloatInvalidOperation = 0xC0000090,
+                FloatOverflow = 0xC0000091,
+                FloatUnderflow = 0xC0000093,
+                IntegerDivideByZero = 0xC0000094,
+                IntegerOverflow = 0xC0000095,
+                PrivilegedInstruction = 0xC0000096
+            };
+        }
+
+        //Below the faulting stack pointer the dispatch leaves alone, and what it needs to run on
+        namespace Layout
+        {
+#if defined(__x86_64__)
+            const uintptr_t redZone = 128;
+            const uintptr_t floatHeader = 0;    //fpregs points at the FXSAVE image
+#else
+            const uintptr_t redZone = 0;
+            const uintptr_t floatHeader = 112;  //An FSAVE header comes before the FXSAVE image
+#endif
+            const uintptr_t dispatchReserve = 16 * 1024;
+            const size_t alternateSize = 64 * 1024;
+
+            //struct _fpx_sw_bytes in the FXSAVE image's unused bytes, there when the kernel saved XSAVE state
+            const uint32_t xstateMagic = 0x46505853;
+            const uintptr_t xstateInfo = 464;
+        }
+
+        /*
+            Everything about one fault, on the faulting thread's stack. ContextRecord is
+            also the frame rt_sigreturn resumes, only the part the kernel reads is copied
+            and uc_mcontext.fpregs points at the copy of the FPU state after it.
+        */
+        struct Delivery
+        {
+            Record Exception;
+            int Signal;
+            Delivery* Outer;
+            Context ContextRecord;
+        };
+
+        namespace Arch
+        {
+#if defined(__x86_64__)
+            enum { Ip = REG_RIP, Sp = REG_RSP, Flags = REG_EFL, Error = REG_ERR, Trap = REG_TRAPNO };
+#else
+            enum { Ip = REG_EIP, Sp = REG_ESP, Flags = REG_EFL, Error = REG_ERR, Trap = REG_TRAPNO };
+#endif
+            inline greg_t& reg(Context& ContextRecord, int Index)
+            {
+                return ContextRecord.uc_mcontext.gregs[Index];
+            }
+
+            //Bytes of the kernel's ucontext, the rest of glibc's ucontext_t isn't read on rt_sigreturn
+            const size_t contextSize = offsetof(ucontext_t, uc_sigmask) + _NSIG / 8;
+
+            //Size of the FPU state fpregs points at, header included
+            inline size_t floatSize(const void* State)
+            {
+                if (State == NULL)
+                {
+                    return 0;
+                }
+
+                const unsigned char* fxsave = static_cast<const unsigned char*>(State) + Layout::floatHeader;
+                uint32_t info[2];
+                memcpy(info, fxsave + Layout::xstateInfo, sizeof(info));
+
+                //extended_size counts the FSAVE header on x86 as well
+                return (info[0] == Layout::xstateMagic) ? info[1] : Layout::floatHeader + 512;
+            }
+
+            //NtContinue: the kernel takes every register, the flags, the FPU state and the signal mask from the frame
+            [[noreturn]] inline void sigreturn(Context* ContextRecord)
+            {
+#if defined(__x86_64__)
+                //rt_sigreturn finds the ucontext right at the stack pointer
+                asm volatile("mov %0, %%rsp\n\tmov %1, %%eax\n\tsyscall" : : "r"(ContextRecord), "i"(SYS_rt_sigreturn) : "memory");
+#else
+                //pretcode, sig, pinfo, puc and siginfo come before the ucontext, the frame starts 4 bytes under esp
+                asm volatile("lea -140(%0), %%esp\n\tmov %1, %%eax\n\tint $0x80" : : "r"(ContextRecord), "i"(SYS_rt_sigreturn) : "memory");
+#endif
+                __builtin_unreachable();
+            }
+
+            //Makes the interrupted thread call Function(Argument) on the stack at Top when the signal handler returns
+            inline void redirect(Context& ContextRecord, void (*Function)(Delivery*), Delivery* Argument, uintptr_t Top)
+            {
+#if defined(__x86_64__)
+                reg(ContextRecord, REG_RDI) = (greg_t)Argument;
+                reg(ContextRecord, Sp) = (greg_t)(Top - sizeof(void*)); //Where a call would leave the return address
+#else
+                reinterpret_cast<Delivery**>(Top)[-4] = Argument; //The stack 16 byte aligned at the argument
+                reg(ContextRecord, Sp) = (greg_t)(Top - 5 * sizeof(void*));
+#endif
+                reg(ContextRecord, Ip) = (greg_t)Function;
+                reg(ContextRecord, Flags) &= ~(greg_t)0x400; //The ABI wants DF clear on every call
+            }
+        }
+
+        //Same layout as the one ExecuteHandler builds, the EstablisherFrame is saved after the registration
+        struct NestedRegistration
+        {
+            Registration Nested;
+            Registration* EstablisherFrame;
+        };
+
+        //Used to catch exceptions inside handlers
+        template <bool unwind, class Tracer, Core::Disposition disposition = unwind ? Core::CollidedUnwind : Core::NestedException>
+        Core::Disposition NestedExceptionHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context*, void* DispatcherContext)
+        {
+            if ((bool)(ExceptionRecord->ExceptionFlags & (Core::Flags::Unwinding | Core::Flags::ExitUnwind)) == unwind)
+            {
+                *static_cast<Registration**>(DispatcherContext) = reinterpret_cast<NestedRegistration*>(EstablisherFrame)->EstablisherFrame;
+                Tracer::nested(unwind, *static_cast<Registration**>(DispatcherContext));
+                return disposition;
+            }
+
+            return Core::ContinueSearch;
+        }
+
+        [[noreturn]] inline void forwardUnhandled(Context* ContextRecord);
+        inline void dispatchFirstChance(Record* Exception);
+
+        template <class StatisticsPolicy = SEH::Statistics::Disabled, class TracePolicy = Trace::Disabled>
+        struct BasicPlatform
+        {
+            typedef Posix::Record Record;
+            typedef Posix::Context Context;
+            typedef Posix::Registration Registration;
+            typedef uintptr_t Address;
+            typedef StatisticsPolicy Statistics;
+            typedef TracePolicy Tracer;
+
+            static const Address alignmentMask = alignof(Registration) - 1;
+            static const bool checkChainOrder = true;
+            static const unsigned int maxChainDepth = 0;
+
+            static Registration* getRegistrationHead()
+            {
+                return currentTeb().ExceptionList;
+            }
+
+            static void popRegistrationHead()
+            {
+                Teb& teb = currentTeb();
+                teb.ExceptionList = teb.ExceptionList->Next;
+            }
+
+            static void getStackLimits(Address& stackLow, Address& stackHigh)
+            {
+                const Teb& teb = currentTeb();
+
+                stackLow = teb.StackLimit;
+                stackHigh = teb.StackBase;
+            }
+
+            static Address getInstructionPointer(const Context& Context)
+            {
+                return (Address)Arch::reg(const_cast<Posix::Context&>(Context), Arch::Ip);
+            }
+
+            template <bool unwind>
+            static Core::Disposition executeHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, Registration*& DispatcherContext, Routine Handler)
+            {
+                Teb& teb = currentTeb();
+
+                //Add NestedExceptionHandler to the chain in case Handler faults
+                NestedRegistration Nested = { { teb.ExceptionList, &NestedExceptionHandler<unwind, Tracer> }, EstablisherFrame };
+                teb.ExceptionList = &Nested.Nested;
+
+                Core::Disposition Disposition = Handler(ExceptionRecord, EstablisherFrame, ContextRecord, &DispatcherContext);
+
+                teb.ExceptionList = Nested.Nested.Next;
+                return Disposition;
+            }
+
+            static bool isHandlerAllowed(const Registration*)
+            {
+                return true;
+            }
+
+            static bool skipHandler(const Record*, const Registration*)
+            {
+                return false;
+            }
+
+            static Routine frameHandler(const Registration* Frame)
+            {
+                return Frame->Handler;
+            }
+
+            //Nothing is memoized unless a platform deriving from this one says which handlers are memo-safe
+            static const bool resolutionMemo = false;
+
+            static bool isMemoSafe(const Registration*)
+            {
+                return false;
+            }
+
+            static uint64_t memoGeneration()
+            {
+                return 0;
+            }
+
+            //Unwind returns to its caller, dispatchDelivery resumes the context once the dispatch is over
+            static void continueContext(Context*, Registration*)
+            {
+            }
+
+            static void raiseException(Record* Exception)
+            {
+                dispatchFirstChance(Exception);
+            }
+
+            static void raiseUnhandled(Record*, Context* Context)
+            {
+                forwardUnhandled(Context);
+            }
+        };
+
+        typedef BasicPlatform<> Platform;
+
+        //What was installed for each signal before enableSignals
+        struct Installed
+        {
+            struct sigaction Previous[_NSIG];
+            bool enabled;
+        };
+
+        inline Installed& installed()
+        {
+            static Installed state = {};
+            return state;
+        }
+
+        const int faultSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+
+        //The exception code Windows uses for the same fault
+        inline void translate(Record& Exception, int Signal, const siginfo_t* Info, Context& ContextRecord)
+        {
+            Exception.ExceptionFlags = 0;
+            Exception.ExceptionRecord = NULL;
+            Exception.ExceptionAddress = (void*)(uintptr_t)Arch::reg(ContextRecord, Arch::Ip);
+            Exception.NumberParameters = 0;
+
+            switch (Signal)
+            {
+            case SIGSEGV:
+            case SIGBUS:
+
+                if (Signal == SIGBUS && Info->si_code == BUS_ADRALN)
+                {
+                    Exception.ExceptionCode = Status::DatatypeMisalignment;
+                    break;
+                }
+
+                Exception.ExceptionCode = (Signal == SIGSEGV) ? Status::AccessViolation : Status::InPageError;
+                Exception.NumberParameters = 2;
+
+                //Page fault error code: bit 1 is a write, bit 4 an instruction fetch (8 for DEP like Windows)
+                if (Arch::reg(ContextRecord, Arch::Trap) == 14)
+                {
+                    uintptr_t Error = (uintptr_t)Arch::reg(ContextRecord, Arch::Error);
+                    Exception.ExceptionInformation[0] = (Error & 0x10) ? 8 : ((Error & 0x2) ? 1 : 0);
+                }
+                else
+                    Exception.ExceptionInformation[0] = 0;
+
+                Exception.ExceptionInformation[1] = (uintptr_t)Info->si_addr;
+                break;
+
+            case SIGFPE:
+
+                switch (Info->si_code)
+                {
+                case FPE_INTDIV: Exception.ExceptionCode = Status::IntegerDivideByZero; break;
+                case FPE_INTOVF: Exception.ExceptionCode = Status::IntegerOverflow; break;
+                case FPE_FLTDIV: Exception.ExceptionCode = Status::FloatDivideByZero; break;
+                case FPE_FLTOVF: Exception.ExceptionCode = Status::FloatOverflow; break;
+                case FPE_FLTUND: Exception.ExceptionCode = Status::FloatUnderflow; break;
+                case FPE_FLTRES: Exception.ExceptionCode = Status::FloatInexactResult; break;
+                case FPE_FLTSUB: Exception.ExceptionCode = Status::ArrayBoundsExceeded; break;
+                default: Exception.ExceptionCode = Status::FloatInvalidOperation; break;
+                }
+
+                break;
+
+            default:
+                Exception.ExceptionCode = (Info->si_code == ILL_PRVOPC || Info->si_code == ILL_PRVREG) ? Status::PrivilegedInstruction : Status::IllegalInstruction;
+                break;
+            }
+        }
+
+        //What the signal would have done without enableSignals
+        inline void chainSignal(int Signal, siginfo_t* Info, void* UserContext)
+        {
+            const struct sigaction& Previous = installed().Previous[Signal];
+
+            if ((Previous.sa_flags & SA_SIGINFO) && Previous.sa_sigaction != NULL)
+            {
+                Previous.sa_sigaction(Signal, Info, UserContext);
+                return;
+            }
+
+            if (Previous.sa_handler != SIG_DFL && Previous.sa_handler != SIG_IGN)
+            {
+                Previous.sa_handler(Signal);
+                return;
+            }
+
+            //A fault comes again when the instruction is retried, one sent by kill doesn't
+            signal(Signal, SIG_DFL);
+
+            if (Info->si_code <= 0)
+            {
+                raise(Signal);
+            }
+        }
+
+        /*
+            Where the thread continues after the signal handler, on its own stack. Never
+            returns: the context is resumed or the fault is given back to the signal's
+            old handler.
+        */
+        [[noreturn]] inline void dispatchDelivery(Delivery* Fault)
+        {
+            Teb& teb = currentTeb();
+            Fault->Outer = teb.Current;
+            teb.Current = Fault;
+
+            long Result = Core::DispatchException<Platform>(&Fault->Exception, &Fault->ContextRecord);
+
+            teb.Current = Fault->Outer;
+
+            if (Result == Core::ContinueExecutionFilter)
+            {
+                Arch::sigreturn(&Fault->ContextRecord);
+            }
+
+            forwardUnhandled(&Fault->ContextRecord);
+        }
+
+        //RtlRaiseException for the codes the core raises while a fault is dispatched
+        inline void dispatchFirstChance(Record* Exception)
+        {
+            Delivery* Fault = currentTeb().Current;
+
+            if (Fault == NULL)
+            {
+                abort(); //Raised by an Unwind outside of any dispatch, there's no context to give it
+            }
+
+            //The core only raises exceptions that can't be continued, it comes back here if nobody unwinds
+            Core::DispatchException<Platform>(Exception, &Fault->ContextRecord);
+            forwardUnhandled(&Fault->ContextRecord);
+        }
+
+        /*
+            NtRaiseException with FirstChance FALSE. The context is resumed so the fault
+            happens again, and this time it goes straight to the old handler, which gets
+            the real siginfo. By default that kills the process at the faulting instruction.
+        */
+        [[noreturn]] inline void forwardUnhandled(Context* ContextRecord)
+        {
+            Teb& teb = currentTeb();
+
+            if (teb.Current == NULL)
+            {
+                abort();
+            }
+
+            teb.Forward = teb.Current->Signal;
+            teb.Current = NULL;
+            Arch::sigreturn(ContextRecord);
+        }
+
+        inline void onSignal(int Signal, siginfo_t* Info, void* UserContext)
+        {
+            Context& Interrupted = *static_cast<Context*>(UserContext);
+            Teb& teb = currentTeb();
+
+            //Only faults of threads with frames are dispatched, not signals sent with kill
+            if (teb.Forward == Signal || Info->si_code <= 0 || teb.StackLimit == 0 || teb.ExceptionList == Core::chainEnd<Registration>())
+            {
+                teb.Forward = 0;
+                chainSignal(Signal, Info, UserContext);
+                return;
+            }
+
+            const void* Float = Interrupted.uc_mcontext.fpregs;
+            size_t floatSize = Arch::floatSize(Float);
+
+            //Delivery, then the FPU state with its FXSAVE image 64 byte aligned
+            uintptr_t Sp = (uintptr_t)Arch::reg(Interrupted, Arch::Sp);
+            uintptr_t FloatState = ((Sp - Layout::redZone - floatSize) & ~(uintptr_t)63) - Layout::floatHeader;
+            uintptr_t Top = (FloatState - sizeof(Delivery)) & ~(uintptr_t)63;
+
+            if (Sp > teb.StackBase || Top < teb.StackLimit + Layout::dispatchReserve)
+            {
+                //Not on the thread's stack or no room left to dispatch on, a stack overflow most likely
+                chainSignal(Signal, Info, UserContext);
+                return;
+            }
+
+            Delivery* Fault = reinterpret_cast<Delivery*>(Top);
+            memcpy(&Fault->ContextRecord, &Interrupted, Arch::contextSize);
+            Fault->Signal = Signal;
+
+            if (Float != NULL)
+            {
+                memcpy((void*)FloatState, Float, floatSize);
+                Fault->ContextRecord.uc_mcontext.fpregs = reinterpret_cast<decltype(Fault->ContextRecord.uc_mcontext.fpregs)>(FloatState);
+            }
+
+            translate(Fault->Exception, Signal, Info, Fault->ContextRecord);
+            Arch::redirect(Interrupted, &dispatchDelivery, Fault, Top);
+        }
+
+        /*
+            Installs the handler for SIGSEGV, SIGBUS, SIGFPE and SIGILL, keeping what was
+            installed before for the faults that aren't handled. Call once at startup.
+        */
+        inline bool enableSignals()
+        {
+            Installed& state = installed();
+
+            if (state.enabled)
+            {
+                return true;
+            }
+
+            struct sigaction Action = {};
+            Action.sa_sigaction = &onSignal;
+            Action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&Action.sa_mask);
+
+            for (int Signal : faultSignals)
+            {
+                if (sigaction(Signal, &Action, &state.Previous[Signal]) != 0)
+                {
+                    return false;
+                }
+            }
+
+            state.enabled = true;
+            return true;
+        }
+
+        inline void disableSignals()
+        {
+            Installed& state = installed();
+
+            if (!state.enabled)
+            {
+                return;
+            }
+
+            for (int Signal : faultSignals)
+            {
+                sigaction(Signal, &state.Previous[Signal], NULL);
+            }
+
+            state.enabled = false;
+        }
+
+        //Reads the stack limits and gives the calling thread an alternate stack
+        inline bool enterThread()
+        {
+            Teb& teb = currentTeb();
+
+            if (teb.StackLimit != 0)
+            {
+                return true;
+            }
+
+            pthread_attr_t Attributes;
+            void* StackAddress;
+            size_t StackSize;
+            size_t GuardSize = 0;
+
+            if (pthread_getattr_np(pthread_self(), &Attributes) != 0)
+            {
+                return false;
+            }
+
+            bool read = pthread_attr_getstack(&Attributes, &StackAddress, &StackSize) == 0;
+            pthread_attr_getguardsize(&Attributes, &GuardSize);
+            pthread_attr_destroy(&Attributes);
+
+            if (!read)
+            {
+                return false;
+            }
+
+            void* Alternate = mmap(NULL, Layout::alternateSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+            if (Alternate == MAP_FAILED)
+            {
+                return false;
+            }
+
+            stack_t Stack = {};
+            Stack.ss_sp = Alternate;
+            Stack.ss_size = Layout::alternateSize;
+
+            if (sigaltstack(&Stack, NULL) != 0)
+            {
+                munmap(Alternate, Layout::alternateSize);
+                return false;
+            }
+
+            teb.AlternateStack = Alternate;
+            teb.AlternateSize = Layout::alternateSize;
+            teb.StackBase = (uintptr_t)StackAddress + StackSize;
+            teb.StackLimit = (uintptr_t)StackAddress + GuardSize;
+            return true;
+        }
+
+        //Before the thread exits, its frames must be gone by then
+        inline void leaveThread()
+        {
+            Teb& teb = currentTeb();
+
+            if (teb.StackLimit == 0)
+            {
+                return;
+            }
+
+            stack_t Stack = {};
+            Stack.ss_flags = SS_DISABLE;
+            sigaltstack(&Stack, NULL);
+            munmap(teb.AlternateStack, teb.AlternateSize);
+
+            teb = { Core::chainEnd<Registration>(), 0, 0, NULL, 0, NULL, 0 };
+        }
+
+        //Registers Frame at the top of the chain
+        inline void pushRegistration(Registration& Frame, Routine Handler)
+        {
+            Teb& teb = currentTeb();
+
+            Frame.Next = teb.ExceptionList;
+            Frame.Handler = Handler;
+            teb.ExceptionList = &Frame;
+        }
+
+        inline void popRegistration(Registration& Frame)
+        {
+            currentTeb().ExceptionList = Frame.Next;
+        }
+
+        //SEH::Unwind, for handlers that unwind to their own frame before resuming
+        inline void Unwind(Registration* TargetFrame, Record* pException, Context* ContextRecord)
+        {
+            Core::Unwind<Platform>(TargetFrame, pException, ContextRecord);
+        }
+
+        /*
+            A frame that catches faults the way __try/__except does, resuming with a
+            __builtin_setjmp buffer instead of a compiler generated landing pad. Entering
+            it is a few stores, no signal mask is saved (sigsetjmp does a syscall for
+            that) because the mask is the thread's own again by the time handlers run.
+
+                Posix::Guard Guard;
+
+                if (__builtin_setjmp(Guard.Resume) == 0)
+                {
+                    Posix::pushGuard(Guard);
+                    ...
+                    Posix::popGuard(Guard);
+                }
+                else
+                {
+                    //Guard.Exception is what was caught, the guard is already popped
+                }
+
+            As with setjmp, locals changed after __builtin_setjmp and read in the else
+            branch have to be volatile. Filter, if set, picks the exceptions to catch.
+        */
+        struct Guard
+        {
+            Registration Frame;
+            bool (*Filter)(const Record* Exception);
+            void* Resume[5];
+            Record Exception;
+        };
+
+        inline Core::Disposition guardHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, void*)
+        {
+            Guard& Target = *reinterpret_cast<Guard*>(EstablisherFrame);
+
+            if ((ExceptionRecord->ExceptionFlags & (Core::Flags::Unwinding | Core::Flags::ExitUnwind)) || (Target.Filter != NULL && !Target.Filter(ExceptionRecord)))
+            {
+                return Core::ContinueSearch;
+            }
+
+            Target.Exception = *ExceptionRecord;
+            Target.Exception.ExceptionRecord = NULL; //Lives on the stack that's about to be dropped
+
+            //Newer frames get their unwind call, then the guard itself is done
+            Unwind(EstablisherFrame, ExceptionRecord, ContextRecord);
+            popRegistration(Target.Frame);
+
+            //The dispatches of faults newer than the guard are over
+            Teb& teb = currentTeb();
+
+            while (teb.Current != NULL && (uintptr_t)teb.Current < (uintptr_t)&Target)
+            {
+                teb.Current = teb.Current->Outer;
+            }
+
+            __builtin_longjmp(Target.Resume, 1);
+        }
+
+        inline void pushGuard(Guard& Target)
+        {
+            pushRegistration(Target.Frame, &guardHandler);
+        }
+
+        inline void popGuard(Guard& Target)
+        {
+            popRegistration(Target.Frame);
+        }
+    }
+}
\ No newline at end of file
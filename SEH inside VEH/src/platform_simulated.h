@@ -0,0 +1,243 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "dispatch_core.h"
+
+/*
+    A platform for dispatch_core.h where the thread is simulated. Every thread gets
+    a simulated TEB holding its own registration chain and stack limits, handlers are
+    plain functions and NtContinue/NtRaiseException are replaced with stand-ins.
+
+    This is what lets DispatchException and Unwind be compiled and profiled with
+    GCC/Clang on any host. Nothing here is used by the library itself.
+*/
+
+namespace SEH
+{
+    namespace Simulated
+    {
+        struct Registration;
+
+        //Laid out like EXCEPTION_RECORD but with pointer sized fields for the host
+        struct Record
+        {
+            uint32_t ExceptionCode;
+            uint32_t ExceptionFlags;
+            Record* ExceptionRecord;
+            void* ExceptionAddress;
+            uint32_t NumberParameters;
+            uintptr_t ExceptionInformation[15];
+        };
+
+        //Only the registers the dispatcher and unwinder care about
+        struct Context
+        {
+            uintptr_t Eip;
+            uintptr_t Esp;
+            uintptr_t Ebp;
+            uintptr_t Eax;
+        };
+
+        typedef Core::Disposition(*Routine)(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, void* DispatcherContext);
+
+        struct Registration
+        {
+            Registration* Next;
+            Routine Handler;
+        };
+
+        //The parts of the TEB the dispatcher reads (NT_TIB ExceptionList, StackBase and StackLimit)
+        struct Teb
+        {
+            Registration* ExceptionList;
+            uintptr_t StackLimit;
+            uintptr_t StackBase;
+        };
+
+        inline Teb& currentTeb()
+        {
+            thread_local Teb teb = { Core::chainEnd<Registration>(), 0, UINTPTR_MAX };
+            return teb;
+        }
+
+        //Thrown by the raise stand-ins, the real ones never return
+        struct RaisedException
+        {
+            Record Exception;
+            bool firstChance;
+        };
+
+        /*
+            Same layout ExecuteHandler builds on the stack. The saved EstablisherFrame
+            sits right after the registration of NestedExceptionHandler.
+        */
+        struct NestedRegistration
+        {
+            Registration Nested;
+            Registration* EstablisherFrame;
+        };
+
+        //Used to catch exceptions inside other simulated handlers
+        template <bool unwind, class Tracer, Core::Disposition disposition = unwind ? Core::CollidedUnwind : Core::NestedException>
+        Core::Disposition NestedExceptionHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context*, void* DispatcherContext)
+        {
+            if ((bool)(ExceptionRecord->ExceptionFlags & (Core::Flags::Unwinding | Core::Flags::ExitUnwind)) == unwind)
+            {
+                *static_cast<Registration**>(DispatcherContext) = reinterpret_cast<NestedRegistration*>(EstablisherFrame)->EstablisherFrame;
+                Tracer::nested(unwind, *static_cast<Registration**>(DispatcherContext));
+                return disposition;
+            }
+
+            return Core::ContinueSearch;
+        }
+
+        //Statistics and tracing are disabled unless a benchmark wants to measure the recorders
+        template <class StatisticsPolicy = SEH::Statistics::Disabled, class TracePolicy = Trace::Disabled>
+        struct BasicPlatform
+        {
+            typedef Simulated::Record Record;
+            typedef Simulated::Context Context;
+            typedef Simulated::Registration Registration;
+            typedef uintptr_t Address;
+            typedef StatisticsPolicy Statistics;
+            typedef TracePolicy Tracer;
+
+            static const Address alignmentMask = alignof(Registration) - 1;
+            static const bool checkChainOrder = true;
+            static const unsigned int maxChainDepth = 0;
+
+            static Registration* getRegistrationHead()
+            {
+                return currentTeb().ExceptionList;
+            }
+
+            static void popRegistrationHead()
+            {
+                Teb& teb = currentTeb();
+                teb.ExceptionList = teb.ExceptionList->Next;
+            }
+
+            static void getStackLimits(Address& stackLow, Address& stackHigh)
+            {
+                const Teb& teb = currentTeb();
+
+                stackLow = teb.StackLimit;
+                stackHigh = teb.StackBase;
+            }
+
+            static Address getInstructionPointer(const Context& Context)
+            {
+                return Context.Eip;
+            }
+
+            template <bool unwind>
+            static Core::Disposition executeHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, Registration*& DispatcherContext, Routine Handler)
+            {
+                Teb& teb = currentTeb();
+
+                //Add NestedExceptionHandler to the chain in case Handler raises
+                NestedRegistration Nested = { { teb.ExceptionList, &NestedExceptionHandler<unwind, Tracer> }, EstablisherFrame };
+                teb.ExceptionList = &Nested.Nested;
+
+                Core::Disposition Disposition = Handler(ExceptionRecord, EstablisherFrame, ContextRecord, &DispatcherContext);
+
+                teb.ExceptionList = Nested.Nested.Next;
+                return Disposition;
+            }
+
+            //Every handler is called, benchmarks override this to skip some
+            static bool isHandlerAllowed(const Registration*)
+            {
+                return true;
+            }
+
+            static bool skipHandler(const Record*, const Registration*)
+            {
+                return false;
+            }
+
+            static Routine frameHandler(const Registration* Frame)
+            {
+                return Frame->Handler;
+            }
+
+            //Nothing is memoized, benchmarks override these to measure resolution_memo.h
+            static const bool resolutionMemo = false;
+
+            static bool isMemoSafe(const Registration*)
+            {
+                return false;
+            }
+
+            static uint64_t memoGeneration()
+            {
+                return 0;
+            }
+
+            //The unwinder's caller simply returns instead of resuming a captured context
+            static void continueContext(Context*, Registration*)
+            {
+            }
+
+            static void raiseException(Record* Exception)
+            {
+                throw RaisedException{ *Exception, true };
+            }
+
+            static void raiseUnhandled(Record* Exception, Context*)
+            {
+                throw RaisedException{ *Exception, false };
+            }
+        };
+
+        typedef BasicPlatform<> Platform;
+
+        //Registers Frame at the top of the simulated chain
+        inline void pushRegistration(Registration& Frame, Routine Handler)
+        {
+            Teb& teb = currentTeb();
+
+            Frame.Next = teb.ExceptionList;
+            Frame.Handler = Handler;
+            teb.ExceptionList = &Frame;
+        }
+
+        //Limits the frames DispatchException and Unwind will accept for this thread
+        inline void setStackLimits(uintptr_t stackLow, uintptr_t stackHigh)
+        {
+            Teb& teb = currentTeb();
+
+            teb.StackLimit = stackLow;
+            teb.StackBase = stackHigh;
+        }
+
+        //Stand-in for the VEH DispatchException is installed as
+        inline long DispatchException(Record* Exception, Context* Context)
+        {
+            return Core::DispatchException<Platform>(Exception, Context);
+        }
+
+        //Stand-in for SEH::Unwind
+        inline void Unwind(Registration* TargetFrame, Record* pException)
+        {
+            Context Context = {};
+            Core::Unwind<Platform>(TargetFrame, pException, &Context);
+        }
+    }
+}
\ No newline at end of file
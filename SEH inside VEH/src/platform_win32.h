@@ -0,0 +1,211 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "epoch.h"
+#include "handler.h"
+#include "cxx_fast_path.h"
+#include "except_handler.h"
+#include "dispatch_core.h"
+#include "handler_profile.h"
+#include "module_tracking.h"
+#include "trace_dump.h"
+#include "snapshot_dump.h"
+#include "telemetry_export.h"
+#include "exception_registration.h"
+
+namespace SEH
+{
+    namespace Win32
+    {
+        //Ticks for the latency histograms, QueryPerformanceFrequency per second
+        struct Clock
+        {
+            static uint64_t now()
+            {
+                LARGE_INTEGER Counter;
+                QueryPerformanceCounter(&Counter);
+
+                return Counter.QuadPart;
+            }
+        };
+
+        /*
+            FlushProcessWriteBuffers orders every other thread's stores for the one closing,
+            so dispatches only need the compiler to keep their store before their load.
+        */
+        struct Barrier
+        {
+            static void light()
+            {
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            }
+
+            static void heavy()
+            {
+                FlushProcessWriteBuffers();
+            }
+        };
+
+        //Dispatches in flight, DisableSEH waits for them
+        typedef Epoch::Domain<Barrier> Dispatches;
+
+        //The real thread: fs:[0], the TIB stack limits and ntdll
+        struct Platform
+        {
+            typedef EXCEPTION_RECORD Record;
+            typedef CONTEXT Context;
+            typedef EXCEPTION_REGISTRATION_RECORD Registration;
+            typedef DWORD Address;
+
+        #if DISPATCH_STATISTICS && TELEMETRY_EXPORT
+            typedef SEH::Statistics::Recorder<Clock, Telemetry_Export::Publisher> Statistics;
+        #elif DISPATCH_STATISTICS
+            typedef SEH::Statistics::Recorder<Clock> Statistics;
+        #else
+            typedef SEH::Statistics::Disabled Statistics;
+        #endif
+
+        #if DISPATCH_TRACE
+            typedef Trace::Recorder<Clock> Tracer;
+        #else
+            typedef Trace::Disabled Tracer;
+        #endif
+
+            static const Address alignmentMask = 0x3;
+            static const bool checkChainOrder = true;
+            static const unsigned int maxChainDepth = MAX_CHAIN_DEPTH;
+
+            static Registration* getRegistrationHead()
+            {
+                return SEH::Registration::getRegistrationHead();
+            }
+
+            static void popRegistrationHead()
+            {
+                SEH::Registration::popRegistrationHead();
+            }
+
+            static void getStackLimits(Address& stackLow, Address& stackHigh)
+            {
+                GetCurrentThreadStackLimits(&stackLow, &stackHigh);
+            }
+
+            static Address getInstructionPointer(const Context& Context)
+            {
+                return Context.Eip;
+            }
+
+            template <bool unwind>
+            static Core::Disposition executeHandler(Record* ExceptionRecord, Registration* EstablisherFrame, Context* ContextRecord, Registration*& DispatcherContext, PEXCEPTION_ROUTINE Routine)
+            {
+            #if HANDLER_PROFILING
+                //The frame's own handler, Routine may be the library's stand-in for it (see frameHandler). Read before the frame can go away
+                DWORD Profiled = (DWORD)EstablisherFrame->Handler;
+
+                //Timed out here, ExecuteHandler is naked
+                uint64_t start = __rdtsc();
+            #endif
+
+                Core::Disposition Disposition = (Core::Disposition)Handler::ExecuteHandler(ExceptionRecord, EstablisherFrame, ContextRecord, DispatcherContext, Routine, &Handler::NestedExceptionHandler<unwind>);
+
+            #if HANDLER_PROFILING
+                Handler_Profile::profiles().record(Profiled, __rdtsc() - start, Disposition);
+            #endif
+
+                return Disposition;
+            }
+
+            static bool isHandlerAllowed(const Registration* Frame)
+            {
+            #if HANDLER_MANIFEST
+                //ExecuteHandler's nested registrations are the library's own and pushed from a parameter, no manifest lists them
+                if (Frame->Handler == (PEXCEPTION_ROUTINE)&Handler::NestedExceptionHandler<false> || Frame->Handler == (PEXCEPTION_ROUTINE)&Handler::NestedExceptionHandler<true>)
+                {
+                    return true;
+                }
+
+                return Module_Tracking::index().manifestAllows((DWORD)Frame->Handler);
+            #else
+                return true;
+            #endif
+            }
+
+            static bool skipHandler(const Record* Exception, const Registration* Frame)
+            {
+            #if CXX_FAST_PATH
+                return Cxx_Fast_Path::skip(Exception, Frame);
+            #else
+                return false;
+            #endif
+            }
+
+            static PEXCEPTION_ROUTINE frameHandler(const Registration* Frame)
+            {
+            #if SCOPE_TABLE_DISPATCH
+                return Except_Handler::frameHandler(Frame);
+            #else
+                return Frame->Handler;
+            #endif
+            }
+
+            static const bool resolutionMemo = (RESOLUTION_MEMO != 0);
+
+            static bool isMemoSafe(const Registration* Frame)
+            {
+                return Resolution_Memo::safeHandlers().contains((uintptr_t)Frame->Handler);
+            }
+
+            static uint64_t memoGeneration()
+            {
+                //Handlers added or removed, or a module loaded or unloaded where a handler may have been
+                return ((uint64_t)Resolution_Memo::safeHandlers().generation() << 32) | Resolution_Memo::moduleGeneration();
+            }
+
+            static void continueContext(Context* Context, Registration* TargetFrame)
+            {
+                /*
+                    Only Unwind continues a context. Context is the caller's (a frame handler below
+                    the VEH), but it resumes in the catch or __except of the function that registered
+                    TargetFrame, above every dispatch it unwound, and never returns to them.
+                */
+                Dispatches::abandon((uintptr_t)TargetFrame);
+                NtContinue(Context, FALSE);
+            }
+
+            static void raiseException(Record* Exception)
+            {
+                RtlRaiseException(Exception);
+            }
+
+            static void raiseUnhandled(Record* Exception, Context* Context)
+            {
+            #if DISPATCH_TRACE
+                Trace_Dump::secondChance(); //Last chance to see how we got here
+            #endif
+
+            #if CRASH_SNAPSHOT
+                Snapshot_Dump::secondChance(Exception, Context);
+            #endif
+
+                NtRaiseException(Exception, Context, FALSE);
+            }
+        };
+    }
+}
\ No newline at end of file
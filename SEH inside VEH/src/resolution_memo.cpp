@@ -0,0 +1,106 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include <atomic>
+
+#include "SEH.h"
+#include "resolution_memo.h"
+
+namespace SEH
+{
+    namespace Resolution_Memo
+    {
+        SafeHandlers& safeHandlers()
+        {
+            static SafeHandlers handlers;
+            return handlers;
+        }
+
+        static std::atomic<uint32_t> modules(1);
+
+        uint32_t moduleGeneration()
+        {
+            return modules.load(std::memory_order_acquire);
+        }
+    }
+}
+
+#if RESOLUTION_MEMO
+
+namespace SEH
+{
+    namespace Resolution_Memo
+    {
+        static PVOID Cookie = NULL;
+
+        //Called by the loader with the loader lock held, only bumps the generation
+        static VOID CALLBACK notification(ULONG, const LDR_DLL_NOTIFICATION_DATA*, PVOID)
+        {
+            modules.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        void watchModules()
+        {
+            if (!Cookie)
+            {
+                LdrRegisterDllNotification(0, &notification, NULL, &Cookie);
+            }
+
+            //Modules may have come and gone while nobody was watching
+            modules.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        void unwatchModules()
+        {
+            if (Cookie)
+            {
+                LdrUnregisterDllNotification(Cookie);
+                Cookie = NULL;
+            }
+        }
+    }
+
+    bool AddMemoSafeHandler(PEXCEPTION_ROUTINE Handler)
+    {
+        return Handler != NULL && Resolution_Memo::safeHandlers().add((uintptr_t)Handler);
+    }
+
+    bool RemoveMemoSafeHandler(PEXCEPTION_ROUTINE Handler)
+    {
+        return Resolution_Memo::safeHandlers().remove((uintptr_t)Handler);
+    }
+}
+
+#else
+
+namespace SEH
+{
+    bool AddMemoSafeHandler(PEXCEPTION_ROUTINE)
+    {
+        return false;
+    }
+
+    bool RemoveMemoSafeHandler(PEXCEPTION_ROUTINE)
+    {
+        return false;
+    }
+}
+
+#endif
\ No newline at end of file
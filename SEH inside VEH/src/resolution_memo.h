@@ -0,0 +1,364 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/*
+    A per-thread memo of how DispatchException got through the chain last time, for
+    programs that raise the same exception from the same place over and over (guard
+    pages, probes, retried faults).
+
+    A path is keyed by the exception's code, flags and address, the chain head and the
+    platform's memo generation. It lists the frames walked and their handlers in order,
+    with a bit for every frame whose handler is memo-safe and returned ContinueSearch.
+    Memo-safe handlers promised that what they return depends on nothing but the key
+    and the frames, and that declining has no side effects. When the key matches,
+    the ContinueSearch they returned is replayed instead of calling them again; one
+    that took the exception last time is called again.
+
+    The memo never jumps over frames. Every frame is still checked the way it always
+    is, and compared with the path; the first frame or handler that differs ends the
+    path there and the walk goes on recording. So a chain that changed below its head,
+    or a handler swapped in the same frame, is noticed before a single handler is
+    skipped wrongly. Anything the platform can't see in the chain (a handler no longer
+    memo-safe, a module loaded over an old one) has to bump the generation, which drops
+    every path at once.
+
+    Only walks that see nothing but ContinueSearch are recorded, a nested exception or
+    a handler that doesn't return ends the recording. What was recorded up to then is
+    kept, so repeated exceptions that end in an unwind (C++ catch, __except) are still
+    memoized up to the catching frame.
+*/
+
+namespace SEH
+{
+    namespace Resolution_Memo
+    {
+        //Frames a path holds, the rest of a longer walk is dispatched as usual
+        const unsigned int maxFrames = 64;
+
+        //Paths a thread remembers, replaced round-robin
+        const unsigned int ways = 4;
+
+        //Same values as Core::Disposition, dispatch_core.h includes this header
+        enum : unsigned int
+        {
+            ContinueSearch = 1
+        };
+
+        /*
+            Handlers registered as memo-safe. Lookups are lock-free, writers are serialized
+            by a mutex and bump the generation so no path recorded before the change is used.
+        */
+        template <size_t capacity = 64>
+        class Handlers
+        {
+        public:
+            Handlers() : used(0), currentGeneration(1)
+            {
+                for (std::atomic<uintptr_t>& slot : slots)
+                {
+                    slot.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            //Returns false if every slot is taken
+            bool add(uintptr_t Handler)
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                size_t count = used.load(std::memory_order_relaxed);
+                size_t freeSlot = capacity;
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    uintptr_t value = slots[i].load(std::memory_order_relaxed);
+
+                    if (value == Handler)
+                    {
+                        return true;
+                    }
+
+                    if (value == 0 && freeSlot == capacity)
+                    {
+                        freeSlot = i;
+                    }
+                }
+
+                if (freeSlot == capacity)
+                {
+                    if (count == capacity)
+                    {
+                        return false;
+                    }
+
+                    freeSlot = count;
+                    used.store(count + 1, std::memory_order_release);
+                }
+
+                slots[freeSlot].store(Handler, std::memory_order_release);
+                bump();
+
+                return true;
+            }
+
+            //Returns false if Handler wasn't added
+            bool remove(uintptr_t Handler)
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                size_t count = used.load(std::memory_order_relaxed);
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if (slots[i].load(std::memory_order_relaxed) == Handler)
+                    {
+                        slots[i].store(0, std::memory_order_release);
+                        bump();
+
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            bool contains(uintptr_t Handler) const
+            {
+                size_t count = used.load(std::memory_order_acquire);
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if (slots[i].load(std::memory_order_acquire) == Handler)
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            //Read before looking handlers up, like Verdict_Cache::Cache::generation
+            uint32_t generation() const
+            {
+                return currentGeneration.load(std::memory_order_acquire);
+            }
+
+        private:
+            void bump()
+            {
+                currentGeneration.fetch_add(1, std::memory_order_acq_rel);
+            }
+
+            std::atomic<uintptr_t> slots[capacity];
+            std::atomic<size_t> used;
+            std::atomic<uint32_t> currentGeneration;
+            std::mutex writer;
+        };
+
+        typedef Handlers<> SafeHandlers;
+
+        //The handlers the library treats as memo-safe, defined by whoever links the library (resolution_memo.cpp)
+        SafeHandlers& safeHandlers();
+
+        /*
+            Bumped whenever a module loads or unloads between watchModules and unwatchModules,
+            a handler may have moved to or from its address. Windows only (resolution_memo.cpp).
+        */
+        uint32_t moduleGeneration();
+        void watchModules();
+        void unwatchModules();
+
+        template <class Registration>
+        struct Path
+        {
+            uint64_t Generation;
+            uint64_t Stamp; //Changes every time the path is handed to another key
+            Registration* Head;
+            const void* Address;
+            uint32_t Code;
+            uint32_t Flags;
+
+            unsigned int Count; //Frames recorded, 0 for an empty path
+            uint64_t Skippable; //Bit per frame
+            Registration* Frames[maxFrames];
+            const void* Handlers[maxFrames];
+        };
+
+        template <class Registration>
+        struct Table
+        {
+            Path<Registration> Paths[ways];
+            uint64_t Stamps;
+            unsigned int Next;
+        };
+
+        template <class Platform>
+        inline Table<typename Platform::Registration>& table()
+        {
+            thread_local Table<typename Platform::Registration> Memo = {};
+            return Memo;
+        }
+
+        /*
+            One DispatchException walk following and recording a path. skip is asked for
+            every frame that passed the chain checks, record is told what its handler
+            returned (ContinueSearch if it was skipped one way or another).
+
+            A handler can raise and dispatch another exception on the same thread, which
+            may take over the path this walk is on. The walk notices by the stamp and stops
+            using the path.
+        */
+        template <class Platform, bool enabled = Platform::resolutionMemo>
+        class Walk
+        {
+            typedef typename Platform::Registration Registration;
+
+        public:
+            template <class Record>
+            Walk(const Record* Exception, Registration* Head) : Index(0)
+            {
+                Table<Registration>& Memo = table<Platform>();
+                uint64_t Generation = Platform::memoGeneration();
+
+                const void* Address = (const void*)Exception->ExceptionAddress;
+                uint32_t Code = Exception->ExceptionCode;
+                uint32_t Flags = Exception->ExceptionFlags;
+
+                for (Path<Registration>& Candidate : Memo.Paths)
+                {
+                    if (Candidate.Count != 0 && Candidate.Head == Head && Candidate.Address == Address && Candidate.Code == Code && Candidate.Flags == Flags)
+                    {
+                        Current = &Candidate;
+
+                        if (Candidate.Generation != Generation)
+                        {
+                            //Same key but recorded before something changed, start over
+                            Candidate.Generation = Generation;
+                            Candidate.Count = 0;
+                            Candidate.Skippable = 0;
+                            Candidate.Stamp = ++Memo.Stamps;
+                        }
+
+                        Stamp = Candidate.Stamp;
+                        return;
+                    }
+                }
+
+                Current = &Memo.Paths[Memo.Next];
+                Memo.Next = (Memo.Next + 1) % ways;
+
+                Current->Count = 0;
+                Current->Skippable = 0;
+                Current->Generation = Generation;
+                Current->Stamp = Stamp = ++Memo.Stamps;
+                Current->Head = Head;
+                Current->Address = Address;
+                Current->Code = Code;
+                Current->Flags = Flags;
+            }
+
+            //True if Frame's handler doesn't have to be called
+            bool skip(const Registration* Frame)
+            {
+                Skipping = false;
+
+                if (Current == NULL || Current->Stamp != Stamp || Index > Current->Count)
+                {
+                    Current = NULL;
+                    return false;
+                }
+
+                if (Index < Current->Count)
+                {
+                    if (Current->Frames[Index] == Frame && Current->Handlers[Index] == (const void*)Frame->Handler)
+                    {
+                        Skipping = (Current->Skippable >> Index) & 1;
+                    }
+                    else
+                    {
+                        //The chain is different from here on, record it instead
+                        Current->Count = Index;
+                        Current->Skippable &= ((uint64_t)1 << Index) - 1;
+                    }
+                }
+
+                return Skipping;
+            }
+
+            void record(const Registration* Frame, unsigned int Disposition)
+            {
+                if (Current == NULL)
+                {
+                    return;
+                }
+
+                if (Disposition != ContinueSearch)
+                {
+                    Current = NULL;
+                    return;
+                }
+
+                if (Index == Current->Count)
+                {
+                    if (Index == maxFrames)
+                    {
+                        Current = NULL;
+                        return;
+                    }
+
+                    Current->Frames[Index] = const_cast<Registration*>(Frame);
+                    Current->Handlers[Index] = (const void*)Frame->Handler;
+
+                    if (Skipping || Platform::isMemoSafe(Frame))
+                    {
+                        Current->Skippable |= (uint64_t)1 << Index;
+                    }
+
+                    Current->Count = Index + 1;
+                }
+
+                ++Index;
+            }
+
+        private:
+            Path<Registration>* Current;
+            uint64_t Stamp;
+            unsigned int Index;
+            bool Skipping;
+        };
+
+        template <class Platform>
+        class Walk<Platform, false>
+        {
+        public:
+            template <class Record, class Registration>
+            Walk(const Record*, Registration*) {}
+
+            template <class Registration>
+            bool skip(const Registration*) { return false; }
+
+            template <class Registration>
+            void record(const Registration*, unsigned int) {}
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,519 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "handler_manifest.h"
+#include "thread_registry.h"
+
+/*
+    A process-wide index of loaded PE32 images and their SafeSEH tables so that
+    VALID_TOP_HANDLER_CHECK doesn't have to go through GetModuleHandleExW (and the
+    loader lock) or re-parse the load config directory on every exception.
+
+    Images are parsed once when they are added. Finding the image of an address is
+    a single load from a table with one slot per 64KB of the 32-bit address space;
+    images are always mapped on the 64KB allocation granularity so a slot never
+    belongs to two images. The SafeSEH RVAs are kept in Eytzinger (BFS) order, which
+    makes the binary search walk memory front to back instead of jumping around.
+
+    An image carrying a handler manifest (a ".sehm" section, see handler_manifest.h)
+    has its handlers looked up in the manifest's perfect hash instead, and the
+    manifest also says which addresses in it are handlers at all.
+
+    Nothing here touches Windows, images are read from memory as they are mapped
+    (RVA == offset) so a mapped image fixture works just as well as a loaded module.
+*/
+
+namespace SEH
+{
+    namespace Safe_SEH
+    {
+        //Reads little endian values out of a mapped image, failing instead of reading past Size
+        struct ImageView
+        {
+            const uint8_t* Data;
+            size_t Size;
+
+            bool read16(size_t offset, uint16_t& value) const
+            {
+                if (offset > Size || Size - offset < sizeof(value)) return false;
+                memcpy(&value, Data + offset, sizeof(value));
+                return true;
+            }
+
+            bool read32(size_t offset, uint32_t& value) const
+            {
+                if (offset > Size || Size - offset < sizeof(value)) return false;
+                memcpy(&value, Data + offset, sizeof(value));
+                return true;
+            }
+        };
+
+        //What the PE headers say about exception handlers
+        struct ImageInfo
+        {
+            uint32_t SizeOfImage;
+            bool noSEH;                     //IMAGE_DLLCHARACTERISTICS_NO_SEH
+            bool hasLoadConfig;             //IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG exists
+            std::vector<uint32_t> SEHandlerTable; //Sorted RVAs of safe handlers
+            uint32_t ManifestRVA = 0;       //The ".sehm" section, 0 if there's none
+            uint32_t ManifestSize = 0;
+        };
+
+        /*
+            Parses the headers of a mapped PE32 image loaded at Base. SEHandlerTable in the
+            load config directory is a VA, so Base is needed to turn it back into an RVA.
+        */
+        inline bool parseImage(const ImageView& image, uint32_t Base, ImageInfo& info)
+        {
+            //Offsets into IMAGE_DOS_HEADER, IMAGE_NT_HEADERS32 and IMAGE_LOAD_CONFIG_DIRECTORY32
+            const size_t e_lfanew = 0x3C;
+            const size_t NumberOfSections = 4 + 2;
+            const size_t SizeOfOptionalHeader = 4 + 16;
+            const size_t OptionalHeader = 0x18;
+            const size_t SizeOfImage = OptionalHeader + 0x38;
+            const size_t DllCharacteristics = OptionalHeader + 0x46;
+            const size_t NumberOfRvaAndSizes = OptionalHeader + 0x5C;
+            const size_t LoadConfigDirectory = OptionalHeader + 0x60 + 10 * 8;
+            const size_t SEHandlerTable = 0x40;
+            const size_t SEHandlerCount = 0x44;
+
+            uint16_t magic;
+            uint32_t ntHeaders, signature;
+
+            info = ImageInfo();
+
+            if (!image.read16(0, magic) || magic != 0x5A4D || !image.read32(e_lfanew, ntHeaders)) //MZ
+            {
+                return false;
+            }
+
+            uint16_t optionalMagic, dllCharacteristics;
+            uint32_t rvaCount;
+
+            if (!image.read32(ntHeaders, signature) || signature != 0x00004550 //PE\0\0
+                || !image.read16(ntHeaders + OptionalHeader, optionalMagic) || optionalMagic != 0x10B //PE32
+                || !image.read32(ntHeaders + SizeOfImage, info.SizeOfImage)
+                || !image.read16(ntHeaders + DllCharacteristics, dllCharacteristics)
+                || !image.read32(ntHeaders + NumberOfRvaAndSizes, rvaCount))
+            {
+                return false;
+            }
+
+            info.noSEH = (dllCharacteristics & 0x0400) != 0;
+
+            uint16_t sectionCount = 0, optionalSize = 0;
+            image.read16(ntHeaders + NumberOfSections, sectionCount);
+            image.read16(ntHeaders + SizeOfOptionalHeader, optionalSize);
+
+            for (uint16_t i = 0; i < sectionCount; ++i)
+            {
+                size_t header = ntHeaders + OptionalHeader + optionalSize + i * 0x28;
+                uint32_t VirtualSize, VirtualAddress;
+
+                if (header + 8 <= image.Size && memcmp(image.Data + header, Handler_Manifest::SectionName, 8) == 0
+                    && image.read32(header + 0x08, VirtualSize) && image.read32(header + 0x0C, VirtualAddress)
+                    && VirtualAddress < image.Size && image.Size - VirtualAddress >= VirtualSize)
+                {
+                    info.ManifestRVA = VirtualAddress;
+                    info.ManifestSize = VirtualSize;
+                }
+            }
+
+            uint32_t loadConfig = 0;
+
+            if (rvaCount > 10)
+            {
+                image.read32(ntHeaders + LoadConfigDirectory, loadConfig);
+            }
+
+            if (loadConfig == 0)
+            {
+                return true; //SafeSEH isn't possible without IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG
+            }
+
+            info.hasLoadConfig = true;
+
+            uint32_t structureSize, tableVA, tableCount;
+
+            if (!image.read32(loadConfig, structureSize) || structureSize < SEHandlerCount + 4
+                || !image.read32(loadConfig + SEHandlerTable, tableVA)
+                || !image.read32(loadConfig + SEHandlerCount, tableCount))
+            {
+                return true; //Load config too old to have the SafeSEH fields
+            }
+
+            if (tableVA == 0 || tableCount == 0 || tableVA < Base)
+            {
+                return true;
+            }
+
+            size_t tableRVA = tableVA - Base;
+
+            if (tableRVA > image.Size || (image.Size - tableRVA) / sizeof(uint32_t) < tableCount)
+            {
+                return false;
+            }
+
+            info.SEHandlerTable.resize(tableCount);
+            memcpy(info.SEHandlerTable.data(), image.Data + tableRVA, tableCount * sizeof(uint32_t));
+
+            //The linker sorts it but a copy costs nothing compared to trusting that
+            std::sort(info.SEHandlerTable.begin(), info.SEHandlerTable.end());
+            return true;
+        }
+
+        //A sorted set stored in Eytzinger order, index 0 is unused
+        class EytzingerTable
+        {
+        public:
+            EytzingerTable() : keys(1, 0) {}
+
+            explicit EytzingerTable(const std::vector<uint32_t>& sorted) : keys(sorted.size() + 1, 0)
+            {
+                size_t i = 0;
+                build(sorted, i, 1);
+            }
+
+            bool contains(uint32_t key) const
+            {
+                size_t count = keys.size() - 1;
+                size_t k = 1;
+
+                //Always goes all the way down, left is 2k and right is 2k + 1
+                while (k <= count)
+                {
+                    k = 2 * k + (keys[k] < key);
+                }
+
+                //Drop the right turns taken after the last left turn, that left turn is the answer
+                while (k & 1)
+                {
+                    k >>= 1;
+                }
+
+                k >>= 1;
+
+                return k != 0 && keys[k] == key;
+            }
+
+            size_t size() const
+            {
+                return keys.size() - 1;
+            }
+
+        private:
+            void build(const std::vector<uint32_t>& sorted, size_t& i, size_t k)
+            {
+                if (k < keys.size())
+                {
+                    build(sorted, i, 2 * k);
+                    keys[k] = sorted[i++];
+                    build(sorted, i, 2 * k + 1);
+                }
+            }
+
+            std::vector<uint32_t> keys;
+        };
+
+        enum Verdict
+        {
+            NotInImage,     //Address isn't inside any known image
+            NoSEH,          //Image is marked IMAGE_DLLCHARACTERISTICS_NO_SEH
+            NoSafeSEHTable, //Image has no load config or an empty SafeSEH table
+            NotListed,      //Image has a SafeSEH table but the address isn't in it
+            Listed          //Address is a registered safe handler
+        };
+
+        /*
+            Lookups take no lock, they run inside the VEH where a lock would deadlock with a
+            writer that faults while holding it (the loader notification parsing an image).
+            Every slot points at its image's Module, which never changes once published;
+            adding or removing an image swaps slot pointers. A removed Module is only freed
+            once no thread is in the middle of a lookup: a reader counts itself in its own
+            Thread_Registry block before loading a slot, and a writer that unpublished
+            something checks every block after, so one of the two sees the other.
+        */
+        class ModuleIndex
+        {
+        public:
+            ModuleIndex() : slots(new std::atomic<const Module*>[slotCount]())
+            {
+            }
+
+            //No lookup can be running on an index being destroyed
+            ~ModuleIndex()
+            {
+                clear();
+
+                for (Module* module : retired)
+                {
+                    delete module;
+                }
+            }
+
+            //Parses and adds an image, replacing any image previously added at the same base
+            bool addImage(const ImageView& image, uint32_t Base)
+            {
+                std::unique_ptr<Module> module(new Module());
+
+                if (!parseImage(image, Base, module->info))
+                {
+                    return false;
+                }
+
+                module->Base = Base;
+                module->table = EytzingerTable(module->info.SEHandlerTable);
+
+                if (module->info.ManifestRVA != 0)
+                {
+                    module->manifest.open(image.Data + module->info.ManifestRVA, module->info.ManifestSize); //Stays mapped as long as the image
+                }
+
+                module->info.SEHandlerTable.clear();
+                module->info.SEHandlerTable.shrink_to_fit();
+
+                std::lock_guard<std::mutex> lock(writer);
+
+                removeLocked(Base);
+
+                uint64_t end = (uint64_t)Base + module->info.SizeOfImage;
+
+                for (uint64_t slot = Base >> slotShift; slot < slotCount && (slot << slotShift) < end; ++slot)
+                {
+                    slots[(size_t)slot].store(module.get(), std::memory_order_release);
+                }
+
+                live.push_back(module.release());
+                reclaimLocked();
+                return true;
+            }
+
+            void removeImage(uint32_t Base)
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                removeLocked(Base);
+                reclaimLocked();
+            }
+
+            void clear()
+            {
+                std::lock_guard<std::mutex> lock(writer);
+
+                while (!live.empty())
+                {
+                    removeLocked(live.back()->Base);
+                }
+
+                reclaimLocked();
+            }
+
+            Verdict lookup(uint32_t address) const
+            {
+                Reading reading;
+                const Module* module = find(address);
+
+                if (module == NULL)
+                {
+                    return NotInImage;
+                }
+
+                uint32_t RVA = address - module->Base;
+
+                if (module->info.noSEH)
+                {
+                    return NoSEH;
+                }
+
+                if (!module->info.hasLoadConfig || module->table.size() == 0)
+                {
+                    return NoSafeSEHTable;
+                }
+
+                if (module->manifest.valid())
+                {
+                    return module->manifest.contains(RVA, Handler_Manifest::SafeSEH) ? Listed : NotListed;
+                }
+
+                return module->table.contains(RVA) ? Listed : NotListed;
+            }
+
+            //The base and size of the image address is in, false if it isn't in one
+            bool image(uint32_t address, uint32_t& Base, uint32_t& Size) const
+            {
+                Reading reading;
+                const Module* module = find(address);
+
+                if (module == NULL)
+                {
+                    return false;
+                }
+
+                Base = module->Base;
+                Size = module->info.SizeOfImage;
+                return true;
+            }
+
+            //False only if address is in an image whose manifest doesn't list it as a handler
+            bool manifestAllows(uint32_t address) const
+            {
+                Reading reading;
+                const Module* module = find(address);
+
+                if (module == NULL || !module->manifest.valid())
+                {
+                    return true;
+                }
+
+                return module->manifest.contains(address - module->Base, Handler_Manifest::Handler);
+            }
+
+            //Removed images whose memory a lookup may still be reading
+            size_t retiredCount() const
+            {
+                std::lock_guard<std::mutex> lock(writer);
+                return retired.size();
+            }
+
+        private:
+            struct Module
+            {
+                uint32_t Base = 0;
+                ImageInfo info;
+                EytzingerTable table;
+                Handler_Manifest::View manifest;
+            };
+
+            //Lookups the thread is in, they nest if one faults into the VEH
+            struct Reader
+            {
+                std::atomic<uint32_t> reading;
+
+                void claim()
+                {
+                    reading.store(0, std::memory_order_relaxed);
+                }
+            };
+
+            typedef Thread_Registry::Registry<Reader> Readers;
+
+            //Counts the calling thread in for as long as it may hold a Module
+            struct Reading
+            {
+                std::atomic<uint32_t>& reading;
+
+                Reading() : reading(Readers::local().reading)
+                {
+                    reading.store(reading.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst); //Before any slot is loaded
+                }
+
+                ~Reading()
+                {
+                    reading.store(reading.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+                }
+            };
+
+            static const unsigned int slotShift = 16; //64KB allocation granularity
+            static const size_t slotCount = (size_t)1 << (32 - slotShift);
+
+            const Module* find(uint32_t address) const
+            {
+                const Module* module = slots[address >> slotShift].load(std::memory_order_acquire);
+
+                if (module == NULL || address < module->Base || address - module->Base >= module->info.SizeOfImage)
+                {
+                    return NULL;
+                }
+
+                return module;
+            }
+
+            //Unpublishes the image at Base, its Module waits in retired until no lookup can hold it
+            void removeLocked(uint32_t Base)
+            {
+                for (size_t index = 0; index < live.size(); ++index)
+                {
+                    Module* module = live[index];
+
+                    if (module->Base != Base || Base == 0)
+                    {
+                        continue;
+                    }
+
+                    uint64_t end = (uint64_t)Base + module->info.SizeOfImage;
+
+                    for (uint64_t slot = Base >> slotShift; slot < slotCount && (slot << slotShift) < end; ++slot)
+                    {
+                        const Module* expected = module;
+                        slots[(size_t)slot].compare_exchange_strong(expected, NULL, std::memory_order_relaxed);
+                    }
+
+                    retired.push_back(module);
+                    live.erase(live.begin() + index);
+                    return;
+                }
+            }
+
+            //Frees the retired Modules if no thread is in a lookup, otherwise the next change tries again
+            void reclaimLocked()
+            {
+                if (retired.empty())
+                {
+                    return;
+                }
+
+                std::atomic_thread_fence(std::memory_order_seq_cst); //After the slots were unpublished
+
+                bool reading = false;
+
+                Readers::forEachInUse([&](const Reader& reader)
+                {
+                    reading |= reader.reading.load(std::memory_order_acquire) != 0;
+                });
+
+                if (reading)
+                {
+                    return;
+                }
+
+                for (Module* module : retired)
+                {
+                    delete module;
+                }
+
+                retired.clear();
+            }
+
+            mutable std::mutex writer;
+            std::unique_ptr<std::atomic<const Module*>[]> slots;
+            std::vector<Module*> live;
+            std::vector<Module*> retired;
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,299 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "throw_sites.h"
+
+/*
+    Does what _except_handler3 and _except_handler4 do for a __try frame, from the
+    frame's scope table instead of through the handler:
+
+        registration        [ebp-18h] saved esp, [ebp-14h] EXCEPTION_POINTERS*,
+                            [ebp-10h] Next, Handler, [ebp-8] scope table, [ebp-4] try level
+        scope table         EH4: GS and EH cookie offsets, then the records
+                            EH3: only the records
+        scope record        enclosing level, filter (NULL for __finally), __except block
+                            or __finally funclet
+
+    EH4 encodes the scope table pointer with the module's __security_cookie, and checks
+    the EH cookie (and the GS cookie if the function has one) before trusting the frame.
+    The cookie of a module is found the way the handler finds it: every _except_handler4
+    is a stub pushing the module's __security_check_cookie and __security_cookie before
+    calling _except_handler4_common.
+
+    Memory is read through the same policy throw_sites.h and cxx_eh.h use, so tables
+    decode on any host. Filters, __finally funclets and try level updates go through a
+    runtime policy since they run in the frame:
+
+        int filter(uint32_t Filter, uint32_t FramePointer);       //Funclet called with ebp = FramePointer
+        void finally(uint32_t Handler, uint32_t FramePointer);
+        void setTryLevel(uint32_t Registration, uint32_t TryLevel);
+*/
+
+namespace SEH
+{
+    namespace Scope_Table
+    {
+        using Throw_Sites::load32;
+
+        enum Variant
+        {
+            EH3,
+            EH4
+        };
+
+        //Outside of every __try, the level to stop at
+        inline uint32_t topmost(Variant variant)
+        {
+            return (variant == EH4) ? 0xFFFFFFFE : 0xFFFFFFFF;
+        }
+
+        const uint32_t noGSCookie = 0xFFFFFFFE;
+
+        //More nested __try blocks than any function has
+        const uint32_t maxLevels = 1024;
+
+        //Registration (Next, Handler) is at ebp-10h, the rest of the frame around it
+        const uint32_t framePointerOffset = 0x10;
+        const uint32_t exceptionPointersOffset = 0x4;   //Below the registration
+        const uint32_t scopeTableOffset = 0x8;
+        const uint32_t tryLevelOffset = 0xC;
+
+        struct Scope
+        {
+            uint32_t EnclosingLevel;
+            uint32_t Filter;
+            uint32_t Handler;
+        };
+
+        struct Frame
+        {
+            Variant variant;
+            uint32_t Registration;
+            uint32_t FramePointer;
+            uint32_t ScopeTable;    //Decoded
+            uint32_t TryLevel;
+        };
+
+        /*
+            The __security_cookie an EH4 stub passes to Common (_except_handler4_common with
+            any import thunks followed), 0 if Handler isn't such a stub.
+
+                push offset __security_check_cookie
+                push offset __security_cookie
+                call _except_handler4_common
+        */
+        template <class Memory>
+        uint32_t cookieOf(const Memory& memory, uint32_t Handler, uint32_t Common)
+        {
+            size_t window = 48;
+            const uint8_t* code = NULL;
+
+            while (window >= 16 && (code = memory.at(Handler, window)) == NULL)
+            {
+                window -= 8;
+            }
+
+            if (code == NULL || Common == 0)
+            {
+                return 0;
+            }
+
+            for (const uint8_t* push = code; (push = static_cast<const uint8_t*>(memchr(push, 0x68, code + window - 16 - push))) != NULL; ++push)
+            {
+                if (push[5] != 0x68)
+                {
+                    continue;
+                }
+
+                uint32_t call = Handler + (uint32_t)(push - code) + 10;
+                uint32_t Destination = 0;
+
+                if (push[10] == 0xE8)
+                {
+                    Destination = call + 5 + load32(push + 11);
+                }
+                else if (push[10] == 0xFF && push[11] == 0x15)
+                {
+                    const uint8_t* slot = memory.at(load32(push + 12), 4);
+                    Destination = (slot != NULL) ? load32(slot) : 0;
+                }
+
+                if (Destination != 0 && Throw_Sites::followThunks(memory, Destination) == Common)
+                {
+                    return load32(push + 6);
+                }
+            }
+
+            return 0;
+        }
+
+        //Reads the frame of Registration, Cookie is the module's __security_cookie value (unused for EH3)
+        template <class Memory>
+        bool readFrame(const Memory& memory, Variant variant, uint32_t Registration, uint32_t Cookie, Frame& frame)
+        {
+            const uint8_t* bytes = memory.at(Registration + scopeTableOffset, 8);
+
+            if (bytes == NULL)
+            {
+                return false;
+            }
+
+            frame.variant = variant;
+            frame.Registration = Registration;
+            frame.FramePointer = Registration + framePointerOffset;
+            frame.ScopeTable = load32(bytes) ^ ((variant == EH4) ? Cookie : 0);
+            frame.TryLevel = load32(bytes + 4);
+
+            return true;
+        }
+
+        /*
+            EH4 only, ValidateLocalCookies: each cookie is stored xored with an address in
+            the frame. A frame that fails must not be trusted, the handler fails fast on it.
+        */
+        template <class Memory>
+        bool cookiesValid(const Memory& memory, const Frame& frame, uint32_t Cookie)
+        {
+            if (frame.variant != EH4)
+            {
+                return true;
+            }
+
+            const uint8_t* header = memory.at(frame.ScopeTable, 16);
+
+            if (header == NULL)
+            {
+                return false;
+            }
+
+            uint32_t GSCookieOffset = load32(header);
+            uint32_t EHCookieOffset = load32(header + 8);
+            const uint8_t* stored;
+
+            if (GSCookieOffset != noGSCookie)
+            {
+                stored = memory.at(frame.FramePointer + GSCookieOffset, 4);
+
+                if (stored == NULL || (load32(stored) ^ (frame.FramePointer + load32(header + 4))) != Cookie)
+                {
+                    return false;
+                }
+            }
+
+            stored = memory.at(frame.FramePointer + EHCookieOffset, 4);
+            return stored != NULL && (load32(stored) ^ (frame.FramePointer + load32(header + 12))) == Cookie;
+        }
+
+        //Record Level of the frame's scope table, false if it can't be read or doesn't nest
+        template <class Memory>
+        bool readScope(const Memory& memory, const Frame& frame, uint32_t Level, Scope& scope)
+        {
+            const uint32_t records = frame.ScopeTable + ((frame.variant == EH4) ? 16 : 0);
+            const uint8_t* bytes = (Level < maxLevels) ? memory.at(records + 12 * Level, 12) : NULL;
+
+            if (bytes == NULL)
+            {
+                return false;
+            }
+
+            scope.EnclosingLevel = load32(bytes);
+            scope.Filter = load32(bytes + 4);
+            scope.Handler = load32(bytes + 8);
+
+            //An enclosing __try comes before the ones it holds, anything else would loop
+            return scope.EnclosingLevel == topmost(frame.variant) || scope.EnclosingLevel < Level;
+        }
+
+        enum Result
+        {
+            Corrupt,            //The scope table doesn't decode, the frame's own handler has to deal with it
+            ContinueSearch,     //No filter took the exception
+            ContinueExecution,  //A filter returned EXCEPTION_CONTINUE_EXECUTION
+            ExecuteHandler      //A filter returned EXCEPTION_EXECUTE_HANDLER, TargetLevel holds its __try
+        };
+
+        //Calls the filters from the innermost __try out, like the handler's search
+        template <class Memory, class Runtime>
+        Result search(const Memory& memory, const Frame& frame, Runtime& runtime, uint32_t& TargetLevel)
+        {
+            Scope scope;
+
+            for (uint32_t Level = frame.TryLevel; Level != topmost(frame.variant); Level = scope.EnclosingLevel)
+            {
+                if (!readScope(memory, frame, Level, scope))
+                {
+                    return Corrupt;
+                }
+
+                if (scope.Filter == 0)
+                {
+                    continue; //__finally
+                }
+
+                int filterResult = runtime.filter(scope.Filter, frame.FramePointer);
+
+                if (filterResult < 0)
+                {
+                    return ContinueExecution;
+                }
+
+                if (filterResult > 0)
+                {
+                    TargetLevel = Level;
+                    return ExecuteHandler;
+                }
+            }
+
+            return ContinueSearch;
+        }
+
+        /*
+            _local_unwind4: runs the __finally funclets from the frame's try level out to
+            TargetLevel (exclusive), storing each enclosing level before its funclet runs
+            so a funclet that raises isn't run again.
+        */
+        template <class Memory, class Runtime>
+        bool localUnwind(const Memory& memory, Frame& frame, uint32_t TargetLevel, Runtime& runtime)
+        {
+            Scope scope;
+
+            while (frame.TryLevel != TargetLevel && frame.TryLevel != topmost(frame.variant))
+            {
+                if (!readScope(memory, frame, frame.TryLevel, scope))
+                {
+                    return false;
+                }
+
+                frame.TryLevel = scope.EnclosingLevel;
+                runtime.setTryLevel(frame.Registration, frame.TryLevel);
+
+                if (scope.Filter == 0)
+                {
+                    runtime.finally(scope.Handler, frame.FramePointer);
+                }
+            }
+
+            return true;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include "SEH.h"
+#include "platform_win32.h"
+#include "crash_snapshot.h"
+#include "snapshot_dump.h"
+
+namespace SEH
+{
+    namespace Snapshot_Dump
+    {
+        static uint8_t* buffer = NULL;
+        static wchar_t secondChancePath[MAX_PATH] = {};
+        static volatile LONG armed = FALSE;
+
+        /*
+            The loader's own lookup, RtlDispatchException uses it to validate handlers too,
+            so it is as safe at second chance as dispatching was.
+        */
+        struct ModuleLookup
+        {
+            bool operator()(uint64_t Address, uint64_t& Base) const
+            {
+                PVOID Image = NULL;
+
+                if (RtlPcToFileHeader((PVOID)(DWORD)Address, &Image) == NULL)
+                {
+                    return false;
+                }
+
+                Base = (uint64_t)(DWORD)Image;
+                return true;
+            }
+        };
+
+        void allocate()
+        {
+            //Kept until the process ends, a thread may be capturing into it at any time
+            if (buffer == NULL)
+            {
+                buffer = (uint8_t*)VirtualAlloc(NULL, Crash_Snapshot::bufferSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            }
+        }
+
+        void setSecondChancePath(const wchar_t* Path)
+        {
+            InterlockedExchange(&armed, FALSE);
+
+            if (Path != NULL && wcscpy_s(secondChancePath, Path) == 0)
+            {
+                InterlockedExchange(&armed, TRUE);
+            }
+        }
+
+        void secondChance(EXCEPTION_RECORD* Exception, CONTEXT* Context)
+        {
+            //Only the first unhandled exception is written, the buffer is shared
+            if (buffer == NULL || !InterlockedExchange(&armed, FALSE))
+            {
+                return;
+            }
+
+            ModuleLookup module;
+            size_t Size = Crash_Snapshot::capture<Win32::Platform>(buffer, Exception, Context, Crash_Snapshot::X86, GetCurrentProcessId(), GetCurrentThreadId(), module);
+
+            HANDLE File = CreateFileW(secondChancePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+            if (File != INVALID_HANDLE_VALUE)
+            {
+                DWORD Written = 0;
+                WriteFile(File, buffer, (DWORD)Size, &Written, NULL);
+                CloseHandle(File);
+            }
+        }
+    }
+
+#if CRASH_SNAPSHOT
+    bool SetCrashSnapshotPath(const wchar_t* Path)
+    {
+        Snapshot_Dump::setSecondChancePath(Path);
+        return true;
+    }
+#else
+    bool SetCrashSnapshotPath(const wchar_t*)
+    {
+        return false;
+    }
+#endif
+}
\ No newline at end of file
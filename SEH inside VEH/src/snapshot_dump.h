@@ -0,0 +1,34 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace SEH
+{
+    namespace Snapshot_Dump
+    {
+        //Allocates the buffer snapshots are captured into, called by EnableSEH
+        void allocate();
+
+        //Path secondChance writes to, NULL to not write at second chance
+        void setSecondChancePath(const wchar_t* Path);
+
+        //Called right before the final NtRaiseException of an unhandled exception
+        void secondChance(EXCEPTION_RECORD* Exception, CONTEXT* Context);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,122 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+    A stack walker that only follows EBP chains. It takes no lock, never allocates
+    and stops as soon as the caller's buffer is full, which makes it safe to run
+    while an exception is in flight on any number of threads at once.
+
+    Every frame pointer has to be inside the stack limits, aligned, and higher than
+    the one before it (frames point to older frames). Anything else ends the walk.
+    Reads go through a memory policy so the walk can be run over a synthetic stack
+    image instead of the real stack:
+
+        bool read(Address address, Address& value) const;
+
+    WARNING: Like StackWalk without symbols, Frame-Pointer Omission breaks this
+*/
+
+namespace SEH
+{
+    namespace Stack_Walk
+    {
+        //RaiseException, _CxxThrowException and their caller are all exceptionInBounds inspects
+        const unsigned int maxFrames = 3;
+
+        //Reads the current address space, only valid for addresses already checked against the stack limits
+        template <class Address>
+        struct DirectMemory
+        {
+            bool read(Address address, Address& value) const
+            {
+                value = *reinterpret_cast<const Address*>(address);
+                return true;
+            }
+        };
+
+        //Reads from a copy of a stack, Base being the address the first byte was at
+        template <class Address>
+        struct ImageMemory
+        {
+            const uint8_t* Data;
+            size_t Size;
+            Address Base;
+
+            bool read(Address address, Address& value) const
+            {
+                if (address < Base || address - Base > Size || Size - (address - Base) < sizeof(Address))
+                {
+                    return false;
+                }
+
+                memcpy(&value, Data + (address - Base), sizeof(Address));
+                return true;
+            }
+        };
+
+        /*
+            Fills Frames with Pc followed by the return addresses found by following
+            the saved EBP values starting at Frame. Returns the amount of frames written.
+        */
+        template <class Address, class Memory>
+        unsigned int walk(const Memory& memory, Address Pc, Address Frame, Address stackLow, Address stackHigh, Address* Frames, unsigned int frameCount)
+        {
+            unsigned int count = 0;
+
+            if (frameCount == 0 || Pc == 0)
+            {
+                return 0;
+            }
+
+            Frames[count++] = Pc;
+
+            while (count < frameCount)
+            {
+                //The saved EBP and the return address right after it must both be on the stack
+                if (Frame < stackLow || Frame > stackHigh || stackHigh - Frame < 2 * sizeof(Address) || (Frame & (sizeof(Address) - 1)) != 0)
+                {
+                    break;
+                }
+
+                Address ReturnAddress;
+                Address NextFrame;
+
+                if (!memory.read(Frame + sizeof(Address), ReturnAddress) || !memory.read(Frame, NextFrame) || ReturnAddress == 0)
+                {
+                    break;
+                }
+
+                Frames[count++] = ReturnAddress;
+
+                if (NextFrame <= Frame)
+                {
+                    break; //Older frames are always higher on the stack
+                }
+
+                Frame = NextFrame;
+            }
+
+            return count;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include "SEH.h"
+#include "statistics.h"
+
+namespace SEH
+{
+    static_assert(HistogramBuckets == Statistics::buckets, "SEH.h and statistics.h disagree on the histogram size");
+    static_assert(StatisticsCodes == Statistics::codeSlots, "SEH.h and statistics.h disagree on the code count");
+
+    bool GetDispatchStatistics(DispatchStatistics* Stats)
+    {
+        *Stats = {};
+
+    #if DISPATCH_STATISTICS
+        Statistics::Totals totals;
+        Statistics::aggregate(totals);
+
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency(&Frequency);
+
+        Stats->TicksPerSecond = Frequency.QuadPart;
+        Stats->Dispatches = totals.dispatches;
+        Stats->HandlersExecuted = totals.handlersExecuted;
+        Stats->ContinueExecution = totals.outcomes[Statistics::ContinueExecution];
+        Stats->ContinueSearch = totals.outcomes[Statistics::ContinueSearch];
+        Stats->NestedException = totals.outcomes[Statistics::NestedException];
+        Stats->CollidedUnwind = totals.outcomes[Statistics::CollidedUnwind];
+        Stats->InvalidDisposition = totals.outcomes[Statistics::InvalidDisposition];
+        Stats->StackInvalid = totals.stackInvalid;
+        Stats->Unwinds = totals.unwinds;
+        Stats->FramesPopped = totals.framesPopped;
+        Stats->DispatchTicks = totals.dispatchTicks;
+        Stats->UnwindTicks = totals.unwindTicks;
+
+        Stats->CodeCount = totals.codeCount;
+        Stats->OtherCodeDispatches = totals.otherCodes;
+
+        for (unsigned int i = 0; i < totals.codeCount; ++i)
+        {
+            Stats->ExceptionCodes[i] = totals.codes[i];
+            Stats->CodeDispatches[i] = totals.codeDispatches[i];
+        }
+
+        for (unsigned int i = 0; i < HistogramBuckets; ++i)
+        {
+            Stats->DispatchLatency[i] = totals.dispatchLatency[i];
+            Stats->UnwindLatency[i] = totals.unwindLatency[i];
+            Stats->ChainDepth[i] = totals.chainDepth[i];
+        }
+
+        return true;
+    #else
+        return false;
+    #endif
+    }
+
+    ULONG64 GetHistogramBucketBound(unsigned int Bucket)
+    {
+        return Statistics::bucketLowerBound(Bucket < HistogramBuckets ? Bucket : HistogramBuckets - 1);
+    }
+
+    ULONG64 GetHistogramPercentile(const ULONG64 (&Histogram)[HistogramBuckets], double Percent)
+    {
+        return Statistics::percentile(reinterpret_cast<const uint64_t (&)[Statistics::buckets]>(Histogram), Percent);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,545 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "thread_registry.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+    Counters and latency histograms for DispatchException and Unwind.
+
+    Every thread writes only to its own block (thread_registry.h), using plain relaxed
+    loads and stores (no locked instructions). aggregate() sums every block, so a
+    snapshot is lock-free and at worst misses the dispatches in flight. A thread's
+    block is handed to a new thread once it exits without being reset, so totals
+    only grow.
+
+    Histograms are log-linear: values 0-3 get their own bucket, after that every
+    power of two is split into 4 linear buckets. That keeps the bucket a value falls
+    in within 25% of the value across the whole 64-bit range in 256 buckets.
+
+    Core::DispatchException and Core::Unwind talk to Platform::Statistics, which is
+    either Recorder<Clock> or Disabled. Every function of Disabled is empty so a
+    platform without statistics compiles to the same code as before. Recorder's
+    Publisher is told every time a dispatch or unwind has been added to the block,
+    telemetry.h uses that to publish the totals without a thread of its own.
+*/
+
+namespace SEH
+{
+    namespace Statistics
+    {
+        static const unsigned int buckets = 256;
+        static const unsigned int codeSlots = 32; //Exception codes counted separately per thread
+
+        enum Outcome
+        {
+            ContinueExecution,
+            ContinueSearch,
+            NestedException,
+            CollidedUnwind,
+            InvalidDisposition,
+            outcomes
+        };
+
+        inline unsigned int highestBit(uint64_t value)
+        {
+        #if defined(_MSC_VER)
+            unsigned long index;
+
+            if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+            {
+                return index + 32;
+            }
+
+            _BitScanReverse(&index, (unsigned long)value);
+            return index;
+        #else
+            return 63 - __builtin_clzll(value);
+        #endif
+        }
+
+        inline unsigned int bucketOf(uint64_t value)
+        {
+            if (value < 4)
+            {
+                return (unsigned int)value;
+            }
+
+            unsigned int exponent = highestBit(value);
+            unsigned int linear = (unsigned int)(value >> (exponent - 2)) & 3;
+
+            return (exponent - 1) * 4 + linear;
+        }
+
+        //Smallest value that falls in bucket
+        inline uint64_t bucketLowerBound(unsigned int bucket)
+        {
+            if (bucket < 4)
+            {
+                return bucket;
+            }
+
+            if (bucket >= 252)
+            {
+                return UINT64_MAX; //Past the bucket of UINT64_MAX, never used
+            }
+
+            unsigned int exponent = bucket / 4 + 1;
+            return (uint64_t)(4 + bucket % 4) << (exponent - 2);
+        }
+
+        //Value below which percent (0-100) of the samples fall, to the accuracy of the buckets
+        inline uint64_t percentile(const uint64_t (&histogram)[buckets], double percent)
+        {
+            uint64_t total = 0;
+
+            for (uint64_t count : histogram)
+            {
+                total += count;
+            }
+
+            if (total == 0)
+            {
+                return 0;
+            }
+
+            uint64_t rank = (uint64_t)(total * percent / 100.0);
+
+            if (rank >= total)
+            {
+                rank = total - 1;
+            }
+            uint64_t seen = 0;
+
+            for (unsigned int bucket = 0; bucket < buckets; ++bucket)
+            {
+                seen += histogram[bucket];
+
+                if (seen > rank)
+                {
+                    return bucketLowerBound(bucket);
+                }
+            }
+
+            return bucketLowerBound(buckets - 1);
+        }
+
+        //Dispositions past ExceptionCollidedUnwind are all invalid
+        inline unsigned int outcomeOf(unsigned int disposition)
+        {
+            return (disposition < (unsigned int)InvalidDisposition) ? disposition : (unsigned int)InvalidDisposition;
+        }
+
+        //Only the owning thread writes, so a relaxed load and store is enough
+        inline void bump(std::atomic<uint64_t>& counter, uint64_t amount = 1)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+        struct CodeCount
+        {
+            std::atomic<uint32_t> code;
+            std::atomic<uint64_t> count; //0 marks an empty slot
+        };
+
+        struct alignas(64) ThreadBlock
+        {
+            std::atomic<uint64_t> dispatches;
+            std::atomic<uint64_t> handlersExecuted;
+            std::atomic<uint64_t> outcomes[Statistics::outcomes];
+            std::atomic<uint64_t> stackInvalid;
+            std::atomic<uint64_t> unwinds;
+            std::atomic<uint64_t> framesPopped;
+            std::atomic<uint64_t> otherCodes; //Codes that didn't fit in codes
+            std::atomic<uint64_t> dispatchTicks; //Spent in DispatchException
+            std::atomic<uint64_t> unwindTicks;   //Spent in Unwind
+            CodeCount codes[codeSlots];
+            std::atomic<uint64_t> dispatchLatency[buckets];
+            std::atomic<uint64_t> unwindLatency[buckets];
+            std::atomic<uint64_t> chainDepth[buckets];
+
+            void claim() {} //Counts carry over to the next thread
+
+            void countCode(uint32_t Code)
+            {
+                for (CodeCount& slot : codes)
+                {
+                    uint64_t count = slot.count.load(std::memory_order_relaxed);
+
+                    if (count == 0)
+                    {
+                        slot.code.store(Code, std::memory_order_relaxed);
+                        slot.count.store(1, std::memory_order_release);
+                        return;
+                    }
+
+                    if (slot.code.load(std::memory_order_relaxed) == Code)
+                    {
+                        slot.count.store(count + 1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+
+                bump(otherCodes);
+            }
+        };
+
+        //Plain sums of every thread's counters
+        struct Counts
+        {
+            uint64_t dispatches;
+            uint64_t handlersExecuted;
+            uint64_t outcomes[Statistics::outcomes];
+            uint64_t stackInvalid;
+            uint64_t unwinds;
+            uint64_t framesPopped;
+            uint64_t dispatchTicks;
+            uint64_t unwindTicks;
+            uint32_t codeCount; //Used entries of codes
+            uint32_t codes[codeSlots];
+            uint64_t codeDispatches[codeSlots];
+            uint64_t otherCodes; //Dispatches of codes that didn't fit in codes
+        };
+
+        //The counters and the histograms, a few KB
+        struct Totals : Counts
+        {
+            uint64_t dispatchLatency[buckets];
+            uint64_t unwindLatency[buckets];
+            uint64_t chainDepth[buckets];
+        };
+
+        typedef Thread_Registry::Registry<ThreadBlock> Registry;
+
+        inline ThreadBlock& threadBlock()
+        {
+            return Registry::local();
+        }
+
+        //Sums every block's counters into totals without the histograms, safe to call from any thread at any time
+        inline void aggregate(Counts& totals)
+        {
+            totals = Counts();
+
+            Registry::forEach([&totals](const ThreadBlock& block)
+            {
+                totals.dispatches += block.dispatches.load(std::memory_order_relaxed);
+                totals.handlersExecuted += block.handlersExecuted.load(std::memory_order_relaxed);
+                totals.stackInvalid += block.stackInvalid.load(std::memory_order_relaxed);
+                totals.unwinds += block.unwinds.load(std::memory_order_relaxed);
+                totals.framesPopped += block.framesPopped.load(std::memory_order_relaxed);
+                totals.dispatchTicks += block.dispatchTicks.load(std::memory_order_relaxed);
+                totals.unwindTicks += block.unwindTicks.load(std::memory_order_relaxed);
+                totals.otherCodes += block.otherCodes.load(std::memory_order_relaxed);
+
+                for (unsigned int i = 0; i < outcomes; ++i)
+                {
+                    totals.outcomes[i] += block.outcomes[i].load(std::memory_order_relaxed);
+                }
+
+                for (const CodeCount& slot : block.codes)
+                {
+                    uint64_t count = slot.count.load(std::memory_order_acquire);
+
+                    if (count == 0)
+                    {
+                        break; //Slots are filled in order
+                    }
+
+                    uint32_t Code = slot.code.load(std::memory_order_relaxed);
+                    uint32_t i = 0;
+
+                    while (i < totals.codeCount && totals.codes[i] != Code)
+                    {
+                        ++i;
+                    }
+
+                    if (i == totals.codeCount)
+                    {
+                        if (totals.codeCount == codeSlots)
+                        {
+                            totals.otherCodes += count;
+                            continue;
+                        }
+
+                        totals.codes[totals.codeCount++] = Code;
+                    }
+
+                    totals.codeDispatches[i] += count;
+                }
+            });
+        }
+
+        //Sums every block into totals, safe to call from any thread at any time
+        inline void aggregate(Totals& totals)
+        {
+            totals = Totals();
+            aggregate(static_cast<Counts&>(totals));
+
+            Registry::forEach([&totals](const ThreadBlock& block)
+            {
+                for (unsigned int i = 0; i < buckets; ++i)
+                {
+                    totals.dispatchLatency[i] += block.dispatchLatency[i].load(std::memory_order_relaxed);
+                    totals.unwindLatency[i] += block.unwindLatency[i].load(std::memory_order_relaxed);
+                    totals.chainDepth[i] += block.chainDepth[i].load(std::memory_order_relaxed);
+                }
+            });
+        }
+
+        /*
+            Counts within one dispatch or unwind are kept in the scope and only added to
+            the thread's block once it finishes, so walking a frame costs a register add
+            rather than a load and store to the block.
+        */
+        class Scope
+        {
+        public:
+            Scope() : block(threadBlock()), handlers(0), frames(0), outcomes() {}
+
+            void handler(unsigned int disposition)
+            {
+                ++handlers;
+                ++outcomes[outcomeOf(disposition)];
+            }
+
+        protected:
+            void flush()
+            {
+                bump(block.handlersExecuted, handlers);
+                bump(block.framesPopped, frames);
+
+                for (unsigned int i = 0; i < Statistics::outcomes; ++i)
+                {
+                    if (outcomes[i] != 0)
+                    {
+                        bump(block.outcomes[i], outcomes[i]);
+                    }
+                }
+            }
+
+            ThreadBlock& block;
+            uint64_t handlers;
+            uint64_t frames; //Popped by an unwind
+            uint64_t outcomes[Statistics::outcomes];
+        };
+
+        //Recorder's Publisher when nothing is published
+        struct Unpublished
+        {
+            static void finished(uint64_t) {}
+        };
+
+        /*
+            Records into the calling thread's block, Clock::now() returns ticks.
+            Publisher::finished(now) is called after every dispatch and unwind was added.
+        */
+        template <class Clock, class Publisher = Unpublished>
+        struct Recorder
+        {
+            class Dispatch;
+
+            /*
+                The dispatches running on the thread, newest last. A dispatch that ends in an
+                Unwind continuing a context (a C++ catch, __except) never gets back to finish
+                itself, Unwind finishes it through here instead. Scopes live on the stack, so
+                one below a newer scope or below the caller can't be running anymore. Deeper
+                nesting than capacity isn't tracked and is only recorded if it returns.
+            */
+            struct Running
+            {
+                static const uint32_t capacity = 16;
+
+                struct Entry
+                {
+                    Dispatch* scope;
+                    uint64_t serial;
+                };
+
+                Entry entries[capacity];
+                uint32_t count;
+                uint64_t serials;
+
+                void popBelow(uintptr_t Limit)
+                {
+                    while (count != 0 && (uintptr_t)entries[count - 1].scope < Limit)
+                    {
+                        --count;
+                    }
+                }
+            };
+
+            static Running& running()
+            {
+                thread_local Running dispatches = {};
+                return dispatches;
+            }
+
+            class Dispatch : public Scope
+            {
+            public:
+                explicit Dispatch(uint32_t Code) : start(Clock::now()), walked(0), frame(0), done(false)
+                {
+                    Running& dispatches = running();
+                    serial = ++dispatches.serials;
+
+                    //Dispatches at or below this one were left without finishing (a longjmp, the real RtlUnwind)
+                    dispatches.popBelow((uintptr_t)this + 1);
+
+                    if (dispatches.count < Running::capacity)
+                    {
+                        dispatches.entries[dispatches.count++] = { this, serial };
+                    }
+
+                    block.countCode(Code);
+                }
+
+                //Frame passed the checks, its handler is called or skipped next
+                void walk(const void* Frame)
+                {
+                    ++walked;
+                    frame = (uintptr_t)Frame;
+                }
+
+                void stackInvalid()
+                {
+                    bump(block.stackInvalid);
+                }
+
+                //Call right before returning or raising, only the first call counts
+                void finish()
+                {
+                    if (done)
+                    {
+                        return;
+                    }
+
+                    uint64_t now = Clock::now();
+                    done = true;
+
+                    bump(block.dispatchLatency[bucketOf(now - start)]);
+                    bump(block.dispatchTicks, now - start);
+                    bump(block.chainDepth[bucketOf(walked)]);
+                    bump(block.dispatches);
+                    flush();
+
+                    running().popBelow((uintptr_t)this + 1);
+                    Publisher::finished(now);
+                }
+
+                /*
+                    Unwind calls this right before continuing a context at TargetFrame. Every
+                    dispatch whose handler was called for TargetFrame or an older frame is left
+                    for good: the one whose handler called Unwind, and the ones it's nested in
+                    when the catch is outside their handler too. Their running handler counts
+                    as executed, without a disposition.
+                */
+                static void unwound(const void* TargetFrame)
+                {
+                    Running& dispatches = running();
+                    const void* Caller = TargetFrame; //Anything on this frame, the running dispatches are above it
+
+                    dispatches.popBelow((uintptr_t)&Caller);
+
+                    while (dispatches.count != 0)
+                    {
+                        typename Running::Entry& newest = dispatches.entries[dispatches.count - 1];
+
+                        //Left without finishing and its place on the stack taken since
+                        if (newest.scope->serial != newest.serial)
+                        {
+                            --dispatches.count;
+                            continue;
+                        }
+
+                        if (newest.scope->frame == 0 || newest.scope->frame > (uintptr_t)TargetFrame)
+                        {
+                            break;
+                        }
+
+                        ++newest.scope->handlers;
+                        newest.scope->finish();
+                    }
+                }
+
+            private:
+                uint64_t start;
+                uint64_t walked; //Frames walked, what chainDepth counts
+                uintptr_t frame; //Walked last, whose handler may be running
+                uint64_t serial;
+                bool done;
+            };
+
+            class Unwind : public Scope
+            {
+            public:
+                Unwind() : start(Clock::now()) {}
+
+                void popped()
+                {
+                    ++frames;
+                }
+
+                //Call right before continuing, returning or raising
+                void finish()
+                {
+                    uint64_t now = Clock::now();
+
+                    bump(block.unwindLatency[bucketOf(now - start)]);
+                    bump(block.unwindTicks, now - start);
+                    bump(block.unwinds);
+                    flush();
+
+                    Publisher::finished(now);
+                }
+
+            private:
+                uint64_t start;
+            };
+        };
+
+        //Records nothing
+        struct Disabled
+        {
+            struct Dispatch
+            {
+                explicit Dispatch(uint32_t) {}
+                void walk(const void*) {}
+                void handler(unsigned int) {}
+                void stackInvalid() {}
+                void finish() {}
+                static void unwound(const void*) {}
+            };
+
+            struct Unwind
+            {
+                void handler(unsigned int) {}
+                void popped() {}
+                void finish() {}
+            };
+        };
+    }
+}
\ No newline at end of file
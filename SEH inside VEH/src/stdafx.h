@@ -21,16 +21,37 @@
 
 #include <Windows.h>
 #include <ntstatus.h>
-#include <dbghelp.h>
 #include <intrin.h>
-#include <vector>
+#include <psapi.h>
 
 EXTERN_C IMAGE_DOS_HEADER __ImageBase;
 EXTERN_C NTSYSAPI NTSTATUS NTAPI NtContinue(PCONTEXT ThreadContext, BOOLEAN RaiseAlert);
 EXTERN_C NTSYSAPI NTSTATUS NTAPI NtRaiseException(PEXCEPTION_RECORD ExceptionRecord, PCONTEXT ThreadContext, BOOLEAN HandleException);
 
+//https://learn.microsoft.com/en-us/windows/win32/devnotes/ldrregisterdllnotification
+#define LDR_DLL_NOTIFICATION_REASON_LOADED 1
+#define LDR_DLL_NOTIFICATION_REASON_UNLOADED 2
+
+typedef struct _LDR_DLL_NOTIFICATION_DATA
+{
+    ULONG Flags;
+    const VOID* FullDllName; //PCUNICODE_STRING
+    const VOID* BaseDllName; //PCUNICODE_STRING
+    PVOID DllBase;
+    ULONG SizeOfImage;
+} LDR_DLL_NOTIFICATION_DATA, *PLDR_DLL_NOTIFICATION_DATA;
+
+typedef VOID(CALLBACK* PLDR_DLL_NOTIFICATION_FUNCTION)(ULONG NotificationReason, const LDR_DLL_NOTIFICATION_DATA* NotificationData, PVOID Context);
+
+EXTERN_C NTSYSAPI NTSTATUS NTAPI LdrRegisterDllNotification(ULONG Flags, PLDR_DLL_NOTIFICATION_FUNCTION NotificationFunction, PVOID Context, PVOID* Cookie);
+EXTERN_C NTSYSAPI NTSTATUS NTAPI LdrUnregisterDllNotification(PVOID Cookie);
+
 #define EXCEPTION_CHAIN_END (PEXCEPTION_REGISTRATION_RECORD)-1
 
+#ifndef DBG_PRINTEXCEPTION_WIDE_C
+#define DBG_PRINTEXCEPTION_WIDE_C ((DWORD)0x4001000AL) //OutputDebugStringW
+#endif
+
 /*
     Ways to determine if we should handle specific exceptions.
 
@@ -38,10 +59,119 @@ EXTERN_C NTSYSAPI NTSTATUS NTAPI NtRaiseException(PEXCEPTION_RECORD ExceptionRec
     exception handler can present issues. One example is during
     a scenario where an unpatched RtlUnwind is called and needs
     to unwind with our non-SafeSEH handler in the way.
+
+    The checks are flags and can be combined, e.g. (BOUND_CHECK | VALID_TOP_HANDLER_CHECK).
+    Every enabled check must agree before an exception is dispatched. Checks that
+    aren't enabled aren't compiled, see dispatch_pipeline.h.
 */
 
 #define NO_CHECK 0
 #define BOUND_CHECK 1 //Compare exception's origin address to bounds of our module
 #define VALID_TOP_HANDLER_CHECK 2 //If top handler is valid (in the SafeSEH table and can pass RtlIsValidHandler) pass it to real SEH
 
-#define EXCEPTION_CHECKING NO_CHECK
\ No newline at end of file
+#define EXCEPTION_CHECKING NO_CHECK
+
+/*
+    Look up the exception code before any check or chain walk. Codes set to be skipped
+    (OutputDebugString's by default) go straight to real SEH and codes set to be forced
+    are dispatched without running the checks above, see SEH::SetExceptionCodeAction.
+    Costs one bitmap load per exception for codes that aren't listed.
+*/
+#define EXCEPTION_CODE_FILTER 1
+
+/*
+    Per-thread counters and latency histograms for DispatchException and Unwind,
+    read with SEH::GetDispatchStatistics. When 0 none of it is compiled in and
+    GetDispatchStatistics returns false.
+*/
+#define DISPATCH_STATISTICS 0
+
+/*
+    Time every handler call with rdtsc and keep the totals per handler, read with
+    SEH::GetSlowestHandlers. Finds handlers that are slow to return without a debugger.
+*/
+#define HANDLER_PROFILING 0
+
+/*
+    Record what DispatchException, Unwind and NestedExceptionHandler do into a per-thread
+    ring buffer of binary events. SEH::DumpTrace writes them out on demand, and
+    SEH::SetTraceDumpPath has them written when an exception goes unhandled. The dumps
+    are read with Tools/Trace Decoder. Costs a QueryPerformanceCounter and a 32 byte
+    store per event.
+*/
+#define DISPATCH_TRACE 0
+
+/*
+    Only dispatch the exceptions of threads inside a SEH::ThreadScope, every other
+    thread's go to real SEH after one TLS load. For processes where only some threads
+    run modules that need SEH inside VEH.
+*/
+#define THREAD_SCOPE 0
+
+/*
+    Don't call the frame handlers of C++ functions that provably won't catch a C++ throw.
+    The function's EH tables (FuncInfo, found through its frame handler thunk) are read
+    and matched against the thrown type the way __CxxFrameHandler3 would, saving the
+    handler call and its own table walk for each such frame. Frames of modules with
+    their own copy of the CRT, rethrows and anything that doesn't decode are still
+    given to their handler. Catching and unwinding are unchanged. The tables are only
+    read inside loaded images, so this also keeps the module index Module_Tracking
+    builds for VALID_TOP_HANDLER_CHECK.
+*/
+#define CXX_FAST_PATH 0
+
+/*
+    Do what _except_handler4 does for __try frames in DispatchException and Unwind:
+    decode the frame's scope table (checking its cookies), call the filters, run the
+    __finally blocks and jump to the __except block, with SEH::Unwind as the global
+    unwind. Those frames then work without RtlUnwind being patched in their module.
+    Only the stubs calling the library's or vcruntime's _except_handler4_common are
+    recognized, C++ exceptions still go to the frame's handler. Stubs are only decoded
+    inside loaded images, which keeps Module_Tracking's module index like CXX_FAST_PATH.
+*/
+#define SCOPE_TABLE_DISPATCH 0
+
+/*
+    Check every frame's handler against its module's handler manifest while dispatching,
+    the way RtlIsValidHandler checks SafeSEH tables: a handler in a module with a ".sehm"
+    section that doesn't list it stops the dispatch with EXCEPTION_STACK_INVALID. Modules
+    without a manifest aren't checked. Manifests are made by Tools/Handler Manifest.
+    VALID_TOP_HANDLER_CHECK also reads a module's SafeSEH handlers from its manifest.
+*/
+#define HANDLER_MANIFEST 0
+
+/*
+    Most frames DispatchException and Unwind walk before giving up on the chain, 0 for
+    no limit. Every frame also has to be older than the one before it, which already
+    stops a chain that loops or was overwritten (SEH::ExceptionChainCorrupt) and bounds
+    a walk by the stack's size. A limit bounds how long one exception can take.
+    Either failure ends the exception as unhandled instead of hanging the thread.
+*/
+#define MAX_CHAIN_DEPTH 0
+
+/*
+    Remember, per thread, which frames the last few exceptions went through and skip the
+    handlers registered with SEH::AddMemoSafeHandler when the same exception is raised from
+    the same place again. Every frame is still checked and compared, see resolution_memo.h.
+    Only worth it for code that raises the same exception over and over below handlers
+    that always decline it.
+*/
+#define RESOLUTION_MEMO 0
+
+/*
+    Capture a compact snapshot of the first exception that goes unhandled: its record
+    chain, CONTEXT and every registration frame with its handler's module and RVA, and
+    why the dispatch stopped. Written to the path given to SEH::SetCrashSnapshotPath with
+    one WriteFile from a buffer allocated by EnableSEH, no minidump involved. Read with
+    Tools/Crash Snapshot Reader.
+*/
+#define CRASH_SNAPSHOT 0
+
+/*
+    Publish the DISPATCH_STATISTICS counters (dispatches per code, dispositions, unwinds,
+    stack invalid aborts, time spent dispatching and unwinding) into named shared memory
+    after SEH::ExportTelemetry, for Tools/Telemetry Scraper and other monitors. The
+    threads finishing dispatches publish at most every 10 ms and never wait for each
+    other or for readers. Does nothing without DISPATCH_STATISTICS.
+*/
+#define TELEMETRY_EXPORT 0
\ No newline at end of file
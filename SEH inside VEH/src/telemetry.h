@@ -0,0 +1,253 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "statistics.h"
+
+/*
+    The statistics totals published into shared memory, for monitors in other processes
+    (Tools/Telemetry Scraper) that don't want to call into the library.
+
+    A Segment is a fixed layout: a Header written once when the segment is set up, a
+    sequence number and the counters as 64-bit words. The sequence is a seqlock: odd
+    while the counters are being written, bumped to the next even number once they are.
+    A reader copies the words between two loads of the same even sequence, otherwise it
+    tries again, so it never sees a half published set.
+
+    Nothing in the library waits on the segment. Statistics::Recorder tells Publisher
+    when a dispatch or unwind finished; at most once per interval one of those threads
+    sums the thread blocks and publishes. A thread that finds the sequence odd skips
+    publishing rather than waiting, the next publication includes its counts anyway.
+    A writer that dies while publishing leaves the sequence odd, readers give up after
+    a number of tries instead of hanging.
+
+    Layout, little endian, the version changes whenever it does:
+
+        Header      bytes 0-31
+        sequence    bytes 32-39
+        reserved    bytes 40-63
+        Counters    from byte 64, as counterWords 64-bit words
+*/
+
+namespace SEH
+{
+    namespace Telemetry
+    {
+        static const uint32_t version = 1;
+        static const unsigned int codeSlots = Statistics::codeSlots;
+
+        struct Header
+        {
+            char magic[8];           //"SEHTELEM"
+            uint32_t version;
+            uint32_t size;           //Of the whole segment
+            uint32_t processId;
+            uint32_t pointerSize;
+            uint64_t ticksPerSecond; //Unit of the times
+        };
+
+        struct Counters
+        {
+            uint64_t publications;   //Times the counters were published
+            uint64_t publishedAt;    //Ticks of the last publication
+            uint64_t dispatches;
+            uint64_t handlersExecuted;
+            uint64_t outcomes[Statistics::outcomes]; //Handler dispositions, Statistics::Outcome order
+            uint64_t stackInvalid;   //Dispatches stopped by a bad frame or a broken chain
+            uint64_t unwinds;
+            uint64_t framesPopped;
+            uint64_t dispatchTicks;  //Spent in DispatchException
+            uint64_t unwindTicks;    //Spent in Unwind
+            uint64_t otherCodes;     //Dispatches of codes that didn't fit in codes
+            uint32_t codeCount;
+            uint32_t reserved;
+            uint32_t codes[codeSlots];
+            uint64_t codeDispatches[codeSlots];
+        };
+
+        static const size_t counterWords = sizeof(Counters) / sizeof(uint64_t);
+
+        struct Segment
+        {
+            Header header;
+            std::atomic<uint64_t> sequence;
+            uint64_t reserved[3];
+            std::atomic<uint64_t> words[counterWords];
+        };
+
+        static_assert(sizeof(Header) == 32, "Header is part of the segment layout");
+        static_assert(sizeof(Counters) % sizeof(uint64_t) == 0, "Counters is copied as 64-bit words");
+        static_assert(offsetof(Segment, sequence) == 32 && offsetof(Segment, words) == 64, "Segment is a fixed layout");
+        static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free, "The sequence and words are shared with other processes");
+
+        //Sets up a zeroed segment, the magic last so a reader never takes a half made one for a segment
+        inline void initialize(Segment& segment, uint32_t processId, uint64_t ticksPerSecond)
+        {
+            segment.header.version = version;
+            segment.header.size = sizeof(Segment);
+            segment.header.processId = processId;
+            segment.header.pointerSize = sizeof(void*);
+            segment.header.ticksPerSecond = ticksPerSecond;
+
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(segment.header.magic, "SEHTELEM", sizeof(segment.header.magic));
+        }
+
+        inline bool isSegment(const Header& header)
+        {
+            return memcmp(header.magic, "SEHTELEM", sizeof(header.magic)) == 0 && header.version == version && header.size == sizeof(Segment);
+        }
+
+        //Returns false at once if another thread is publishing
+        inline bool publish(Segment& segment, const Counters& counters)
+        {
+            uint64_t sequence = segment.sequence.load(std::memory_order_relaxed);
+
+            if ((sequence & 1) != 0 || !segment.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+            {
+                return false;
+            }
+
+            //No word may be seen written before the sequence is odd
+            std::atomic_thread_fence(std::memory_order_release);
+
+            uint64_t words[counterWords];
+            memcpy(words, &counters, sizeof(counters));
+
+            for (size_t i = 0; i < counterWords; ++i)
+            {
+                segment.words[i].store(words[i], std::memory_order_relaxed);
+            }
+
+            segment.sequence.store(sequence + 2, std::memory_order_release);
+            return true;
+        }
+
+        //Copies a consistent set of counters, false if a writer held the segment for every try
+        inline bool read(const Segment& segment, Counters& counters, unsigned int tries = 10000)
+        {
+            for (unsigned int i = 0; i < tries; ++i)
+            {
+                uint64_t before = segment.sequence.load(std::memory_order_acquire);
+
+                if ((before & 1) != 0)
+                {
+                    continue;
+                }
+
+                uint64_t words[counterWords];
+
+                for (size_t word = 0; word < counterWords; ++word)
+                {
+                    words[word] = segment.words[word].load(std::memory_order_relaxed);
+                }
+
+                //The copies above may not be moved past the second load
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (segment.sequence.load(std::memory_order_relaxed) == before)
+                {
+                    memcpy(&counters, words, sizeof(counters));
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        inline void fill(Counters& counters, const Statistics::Counts& totals)
+        {
+            counters.dispatches = totals.dispatches;
+            counters.handlersExecuted = totals.handlersExecuted;
+            counters.stackInvalid = totals.stackInvalid;
+            counters.unwinds = totals.unwinds;
+            counters.framesPopped = totals.framesPopped;
+            counters.dispatchTicks = totals.dispatchTicks;
+            counters.unwindTicks = totals.unwindTicks;
+            counters.otherCodes = totals.otherCodes;
+            counters.codeCount = totals.codeCount;
+
+            for (unsigned int i = 0; i < Statistics::outcomes; ++i)
+            {
+                counters.outcomes[i] = totals.outcomes[i];
+            }
+
+            for (unsigned int i = 0; i < totals.codeCount; ++i)
+            {
+                counters.codes[i] = totals.codes[i];
+                counters.codeDispatches[i] = totals.codeDispatches[i];
+            }
+        }
+
+        /*
+            Statistics::Recorder's Publisher. Target::segment() is where to publish (NULL for
+            nowhere yet) and Target::interval() the fewest ticks between two publications.
+            Of the threads finishing at the same time, the one that moves the last
+            publication time forward publishes, the others return.
+        */
+        template <class Target>
+        struct Publisher
+        {
+            static void finished(uint64_t now)
+            {
+                Segment* segment = Target::segment();
+
+                if (segment == NULL)
+                {
+                    return;
+                }
+
+                uint64_t last = lastPublished().load(std::memory_order_relaxed);
+
+                if (now - last < Target::interval() || !lastPublished().compare_exchange_strong(last, now, std::memory_order_relaxed))
+                {
+                    return;
+                }
+
+                //Only the counters, the histograms would be a few KB on a stack that may be almost gone
+                Statistics::Counts totals;
+                Statistics::aggregate(totals);
+
+                Counters counters = {};
+                fill(counters, totals);
+                counters.publications = publications().fetch_add(1, std::memory_order_relaxed) + 1;
+                counters.publishedAt = now;
+
+                publish(*segment, counters);
+            }
+
+        private:
+            static std::atomic<uint64_t>& lastPublished()
+            {
+                static std::atomic<uint64_t> last(0);
+                return last;
+            }
+
+            static std::atomic<uint64_t>& publications()
+            {
+                static std::atomic<uint64_t> count(0);
+                return count;
+            }
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include <mutex>
+
+#include "SEH.h"
+#include "telemetry_export.h"
+
+namespace SEH
+{
+    namespace Telemetry_Export
+    {
+        //Published at most this often
+        static const uint64_t publicationsPerSecond = 100;
+
+        static std::atomic<Telemetry::Segment*> exported(NULL);
+        static uint64_t publicationInterval = 0;
+
+        bool start(const wchar_t* Name)
+        {
+            static std::mutex starting;
+            std::lock_guard<std::mutex> lock(starting);
+
+            if (exported.load(std::memory_order_relaxed) != NULL)
+            {
+                return false;
+            }
+
+            wchar_t DefaultName[64];
+
+            if (Name == NULL)
+            {
+                swprintf_s(DefaultName, L"Local\\SEH inside VEH telemetry %lu", GetCurrentProcessId());
+                Name = DefaultName;
+            }
+
+            HANDLE Mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Telemetry::Segment), Name);
+
+            if (Mapping == NULL)
+            {
+                return false;
+            }
+
+            //Someone else's segment by that name, don't write over it
+            if (GetLastError() == ERROR_ALREADY_EXISTS)
+            {
+                CloseHandle(Mapping);
+                return false;
+            }
+
+            Telemetry::Segment* Segment = (Telemetry::Segment*)MapViewOfFile(Mapping, FILE_MAP_WRITE, 0, 0, sizeof(Telemetry::Segment));
+
+            if (Segment == NULL)
+            {
+                CloseHandle(Mapping);
+                return false;
+            }
+
+            LARGE_INTEGER Frequency;
+            QueryPerformanceFrequency(&Frequency);
+
+            Telemetry::initialize(*Segment, GetCurrentProcessId(), Frequency.QuadPart);
+            publicationInterval = Frequency.QuadPart / publicationsPerSecond;
+
+            //The mapping and the view stay until the process ends, a dispatch may be publishing at any time
+            exported.store(Segment, std::memory_order_release);
+            return true;
+        }
+
+        Telemetry::Segment* Target::segment()
+        {
+            return exported.load(std::memory_order_acquire);
+        }
+
+        uint64_t Target::interval()
+        {
+            return publicationInterval;
+        }
+    }
+
+#if DISPATCH_STATISTICS && TELEMETRY_EXPORT
+    bool ExportTelemetry(const wchar_t* Name)
+    {
+        return Telemetry_Export::start(Name);
+    }
+#else
+    bool ExportTelemetry(const wchar_t*)
+    {
+        return false;
+    }
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "telemetry.h"
+
+namespace SEH
+{
+    namespace Telemetry_Export
+    {
+        //Creates the named shared memory and starts publishing into it, only once per process
+        bool start(const wchar_t* Name);
+
+        //Telemetry::Publisher's target, nowhere until start
+        struct Target
+        {
+            static Telemetry::Segment* segment();
+            static uint64_t interval();
+        };
+
+        typedef Telemetry::Publisher<Target> Publisher;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,141 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+/*
+    A Block per thread that other threads can read at any time without locks.
+
+    Blocks live in a singly linked list that only ever grows; they are never freed.
+    When a thread exits its block is marked free and handed to the next new thread,
+    which calls Block::claim() before using it. Readers walk the list with forEach
+    and see every block that was ever handed out, in use or not.
+
+    Block must be value-initializable and have a void claim().
+
+    A thread's first block is usually made on its first dispatch, inside the VEH and
+    maybe with the heap lock held by the code that faulted. So nodes come from an
+    allocator the library can set to something that doesn't touch the heap (SEH.cpp
+    carves them from reserved pages); operator new is only the default, and the
+    fallback if the allocator runs out.
+*/
+
+namespace SEH
+{
+    namespace Thread_Registry
+    {
+        //Returns Size bytes aligned to Alignment that are never given back, or NULL
+        typedef void* (*Allocator)(size_t Size, size_t Alignment);
+
+        inline std::atomic<Allocator>& allocator()
+        {
+            static std::atomic<Allocator> current(nullptr);
+            return current;
+        }
+
+        template <class Block>
+        class Registry
+        {
+        public:
+            //The calling thread's block, claimed on first use
+            static Block& local()
+            {
+                thread_local Owner owner;
+                return owner.node->block;
+            }
+
+            template <class Function>
+            static void forEach(Function function)
+            {
+                for (Node* node = head().load(std::memory_order_acquire); node != nullptr; node = node->next)
+                {
+                    function(node->block);
+                }
+            }
+
+            //Only the blocks of threads that are still running
+            template <class Function>
+            static void forEachInUse(Function function)
+            {
+                for (Node* node = head().load(std::memory_order_acquire); node != nullptr; node = node->next)
+                {
+                    if (node->inUse.load(std::memory_order_acquire))
+                    {
+                        function(node->block);
+                    }
+                }
+            }
+
+        private:
+            struct Node
+            {
+                Block block;
+                std::atomic<bool> inUse;
+                Node* next;
+            };
+
+            static std::atomic<Node*>& head()
+            {
+                static std::atomic<Node*> first(nullptr);
+                return first;
+            }
+
+            //Reuses the block of a thread that exited before making a new one
+            static Node* claim()
+            {
+                Node* node;
+
+                for (node = head().load(std::memory_order_acquire); node != nullptr; node = node->next)
+                {
+                    bool free = false;
+
+                    if (node->inUse.compare_exchange_strong(free, true, std::memory_order_acquire))
+                    {
+                        break;
+                    }
+                }
+
+                if (node == nullptr)
+                {
+                    Allocator allocate = allocator().load(std::memory_order_acquire);
+                    void* memory = (allocate != nullptr) ? allocate(sizeof(Node), alignof(Node)) : nullptr;
+
+                    node = (memory != nullptr) ? new (memory) Node() : new Node(); //Value initialized
+                    node->inUse.store(true, std::memory_order_relaxed);
+                    node->next = head().load(std::memory_order_relaxed);
+
+                    while (!head().compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {}
+                }
+
+                node->block.claim();
+                return node;
+            }
+
+            struct Owner
+            {
+                Node* node;
+
+                Owner() : node(claim()) {}
+                ~Owner() { node->inUse.store(false, std::memory_order_release); }
+            };
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,69 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "dispatch_pipeline.h"
+
+/*
+    Threads that asked for SEH emulation with SEH::ThreadScope. The VEH is process-wide,
+    with THREAD_SCOPE set every other thread's exceptions go back to real SEH after
+    one TLS load, before the code filter, the checks or any chain walk.
+
+    Scopes nest: the depth is a plain per-thread counter, only its own thread ever
+    touches it so it needs no atomics.
+*/
+
+#ifndef THREAD_SCOPE
+#define THREAD_SCOPE 0
+#endif
+
+namespace SEH
+{
+    namespace Thread_Scope
+    {
+        //How many scopes the calling thread is in
+        inline unsigned int& depth()
+        {
+            thread_local unsigned int Depth = 0;
+            return Depth;
+        }
+
+        inline void enter()
+        {
+            ++depth();
+        }
+
+        inline void leave()
+        {
+            --depth();
+        }
+
+        //Thread_Scope as a DispatchException pipeline stage, runs before every other check
+        struct Check
+        {
+            static const bool enabled = (THREAD_SCOPE != 0);
+            static const unsigned int cost = 0;
+
+            template <class Platform>
+            static Pipeline::Verdict filter(typename Platform::Record*, typename Platform::Context*)
+            {
+                return (depth() != 0) ? Pipeline::Next : Pipeline::Skip;
+            }
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,235 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+    Finds the return addresses BOUND_CHECK expects at the top of a C++ throw's stack
+    trace by decoding code instead of throwing and walking the stack:
+
+        RaiseException      returns to the instruction after its call to RtlRaiseException,
+                            which is also the Eip of the context the exception is raised with
+        _CxxThrowException  returns to the instruction after its call to RaiseException
+
+    Functions are followed through the jmps in front of them (import thunks, incremental
+    linking thunks, the kernel32 stubs that jump to kernelbase), then their first
+    instructions are searched for a call whose destination resolves to the callee.
+    Calls are matched on the exact destination, so bytes that only look like a call
+    don't count. No instruction length decoding is needed for that.
+
+    Code is read through a memory policy, the same one unwind_patch.h uses, so the
+    decoder runs just as well over a fixture as over the loaded modules:
+
+        const uint8_t* at(uint32_t VA, size_t size) const; //NULL if not readable
+
+    Bytes that only look like a jmp or a call [slot] point anywhere, so the loaded
+    modules are read through ImageMemory, which only lets reads inside an image through.
+*/
+
+namespace SEH
+{
+    namespace Throw_Sites
+    {
+        //How far into a function the call is looked for, both calls are near the top
+        const size_t searchWindow = 512;
+
+        //How many jmps to follow to reach a function's body
+        const unsigned int maxThunks = 4;
+
+        //Reads the current address space unchecked, only for what ImageMemory let through
+        struct ProcessMemory
+        {
+            const uint8_t* at(uint32_t VA, size_t) const
+            {
+                return reinterpret_cast<const uint8_t*>((uintptr_t)VA);
+            }
+        };
+
+        /*
+            Inner, limited to reads that lie within one image. Images finds the image an
+            address is in:
+
+                bool find(uint32_t VA, uint32_t& Base, uint32_t& Size) const;
+
+            The last image found is kept, decoding mostly reads around the same place.
+        */
+        template <class Images, class Inner = ProcessMemory>
+        struct ImageMemory
+        {
+            Images images;
+            Inner inner;
+            mutable uint32_t Base = 0;
+            mutable uint32_t Size = 0;
+
+            const uint8_t* at(uint32_t VA, size_t size) const
+            {
+                if (VA - Base >= Size && !images.find(VA, Base, Size))
+                {
+                    return NULL;
+                }
+
+                if (VA - Base >= Size || Size - (VA - Base) < size)
+                {
+                    return NULL;
+                }
+
+                return inner.at(VA, size);
+            }
+        };
+
+        //Reads from a copy of code, Base being the address the first byte was at
+        struct BufferMemory
+        {
+            const uint8_t* Data;
+            size_t Size;
+            uint32_t Base;
+
+            const uint8_t* at(uint32_t VA, size_t size) const
+            {
+                if (VA < Base || VA - Base > Size || Size - (VA - Base) < size)
+                {
+                    return NULL;
+                }
+
+                return Data + (VA - Base);
+            }
+        };
+
+        inline uint32_t load32(const uint8_t* bytes)
+        {
+            uint32_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        //Follows jmp rel32, jmp rel8 and jmp [slot] from Function, returns where they end
+        template <class Memory>
+        uint32_t followThunks(const Memory& memory, uint32_t Function)
+        {
+            for (unsigned int i = 0; i < maxThunks && Function != 0; ++i)
+            {
+                const uint8_t* code = memory.at(Function, 2);
+
+                if (code == NULL)
+                {
+                    break;
+                }
+
+                if (code[0] == 0xE9 && (code = memory.at(Function, 5)) != NULL)
+                {
+                    Function += 5 + load32(code + 1);
+                }
+                else if (code[0] == 0xEB)
+                {
+                    Function += 2 + (int8_t)code[1];
+                }
+                else if (code[0] == 0xFF && code[1] == 0x25 && (code = memory.at(Function, 6)) != NULL)
+                {
+                    const uint8_t* slot = memory.at(load32(code + 2), 4);
+
+                    if (slot == NULL)
+                    {
+                        break;
+                    }
+
+                    Function = load32(slot);
+                }
+                else
+                    break;
+            }
+
+            return Function;
+        }
+
+        /*
+            Returns the address right after the first call in Function's body that reaches
+            Callee (also through thunks), or 0. Both are followed through thunks first.
+        */
+        template <class Memory>
+        uint32_t findReturnSite(const Memory& memory, uint32_t Function, uint32_t Callee)
+        {
+            Function = followThunks(memory, Function);
+            Callee = followThunks(memory, Callee);
+
+            if (Function == 0 || Callee == 0)
+            {
+                return 0;
+            }
+
+            //The window may run past the end of what's readable, shrink it until it doesn't
+            size_t window = searchWindow;
+            const uint8_t* code = NULL;
+
+            while (window >= 6 && (code = memory.at(Function, window)) == NULL)
+            {
+                window /= 2;
+            }
+
+            if (code == NULL)
+            {
+                return 0;
+            }
+
+            for (size_t i = 0; i + 5 <= window; ++i)
+            {
+                //call [slot]
+                if (code[i] == 0xFF && code[i + 1] == 0x15 && i + 6 <= window)
+                {
+                    const uint8_t* slot = memory.at(load32(code + i + 2), 4);
+
+                    if (slot != NULL && followThunks(memory, load32(slot)) == Callee)
+                    {
+                        return Function + (uint32_t)i + 6;
+                    }
+                }
+
+                //call rel32, maybe to a thunk
+                if (code[i] == 0xE8)
+                {
+                    uint32_t destination = Function + (uint32_t)i + 5 + load32(code + i + 1);
+
+                    if (destination == Callee || followThunks(memory, destination) == Callee)
+                    {
+                        return Function + (uint32_t)i + 5;
+                    }
+                }
+            }
+
+            return 0;
+        }
+
+        struct Sites
+        {
+            uint32_t RaiseException;     //Return address inside RaiseException
+            uint32_t _CxxThrowException; //Return address inside _CxxThrowException
+        };
+
+        //Returns false if either site wasn't found, the functions are their addresses or any thunk to them
+        template <class Memory>
+        bool resolve(const Memory& memory, uint32_t RaiseException, uint32_t RtlRaiseException, uint32_t _CxxThrowException, Sites& sites)
+        {
+            sites.RaiseException = findReturnSite(memory, RaiseException, RtlRaiseException);
+            sites._CxxThrowException = findReturnSite(memory, _CxxThrowException, RaiseException);
+
+            return sites.RaiseException != 0 && sites._CxxThrowException != 0;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,267 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "thread_registry.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#else
+#include <functional>
+#include <thread>
+#endif
+
+/*
+    A binary trace of what DispatchException, Unwind and NestedExceptionHandler did.
+
+    Every thread records fixed-size events into its own ring (thread_registry.h), so
+    recording is a timestamp, a 32 byte store and a release store of the head, no locks
+    or locked instructions. The ring keeps the newest ringEvents events.
+
+    dump() writes every ring for the trace decoder (Tools/Trace Decoder) from any
+    thread at any time. A ring being written while it is dumped is copied without
+    stopping its thread; events its thread may have overwritten during the copy are
+    written as Lost instead, so a dump never contains torn events.
+
+    Core::DispatchException and Core::Unwind talk to Platform::Tracer, which is either
+    Recorder<Clock> or Disabled (every function empty).
+
+    File layout, all little endian:
+
+        FileHeader
+        for every thread that recorded anything:
+            ThreadHeader
+            Event[ThreadHeader::count]
+*/
+
+namespace SEH
+{
+    namespace Trace
+    {
+        static const size_t ringEvents = 2048; //64KB per thread
+
+        enum EventType : uint8_t
+        {
+            Lost,          //Overwritten while being dumped
+            DispatchBegin, //value: ExceptionCode, a: ExceptionAddress, b: ExceptionFlags
+            HandlerCall,   //a: frame, b: handler
+            HandlerReturn, //value: disposition, a: frame
+            StackInvalid,  //a: frame outside of the stack or unaligned, dispatch stops
+            DispatchEnd,   //value: EXCEPTION_CONTINUE_EXECUTION or EXCEPTION_CONTINUE_SEARCH
+            Nested,        //a: frame whose handler raised, from NestedExceptionHandler
+            UnwindBegin,   //value: ExceptionCode (0 without a record), a: target frame, b: ExceptionFlags
+            Collided,      //a: frame the collided unwind picks up from
+            UnwindEnd,     //Target reached, a: target frame
+            Raise,         //value: status raised instead of returning (e.g. STATUS_INVALID_DISPOSITION)
+            Unhandled,     //value: ExceptionCode passed to the final NtRaiseException
+            eventTypes
+        };
+
+        enum EventFlags : uint8_t
+        {
+            Unwinding = 0x1 //HandlerCall, HandlerReturn, Nested, Raise and Unhandled during an unwind
+        };
+
+        struct Event
+        {
+            uint64_t timestamp;
+            uint8_t type;
+            uint8_t flags;
+            uint16_t reserved;
+            uint32_t value;
+            uint64_t a;
+            uint64_t b;
+        };
+
+        static_assert(sizeof(Event) == 32, "Event is part of the file format");
+
+        struct FileHeader
+        {
+            char magic[8];           //"SEHTRACE"
+            uint32_t version;
+            uint32_t eventSize;
+            uint64_t ticksPerSecond; //Unit of Event::timestamp
+            uint32_t pointerSize;    //Of the traced process
+            uint32_t reserved;
+        };
+
+        struct ThreadHeader
+        {
+            uint32_t threadId;
+            uint32_t reserved;
+            uint64_t firstIndex; //Events the thread recorded before the first one in the dump
+            uint64_t count;
+        };
+
+        static const uint32_t version = 1;
+
+        inline uint32_t currentThreadId()
+        {
+        #if defined(_WIN32)
+            return GetCurrentThreadId();
+        #elif defined(__linux__)
+            return (uint32_t)syscall(SYS_gettid);
+        #else
+            return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+        #endif
+        }
+
+        struct Ring
+        {
+            std::atomic<uint64_t> head; //Events ever recorded, the next one goes in events[head % ringEvents]
+            std::atomic<uint32_t> threadId;
+            Event events[ringEvents];
+
+            //A new thread starts with an empty ring
+            void claim()
+            {
+                head.store(0, std::memory_order_release);
+                threadId.store(currentThreadId(), std::memory_order_relaxed);
+            }
+
+            void record(uint64_t timestamp, EventType type, uint8_t flags, uint32_t value, uint64_t a, uint64_t b)
+            {
+                uint64_t index = head.load(std::memory_order_relaxed);
+                Event& event = events[index % ringEvents];
+
+                event.timestamp = timestamp;
+                event.type = type;
+                event.flags = flags;
+                event.reserved = 0;
+                event.value = value;
+                event.a = a;
+                event.b = b;
+
+                head.store(index + 1, std::memory_order_release);
+            }
+        };
+
+        typedef Thread_Registry::Registry<Ring> Registry;
+
+        /*
+            Writes every ring, write(const void*, size_t) returns false on failure. Doesn't
+            allocate, so it can run at second chance.
+        */
+        template <class Writer>
+        bool dump(Writer& write, uint64_t ticksPerSecond)
+        {
+            FileHeader header = {};
+            memcpy(header.magic, "SEHTRACE", sizeof(header.magic));
+            header.version = version;
+            header.eventSize = sizeof(Event);
+            header.ticksPerSecond = ticksPerSecond;
+            header.pointerSize = sizeof(void*);
+
+            bool written = write(&header, sizeof(header));
+
+            Registry::forEach([&](const Ring& ring)
+            {
+                const size_t chunkEvents = 64;
+
+                uint64_t head = ring.head.load(std::memory_order_acquire);
+                uint64_t first = (head > ringEvents) ? head - ringEvents : 0;
+
+                if (!written || head == 0)
+                {
+                    return;
+                }
+
+                ThreadHeader thread = {};
+                thread.threadId = ring.threadId.load(std::memory_order_relaxed);
+                thread.firstIndex = first;
+                thread.count = head - first;
+
+                written = write(&thread, sizeof(thread));
+
+                for (uint64_t index = first; written && index < head; index += chunkEvents)
+                {
+                    Event chunk[chunkEvents];
+                    size_t count = (size_t)((head - index < chunkEvents) ? head - index : chunkEvents);
+
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        chunk[i] = ring.events[(index + i) % ringEvents];
+                    }
+
+                    //The owner may have lapped us, it writes events[now % ringEvents] before publishing now + 1
+                    uint64_t now = ring.head.load(std::memory_order_acquire);
+                    uint64_t oldestIntact = (now + 1 > ringEvents) ? now + 1 - ringEvents : 0;
+
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        if (index + i < oldestIntact)
+                        {
+                            chunk[i] = Event();
+                            chunk[i].type = Lost;
+                        }
+                    }
+
+                    written = write(chunk, count * sizeof(Event));
+                }
+            });
+
+            return written;
+        }
+
+        //Records into the calling thread's ring, Clock::now() returns ticks
+        template <class Clock>
+        struct Recorder
+        {
+            static void record(EventType type, uint8_t flags, uint32_t value, uint64_t a = 0, uint64_t b = 0)
+            {
+                Registry::local().record(Clock::now(), type, flags, value, a, b);
+            }
+
+            static void dispatchBegin(uint32_t Code, const void* Address, uint32_t Flags) { record(DispatchBegin, 0, Code, (uintptr_t)Address, Flags); }
+            static void handlerCall(bool unwind, const void* Frame, const void* Handler) { record(HandlerCall, unwind ? Unwinding : 0, 0, (uintptr_t)Frame, (uintptr_t)Handler); }
+            static void handlerReturn(bool unwind, const void* Frame, unsigned int Disposition) { record(HandlerReturn, unwind ? Unwinding : 0, Disposition, (uintptr_t)Frame); }
+            static void stackInvalid(const void* Frame) { record(StackInvalid, 0, 0, (uintptr_t)Frame); }
+            static void dispatchEnd(long Result) { record(DispatchEnd, 0, (uint32_t)Result); }
+            static void nested(bool unwind, const void* Frame) { record(Nested, unwind ? Unwinding : 0, 0, (uintptr_t)Frame); }
+            static void unwindBegin(uint32_t Code, const void* TargetFrame, uint32_t Flags) { record(UnwindBegin, Unwinding, Code, (uintptr_t)TargetFrame, Flags); }
+            static void collided(const void* Frame) { record(Collided, Unwinding, 0, (uintptr_t)Frame); }
+            static void unwindEnd(const void* TargetFrame) { record(UnwindEnd, Unwinding, 0, (uintptr_t)TargetFrame); }
+            static void raise(bool unwind, uint32_t Status) { record(Raise, unwind ? Unwinding : 0, Status); }
+            static void unhandled(bool unwind, uint32_t Code) { record(Unhandled, unwind ? Unwinding : 0, Code); }
+        };
+
+        //Records nothing
+        struct Disabled
+        {
+            static void dispatchBegin(uint32_t, const void*, uint32_t) {}
+            static void handlerCall(bool, const void*, const void*) {}
+            static void handlerReturn(bool, const void*, unsigned int) {}
+            static void stackInvalid(const void*) {}
+            static void dispatchEnd(long) {}
+            static void nested(bool, const void*) {}
+            static void unwindBegin(uint32_t, const void*, uint32_t) {}
+            static void collided(const void*) {}
+            static void unwindEnd(const void*) {}
+            static void raise(bool, uint32_t) {}
+            static void unhandled(bool, uint32_t) {}
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include "SEH.h"
+#include "trace.h"
+#include "trace_dump.h"
+
+namespace SEH
+{
+    namespace Trace_Dump
+    {
+        static wchar_t secondChancePath[MAX_PATH] = {};
+        static volatile LONG armed = FALSE;
+
+        struct FileWriter
+        {
+            HANDLE File;
+
+            bool operator()(const void* Data, size_t Size)
+            {
+                DWORD Written = 0;
+                return WriteFile(File, Data, (DWORD)Size, &Written, NULL) && Written == Size;
+            }
+        };
+
+        bool dump(const wchar_t* Path)
+        {
+            HANDLE File = CreateFileW(Path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+            if (File == INVALID_HANDLE_VALUE)
+            {
+                return false;
+            }
+
+            LARGE_INTEGER Frequency;
+            QueryPerformanceFrequency(&Frequency);
+
+            FileWriter write = { File };
+            bool written = Trace::dump(write, Frequency.QuadPart);
+
+            CloseHandle(File);
+            return written;
+        }
+
+        void setSecondChancePath(const wchar_t* Path)
+        {
+            InterlockedExchange(&armed, FALSE);
+
+            if (Path != NULL && wcscpy_s(secondChancePath, Path) == 0)
+            {
+                InterlockedExchange(&armed, TRUE);
+            }
+        }
+
+        void secondChance()
+        {
+            //Only the first unhandled exception is dumped, the rest would overwrite it
+            if (InterlockedExchange(&armed, FALSE))
+            {
+                dump(secondChancePath);
+            }
+        }
+    }
+
+    bool DumpTrace(const wchar_t* Path)
+    {
+    #if DISPATCH_TRACE
+        return Trace_Dump::dump(Path);
+    #else
+        return false;
+    #endif
+    }
+
+    void SetTraceDumpPath(const wchar_t* Path)
+    {
+        Trace_Dump::setSecondChancePath(Path);
+    }
+}
\ No newline at end of file
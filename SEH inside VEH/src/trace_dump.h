@@ -0,0 +1,34 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+namespace SEH
+{
+    namespace Trace_Dump
+    {
+        //Writes every thread's trace ring to Path, see trace.h for the format
+        bool dump(const wchar_t* Path);
+
+        //Path secondChance dumps to, NULL to not dump at second chance
+        void setSecondChancePath(const wchar_t* Path);
+
+        //Called right before the final NtRaiseException of an unhandled exception
+        void secondChance();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,1005 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UNWIND_PATCH_SSE2 1
+#include <emmintrin.h>
+#else
+#define UNWIND_PATCH_SSE2 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+    Finds the calls and jmps that reach RtlUnwind and sends them to SEH::Unwind
+    instead, what the IDA scripts in "Unwinding Problem/Patching RtlUnwind" used to
+    do by hand.
+
+    scan() is the core. It goes over a buffer of x86 code once and reports every
+
+        FF 15 [slot]    call [slot]     slot is an IAT entry of RtlUnwind
+        FF 25 [slot]    jmp [slot]      (how the linker writes import thunks)
+        E8 rel32        call rel32      to RtlUnwind itself or to a jmp [slot] thunk
+        E9 rel32        jmp rel32
+
+    It only needs the code, the address it runs at and a way to read the bytes at a
+    branch destination, so the same scan works on a PE file and on a loaded module.
+
+    Image reads the headers, sections, imports, exports, symbols and base
+    relocations of a PE32 image either as a file or as mapped by the loader, and
+    patchImage() rewrites the sites found in it:
+
+        SEH inside VEH linked statically    call/jmp [slot] becomes call/jmp rel32 to
+                                            SEH::Unwind plus a nop and the relocation of
+                                            the slot address is dropped. Direct calls are
+                                            pointed at SEH::Unwind as well.
+        SEH inside VEH linked dynamically   call/jmp [slot] reads the IAT entry of
+                                            SEH::Unwind instead. Direct calls reach it
+                                            through their thunk, which is patched too.
+
+    Nothing is left pointing at RtlUnwind afterwards, so patching twice is harmless.
+
+    planRedirection() is the in-memory version EnableSEH uses on loaded modules, which
+    only has to change IAT entries (see unwind_redirect.cpp).
+*/
+
+namespace SEH
+{
+    namespace Unwind_Patch
+    {
+        enum SiteKind
+        {
+            IndirectCall, //FF 15
+            IndirectJmp,  //FF 25
+            DirectCall,   //E8
+            DirectJmp     //E9
+        };
+
+        struct Site
+        {
+            uint32_t VA;     //Address of the opcode
+            SiteKind kind;
+            uint32_t target; //Slot for indirect sites, destination for direct ones
+        };
+
+        //What a call to RtlUnwind goes through
+        struct Targets
+        {
+            std::vector<uint32_t> slots; //VAs of the IAT entries of RtlUnwind
+            uint32_t function;           //VA of RtlUnwind itself, 0 if it isn't known (offline)
+
+            bool isSlot(uint32_t VA) const
+            {
+                return std::find(slots.begin(), slots.end(), VA) != slots.end();
+            }
+        };
+
+        inline bool equalsIgnoreCase(const char* a, const char* b)
+        {
+            for (; *a != 0 && *b != 0; ++a, ++b)
+            {
+                if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+                {
+                    return false;
+                }
+            }
+
+            return *a == *b;
+        }
+
+        inline uint32_t load32(const uint8_t* bytes)
+        {
+            uint32_t value;
+            memcpy(&value, bytes, sizeof(value));
+            return value;
+        }
+
+        inline void store32(uint8_t* bytes, uint32_t value)
+        {
+            memcpy(bytes, &value, sizeof(value));
+        }
+
+        //Memory needs `const uint8_t* at(uint32_t VA, size_t size) const`, NULL when it can't be read
+        template <class Memory>
+        inline bool isThunk(const Memory& memory, const Targets& targets, uint32_t VA)
+        {
+            const uint8_t* thunk = memory.at(VA, 6);
+
+            return thunk != NULL && thunk[0] == 0xFF && thunk[1] == 0x25 && targets.isSlot(load32(thunk + 2));
+        }
+
+        /*
+            Checks for a site at Code[i], reports it and returns its length, or returns 0.
+            Reading a branch destination through memory is why this is so much slower
+            than skipping bytes that can't start a site, see scan().
+        */
+        template <class Memory, class Visitor>
+        inline size_t matchSite(const uint8_t* Code, size_t Size, size_t i, uint32_t CodeVA, const Targets& targets, const Memory& memory, Visitor& visit)
+        {
+            uint8_t opcode = Code[i];
+
+            if (opcode == 0xFF && i + 6 <= Size && (Code[i + 1] == 0x15 || Code[i + 1] == 0x25))
+            {
+                uint32_t slot = load32(Code + i + 2);
+
+                if (targets.isSlot(slot))
+                {
+                    visit(Site{ CodeVA + (uint32_t)i, (Code[i + 1] == 0x15) ? IndirectCall : IndirectJmp, slot });
+                    return 6;
+                }
+            }
+            else if ((opcode == 0xE8 || opcode == 0xE9) && i + 5 <= Size)
+            {
+                uint32_t destination = CodeVA + (uint32_t)i + 5 + load32(Code + i + 1);
+
+                if ((targets.function != 0 && destination == targets.function) || isThunk(memory, targets, destination))
+                {
+                    visit(Site{ CodeVA + (uint32_t)i, (opcode == 0xE8) ? DirectCall : DirectJmp, destination });
+                    return 5;
+                }
+            }
+
+            return 0;
+        }
+
+        //scan() one byte at a time from Start, also what it uses for the last few bytes
+        template <class Memory, class Visitor>
+        inline void scanBytewise(const uint8_t* Code, size_t Size, uint32_t CodeVA, const Targets& targets, const Memory& memory, Visitor&& visit, size_t Start = 0)
+        {
+            for (size_t i = Start; i + 5 <= Size; )
+            {
+                size_t length = matchSite(Code, Size, i, CodeVA, targets, memory, visit);
+                i += (length != 0) ? length : 1;
+            }
+        }
+
+        inline unsigned int lowestBit(unsigned int mask)
+        {
+        #ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return index;
+        #else
+            return (unsigned int)__builtin_ctz(mask);
+        #endif
+        }
+
+        /*
+            Calls visit(const Site&) for every RtlUnwind site in Code, which runs at CodeVA.
+
+            With SSE2 the bytes are first compared 16 at a time against the opcodes a site
+            can start with (E8, E9, FF followed by 15 or 25), and only the few that match
+            are looked at further. Sites never overlap: a byte inside a site that was just
+            reported isn't checked, the same as scanning a byte at a time.
+        */
+        template <class Memory, class Visitor>
+        inline void scan(const uint8_t* Code, size_t Size, uint32_t CodeVA, const Targets& targets, const Memory& memory, Visitor&& visit)
+        {
+        #if UNWIND_PATCH_SSE2
+            const __m128i opcodeMask = _mm_set1_epi8((char)0xFE);
+            const __m128i directOpcode = _mm_set1_epi8((char)0xE8); //E8 and E9
+            const __m128i indirectOpcode = _mm_set1_epi8((char)0xFF);
+            const __m128i call = _mm_set1_epi8(0x15);
+            const __m128i jmp = _mm_set1_epi8(0x25);
+
+            size_t block = 0, next = 0;
+
+            //The block and the byte after it have to be readable
+            for (; block + 17 <= Size; block += 16)
+            {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Code + block));
+                __m128i following = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Code + block + 1));
+
+                __m128i direct = _mm_cmpeq_epi8(_mm_and_si128(bytes, opcodeMask), directOpcode);
+                __m128i indirect = _mm_and_si128(_mm_cmpeq_epi8(bytes, indirectOpcode), _mm_or_si128(_mm_cmpeq_epi8(following, call), _mm_cmpeq_epi8(following, jmp)));
+
+                unsigned int candidates = (unsigned int)_mm_movemask_epi8(_mm_or_si128(direct, indirect));
+
+                while (candidates != 0)
+                {
+                    size_t i = block + lowestBit(candidates);
+                    candidates &= candidates - 1;
+
+                    if (i >= next)
+                    {
+                        size_t length = matchSite(Code, Size, i, CodeVA, targets, memory, visit);
+
+                        if (length != 0)
+                        {
+                            next = i + length;
+                        }
+                    }
+                }
+            }
+
+            scanBytewise(Code, Size, CodeVA, targets, memory, visit, std::max(block, next));
+        #else
+            scanBytewise(Code, Size, CodeVA, targets, memory, visit);
+        #endif
+        }
+
+        enum Layout
+        {
+            FileLayout,  //As stored on disk, sections at PointerToRawData
+            MappedLayout //As mapped by the loader, RVA == offset
+        };
+
+        struct Section
+        {
+            uint32_t VirtualAddress;
+            uint32_t VirtualSize;
+            uint32_t PointerToRawData;
+            uint32_t SizeOfRawData;
+            uint32_t Characteristics;
+        };
+
+        //An IMAGE_REL_BASED_HIGHLOW fixup
+        struct Relocation
+        {
+            uint32_t RVA;    //What gets fixed up
+            uint32_t offset; //Offset of the 16 bit entry in the relocation block
+        };
+
+        //A PE32 image in memory, reads are bounds checked and return false or NULL instead of going past Size
+        class Image
+        {
+        public:
+            uint8_t* Data = NULL;
+            size_t Size = 0;
+            Layout layout = FileLayout;
+
+            uint32_t ImageBase = 0;
+            uint32_t SizeOfImage = 0;
+            uint32_t SizeOfHeaders = 0;
+            size_t CheckSumOffset = 0;
+            std::vector<Section> sections;
+            std::vector<Relocation> relocations; //Sorted by RVA
+            bool hasRelocations = false;         //IMAGE_DIRECTORY_ENTRY_BASERELOC exists, the image isn't fixed
+
+            const char* error = NULL;
+
+            bool parse(uint8_t* Bytes, size_t Length, Layout Kind)
+            {
+                //Offsets into IMAGE_DOS_HEADER, IMAGE_NT_HEADERS32 and IMAGE_SECTION_HEADER
+                const size_t e_lfanew = 0x3C;
+                const size_t NumberOfSections = 4 + 2;
+                const size_t SizeOfOptionalHeader = 4 + 16;
+                const size_t OptionalHeader = 0x18;
+
+                Data = Bytes;
+                Size = Length;
+                layout = Kind;
+                sections.clear();
+                relocations.clear();
+                hasRelocations = false;
+                error = NULL;
+
+                uint16_t magic, optionalMagic, sectionCount, optionalSize;
+                uint32_t ntHeaders, signature;
+
+                if (!read16(0, magic) || magic != 0x5A4D || !read32(e_lfanew, ntHeaders)) //MZ
+                {
+                    return fail("not a PE image");
+                }
+
+                if (!read32(ntHeaders, signature) || signature != 0x00004550 //PE\0\0
+                    || !read16(ntHeaders + NumberOfSections, sectionCount)
+                    || !read16(ntHeaders + SizeOfOptionalHeader, optionalSize))
+                {
+                    return fail("not a PE image");
+                }
+
+                if (!read16(ntHeaders + OptionalHeader, optionalMagic) || optionalMagic != 0x10B)
+                {
+                    return fail("not a PE32 image");
+                }
+
+                uint32_t rvaCount;
+
+                if (!read32(ntHeaders + OptionalHeader + 0x1C, ImageBase)
+                    || !read32(ntHeaders + OptionalHeader + 0x38, SizeOfImage)
+                    || !read32(ntHeaders + OptionalHeader + 0x3C, SizeOfHeaders)
+                    || !read32(ntHeaders + OptionalHeader + 0x5C, rvaCount))
+                {
+                    return fail("truncated optional header");
+                }
+
+                CheckSumOffset = ntHeaders + OptionalHeader + 0x40;
+                directoryCount = std::min<uint32_t>(rvaCount, 16);
+                directories = ntHeaders + OptionalHeader + 0x60;
+
+                size_t sectionHeaders = ntHeaders + OptionalHeader + optionalSize;
+
+                for (uint16_t i = 0; i < sectionCount; ++i)
+                {
+                    size_t header = sectionHeaders + i * 0x28;
+                    Section section;
+
+                    if (!read32(header + 0x08, section.VirtualSize)
+                        || !read32(header + 0x0C, section.VirtualAddress)
+                        || !read32(header + 0x10, section.SizeOfRawData)
+                        || !read32(header + 0x14, section.PointerToRawData)
+                        || !read32(header + 0x24, section.Characteristics))
+                    {
+                        return fail("truncated section table");
+                    }
+
+                    sections.push_back(section);
+                }
+
+                return parseRelocations();
+            }
+
+            //Data at RVA if size bytes of it are in the image
+            uint8_t* atRVA(uint32_t RVA, size_t size) const
+            {
+                size_t offset;
+
+                if (!offsetOf(RVA, size, offset))
+                {
+                    return NULL;
+                }
+
+                return Data + offset;
+            }
+
+            //The Memory interface of scan()
+            const uint8_t* at(uint32_t VA, size_t size) const
+            {
+                return atRVA(VA - ImageBase, size);
+            }
+
+            bool offsetOf(uint32_t RVA, size_t size, size_t& offset) const
+            {
+                if (layout == MappedLayout || RVA < SizeOfHeaders)
+                {
+                    offset = RVA;
+                }
+                else
+                {
+                    const Section* section = sectionOf(RVA);
+
+                    if (section == NULL || RVA - section->VirtualAddress >= section->SizeOfRawData)
+                    {
+                        return false; //Uninitialized data isn't in the file
+                    }
+
+                    offset = (size_t)section->PointerToRawData + (RVA - section->VirtualAddress);
+
+                    if (section->SizeOfRawData - (RVA - section->VirtualAddress) < size)
+                    {
+                        return false;
+                    }
+                }
+
+                return offset <= Size && Size - offset >= size;
+            }
+
+            const Section* sectionOf(uint32_t RVA) const
+            {
+                for (const Section& section : sections)
+                {
+                    uint32_t extent = std::max(section.VirtualSize, section.SizeOfRawData);
+
+                    if (RVA >= section.VirtualAddress && RVA - section.VirtualAddress < extent)
+                    {
+                        return &section;
+                    }
+                }
+
+                return NULL;
+            }
+
+            //A NUL terminated string at RVA, NULL if it runs off the end of its section
+            const char* string(uint32_t RVA) const
+            {
+                const uint8_t* start = atRVA(RVA, 1);
+
+                if (start == NULL)
+                {
+                    return NULL;
+                }
+
+                size_t available = (Data + Size) - start;
+
+                if (layout == FileLayout && RVA >= SizeOfHeaders)
+                {
+                    const Section* section = sectionOf(RVA);
+                    available = std::min<size_t>(available, section->SizeOfRawData - (RVA - section->VirtualAddress));
+                }
+
+                return (memchr(start, 0, available) != NULL) ? reinterpret_cast<const char*>(start) : NULL;
+            }
+
+            bool directory(unsigned int index, uint32_t& RVA, uint32_t& size) const
+            {
+                if (index >= directoryCount || !read32(directories + index * 8, RVA) || !read32(directories + index * 8 + 4, size))
+                {
+                    return false;
+                }
+
+                return RVA != 0;
+            }
+
+            /*
+                Visits every imported function as visit(const char* Dll, const char* Name, uint32_t SlotVA),
+                stopping when it returns true. Name is NULL for imports by ordinal and when the
+                name is gone (a loaded image without OriginalFirstThunk).
+            */
+            template <class Visitor>
+            bool forEachImport(Visitor&& visit) const
+            {
+                uint32_t descriptor, size;
+
+                if (!directory(1, descriptor, size)) //IMAGE_DIRECTORY_ENTRY_IMPORT
+                {
+                    return false;
+                }
+
+                for (;; descriptor += 0x14)
+                {
+                    const uint8_t* entry = atRVA(descriptor, 0x14);
+
+                    if (entry == NULL)
+                    {
+                        return false;
+                    }
+
+                    uint32_t originalFirstThunk = load32(entry), name = load32(entry + 0xC), firstThunk = load32(entry + 0x10);
+
+                    if (name == 0 || firstThunk == 0)
+                    {
+                        return false;
+                    }
+
+                    const char* Dll = string(name);
+
+                    //Without OriginalFirstThunk the IAT holds the names in a file, but addresses once loaded
+                    uint32_t lookup = (originalFirstThunk != 0) ? originalFirstThunk : (layout == FileLayout) ? firstThunk : 0;
+
+                    for (uint32_t i = 0; Dll != NULL; ++i)
+                    {
+                        const uint8_t* slot = atRVA(firstThunk + i * 4, 4);
+                        const uint8_t* thunk = (lookup != 0) ? atRVA(lookup + i * 4, 4) : slot;
+
+                        if (slot == NULL || thunk == NULL || load32(thunk) == 0)
+                        {
+                            break;
+                        }
+
+                        const char* Name = NULL;
+
+                        if (lookup != 0 && (load32(thunk) & 0x80000000) == 0) //IMAGE_ORDINAL_FLAG32
+                        {
+                            Name = string(load32(thunk) + 2); //Skip the hint
+                        }
+
+                        if (visit(Dll, Name, ImageBase + firstThunk + i * 4))
+                        {
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            //RVA of the function exported as Name (or starting with Name when prefix is set)
+            bool findExport(const char* Name, bool prefix, uint32_t& RVA) const
+            {
+                uint32_t exports, size;
+
+                if (!directory(0, exports, size)) //IMAGE_DIRECTORY_ENTRY_EXPORT
+                {
+                    return false;
+                }
+
+                const uint8_t* header = atRVA(exports, 0x28);
+
+                if (header == NULL)
+                {
+                    return false;
+                }
+
+                uint32_t nameCount = load32(header + 0x18);
+                uint32_t functions = load32(header + 0x1C), names = load32(header + 0x20), ordinals = load32(header + 0x24);
+
+                for (uint32_t i = 0; i < nameCount; ++i)
+                {
+                    const uint8_t* name = atRVA(names + i * 4, 4);
+                    const uint8_t* ordinal = atRVA(ordinals + i * 2, 2);
+                    const char* exported = (name != NULL) ? string(load32(name)) : NULL;
+
+                    if (exported == NULL || ordinal == NULL || !matches(exported, Name, prefix))
+                    {
+                        continue;
+                    }
+
+                    uint16_t index;
+                    memcpy(&index, ordinal, sizeof(index));
+
+                    const uint8_t* function = atRVA(functions + index * 4, 4);
+
+                    if (function != NULL)
+                    {
+                        RVA = load32(function);
+
+                        //An RVA inside the export directory is a forwarder string, not code
+                        if (RVA != 0 && (RVA < exports || RVA - exports >= size))
+                        {
+                            return true;
+                        }
+                    }
+                }
+
+                return false;
+            }
+
+            //RVA of a function named Name in the COFF symbol table, only files have one
+            bool findSymbol(const char* Name, bool prefix, uint32_t& RVA) const
+            {
+                uint32_t ntHeaders, symbols, symbolCount;
+
+                if (layout != FileLayout || !read32(0x3C, ntHeaders) || !read32(ntHeaders + 4 + 8, symbols)
+                    || !read32(ntHeaders + 4 + 12, symbolCount) || symbols == 0)
+                {
+                    return false;
+                }
+
+                size_t strings = (size_t)symbols + (size_t)symbolCount * 18;
+
+                for (uint32_t i = 0; i < symbolCount; ++i)
+                {
+                    size_t symbol = (size_t)symbols + (size_t)i * 18;
+                    uint32_t value, zeroes, stringOffset;
+                    uint16_t sectionNumber;
+                    char shortName[9] = {};
+                    const char* symbolName = shortName;
+
+                    if (symbol + 18 > Size || !read32(symbol, zeroes) || !read32(symbol + 4, stringOffset)
+                        || !read32(symbol + 8, value) || !read16(symbol + 12, sectionNumber))
+                    {
+                        return false;
+                    }
+
+                    uint8_t auxiliaryCount = Data[symbol + 17];
+
+                    if (zeroes == 0)
+                    {
+                        //Long names are offsets into the string table after the symbols
+                        if (strings + stringOffset >= Size || memchr(Data + strings + stringOffset, 0, Size - strings - stringOffset) == NULL)
+                        {
+                            i += auxiliaryCount;
+                            continue;
+                        }
+
+                        symbolName = reinterpret_cast<const char*>(Data + strings + stringOffset);
+                    }
+                    else
+                    {
+                        memcpy(shortName, Data + symbol, 8);
+                    }
+
+                    if (sectionNumber >= 1 && sectionNumber <= sections.size() && matches(symbolName, Name, prefix))
+                    {
+                        RVA = sections[sectionNumber - 1].VirtualAddress + value;
+                        return true;
+                    }
+
+                    i += auxiliaryCount;
+                }
+
+                return false;
+            }
+
+            //Removes the base relocation of RVA by turning its entry into IMAGE_REL_BASED_ABSOLUTE (padding)
+            bool removeRelocation(uint32_t RVA)
+            {
+                std::vector<Relocation>::iterator relocation = findRelocation(RVA);
+
+                if (relocation == relocations.end())
+                {
+                    return false;
+                }
+
+                uint16_t entry = 0;
+                memcpy(Data + relocation->offset, &entry, sizeof(entry));
+                relocations.erase(relocation);
+                return true;
+            }
+
+            bool isRelocated(uint32_t RVA) const
+            {
+                return const_cast<Image*>(this)->findRelocation(RVA) != relocations.end();
+            }
+
+            bool read16(size_t offset, uint16_t& value) const
+            {
+                if (offset > Size || Size - offset < sizeof(value)) return false;
+                memcpy(&value, Data + offset, sizeof(value));
+                return true;
+            }
+
+            bool read32(size_t offset, uint32_t& value) const
+            {
+                if (offset > Size || Size - offset < sizeof(value)) return false;
+                memcpy(&value, Data + offset, sizeof(value));
+                return true;
+            }
+
+        private:
+            static bool matches(const char* name, const char* wanted, bool prefix)
+            {
+                return prefix ? strncmp(name, wanted, strlen(wanted)) == 0 : strcmp(name, wanted) == 0;
+            }
+
+            bool fail(const char* reason)
+            {
+                error = reason;
+                return false;
+            }
+
+            std::vector<Relocation>::iterator findRelocation(uint32_t RVA)
+            {
+                std::vector<Relocation>::iterator relocation = std::lower_bound(relocations.begin(), relocations.end(), RVA,
+                    [](const Relocation& entry, uint32_t value) { return entry.RVA < value; });
+
+                return (relocation != relocations.end() && relocation->RVA == RVA) ? relocation : relocations.end();
+            }
+
+            bool parseRelocations()
+            {
+                uint32_t block, size;
+
+                if (!directory(5, block, size)) //IMAGE_DIRECTORY_ENTRY_BASERELOC
+                {
+                    return true;
+                }
+
+                hasRelocations = true;
+
+                //Blocks are IMAGE_BASE_RELOCATION {VirtualAddress, SizeOfBlock} followed by 16 bit entries
+                for (uint32_t end = block + size; block + 8 <= end; )
+                {
+                    size_t offset;
+                    uint32_t pageRVA, blockSize;
+
+                    if (!offsetOf(block, 8, offset) || !read32(offset, pageRVA) || !read32(offset + 4, blockSize) || blockSize < 8)
+                    {
+                        break;
+                    }
+
+                    if (!offsetOf(block, blockSize, offset))
+                    {
+                        return fail("truncated base relocations");
+                    }
+
+                    for (uint32_t entry = 8; entry + 2 <= blockSize; entry += 2)
+                    {
+                        uint16_t value = 0;
+                        read16(offset + entry, value);
+
+                        if ((value >> 12) == 3) //IMAGE_REL_BASED_HIGHLOW
+                        {
+                            relocations.push_back(Relocation{ pageRVA + (value & 0xFFF), (uint32_t)(offset + entry) });
+                        }
+                    }
+
+                    block += blockSize;
+                }
+
+                //The linker writes them in order but nothing requires it
+                std::sort(relocations.begin(), relocations.end(), [](const Relocation& a, const Relocation& b) { return a.RVA < b.RVA; });
+                return true;
+            }
+
+            size_t directories = 0;
+            uint32_t directoryCount = 0;
+        };
+
+        /*
+            IAT entries of RtlUnwind, kernel32.dll only has a stub that forwards to ntdll.dll's.
+            In a loaded image an entry that already holds Function counts too, however it was
+            imported.
+        */
+        inline Targets findRtlUnwind(const Image& image, uint32_t Function = 0)
+        {
+            Targets targets;
+            targets.function = Function;
+
+            image.forEachImport([&](const char* Dll, const char* Name, uint32_t SlotVA)
+            {
+                const uint8_t* slot = image.at(SlotVA, 4);
+
+                if ((Name != NULL && strcmp(Name, "RtlUnwind") == 0 && (equalsIgnoreCase(Dll, "ntdll.dll") || equalsIgnoreCase(Dll, "kernel32.dll")))
+                    || (image.layout == MappedLayout && Function != 0 && slot != NULL && load32(slot) == Function))
+                {
+                    targets.slots.push_back(SlotVA);
+                }
+
+                return false;
+            });
+
+            return targets;
+        }
+
+        //Scans every executable section of image
+        template <class Visitor>
+        inline void scanImage(const Image& image, const Targets& targets, Visitor&& visit)
+        {
+            for (const Section& section : image.sections)
+            {
+                //IMAGE_SCN_CNT_CODE or IMAGE_SCN_MEM_EXECUTE
+                if ((section.Characteristics & 0x20000020) == 0)
+                {
+                    continue;
+                }
+
+                //Past VirtualSize is padding in a file and zeroes in memory
+                uint32_t size = section.SizeOfRawData;
+
+                if (image.layout == MappedLayout || (section.VirtualSize != 0 && section.VirtualSize < size))
+                {
+                    size = section.VirtualSize;
+                }
+
+                const uint8_t* code = image.atRVA(section.VirtualAddress, size);
+
+                if (code != NULL)
+                {
+                    scan(code, size, image.ImageBase + section.VirtualAddress, targets, image, visit);
+                }
+            }
+        }
+
+        /*
+            What it takes to send a loaded module's calls to RtlUnwind to SEH::Unwind while
+            its code may be running. Pointing the IAT entries of RtlUnwind at SEH::Unwind
+            covers every call/jmp [slot] and every thunk with one aligned 4 byte store each,
+            which nobody can see half done. Only branches straight to RtlUnwind (the linker
+            never makes them, a hook could) need their rel32 rewritten in the code.
+        */
+        struct Redirection
+        {
+            std::vector<uint32_t> slots;    //IAT entries to point at SEH::Unwind
+            std::vector<uint32_t> branches; //VAs of E8/E9 straight to RtlUnwind
+            size_t sites = 0;               //Every site found, all of them reach SEH::Unwind once the above are patched
+        };
+
+        inline Redirection planRedirection(const Image& image, uint32_t RtlUnwind)
+        {
+            Redirection redirection;
+            Targets targets = findRtlUnwind(image, RtlUnwind);
+
+            if (targets.slots.empty() && RtlUnwind == 0)
+            {
+                return redirection;
+            }
+
+            scanImage(image, targets, [&](const Site& site)
+            {
+                ++redirection.sites;
+
+                if ((site.kind == DirectCall || site.kind == DirectJmp) && site.target == RtlUnwind)
+                {
+                    redirection.branches.push_back(site.VA);
+                }
+            });
+
+            redirection.slots = targets.slots;
+            return redirection;
+        }
+
+        //Sums the image the way CheckSumMappedFile does, with the CheckSum field itself left out
+        inline uint32_t checksum(const uint8_t* Data, size_t Size, size_t CheckSumOffset)
+        {
+            uint64_t sum = 0;
+
+            for (size_t i = 0; i < Size; i += 2)
+            {
+                if (i == CheckSumOffset || i == CheckSumOffset + 2)
+                {
+                    continue;
+                }
+
+                uint16_t word = Data[i];
+
+                if (i + 1 < Size)
+                {
+                    word |= (uint16_t)(Data[i + 1] << 8);
+                }
+
+                sum += word;
+                sum = (sum & 0xFFFF) + (sum >> 16);
+            }
+
+            sum = (sum & 0xFFFF) + (sum >> 16);
+            return (uint32_t)sum + (uint32_t)Size;
+        }
+
+        enum Linkage
+        {
+            NotNeeded, //Nothing reaches RtlUnwind
+            Static,    //SEH::Unwind is code in the image
+            Dynamic    //SEH::Unwind is imported
+        };
+
+        enum Action
+        {
+            Redirected,   //Now a call/jmp rel32 to SEH::Unwind
+            Reimported,   //Now reads the IAT entry of SEH::Unwind
+            ThroughThunk, //Left alone, reaches SEH::Unwind through its patched thunk
+            Unrelocated   //Skipped, the image has relocations but none for the slot so it isn't an instruction
+        };
+
+        struct PatchedSite
+        {
+            Site site;
+            uint32_t RVA;
+            Action action;
+            bool relocationRemoved;
+        };
+
+        struct Options
+        {
+            const char* Symbol = "?Unwind@SEH@@"; //Imports, exports and symbols starting with this are SEH::Unwind
+            const char* Dll = NULL;               //Only take SEH::Unwind from imports of this module, NULL for any
+            uint32_t UnwindRVA = 0;               //SEH::Unwind when it's neither exported nor in the symbol table, 0 to look it up
+            bool dryRun = false;                  //Only report what would be patched
+        };
+
+        struct Report
+        {
+            Linkage linkage = NotNeeded;
+            uint32_t unwind = 0; //RVA of SEH::Unwind, or of its IAT entry when linked dynamically
+            std::vector<PatchedSite> sites;
+            bool checksumUpdated = false;
+            const char* error = NULL;
+        };
+
+        //Finds where SEH::Unwind is, preferring an import over code in the image
+        inline bool findUnwind(const Image& image, const Options& options, Report& report)
+        {
+            uint32_t slot = 0;
+
+            image.forEachImport([&](const char* Dll, const char* Name, uint32_t SlotVA)
+            {
+                if (Name != NULL && (options.Dll == NULL || equalsIgnoreCase(Dll, options.Dll)) && strncmp(Name, options.Symbol, strlen(options.Symbol)) == 0)
+                {
+                    slot = SlotVA;
+                    return true;
+                }
+
+                return false;
+            });
+
+            if (slot != 0)
+            {
+                report.linkage = Dynamic;
+                report.unwind = slot - image.ImageBase;
+                return true;
+            }
+
+            uint32_t RVA = options.UnwindRVA;
+
+            if (RVA != 0 || image.findExport(options.Symbol, true, RVA) || image.findSymbol(options.Symbol, true, RVA))
+            {
+                report.linkage = Static;
+                report.unwind = RVA;
+                return true;
+            }
+
+            report.error = "can't find SEH::Unwind, it isn't imported, exported or in the symbol table (pass its RVA)";
+            return false;
+        }
+
+        //Scans the executable sections of image and patches every RtlUnwind site in place
+        inline bool patchImage(Image& image, const Options& options, Report& report)
+        {
+            report = Report();
+
+            Targets targets = findRtlUnwind(image);
+
+            if (targets.slots.empty())
+            {
+                return true;
+            }
+
+            std::vector<Site> sites;
+            scanImage(image, targets, [&](const Site& site) { sites.push_back(site); });
+
+            if (sites.empty())
+            {
+                return true;
+            }
+
+            if (!findUnwind(image, options, report))
+            {
+                return false;
+            }
+
+            uint32_t unwindVA = image.ImageBase + report.unwind;
+            bool patched = false;
+
+            //Every site was found before any was patched, so a patched thunk can't hide the calls made through it
+            for (const Site& site : sites)
+            {
+                uint32_t RVA = site.VA - image.ImageBase;
+                bool indirect = (site.kind == IndirectCall || site.kind == IndirectJmp);
+                uint8_t* code = image.atRVA(RVA, indirect ? 6 : 5);
+                PatchedSite result = { site, RVA, Redirected, false };
+
+                if (indirect && image.hasRelocations && !image.isRelocated(RVA + 2))
+                {
+                    result.action = Unrelocated;
+                }
+                else if (report.linkage == Dynamic)
+                {
+                    result.action = indirect ? Reimported : ThroughThunk;
+
+                    if (indirect && !options.dryRun)
+                    {
+                        store32(code + 2, unwindVA); //The relocation still applies, it's still an absolute address
+                        patched = true;
+                    }
+                }
+                else
+                {
+                    result.relocationRemoved = indirect && image.isRelocated(RVA + 2);
+
+                    if (!options.dryRun)
+                    {
+                        bool call = (site.kind == IndirectCall || site.kind == DirectCall);
+
+                        code[0] = call ? 0xE8 : 0xE9;
+                        store32(code + 1, unwindVA - site.VA - 5);
+
+                        if (indirect)
+                        {
+                            code[5] = 0x90; //nop out the last byte of the 6 byte instruction
+                            image.removeRelocation(RVA + 2);
+                        }
+
+                        patched = true;
+                    }
+                }
+
+                report.sites.push_back(result);
+            }
+
+            //A zero CheckSum is never checked, anything else has to stay correct (drivers, boot images)
+            uint32_t CheckSum;
+
+            if (patched && image.layout == FileLayout && image.read32(image.CheckSumOffset, CheckSum) && CheckSum != 0)
+            {
+                store32(image.Data + image.CheckSumOffset, checksum(image.Data, image.Size, image.CheckSumOffset));
+                report.checksumUpdated = true;
+            }
+
+            return true;
+        }
+    }
+}
\ No newline at end of file
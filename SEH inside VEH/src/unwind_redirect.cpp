@@ -0,0 +1,158 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+
+#include <vector>
+
+#include "SEH.h"
+#include "unwind_patch.h"
+#include "unwind_redirect.h"
+
+/*
+    The in-memory alternative to patching RtlUnwind in the file (Unwinding Problem).
+    Every module passed to EnableSEH is scanned once with the same scanner as
+    Tools/RtlUnwind Patcher, and the IAT entries of RtlUnwind are pointed at
+    SEH::Unwind. Apart from direct branches to RtlUnwind, which the linker doesn't
+    make, the code of the module is left alone, so threads already running it see
+    either the old or the new target, never a torn instruction.
+
+    A reference to each patched module is held until DisableSEH restores it, so it
+    can't be unloaded with the patches still pointing into it.
+*/
+
+namespace SEH
+{
+    namespace Unwind_Redirect
+    {
+        struct Patch
+        {
+            DWORD* Address;
+            DWORD Original;
+            DWORD Replacement;
+            DWORD Protection; //What to open the page with to write it
+        };
+
+        static std::vector<Patch> patches;
+        static std::vector<HMODULE> modules;
+
+        static bool write(DWORD* Address, DWORD Value, DWORD Protection)
+        {
+            DWORD OldProtection;
+
+            if (!VirtualProtect(Address, sizeof(DWORD), Protection, &OldProtection))
+            {
+                return false;
+            }
+
+            //Atomic even when a rel32 isn't aligned, x86 locks both cache lines
+            InterlockedExchange((LONG*)Address, (LONG)Value);
+
+            VirtualProtect(Address, sizeof(DWORD), OldProtection, &OldProtection);
+
+            if (Protection == PAGE_EXECUTE_READWRITE)
+            {
+                FlushInstructionCache(GetCurrentProcess(), Address, sizeof(DWORD));
+            }
+
+            return true;
+        }
+
+        static void apply(DWORD* Address, DWORD Replacement, DWORD Protection)
+        {
+            Patch patch = { Address, *Address, Replacement, Protection };
+
+            if (patch.Original != Replacement && write(Address, Replacement, Protection))
+            {
+                patches.push_back(patch);
+            }
+        }
+
+        DWORD redirect(HMODULE Module)
+        {
+            HMODULE Handle;
+
+            //Takes a reference, NULL is the module SEH inside VEH is linked into
+            if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, Module ? (LPCWSTR)Module : (LPCWSTR)&__ImageBase, &Handle))
+            {
+                return 0;
+            }
+
+            IMAGE_DOS_HEADER* DosHeader = (IMAGE_DOS_HEADER*)Handle;
+            IMAGE_NT_HEADERS* NTHeaders = (IMAGE_NT_HEADERS*)((DWORD)DosHeader + DosHeader->e_lfanew);
+
+            Unwind_Patch::Image image;
+
+            if (!image.parse((uint8_t*)Handle, NTHeaders->OptionalHeader.SizeOfImage, Unwind_Patch::MappedLayout))
+            {
+                FreeLibrary(Handle);
+                return 0;
+            }
+
+            image.ImageBase = (DWORD)Handle; //Where it is, not where it wanted to be
+
+            static DWORD RtlUnwindAddress = (DWORD)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "RtlUnwind");
+            DWORD UnwindAddress = (DWORD)&SEH::Unwind;
+
+            Unwind_Patch::Redirection redirection = Unwind_Patch::planRedirection(image, RtlUnwindAddress);
+            size_t patched = patches.size();
+
+            for (uint32_t slot : redirection.slots)
+            {
+                apply((DWORD*)slot, UnwindAddress, PAGE_READWRITE);
+            }
+
+            for (uint32_t branch : redirection.branches)
+            {
+                apply((DWORD*)(branch + 1), UnwindAddress - branch - 5, PAGE_EXECUTE_READWRITE);
+            }
+
+            if (patches.size() != patched)
+            {
+                modules.push_back(Handle);
+            }
+            else
+            {
+                FreeLibrary(Handle);
+            }
+
+            return (DWORD)redirection.sites;
+        }
+
+        void restore()
+        {
+            //Newest first, and only what still holds our value in case someone patched over it
+            for (size_t i = patches.size(); i-- > 0; )
+            {
+                if (*patches[i].Address == patches[i].Replacement)
+                {
+                    write(patches[i].Address, patches[i].Original, patches[i].Protection);
+                }
+            }
+
+            patches.clear();
+
+            for (HMODULE Module : modules)
+            {
+                FreeLibrary(Module);
+            }
+
+            modules.clear();
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,193 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+    A fixed-size, open-addressing, lock-free memo of valid/invalid verdicts keyed
+    by a 32-bit handler address.
+
+    Each entry is one 64-bit word: the key, the generation it was computed in and
+    the verdict. Readers and writers only ever load or store whole words so an entry
+    is never seen half written. Bumping the generation (on every module load and
+    unload) makes every existing entry stale at once without touching the table.
+
+    A verdict must be computed after reading the generation it is inserted with:
+
+        uint32_t generation = cache.generation();
+        bool verdict = compute(key);
+        cache.insert(key, verdict, generation);
+
+    If a module loads or unloads in between, the entry is stale the moment it's
+    written and is never returned.
+*/
+
+namespace SEH
+{
+    namespace Verdict_Cache
+    {
+        struct Stats
+        {
+            uint64_t hits;
+            uint64_t misses;
+        };
+
+        //capacity must be a power of two, probes is the longest run of slots looked at per key
+        template <size_t capacity, unsigned int probes = 8>
+        class Cache
+        {
+            static_assert(capacity != 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+            static_assert(probes != 0 && probes <= capacity, "probes must be between 1 and capacity");
+
+        public:
+            Cache() : currentGeneration(1)
+            {
+                for (std::atomic<uint64_t>& entry : entries)
+                {
+                    entry.store(0, std::memory_order_relaxed);
+                }
+
+                for (Counter& counter : counters)
+                {
+                    counter.hits.store(0, std::memory_order_relaxed);
+                    counter.misses.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            uint32_t generation() const
+            {
+                return currentGeneration.load(std::memory_order_acquire);
+            }
+
+            //Makes every entry stale, call after the state verdicts depend on has changed
+            void invalidate()
+            {
+                uint32_t next = (currentGeneration.load(std::memory_order_relaxed) + 1) & generationMask;
+                currentGeneration.store(next == 0 ? 1 : next, std::memory_order_release); //0 marks empty entries
+            }
+
+            //Returns true and sets verdict if key has a verdict from the current generation
+            bool lookup(uint32_t key, bool& verdict)
+            {
+                uint32_t generation = this->generation();
+                size_t slot = home(key);
+
+                for (unsigned int i = 0; i < probes; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t entry = entries[slot].load(std::memory_order_acquire);
+
+                    if (entry == 0)
+                    {
+                        break; //Keys are never inserted past an empty slot
+                    }
+
+                    if (entryKey(entry) == key && entryGeneration(entry) == generation)
+                    {
+                        verdict = entryVerdict(entry);
+                        counter().hits.fetch_add(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+
+                counter().misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            void insert(uint32_t key, bool verdict, uint32_t generation)
+            {
+                uint64_t entry = pack(key, generation, verdict);
+                size_t slot = home(key);
+                size_t victim = slot;
+
+                for (unsigned int i = 0; i < probes; ++i, slot = (slot + 1) & (capacity - 1))
+                {
+                    uint64_t current = entries[slot].load(std::memory_order_relaxed);
+
+                    /*
+                        Reuse a slot that is empty, stale or already holds this key. Losing a race
+                        for it just means another verdict got cached there, keep probing.
+                    */
+                    if (current == 0 || entryGeneration(current) != generation || entryKey(current) == key)
+                    {
+                        if (entries[slot].compare_exchange_strong(current, entry, std::memory_order_release, std::memory_order_relaxed))
+                        {
+                            return;
+                        }
+                    }
+                }
+
+                //Every slot in the run is live, replace the one at home
+                entries[victim].store(entry, std::memory_order_release);
+            }
+
+            //Sum of every thread's hits and misses
+            Stats stats() const
+            {
+                Stats stats = {};
+
+                for (const Counter& counter : counters)
+                {
+                    stats.hits += counter.hits.load(std::memory_order_relaxed);
+                    stats.misses += counter.misses.load(std::memory_order_relaxed);
+                }
+
+                return stats;
+            }
+
+        private:
+            static const uint32_t generationMask = 0x7FFFFFFF;
+            static const unsigned int stripes = 16;
+
+            //Counters are striped per thread so counting doesn't bounce one cache line between every core
+            struct alignas(64) Counter
+            {
+                std::atomic<uint64_t> hits;
+                std::atomic<uint64_t> misses;
+            };
+
+            static uint64_t pack(uint32_t key, uint32_t generation, bool verdict)
+            {
+                return ((uint64_t)key << 32) | ((uint64_t)(generation & generationMask) << 1) | (verdict ? 1 : 0);
+            }
+
+            static uint32_t entryKey(uint64_t entry) { return (uint32_t)(entry >> 32); }
+            static uint32_t entryGeneration(uint64_t entry) { return (uint32_t)(entry >> 1) & generationMask; }
+            static bool entryVerdict(uint64_t entry) { return (entry & 1) != 0; }
+
+            static size_t home(uint32_t key)
+            {
+                return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+            }
+
+            Counter& counter()
+            {
+                static std::atomic<unsigned int> nextStripe(0);
+                thread_local unsigned int stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % stripes;
+
+                return counters[stripe];
+            }
+
+            std::atomic<uint32_t> currentGeneration;
+            std::atomic<uint64_t> entries[capacity];
+            Counter counters[stripes];
+        };
+    }
+}
\ No newline at end of file
@@ -0,0 +1,318 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "crash_snapshot.h"
+
+using namespace SEH;
+
+/*
+    Prints crash snapshots written at second chance after SEH::SetCrashSnapshotPath.
+    Only needs crash_snapshot.h (and the dispatch core it includes) from the library,
+    so it builds anywhere.
+*/
+
+struct Snapshot
+{
+    const Crash_Snapshot::FileHeader* header;
+    const Crash_Snapshot::Record* records;
+    const Crash_Snapshot::Frame* frames;
+    const uint8_t* context;
+};
+
+static const char* reasonNames[] =
+{
+    "no handler took it", "EXCEPTION_STACK_INVALID", "the chain is corrupt", "the chain is too deep", "the unwind target wasn't found"
+};
+
+static const char* statusNames[] =
+{
+    "", "outside the stack", "unaligned", "handler not allowed", "out of order", "too deep"
+};
+
+static const char* architectureNames[] =
+{
+    "unknown", "x86", "simulated"
+};
+
+static const char* codeName(uint32_t code)
+{
+    switch (code)
+    {
+    case 0xC0000005: return "EXCEPTION_ACCESS_VIOLATION";
+    case 0xC000001D: return "EXCEPTION_ILLEGAL_INSTRUCTION";
+    case 0xC0000025: return "EXCEPTION_NONCONTINUABLE_EXCEPTION";
+    case 0xC0000026: return "EXCEPTION_INVALID_DISPOSITION";
+    case 0xC0000027: return "STATUS_UNWIND";
+    case 0xC0000028: return "EXCEPTION_BAD_STACK";
+    case 0xC0000029: return "EXCEPTION_INVALID_UNWIND_TARGET";
+    case 0xC0000094: return "EXCEPTION_INT_DIVIDE_BY_ZERO";
+    case 0xC00000FD: return "EXCEPTION_STACK_OVERFLOW";
+    case 0x80000003: return "EXCEPTION_BREAKPOINT";
+    case 0xE06D7363: return "C++ exception";
+    case Core::Status::ChainCorrupt: return "SEH::ExceptionChainCorrupt";
+    case Core::Status::ChainTooDeep: return "SEH::ExceptionChainTooDeep";
+    default: return "";
+    }
+}
+
+template <size_t count>
+static const char* nameOf(const char* (&names)[count], uint32_t value)
+{
+    return (value < count) ? names[value] : "?";
+}
+
+//Checks every count and size against the file before anything is read through them
+static bool parse(const std::vector<uint8_t>& data, Snapshot& snapshot, const char* path)
+{
+    using namespace Crash_Snapshot;
+
+    if (data.size() < sizeof(FileHeader))
+    {
+        fprintf(stderr, "%s is too small to be a crash snapshot\n", path);
+        return false;
+    }
+
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(data.data());
+
+    if (memcmp(header->magic, "SEHCRASH", sizeof(header->magic)) != 0 || header->version != version)
+    {
+        fprintf(stderr, "%s is not a version %u crash snapshot\n", path, version);
+        return false;
+    }
+
+    if (header->recordCount > maxRecords || header->frameCount > maxFrames || header->contextSize > maxContext)
+    {
+        fprintf(stderr, "%s: %u records, %u frames and %u context bytes is more than a snapshot holds, it is corrupt\n", path, header->recordCount, header->frameCount, header->contextSize);
+        return false;
+    }
+
+    size_t expected = sizeof(FileHeader) + header->recordCount * sizeof(Record) + header->frameCount * sizeof(Frame) + header->contextSize;
+
+    if (header->size > data.size() || header->size < expected)
+    {
+        fprintf(stderr, "%s is truncated (%zu of %u bytes, %zu needed)\n", path, data.size(), header->size, expected);
+        return false;
+    }
+
+    snapshot.header = header;
+    snapshot.records = reinterpret_cast<const Record*>(data.data() + sizeof(FileHeader));
+    snapshot.frames = reinterpret_cast<const Frame*>(snapshot.records + header->recordCount);
+    snapshot.context = reinterpret_cast<const uint8_t*>(snapshot.frames + header->frameCount);
+
+    return true;
+}
+
+static void printAddress(const Snapshot& snapshot, uint64_t value)
+{
+    printf((snapshot.header->pointerSize == 4) ? "0x%08llX" : "0x%016llX", (unsigned long long)value);
+}
+
+static uint64_t contextField(const Snapshot& snapshot, uint32_t offset, uint32_t size)
+{
+    uint64_t value = 0;
+
+    if (offset + size <= snapshot.header->contextSize)
+    {
+        memcpy(&value, snapshot.context + offset, size);
+    }
+
+    return value;
+}
+
+static void printContext(const Snapshot& snapshot, bool raw)
+{
+    using namespace Crash_Snapshot;
+
+    const Crash_Snapshot::FileHeader& header = *snapshot.header;
+    printf("\nContext (%s, %u bytes):\n", nameOf(architectureNames, header.architecture), header.contextSize);
+
+    if (header.architecture == X86 && header.contextSize >= X86Context::size)
+    {
+        static const struct { const char* name; uint32_t offset; } registers[] =
+        {
+            { "Eax", X86Context::Eax }, { "Ebx", X86Context::Ebx }, { "Ecx", X86Context::Ecx }, { "Edx", X86Context::Edx },
+            { "Esi", X86Context::Esi }, { "Edi", X86Context::Edi }, { "Ebp", X86Context::Ebp }, { "Esp", X86Context::Esp },
+            { "Eip", X86Context::Eip }, { "EFlags", X86Context::EFlags }, { "ContextFlags", X86Context::ContextFlags }
+        };
+
+        for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); ++i)
+        {
+            printf("  %-12s 0x%08llX\n", registers[i].name, (unsigned long long)contextField(snapshot, registers[i].offset, 4));
+        }
+
+        printf("  Cs 0x%04llX  Ss 0x%04llX  Ds 0x%04llX  Es 0x%04llX  Fs 0x%04llX  Gs 0x%04llX\n",
+            (unsigned long long)contextField(snapshot, X86Context::SegCs, 2), (unsigned long long)contextField(snapshot, X86Context::SegSs, 2),
+            (unsigned long long)contextField(snapshot, X86Context::SegDs, 2), (unsigned long long)contextField(snapshot, X86Context::SegEs, 2),
+            (unsigned long long)contextField(snapshot, X86Context::SegFs, 2), (unsigned long long)contextField(snapshot, X86Context::SegGs, 2));
+    }
+    else if (header.architecture == Simulated && header.contextSize >= 4 * header.pointerSize)
+    {
+        static const char* registers[] = { "Eip", "Esp", "Ebp", "Eax" };
+
+        for (uint32_t i = 0; i < 4; ++i)
+        {
+            printf("  %-12s ", registers[i]);
+            printAddress(snapshot, contextField(snapshot, i * header.pointerSize, header.pointerSize));
+            printf("\n");
+        }
+    }
+    else
+    {
+        raw = true;
+    }
+
+    if (raw)
+    {
+        for (uint32_t line = 0; line < header.contextSize; line += 16)
+        {
+            printf("  %04X:", line);
+
+            for (uint32_t i = line; i < line + 16 && i < header.contextSize; ++i)
+            {
+                printf(" %02X", snapshot.context[i]);
+            }
+
+            printf("\n");
+        }
+    }
+}
+
+static void print(const Snapshot& snapshot, bool raw)
+{
+    using namespace Crash_Snapshot;
+
+    const FileHeader& header = *snapshot.header;
+
+    printf("Crash snapshot of process %u, thread %u (%u-bit)\n", header.processId, header.threadId, header.pointerSize * 8);
+    printf("Reason: %s", nameOf(reasonNames, header.reason));
+
+    if (header.frameCount != 0 && snapshot.frames[header.frameCount - 1].status != Valid)
+    {
+        printf(", frame %u is %s", header.frameCount - 1, nameOf(statusNames, snapshot.frames[header.frameCount - 1].status));
+    }
+
+    printf("\nStack: ");
+    printAddress(snapshot, header.stackLow);
+    printf(" - ");
+    printAddress(snapshot, header.stackHigh);
+
+    printf("\n\nException records:\n");
+
+    for (uint32_t i = 0; i < header.recordCount; ++i)
+    {
+        const Record& record = snapshot.records[i];
+
+        printf("  #%u 0x%08X %s flags 0x%X at ", i, record.code, codeName(record.code), record.flags);
+        printAddress(snapshot, record.address);
+
+        for (uint32_t parameter = 0; parameter < record.numberParameters && parameter < 15; ++parameter)
+        {
+            printf(parameter == 0 ? "\n     parameters " : " ");
+            printAddress(snapshot, record.information[parameter]);
+        }
+
+        printf("\n");
+    }
+
+    printf("\nFrames from head ");
+    printAddress(snapshot, header.chainHead);
+    printf(":\n");
+
+    for (uint32_t i = 0; i < header.frameCount; ++i)
+    {
+        const Frame& frame = snapshot.frames[i];
+
+        printf("  #%-3u ", i);
+        printAddress(snapshot, frame.frame);
+
+        if (frame.handler != 0)
+        {
+            printf("  handler ");
+            printAddress(snapshot, frame.handler);
+
+            if (frame.moduleBase != 0)
+            {
+                printf(" (module ");
+                printAddress(snapshot, frame.moduleBase);
+                printf(" + 0x%X)", frame.handlerRva);
+            }
+        }
+
+        if (frame.status != Valid)
+        {
+            printf("  <- %s", nameOf(statusNames, frame.status));
+        }
+
+        printf("\n");
+    }
+
+    if (header.chainTruncated)
+    {
+        printf("  ... more than %u frames\n", maxFrames);
+    }
+
+    printContext(snapshot, raw);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = NULL;
+    bool raw = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--raw") == 0)
+            raw = true;
+        else
+            path = argv[i];
+    }
+
+    if (path == NULL)
+    {
+        fprintf(stderr, "usage: crash_snapshot_reader [--raw] <snapshot>\n");
+        return 2;
+    }
+
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    //Snapshots are a few KB at most
+    std::vector<uint8_t> data(Crash_Snapshot::bufferSize + 1);
+    data.resize(fread(data.data(), 1, data.size(), file));
+    fclose(file);
+
+    Snapshot snapshot;
+
+    if (!parse(data, snapshot, path))
+    {
+        return 1;
+    }
+
+    print(snapshot, raw);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,225 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "handler_scan.h"
+
+using namespace SEH;
+
+/*
+    Lists every exception handler a PE32 file can register (see handler_scan.h) and
+    writes them out as a handler manifest (handler_manifest.h), either to a file or
+    into the PE itself as its ".sehm" section, where HANDLER_MANIFEST finds it once
+    the module is loaded. Only needs the library's headers, so it builds anywhere.
+*/
+
+struct Options
+{
+    bool list = false;
+    bool embed = false;
+    const char* out = NULL;
+};
+
+static bool readFile(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    bool read = fseek(file, 0, SEEK_END) == 0;
+    long size = read ? ftell(file) : -1;
+
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        data.resize((size_t)size);
+        read = fread(data.data(), 1, data.size(), file) == data.size();
+    }
+    else
+        read = false;
+
+    fclose(file);
+    return read;
+}
+
+static bool writeFile(const char* path, const std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "wb");
+
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && written;
+}
+
+static std::string kindNames(uint32_t Kinds)
+{
+    static const char* names[] = { "safeseh", "registered", "c++", "eh4", "eh3", "scope-table", "funcinfo" };
+    std::string text;
+
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (Kinds & (1u << i))
+        {
+            text += text.empty() ? "" : ",";
+            text += names[i];
+        }
+    }
+
+    return text;
+}
+
+static bool processFile(const char* path, const Options& options)
+{
+    std::vector<uint8_t> file;
+    Unwind_Patch::Image image;
+
+    if (!readFile(path, file))
+    {
+        fprintf(stderr, "%s: error: can't read the file\n", path);
+        return false;
+    }
+
+    if (!image.parse(file.data(), file.size(), Unwind_Patch::FileLayout))
+    {
+        fprintf(stderr, "%s: error: %s\n", path, image.error);
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<uint8_t> manifest;
+    Handler_Manifest::View view;
+
+    if (!Handler_Manifest::build(Handler_Scan::scanImage(image), manifest) || !view.open(manifest.data(), manifest.size()))
+    {
+        fprintf(stderr, "%s: error: can't build a perfect hash of the handlers\n", path);
+        return false;
+    }
+
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    size_t counts[7] = {};
+
+    for (uint32_t i = 0; i < view.size(); ++i)
+    {
+        Handler_Manifest::Entry entry = view.at(i);
+
+        for (unsigned int kind = 0; kind < 7; ++kind)
+        {
+            counts[kind] += (entry.Kinds >> kind) & 1;
+        }
+
+        if (options.list)
+        {
+            printf("%s: 0x%08x %-32s", path, entry.RVA, kindNames(entry.Kinds).c_str());
+
+            if (entry.Data != 0)
+            {
+                printf(" 0x%08x", entry.Data);
+            }
+
+            printf("\n");
+        }
+    }
+
+    printf("%s: %zu safeseh, %zu registered, %zu c++, %zu eh4, %zu eh3 handlers, %zu scope tables, %zu funcinfo; %zu bytes in %.1f ms\n",
+        path, counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], manifest.size(), elapsed);
+
+    if (options.embed)
+    {
+        const char* error = NULL;
+
+        if (!Handler_Scan::embed(file, manifest, error))
+        {
+            fprintf(stderr, "%s: error: %s\n", path, error);
+            return false;
+        }
+
+        if (!writeFile(path, file))
+        {
+            fprintf(stderr, "%s: error: can't write the file\n", path);
+            return false;
+        }
+
+        return true;
+    }
+
+    std::string out = (options.out != NULL) ? options.out : std::string(path) + ".sehm";
+
+    if (!writeFile(out.c_str(), manifest))
+    {
+        fprintf(stderr, "%s: error: can't write %s\n", path, out.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    std::vector<const char*> paths;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--list") == 0)
+            options.list = true;
+        else if (strcmp(argv[i], "--embed") == 0)
+            options.embed = true;
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            options.out = argv[++i];
+        else if (argv[i][0] != '-')
+            paths.push_back(argv[i]);
+        else
+        {
+            paths.clear();
+            break;
+        }
+    }
+
+    if (paths.empty() || (options.out != NULL && (paths.size() != 1 || options.embed)))
+    {
+        fprintf(stderr, "usage: handler_manifest [--list] [--embed | --out <file>] <pe>...\n");
+        return 2;
+    }
+
+    int status = 0;
+
+    for (const char* path : paths)
+    {
+        if (!processFile(path, options))
+        {
+            status = 1;
+        }
+    }
+
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,277 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "unwind_patch.h"
+
+using namespace SEH;
+
+/*
+    Patches the calls and jmps to RtlUnwind in PE32 files so they reach SEH::Unwind
+    (see "Unwinding Problem/Patching RtlUnwind"). Every file is mapped and patched
+    in place in one pass over it, files are spread over as many threads as asked
+    for. Only needs unwind_patch.h from the library, so it builds anywhere.
+*/
+
+//A file mapped into memory, writable unless it's only being read for a dry run
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (Data != NULL) UnmapViewOfFile(Data);
+        if (mapping != NULL) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (Data != NULL) munmap(Data, Size);
+        if (file != -1) close(file);
+#endif
+    }
+
+    bool open(const char* path, bool writable)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        LARGE_INTEGER length;
+
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart == 0)
+        {
+            return false;
+        }
+
+        mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+        Data = (mapping != NULL) ? static_cast<uint8_t*>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0)) : NULL;
+        Size = (size_t)length.QuadPart;
+#else
+        struct stat status;
+
+        file = ::open(path, writable ? O_RDWR : O_RDONLY);
+
+        if (file == -1 || fstat(file, &status) != 0 || status.st_size == 0)
+        {
+            return false;
+        }
+
+        Size = (size_t)status.st_size;
+
+        /*
+            A private mapping for dry runs: Image hands out writable pointers, so a bug
+            there can't reach a file nobody asked to change.
+        */
+        void* view = mmap(NULL, Size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, file, 0);
+        Data = (view != MAP_FAILED) ? static_cast<uint8_t*>(view) : NULL;
+#endif
+        return Data != NULL;
+    }
+
+    uint8_t* Data = NULL;
+    size_t Size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int file = -1;
+#endif
+};
+
+static const char* kindNames[] = { "call [RtlUnwind]", "jmp [RtlUnwind]", "call", "jmp" };
+
+static void appendf(std::string& text, const char* format, ...)
+{
+    char line[512];
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    text += line;
+}
+
+//Patches one file, returns false if it couldn't be read or has RtlUnwind sites that can't be patched
+static bool patchFile(const char* path, const Unwind_Patch::Options& options, std::string& report)
+{
+    MappedFile file;
+    Unwind_Patch::Image image;
+    Unwind_Patch::Report result;
+
+    if (!file.open(path, !options.dryRun))
+    {
+        appendf(report, "%s: error: can't map the file\n", path);
+        return false;
+    }
+
+    if (!image.parse(file.Data, file.Size, Unwind_Patch::FileLayout))
+    {
+        appendf(report, "%s: error: %s\n", path, image.error);
+        return false;
+    }
+
+    if (!Unwind_Patch::patchImage(image, options, result))
+    {
+        appendf(report, "%s: error: %s\n", path, result.error);
+        return false;
+    }
+
+    if (result.linkage == Unwind_Patch::NotNeeded)
+    {
+        appendf(report, "%s: nothing reaches RtlUnwind\n", path);
+        return true;
+    }
+
+    size_t patched = 0;
+
+    appendf(report, "%s: SEH::Unwind %s at rva 0x%08x\n", path, (result.linkage == Unwind_Patch::Static) ? "linked statically" : "imported", result.unwind);
+
+    for (const Unwind_Patch::PatchedSite& site : result.sites)
+    {
+        std::string from = kindNames[site.site.kind];
+        bool jmp = (site.site.kind == Unwind_Patch::IndirectJmp || site.site.kind == Unwind_Patch::DirectJmp);
+
+        if (site.site.kind == Unwind_Patch::DirectCall || site.site.kind == Unwind_Patch::DirectJmp)
+        {
+            appendf(from, " 0x%08x (thunk)", site.site.target - image.ImageBase);
+        }
+
+        appendf(report, "%s: 0x%08x %-28s ", path, site.RVA, from.c_str());
+
+        switch (site.action)
+        {
+        case Unwind_Patch::Redirected:
+            appendf(report, "-> %s 0x%08x", jmp ? "jmp" : "call", result.unwind);
+            break;
+        case Unwind_Patch::Reimported:
+            appendf(report, "-> %s [0x%08x]", jmp ? "jmp" : "call", result.unwind);
+            break;
+        case Unwind_Patch::ThroughThunk:
+            appendf(report, "reaches SEH::Unwind through the thunk");
+            break;
+        case Unwind_Patch::Unrelocated:
+            appendf(report, "skipped, no relocation for the slot so it isn't code");
+            break;
+        }
+
+        if (site.relocationRemoved)
+        {
+            appendf(report, ", relocation removed");
+        }
+
+        appendf(report, "\n");
+        patched += (site.action == Unwind_Patch::Redirected || site.action == Unwind_Patch::Reimported);
+    }
+
+    appendf(report, "%s: %zu sites, %zu %s%s\n", path, result.sites.size(), patched, options.dryRun ? "would be patched" : "patched",
+        result.checksumUpdated ? ", checksum updated" : "");
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Unwind_Patch::Options options;
+    std::vector<const char*> paths;
+    unsigned int jobs = std::thread::hardware_concurrency();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--dry-run") == 0)
+            options.dryRun = true;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            jobs = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--unwind") == 0 && i + 1 < argc)
+            options.UnwindRVA = (uint32_t)strtoul(argv[++i], NULL, 16);
+        else if (strcmp(argv[i], "--symbol") == 0 && i + 1 < argc)
+            options.Symbol = argv[++i];
+        else if (strcmp(argv[i], "--dll") == 0 && i + 1 < argc)
+            options.Dll = argv[++i];
+        else if (argv[i][0] != '-')
+            paths.push_back(argv[i]);
+        else
+        {
+            paths.clear();
+            break;
+        }
+    }
+
+    if (paths.empty())
+    {
+        fprintf(stderr, "usage: rtlunwind_patcher [--dry-run] [--jobs <n>] [--unwind <rva>] [--symbol <name>] [--dll <name>] <pe>...\n");
+        return 2;
+    }
+
+    jobs = std::max(1u, std::min<unsigned int>(jobs, (unsigned int)paths.size()));
+
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    std::mutex output;
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 0; i < jobs; ++i)
+    {
+        workers.emplace_back([&]()
+        {
+            for (size_t index = next.fetch_add(1); index < paths.size(); index = next.fetch_add(1))
+            {
+                std::string report;
+
+                if (!patchFile(paths[index], options, report))
+                {
+                    failed.fetch_add(1);
+                }
+
+                //One file's report at a time so lines of different files don't interleave
+                std::lock_guard<std::mutex> lock(output);
+                fputs(report.c_str(), stdout);
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    return (failed.load() == 0) ? 0 : 1;
+}
\ No newline at end of file
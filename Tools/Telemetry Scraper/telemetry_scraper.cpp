@@ -0,0 +1,343 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "telemetry_scraper.h"
+
+#if !defined(_WIN32)
+#include "platform_simulated.h"
+#endif
+
+using namespace SEH;
+
+/*
+    Prints the telemetry a process publishes with SEH::ExportTelemetry, once or as rates
+    every interval. Only needs telemetry.h and statistics.h from the library (and the
+    simulated platform for --simulate), so it builds anywhere.
+*/
+
+static const char* outcomeNames[Statistics::outcomes] =
+{
+    "ContinueExecution", "ContinueSearch", "NestedException", "CollidedUnwind", "invalid"
+};
+
+static double seconds(const Telemetry::Header& header, uint64_t ticks)
+{
+    return (header.ticksPerSecond != 0) ? (double)ticks / header.ticksPerSecond : 0;
+}
+
+static void printTotals(const Telemetry::Header& header, const Telemetry::Counters& counters)
+{
+    printf("process %u (%u-bit), %llu publications\n", header.processId, header.pointerSize * 8, (unsigned long long)counters.publications);
+    printf("  dispatches      %12llu  %10.3f s in DispatchException\n", (unsigned long long)counters.dispatches, seconds(header, counters.dispatchTicks));
+    printf("  unwinds         %12llu  %10.3f s in Unwind, %llu frames popped\n", (unsigned long long)counters.unwinds, seconds(header, counters.unwindTicks), (unsigned long long)counters.framesPopped);
+    printf("  stack invalid   %12llu\n", (unsigned long long)counters.stackInvalid);
+    printf("  handlers        %12llu\n", (unsigned long long)counters.handlersExecuted);
+
+    for (unsigned int i = 0; i < Statistics::outcomes; ++i)
+    {
+        printf("    %-18s %12llu\n", outcomeNames[i], (unsigned long long)counters.outcomes[i]);
+    }
+
+    for (uint32_t i = 0; i < counters.codeCount && i < Telemetry::codeSlots; ++i)
+    {
+        printf("  code 0x%08X %12llu\n", counters.codes[i], (unsigned long long)counters.codeDispatches[i]);
+    }
+
+    if (counters.otherCodes != 0)
+    {
+        printf("  other codes     %12llu\n", (unsigned long long)counters.otherCodes);
+    }
+}
+
+//Dispatches of Code in counters, codes may be in another slot from one publication to the next
+static uint64_t codeDispatches(const Telemetry::Counters& counters, uint32_t Code)
+{
+    for (uint32_t i = 0; i < counters.codeCount && i < Telemetry::codeSlots; ++i)
+    {
+        if (counters.codes[i] == Code)
+        {
+            return counters.codeDispatches[i];
+        }
+    }
+
+    return 0;
+}
+
+static void printRates(const Telemetry::Header& header, const Telemetry::Counters& before, const Telemetry::Counters& after, double elapsed)
+{
+    uint64_t dispatches = after.dispatches - before.dispatches;
+    uint64_t unwinds = after.unwinds - before.unwinds;
+
+    printf("%10.0f dispatches/s  %8.0f unwinds/s  %6.0f stack invalid/s", dispatches / elapsed, unwinds / elapsed, (after.stackInvalid - before.stackInvalid) / elapsed);
+
+    if (dispatches != 0)
+        printf("  dispatch %8.0f ns", seconds(header, after.dispatchTicks - before.dispatchTicks) * 1e9 / dispatches);
+    if (unwinds != 0)
+        printf("  unwind %8.0f ns", seconds(header, after.unwindTicks - before.unwindTicks) * 1e9 / unwinds);
+
+    for (uint32_t i = 0; i < after.codeCount && i < Telemetry::codeSlots; ++i)
+    {
+        uint64_t count = after.codeDispatches[i] - codeDispatches(before, after.codes[i]);
+
+        if (count != 0)
+        {
+            printf("  0x%08X %.0f/s", after.codes[i], count / elapsed);
+        }
+    }
+
+    printf("\n");
+}
+
+static void printJson(const Telemetry::Header& header, const Telemetry::Counters& counters)
+{
+    printf("{\"process\":%u,\"ticks_per_second\":%llu,\"publications\":%llu,\"published_at\":%llu,\"dispatches\":%llu,\"handlers\":%llu,",
+        header.processId, (unsigned long long)header.ticksPerSecond, (unsigned long long)counters.publications, (unsigned long long)counters.publishedAt,
+        (unsigned long long)counters.dispatches, (unsigned long long)counters.handlersExecuted);
+
+    printf("\"stack_invalid\":%llu,\"unwinds\":%llu,\"frames_popped\":%llu,\"dispatch_ticks\":%llu,\"unwind_ticks\":%llu,\"outcomes\":{",
+        (unsigned long long)counters.stackInvalid, (unsigned long long)counters.unwinds, (unsigned long long)counters.framesPopped,
+        (unsigned long long)counters.dispatchTicks, (unsigned long long)counters.unwindTicks);
+
+    for (unsigned int i = 0; i < Statistics::outcomes; ++i)
+    {
+        printf("%s\"%s\":%llu", (i != 0) ? "," : "", outcomeNames[i], (unsigned long long)counters.outcomes[i]);
+    }
+
+    printf("},\"codes\":{");
+
+    for (uint32_t i = 0; i < counters.codeCount && i < Telemetry::codeSlots; ++i)
+    {
+        printf("%s\"0x%08X\":%llu", (i != 0) ? "," : "", counters.codes[i], (unsigned long long)counters.codeDispatches[i]);
+    }
+
+    printf("},\"other_codes\":%llu}\n", (unsigned long long)counters.otherCodes);
+    fflush(stdout);
+}
+
+#if !defined(_WIN32)
+
+/*
+    --simulate: a stand-in for a process using the library, so the scraper can be tried on
+    Linux. Threads dispatch and unwind on the simulated platform with the statistics
+    recorder publishing into a file-backed segment.
+*/
+
+struct SteadyClock
+{
+    static uint64_t now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+struct FileTarget
+{
+    static Telemetry::Segment*& segment()
+    {
+        static Telemetry::Segment* file = NULL;
+        return file;
+    }
+
+    static uint64_t interval()
+    {
+        return 10000000; //10 ms
+    }
+};
+
+typedef Simulated::BasicPlatform<Statistics::Recorder<SteadyClock, Telemetry::Publisher<FileTarget>>> PublishingPlatform;
+
+static Core::Disposition SearchHandler(Simulated::Record*, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return Core::ContinueSearch;
+}
+
+static Core::Disposition ExecuteHandler(Simulated::Record* ExceptionRecord, Simulated::Registration*, Simulated::Context*, void*)
+{
+    return (ExceptionRecord->ExceptionFlags & Core::Flags::Unwinding) ? Core::ContinueSearch : Core::ContinueExecution;
+}
+
+static void simulateThread(std::chrono::steady_clock::time_point end)
+{
+    static const uint32_t codes[] = { 0xC0000005, 0xC0000094, 0xE06D7363, 0x80000003 };
+
+    std::vector<Simulated::Registration> frames(8);
+    Simulated::setStackLimits((uintptr_t)frames.data(), (uintptr_t)(frames.data() + frames.size()));
+
+    for (uint64_t i = 0; std::chrono::steady_clock::now() < end; ++i)
+    {
+        for (size_t frame = frames.size(); frame-- > 0;)
+        {
+            Simulated::pushRegistration(frames[frame], (frame == frames.size() - 1) ? &ExecuteHandler : &SearchHandler);
+        }
+
+        //Now and then a frame leads outside the stack and the exception goes unhandled
+        if (i % 64 == 0)
+        {
+            frames[3].Next = (Simulated::Registration*)((uintptr_t)frames.data() - 64);
+        }
+
+        Simulated::Record Exception = {};
+        Simulated::Context Context = {};
+        Exception.ExceptionCode = codes[i % 4];
+
+        try
+        {
+            Core::DispatchException<PublishingPlatform>(&Exception, &Context);
+        }
+        catch (const Simulated::RaisedException&)
+        {
+        }
+
+        if (i % 64 == 0)
+        {
+            Simulated::currentTeb().ExceptionList = Core::chainEnd<Simulated::Registration>();
+        }
+        else
+        {
+            Core::Unwind<PublishingPlatform>(Core::chainEnd<Simulated::Registration>(), NULL, &Context);
+        }
+
+        if (i % 1024 == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+static int simulate(const char* path, unsigned int duration)
+{
+    FileTarget::segment() = Telemetry_Scraper::createFileSegment(path, 1000000000);
+
+    if (FileTarget::segment() == NULL)
+    {
+        fprintf(stderr, "can't create %s\n", path);
+        return 1;
+    }
+
+    printf("publishing into %s for %u s\n", path, duration);
+    fflush(stdout);
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        threads.emplace_back(simulateThread, end);
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    return 0;
+}
+
+#endif
+
+int main(int argc, char** argv)
+{
+    const char* name = NULL;
+    const char* simulatePath = NULL;
+    unsigned int interval = 1000;
+    unsigned int count = 1;
+    unsigned int duration = 10;
+    bool json = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            interval = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            count = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc)
+            simulatePath = argv[++i];
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            duration = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else
+            name = argv[i];
+    }
+
+    if (simulatePath != NULL)
+    {
+    #if defined(_WIN32)
+        fprintf(stderr, "--simulate is for hosts without the library, use SEH::ExportTelemetry on Windows\n");
+        return 2;
+    #else
+        return simulate(simulatePath, duration);
+    #endif
+    }
+
+    if (name == NULL)
+    {
+        fprintf(stderr, "usage: telemetry_scraper [--interval <ms>] [--count <n>] [--json] <segment>\n");
+        fprintf(stderr, "       telemetry_scraper --simulate <file> [--seconds <n>]\n");
+        return 2;
+    }
+
+    Telemetry_Scraper::Scraper scraper;
+
+    if (!scraper.open(name))
+    {
+        fprintf(stderr, "%s is not a version %u telemetry segment\n", name, Telemetry::version);
+        return 1;
+    }
+
+    Telemetry::Counters previous = {};
+    std::chrono::steady_clock::time_point previousTime;
+
+    //count 0 scrapes until killed
+    for (unsigned int i = 0; count == 0 || i < count; ++i)
+    {
+        if (i != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        }
+
+        Telemetry::Counters counters;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if (!scraper.read(counters))
+        {
+            fprintf(stderr, "%s stayed busy, its publisher may have died while publishing\n", name);
+            return 1;
+        }
+
+        if (json)
+            printJson(scraper.header(), counters);
+        else if (i == 0)
+            printTotals(scraper.header(), counters);
+        else
+            printRates(scraper.header(), previous, counters, std::chrono::duration<double>(now - previousTime).count());
+
+        fflush(stdout);
+        previous = counters;
+        previousTime = now;
+    }
+
+    return 0;
+}
\ No newline at end of file
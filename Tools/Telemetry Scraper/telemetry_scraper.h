@@ -0,0 +1,164 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "telemetry.h"
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+    Reads the telemetry a process publishes with SEH::ExportTelemetry (telemetry.h)
+    from outside that process, without calling into it.
+
+    On Windows a segment is the named shared memory ExportTelemetry created. Elsewhere
+    it is a file that the publisher maps shared (createFileSegment), the layout is the
+    same, which is how scrapers are tried and tested on Linux.
+*/
+
+namespace SEH
+{
+    namespace Telemetry_Scraper
+    {
+        class Scraper
+        {
+        public:
+            Scraper() : segment(NULL), mapping(NULL) {}
+            ~Scraper() { close(); }
+
+            Scraper(const Scraper&) = delete;
+            Scraper& operator=(const Scraper&) = delete;
+
+            //Maps the segment read-only, false if there is none or it isn't a version the scraper knows
+            bool open(const char* name)
+            {
+                close();
+
+            #if defined(_WIN32)
+                mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+
+                if (mapping == NULL)
+                {
+                    return false;
+                }
+
+                segment = (const Telemetry::Segment*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(Telemetry::Segment));
+            #else
+                int file = ::open(name, O_RDONLY);
+
+                if (file == -1)
+                {
+                    return false;
+                }
+
+                struct stat status;
+
+                if (fstat(file, &status) == 0 && (size_t)status.st_size >= sizeof(Telemetry::Segment))
+                {
+                    void* view = mmap(NULL, sizeof(Telemetry::Segment), PROT_READ, MAP_SHARED, file, 0);
+                    segment = (view != MAP_FAILED) ? (const Telemetry::Segment*)view : NULL;
+                }
+
+                ::close(file); //The mapping keeps the file
+            #endif
+
+                if (segment == NULL || !Telemetry::isSegment(segment->header))
+                {
+                    close();
+                    return false;
+                }
+
+                return true;
+            }
+
+            void close()
+            {
+            #if defined(_WIN32)
+                if (segment != NULL)
+                    UnmapViewOfFile(segment);
+                if (mapping != NULL)
+                    CloseHandle(mapping);
+            #else
+                if (segment != NULL)
+                    munmap((void*)segment, sizeof(Telemetry::Segment));
+            #endif
+
+                segment = NULL;
+                mapping = NULL;
+            }
+
+            //Only valid after open returned true
+            const Telemetry::Header& header() const
+            {
+                return segment->header;
+            }
+
+            //False if the publisher kept the segment busy for every try, it may have died while publishing
+            bool read(Telemetry::Counters& counters) const
+            {
+                return Telemetry::read(*segment, counters);
+            }
+
+        private:
+            const Telemetry::Segment* segment;
+            void* mapping; //Windows' file mapping handle
+        };
+
+    #if !defined(_WIN32)
+        //Creates (or truncates) a file-backed segment at path and maps it for a publisher, NULL on failure
+        inline Telemetry::Segment* createFileSegment(const char* path, uint64_t ticksPerSecond)
+        {
+            int file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+            if (file == -1)
+            {
+                return NULL;
+            }
+
+            //Truncating zeroes it, the sequence starts at 0
+            void* view = MAP_FAILED;
+
+            if (ftruncate(file, sizeof(Telemetry::Segment)) == 0)
+            {
+                view = mmap(NULL, sizeof(Telemetry::Segment), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            }
+
+            ::close(file);
+
+            if (view == MAP_FAILED)
+            {
+                return NULL;
+            }
+
+            Telemetry::Segment* segment = (Telemetry::Segment*)view;
+            Telemetry::initialize(*segment, (uint32_t)getpid(), ticksPerSecond);
+
+            return segment;
+        }
+    #endif
+    }
+}
\ No newline at end of file
@@ -0,0 +1,414 @@
+/*
+    SEH inside VEH - Implements SEH, bypassing SafeSEH, inside VEH
+    Copyright (C) 2023 Nick Daniel / https://github.com/Nick-Source
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+#include "statistics.h"
+
+using namespace SEH;
+
+/*
+    Turns dumps written by SEH::DumpTrace (or at second chance) into per-thread
+    timelines and summary statistics. Only needs trace.h and statistics.h from the
+    library, so it builds anywhere.
+*/
+
+struct Thread
+{
+    Trace::ThreadHeader header;
+    std::vector<Trace::Event> events;
+};
+
+struct Dump
+{
+    Trace::FileHeader header;
+    std::vector<Thread> threads;
+};
+
+struct HandlerSummary
+{
+    uint64_t calls = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    uint64_t dispositions[Statistics::outcomes] = {};
+};
+
+static const char* eventNames[Trace::eventTypes] =
+{
+    "lost", "dispatch", "call", "return", "stack invalid", "dispatch end",
+    "nested", "unwind", "collided", "unwind end", "raise", "unhandled"
+};
+
+static const char* dispositionNames[Statistics::outcomes] =
+{
+    "ExceptionContinueExecution", "ExceptionContinueSearch", "ExceptionNestedException", "ExceptionCollidedUnwind", "invalid disposition"
+};
+
+static bool readDump(const char* path, Dump& dump)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+
+    bool valid = fread(&dump.header, sizeof(dump.header), 1, file) == 1 &&
+        memcmp(dump.header.magic, "SEHTRACE", sizeof(dump.header.magic)) == 0 &&
+        dump.header.version == Trace::version && dump.header.eventSize == sizeof(Trace::Event);
+
+    if (!valid)
+    {
+        fprintf(stderr, "%s is not a version %u trace dump\n", path, Trace::version);
+    }
+
+    Thread thread;
+
+    while (valid && fread(&thread.header, sizeof(thread.header), 1, file) == 1)
+    {
+        if (thread.header.count > Trace::ringEvents * 64)
+        {
+            fprintf(stderr, "%s: thread %u claims %llu events, the dump is corrupt\n", path, thread.header.threadId, (unsigned long long)thread.header.count);
+            valid = false;
+            break;
+        }
+
+        thread.events.resize((size_t)thread.header.count);
+
+        if (fread(thread.events.data(), sizeof(Trace::Event), thread.events.size(), file) != thread.events.size())
+        {
+            fprintf(stderr, "%s: thread %u is truncated\n", path, thread.header.threadId);
+            valid = false;
+            break;
+        }
+
+        dump.threads.push_back(thread);
+    }
+
+    fclose(file);
+    return valid;
+}
+
+static std::string address(const Dump& dump, uint64_t value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), (dump.header.pointerSize == 4) ? "0x%08llX" : "0x%016llX", (unsigned long long)value);
+    return text;
+}
+
+static const char* dispositionName(uint32_t disposition)
+{
+    return dispositionNames[Statistics::outcomeOf(disposition)];
+}
+
+static double microseconds(const Dump& dump, uint64_t ticks)
+{
+    return dump.header.ticksPerSecond ? ticks * 1e6 / dump.header.ticksPerSecond : 0;
+}
+
+static void printTimeline(const Dump& dump, const Thread& thread)
+{
+    printf("thread %u: %llu events (%llu earlier ones overwritten)\n", thread.header.threadId,
+        (unsigned long long)thread.header.count, (unsigned long long)thread.header.firstIndex);
+
+    uint64_t start = 0;
+    int depth = 0;
+
+    for (const Trace::Event& event : thread.events)
+    {
+        if (event.type == Trace::Lost)
+        {
+            printf("  %14s  <lost>\n", "");
+            continue;
+        }
+
+        if (start == 0)
+        {
+            start = event.timestamp;
+        }
+
+        if (event.type == Trace::HandlerReturn || event.type == Trace::DispatchEnd || event.type == Trace::UnwindEnd ||
+            event.type == Trace::Raise || event.type == Trace::Unhandled)
+        {
+            depth = std::max(depth - 1, 0);
+        }
+
+        printf("  %12.3fus  %*s", microseconds(dump, event.timestamp - start), depth * 2, "");
+
+        switch (event.type)
+        {
+        case Trace::DispatchBegin:
+            printf("dispatch %08X at %s flags %llX\n", event.value, address(dump, event.a).c_str(), (unsigned long long)event.b);
+            break;
+        case Trace::HandlerCall:
+            printf("call %s frame %s%s\n", address(dump, event.b).c_str(), address(dump, event.a).c_str(), (event.flags & Trace::Unwinding) ? " (unwinding)" : "");
+            break;
+        case Trace::HandlerReturn:
+            printf("return %s\n", dispositionName(event.value));
+            break;
+        case Trace::StackInvalid:
+            printf("stack invalid, frame %s\n", address(dump, event.a).c_str());
+            break;
+        case Trace::DispatchEnd:
+            printf("dispatch end, %s\n", ((int32_t)event.value == -1) ? "EXCEPTION_CONTINUE_EXECUTION" : "EXCEPTION_CONTINUE_SEARCH");
+            break;
+        case Trace::Nested:
+            printf("%s in handler of frame %s\n", (event.flags & Trace::Unwinding) ? "collided unwind" : "nested exception", address(dump, event.a).c_str());
+            break;
+        case Trace::UnwindBegin:
+            printf("unwind to %s code %08X flags %llX\n", address(dump, event.a).c_str(), event.value, (unsigned long long)event.b);
+            break;
+        case Trace::Collided:
+            printf("collided, resuming at frame %s\n", address(dump, event.a).c_str());
+            break;
+        case Trace::UnwindEnd:
+            printf("unwind end at %s\n", address(dump, event.a).c_str());
+            break;
+        case Trace::Raise:
+            printf("raise %08X\n", event.value);
+            break;
+        case Trace::Unhandled:
+            printf("unhandled %08X\n", event.value);
+            break;
+        default:
+            printf("unknown event %u\n", event.type);
+            break;
+        }
+
+        if (event.type == Trace::DispatchBegin || event.type == Trace::UnwindBegin || event.type == Trace::HandlerCall)
+        {
+            ++depth;
+        }
+    }
+
+    printf("\n");
+}
+
+static void printDurations(const Dump& dump, const char* name, std::vector<uint64_t>& durations)
+{
+    if (durations.empty())
+    {
+        return;
+    }
+
+    std::sort(durations.begin(), durations.end());
+
+    uint64_t total = 0;
+
+    for (uint64_t duration : durations)
+    {
+        total += duration;
+    }
+
+    printf("  %-10s %8zu  mean %10.3fus  p50 %10.3fus  p99 %10.3fus  max %10.3fus\n", name, durations.size(),
+        microseconds(dump, total / durations.size()), microseconds(dump, durations[durations.size() / 2]),
+        microseconds(dump, durations[durations.size() * 99 / 100]), microseconds(dump, durations.back()));
+}
+
+static void printSummary(const Dump& dump, const std::vector<const Thread*>& threads)
+{
+    uint64_t counts[Trace::eventTypes] = {};
+    std::map<uint32_t, uint64_t> codes;
+    std::map<uint64_t, HandlerSummary> handlers;
+    std::vector<uint64_t> dispatches, unwinds;
+
+    for (const Thread* thread : threads)
+    {
+        struct Open
+        {
+            uint8_t type;
+            uint64_t timestamp;
+            uint64_t handler;
+        };
+
+        std::vector<Open> open; //Dispatches, unwinds and handler calls that haven't ended
+
+        for (const Trace::Event& event : thread->events)
+        {
+            if (event.type >= Trace::eventTypes)
+            {
+                continue;
+            }
+
+            ++counts[event.type];
+
+            switch (event.type)
+            {
+            case Trace::Lost:
+                open.clear(); //Can't pair anything across a gap
+                break;
+
+            case Trace::DispatchBegin:
+                ++codes[event.value];
+                open.push_back({ event.type, event.timestamp, 0 });
+                break;
+
+            case Trace::UnwindBegin:
+            case Trace::HandlerCall:
+                open.push_back({ event.type, event.timestamp, event.b });
+                break;
+
+            case Trace::HandlerReturn:
+                if (!open.empty() && open.back().type == Trace::HandlerCall)
+                {
+                    HandlerSummary& handler = handlers[open.back().handler];
+                    uint64_t duration = event.timestamp - open.back().timestamp;
+
+                    ++handler.calls;
+                    handler.total += duration;
+                    handler.max = std::max(handler.max, duration);
+                    ++handler.dispositions[Statistics::outcomeOf(event.value)];
+
+                    open.pop_back();
+                }
+                break;
+
+            case Trace::DispatchEnd:
+            case Trace::UnwindEnd:
+            case Trace::Raise:
+            case Trace::Unhandled:
+                //Handlers that never returned (e.g. __except resuming elsewhere) are still open
+                while (!open.empty() && open.back().type == Trace::HandlerCall)
+                {
+                    open.pop_back();
+                }
+
+                if (!open.empty())
+                {
+                    (open.back().type == Trace::DispatchBegin ? dispatches : unwinds).push_back(event.timestamp - open.back().timestamp);
+                    open.pop_back();
+                }
+                break;
+            }
+        }
+    }
+
+    printf("events\n");
+
+    for (unsigned int type = 0; type < Trace::eventTypes; ++type)
+    {
+        if (counts[type] != 0)
+        {
+            printf("  %-14s %10llu\n", eventNames[type], (unsigned long long)counts[type]);
+        }
+    }
+
+    printf("\ndurations\n");
+    printDurations(dump, "dispatch", dispatches);
+    printDurations(dump, "unwind", unwinds);
+
+    std::vector<std::pair<uint64_t, uint32_t>> byCount;
+
+    for (const std::pair<const uint32_t, uint64_t>& code : codes)
+    {
+        byCount.push_back({ code.second, code.first });
+    }
+
+    std::sort(byCount.rbegin(), byCount.rend());
+
+    printf("\nexception codes\n");
+
+    for (const std::pair<uint64_t, uint32_t>& code : byCount)
+    {
+        printf("  %08X %10llu\n", code.second, (unsigned long long)code.first);
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> byTotal;
+
+    for (const std::pair<const uint64_t, HandlerSummary>& handler : handlers)
+    {
+        byTotal.push_back({ handler.second.total, handler.first });
+    }
+
+    std::sort(byTotal.rbegin(), byTotal.rend());
+
+    printf("\nslowest handlers (by total time)\n");
+
+    for (size_t i = 0; i < byTotal.size() && i < 10; ++i)
+    {
+        const HandlerSummary& handler = handlers[byTotal[i].second];
+
+        printf("  %s  calls %8llu  total %12.3fus  max %10.3fus  continue search %llu  continue execution %llu\n",
+            address(dump, byTotal[i].second).c_str(), (unsigned long long)handler.calls, microseconds(dump, handler.total), microseconds(dump, handler.max),
+            (unsigned long long)handler.dispositions[Statistics::ContinueSearch], (unsigned long long)handler.dispositions[Statistics::ContinueExecution]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = NULL;
+    bool summaryOnly = false;
+    bool allThreads = true;
+    uint32_t threadId = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--summary") == 0)
+            summaryOnly = true;
+        else if (strcmp(argv[i], "--thread") == 0 && i + 1 < argc)
+        {
+            allThreads = false;
+            threadId = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else
+            path = argv[i];
+    }
+
+    if (path == NULL)
+    {
+        fprintf(stderr, "usage: trace_decoder [--summary] [--thread <id>] <dump>\n");
+        return 2;
+    }
+
+    Dump dump;
+
+    if (!readDump(path, dump))
+    {
+        return 1;
+    }
+
+    std::vector<const Thread*> threads;
+
+    for (const Thread& thread : dump.threads)
+    {
+        if (allThreads || thread.header.threadId == threadId)
+        {
+            threads.push_back(&thread);
+        }
+    }
+
+    printf("%zu threads, %u-bit process, %llu ticks per second\n\n", threads.size(), dump.header.pointerSize * 8, (unsigned long long)dump.header.ticksPerSecond);
+
+    if (!summaryOnly)
+    {
+        for (const Thread* thread : threads)
+        {
+            printTimeline(dump, *thread);
+        }
+    }
+
+    printSummary(dump, threads);
+    return 0;
+}
\ No newline at end of file